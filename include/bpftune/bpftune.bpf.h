@@ -132,6 +132,31 @@ static __always_inline typeof(name(0)) ____##name(struct pt_regs *ctx, ##args)
 	} _name SEC(".maps")
 #endif /* BPFTUNE_LEGACY */
 
+/* Per-CPU counters for hot paths; each CPU updates only its own copy,
+ * avoiding cache-line bouncing and lost updates.  Userspace sums the
+ * per-CPU values via bpftune_percpu_counter_sum().
+ */
+#define BPF_PERCPU_COUNTERS(_name, _num_counters)			\
+	BPF_MAP_DEF(_name, BPF_MAP_TYPE_PERCPU_ARRAY, __u32, __s64,	\
+		    _num_counters)
+
+static __always_inline __s64 *percpu_counter(void *map, __u32 idx)
+{
+	return bpf_map_lookup_elem(map, &idx);
+}
+
+/* returns this CPU's value after adding delta */
+static __always_inline __s64 percpu_counter_add(void *map, __u32 idx,
+						__s64 delta)
+{
+	__s64 *counter = percpu_counter(map, idx);
+
+	if (!counter)
+		return 0;
+	*counter += delta;
+	return *counter;
+}
+
 /* used to save data on entry to be retrieved on return  */
 #define save_entry_data(save_map, save_struct, save_field, save_data)	\
 	do {								\
@@ -171,16 +196,153 @@ unsigned short bpftune_learning_rate;
 #include <bpftune/bpftune.h>
 #include <bpftune/corr.h>
 
-BPF_RINGBUF(ring_buffer_map, 128 * 1024);
+BPF_RINGBUF(ring_buffer_map, BPFTUNE_RINGBUF_SIZE);
+
+BPF_MAP_DEF(netns_map, BPF_MAP_TYPE_HASH, __u64, __u64, BPFTUNE_NETNS_MAP_MAX);
+
+BPF_PERCPU_COUNTERS(bpftune_counters, BPFTUNE_NUM_COUNTERS);
+
+/* send event to userspace, counting ring buffer drops. */
+static __always_inline long bpftune_ringbuf_output(void *data, __u64 size)
+{
+	long ret = bpf_ringbuf_output(&ring_buffer_map, data, size, 0);
+
+	if (ret)
+		percpu_counter_add(&bpftune_counters,
+				   BPFTUNE_COUNTER_RINGBUF_DROPS, 1);
+	return ret;
+}
+
+/* Sampling gate for hot-path programs: examine 1 in 2^shift calls, with
+ * shift adapted per-CPU to the yield of useful samples over each window
+ * of BPFTUNE_SAMPLE_WINDOW samples; with no useful samples we back off
+ * towards 1 in 2^BPFTUNE_SAMPLE_MAX_SHIFT, with a high yield (>1/8) we
+ * examine every call.  Usage:
+ *
+ *	if (!bpftune_sample(&samplers, idx))
+ *		return 0;
+ *	...
+ *	bpftune_sample_yield(&samplers, idx, useful);
+ */
+#define BPFTUNE_SAMPLE_WINDOW		128
+#define BPFTUNE_SAMPLE_MAX_SHIFT	6
+
+struct bpftune_sampler {
+	__u32 calls;
+	__u32 samples;		/* samples in current window */
+	__u32 hits;		/* useful samples in current window */
+	__u32 shift;
+};
+
+#define BPF_SAMPLERS(_name, _num_samplers)				\
+	BPF_MAP_DEF(_name, BPF_MAP_TYPE_PERCPU_ARRAY, __u32,		\
+		    struct bpftune_sampler, _num_samplers)
+
+static __always_inline bool bpftune_sample(void *map, __u32 idx)
+{
+	struct bpftune_sampler *s = bpf_map_lookup_elem(map, &idx);
+
+	if (!s)
+		return true;
+	s->calls++;
+	return (s->calls & ((1U << (s->shift & 31)) - 1)) == 0;
+}
+
+static __always_inline void bpftune_sample_yield(void *map, __u32 idx,
+						 bool useful)
+{
+	struct bpftune_sampler *s = bpf_map_lookup_elem(map, &idx);
+
+	/* also seen by userspace, to keep on-demand programs attached */
+	if (useful)
+		percpu_counter_add(&bpftune_counters,
+				   BPFTUNE_COUNTER_SAMPLE_YIELD, 1);
+	if (!s)
+		return;
+	s->samples++;
+	if (useful)
+		s->hits++;
+	if (s->samples < BPFTUNE_SAMPLE_WINDOW)
+		return;
+	if (!s->hits) {
+		if (s->shift < BPFTUNE_SAMPLE_MAX_SHIFT)
+			s->shift++;
+	} else if (s->hits >= (BPFTUNE_SAMPLE_WINDOW >> 3)) {
+		s->shift = 0;
+	} else if (s->shift) {
+		s->shift--;
+	}
+	s->samples = s->hits = 0;
+}
 
-BPF_MAP_DEF(netns_map, BPF_MAP_TYPE_HASH, __u64, __u64, 65536);
+/* signal userspace that this tuner's on-demand programs are needed */
+static __always_inline void bpftune_ondemand_trigger(void)
+{
+	percpu_counter_add(&bpftune_counters,
+			   BPFTUNE_COUNTER_ONDEMAND_TRIGGER, 1);
+}
 
 unsigned int tuner_id;
 unsigned int bpftune_pid;
+/* if non-zero, coalesce repeated sysctl events within window (msec) */
+unsigned int bpftune_coalesce_msec;
 /* init_net value used for older kernels since __ksym does not work */
 unsigned long bpftune_init_net;
+/* if non-zero, changes are verified over a window (sec) */
+unsigned int bpftune_verify_sec;
+/* if set, per-connection state is kept per cgroup */
+bool bpftune_cgroup_scoped;
+
+/* Reserve a variable-length record for an event of the given type with
+ * payload_size bytes after the header directly in the ring buffer, so
+ * that no struct bpftune_event need be built on the stack and copied.
+ * payload_size must be a constant.  Header fields other than tuner_id
+ * and type are zeroed; fill in the header and payload and submit with
+ * bpftune_event_submit().  Usage:
+ *
+ *	event = bpftune_event_reserve(BPFTUNE_EVENT_HDR, 0);
+ *	if (!event)
+ *		return 0;
+ *	event->scenario_id = ...;
+ *	bpftune_event_submit(event);
+ */
+static __always_inline struct bpftune_event *
+bpftune_event_reserve(unsigned int type, __u64 payload_size)
+{
+	struct bpftune_event *event;
+
+	event = bpf_ringbuf_reserve(&ring_buffer_map,
+				    BPFTUNE_EVENT_HDR_SIZE + payload_size, 0);
+	if (!event) {
+		percpu_counter_add(&bpftune_counters,
+				   BPFTUNE_COUNTER_RINGBUF_DROPS, 1);
+		return NULL;
+	}
+	event->tuner_id = tuner_id;
+	event->scenario_id = 0;
+	event->netns_cookie = 0;
+	event->pid = 0;
+	event->count = 0;
+	event->num_updates = 0;
+	event->type = type;
+	return event;
+}
+
+static __always_inline void bpftune_event_submit(struct bpftune_event *event)
+{
+	bpf_ringbuf_submit(event, 0);
+}
+
+/* release a reserved event without sending it */
+static __always_inline void bpftune_event_discard(struct bpftune_event *event)
+{
+	bpf_ringbuf_discard(event, 0);
+}
 
 /* TCP buffer tuning */
+#ifndef SOL_SOCKET
+#define SOL_SOCKET		1
+#endif
 #ifndef SO_SNDBUF
 #define SO_SNDBUF       	7
 #endif
@@ -210,6 +372,10 @@ unsigned long bpftune_init_net;
 #define TCP_CONGESTION		13
 #endif
 
+#ifndef TCP_NOTSENT_LOWAT
+#define TCP_NOTSENT_LOWAT	25
+#endif
+
 #ifndef AF_INET
 #define AF_INET			2
 #endif
@@ -233,6 +399,9 @@ unsigned long bpftune_init_net;
 #ifndef TCP_CA_NAME_MAX
 #define TCP_CA_NAME_MAX		16
 #endif
+#ifndef TCP_ECN_OK
+#define TCP_ECN_OK		1
+#endif
 
 /* neigh table tuning */
 #ifndef NUD_PERMANENT
@@ -242,7 +411,11 @@ unsigned long bpftune_init_net;
 #define NTF_EXT_LEARNED	0x10
 #endif
 
+#define ENOENT		2
+#define ENOMEM		12
 #define EINVAL		22
+#define ENOSPC		28
+#define ENOBUFS		105
 
 bool debug;
 
@@ -271,56 +444,223 @@ static __always_inline long get_netns_cookie(struct net *net)
 	/* not global ns, no cookie support. */
 	return -1;
 }
+
+/* cgroup id of socket, or 0 if tuning is not scoped to cgroups or the
+ * kernel does not record the cgroup pointer in the socket.
+ */
+static __always_inline __u64 get_sk_cgroup_id(struct sock *sk)
+{
+	struct cgroup *cgrp;
+
+	if (!bpftune_cgroup_scoped || !sk)
+		return 0;
+	if (!bpf_core_field_exists(sk->sk_cgrp_data.cgroup))
+		return 0;
+	cgrp = BPF_CORE_READ(sk, sk_cgrp_data.cgroup);
+	if (!cgrp)
+		return 0;
+	return BPF_CORE_READ(cgrp, kn, id);
+}
  
+/* true if the NUMA node we are running on - where socket memory is
+ * likely to be allocated - has no free memory above its high watermark;
+ * raising memory limits would then just push the node further into
+ * reclaim.
+ */
+static __always_inline bool bpftune_node_low_on_memory(struct bpftune_mem *mem)
+{
+	__u32 node = bpf_get_numa_node_id();
+
+	if (node >= BPFTUNE_MAX_NODES || node >= mem->num_nodes)
+		return false;
+	return mem->node_free_pages[node] == 0;
+}
+
+enum bpftune_sk_mem_state {
+	BPFTUNE_SK_MEM_NORMAL,
+	BPFTUNE_SK_MEM_NEAR_PRESSURE,
+	BPFTUNE_SK_MEM_NEAR_EXHAUSTION,
+};
+
+/* compare memory allocated by the protocol of sk - in SK_MEM_QUANTUM
+ * units - with its sysctl_mem[] limits in pages, which are read into
+ * mem[].  Returns a bpftune_sk_mem_state, or a negative value if limits
+ * or allocation cannot be read.
+ */
+static __always_inline int bpftune_sk_mem_state(struct sock *sk, long mem[3],
+						int page_shift,
+						int quantum_shift)
+{
+	long limit_sk_mem_quantum[3] = { };
+	struct proto *prot = BPF_CORE_READ(sk, sk_prot);
+	atomic_long_t *memory_allocated = BPF_CORE_READ(prot, memory_allocated);
+	long *sysctl_mem = BPF_CORE_READ(prot, sysctl_mem);
+	__u8 shift_left = 0, shift_right = 0;
+	long allocated;
+	int i;
+
+	if (!sk || !prot || !memory_allocated)
+		return -EINVAL;
+	allocated = BPF_CORE_READ(memory_allocated, counter);
+	if (!allocated)
+		return -EINVAL;
+	if (bpf_probe_read_kernel(mem, 3 * sizeof(long), sysctl_mem))
+		return -EINVAL;
+
+	if (!mem[0] || !mem[1] || !mem[2])
+		return -EINVAL;
+
+	if (page_shift >= quantum_shift) {
+		shift_left = page_shift - quantum_shift;
+		if (shift_left >= 32)
+			return -EINVAL;
+	} else {
+		shift_right = quantum_shift - page_shift;
+		if (shift_right >= 32)
+			return -EINVAL;
+	}
+
+	for (i = 0; i < 3; i++) {
+		limit_sk_mem_quantum[i] = mem[i];
+		if (shift_left)
+			limit_sk_mem_quantum[i] <<= shift_left;
+		if (shift_right)
+			limit_sk_mem_quantum[i] >>= shift_right;
+		if (limit_sk_mem_quantum[i] <= 0)
+			return -EINVAL;
+	}
+
+	if (NEARLY_FULL(allocated, limit_sk_mem_quantum[2]))
+		return BPFTUNE_SK_MEM_NEAR_EXHAUSTION;
+	if (NEARLY_FULL(allocated, limit_sk_mem_quantum[1]))
+		return BPFTUNE_SK_MEM_NEAR_PRESSURE;
+	return BPFTUNE_SK_MEM_NORMAL;
+}
+
 #define last_event_key(nscookie, tuner, event)	\
 	((__u64)nscookie | ((__u64)event << 32) |((__u64)tuner <<48))
 
-struct {
-	__uint(type, BPF_MAP_TYPE_HASH);
-	__uint(max_entries, 65536);
-	__type(key, __u64);
-	__type(value, __u64);
-} last_event_map SEC(".maps");
+/* shared by all tuners; key includes tuner id */
+BPF_MAP_DEF(last_event_map, BPF_MAP_TYPE_LRU_HASH, __u64, __u64,
+	    BPFTUNE_LAST_EVENT_MAX);
+
+BPF_MAP_DEF(coalesce_map, BPF_MAP_TYPE_LRU_HASH, struct bpftune_coalesce_key,
+	    struct bpftune_coalesce, BPFTUNE_COALESCE_MAX);
+
+/* returns 1 if event should be sent, 0 if coalesced. */
+static __always_inline int coalesce_net_sysctl_event(long nscookie, __u64 now,
+						     int scenario_id,
+						     int event_id,
+						     long *old, long *new,
+						     struct bpftune_event *event)
+{
+	struct bpftune_coalesce_key key = {};
+	struct bpftune_coalesce *c;
+
+	key.netns_cookie = nscookie;
+	key.event_id = event_id;
+	c = bpf_map_lookup_elem(&coalesce_map, &key);
+	if (!c) {
+		struct bpftune_coalesce newc = {};
+
+		/* first event is sent immediately; later ones in window are
+		 * coalesced.
+		 */
+		newc.first = newc.last = now;
+		newc.scenario_id = scenario_id;
+		bpf_map_update_elem(&coalesce_map, &key, &newc, BPF_NOEXIST);
+		event->count = 1;
+		return 1;
+	}
+	c->last = now;
+	if ((now - c->first) < (bpftune_coalesce_msec * MSEC)) {
+		if (c->count == 0) {
+			c->old[0] = old[0];
+			c->old[1] = old[1];
+			c->old[2] = old[2];
+		}
+		c->new[0] = new[0];
+		c->new[1] = new[1];
+		c->new[2] = new[2];
+		c->scenario_id = scenario_id;
+		__sync_fetch_and_add(&c->count, 1);
+		return 0;
+	}
+	/* window elapsed; send summary of pending events plus this one */
+	event->count = c->count + 1;
+	if (c->count) {
+		old[0] = c->old[0];
+		old[1] = c->old[1];
+		old[2] = c->old[2];
+	}
+	c->first = now;
+	c->count = 0;
+	return 1;
+}
+
+/* avoid sending same event for same tuner+netns in < 25msec */
+static __always_inline bool last_event_ratelimit(long nscookie, int event_id,
+						 __u64 now)
+{
+	__u64 event_key = last_event_key(nscookie, tuner_id, event_id);
+	__u64 *last_timep = bpf_map_lookup_elem(&last_event_map, &event_key);
+
+	if (last_timep) {
+		if ((now - *last_timep) < (25 * MSEC))
+			return true;
+		*last_timep = now;
+	} else {
+		bpf_map_update_elem(&last_event_map, &event_key, &now, 0);
+	}
+	return false;
+}
 
 static __always_inline long send_net_sysctl_event(struct net *net,
 						  int scenario_id, int event_id,
 						  long *old, long *new,
 						  struct bpftune_event *event)
 {
+	struct bpftune_event *rec;
 	__u64 now = bpf_ktime_get_ns();
-	__u64 event_key = 0;
 	long nscookie = 0;
-	__u64 *last_timep = NULL;
-	int ret = 0;
 
 	nscookie = get_netns_cookie(net);
 	if (nscookie < 0)
 		return nscookie;
+	/* callers use these (e.g. to correlate the change per netns) even
+	 * when the event is coalesced or rate-limited rather than sent.
+	 */
+	event->tuner_id = tuner_id;
+	event->scenario_id = scenario_id;
+	event->netns_cookie = nscookie;
 
-	event_key = last_event_key(nscookie, tuner_id, event_id);
-	/* avoid sending same event for same tuner+netns in < 25msec */
-	last_timep = bpf_map_lookup_elem(&last_event_map, &event_key);
-	if (last_timep) {
-		if ((now - *last_timep) < (25 * MSEC))
+	if (bpftune_coalesce_msec) {
+		if (!coalesce_net_sysctl_event(nscookie, now, scenario_id,
+					       event_id, old, new, event))
 			return 0;
-		*last_timep = now;
-	} else {
-		bpf_map_update_elem(&last_event_map, &event_key, &now, 0);
+	} else if (last_event_ratelimit(nscookie, event_id, now)) {
+		return 0;
 	}
 
-	event->tuner_id = tuner_id;
-	event->scenario_id = scenario_id;
-	event->netns_cookie = nscookie;
-	event->update[0].id = event_id;
-	event->update[0].old[0] = old[0];
-	event->update[0].old[1] = old[1];
-	event->update[0].old[2] = old[2];
-	event->update[0].new[0] = new[0];
-	event->update[0].new[1] = new[1];
-	event->update[0].new[2] = new[2];
-	ret = bpf_ringbuf_output(&ring_buffer_map, event, sizeof(*event), 0);
-	bpftune_debug("tuner [%d] scenario [%d]: event send: %d ",
-		    tuner_id, scenario_id, ret);
+	/* only the header and a single update are sent. */
+	rec = bpftune_event_reserve(BPFTUNE_EVENT_UPDATES,
+				    sizeof(struct bpftunable_update));
+	if (!rec)
+		return -ENOSPC;
+	rec->scenario_id = scenario_id;
+	rec->netns_cookie = nscookie;
+	rec->count = event->count;
+	rec->num_updates = 1;
+	rec->update[0].id = event_id;
+	rec->update[0].old[0] = old[0];
+	rec->update[0].old[1] = old[1];
+	rec->update[0].old[2] = old[2];
+	rec->update[0].new[0] = new[0];
+	rec->update[0].new[1] = new[1];
+	rec->update[0].new[2] = new[2];
+	bpftune_event_submit(rec);
+	bpftune_debug("tuner [%d] scenario [%d]: event sent ",
+		    tuner_id, scenario_id);
 	bpftune_debug("\told '%ld %ld %ld'\n", old[0], old[1], old[2]);
 	bpftune_debug("\tnew '%ld %ld %ld'\n", new[0], new[1], new[2]);
 	return 0;
@@ -337,11 +677,101 @@ static __always_inline long send_sk_sysctl_event(struct sock *sk,
 				     old, new, event);
 }
 
-static inline void corr_update_bpf(void *map, __u64 id,
+/* Add a sysctl update to event.  Updates added are sent in a single event
+ * by send_net_sysctl_events(), so that userspace can apply related
+ * updates together (see bpftuner_tunable_sysctls_write()).
+ */
+static __always_inline int bpftune_event_update_add(struct bpftune_event *event,
+						    int event_id,
+						    long *old, long *new)
+{
+	unsigned int i = event->num_updates;
+
+	if (i >= BPFTUNE_MAX_UPDATES)
+		return -EINVAL;
+	event->update[i].id = event_id;
+	event->update[i].old[0] = old[0];
+	event->update[i].old[1] = old[1];
+	event->update[i].old[2] = old[2];
+	event->update[i].new[0] = new[0];
+	event->update[i].new[1] = new[1];
+	event->update[i].new[2] = new[2];
+	event->num_updates = i + 1;
+	return 0;
+}
+
+/* send an event with updates added by bpftune_event_update_add().  Such
+ * events are not coalesced, but are rate-limited by their first update.
+ */
+static __always_inline long send_net_sysctl_events(struct net *net,
+						   int scenario_id,
+						   struct bpftune_event *event)
+{
+	unsigned int num_updates = event->num_updates;
+	long nscookie;
+	int ret;
+
+	if (!num_updates)
+		return 0;
+	if (num_updates > BPFTUNE_MAX_UPDATES)
+		num_updates = BPFTUNE_MAX_UPDATES;
+	nscookie = get_netns_cookie(net);
+	if (nscookie < 0)
+		return nscookie;
+	if (last_event_ratelimit(nscookie, event->update[0].id,
+				 bpf_ktime_get_ns()))
+		return 0;
+	event->tuner_id = tuner_id;
+	event->scenario_id = scenario_id;
+	event->netns_cookie = nscookie;
+	event->type = BPFTUNE_EVENT_UPDATES;
+	/* send the header and only the updates added. */
+	ret = bpftune_ringbuf_output(event, BPFTUNE_EVENT_HDR_SIZE +
+				     num_updates *
+				     sizeof(struct bpftunable_update));
+	bpftune_debug("tuner [%d] scenario [%d]: sent event with %d updates: %d\n",
+		      tuner_id, scenario_id, event->num_updates, ret);
+	return 0;
+}
+
+BPF_MAP_DEF(verify_map, BPF_MAP_TYPE_LRU_HASH, struct bpftune_verify_key,
+	    struct bpftune_verify_metric, BPFTUNE_VERIFY_MAX);
+
+/* Add to the cost metric for tunable in netns; userspace compares the
+ * rate of cost before and after a change to a BPFTUNABLE_VERIFY tunable
+ * and rolls back changes that increase it.  netns_cookie should match
+ * the cookie of events for the tunable (0 if sent for a NULL net).
+ */
+static __always_inline void bpftune_verify_cost_add(long netns_cookie,
+						    unsigned int tunable,
+						    __u64 cost)
+{
+	struct bpftune_verify_key key = {};
+	struct bpftune_verify_metric *m;
+
+	if (!bpftune_verify_sec || netns_cookie < 0)
+		return;
+	key.netns_cookie = netns_cookie;
+	key.tunable = tunable;
+	m = bpf_map_lookup_elem(&verify_map, &key);
+	if (!m) {
+		struct bpftune_verify_metric new_m = {};
+
+		new_m.start = bpf_ktime_get_ns();
+		bpf_map_update_elem(&verify_map, &key, &new_m, BPF_NOEXIST);
+		m = bpf_map_lookup_elem(&verify_map, &key);
+		if (!m)
+			return;
+	}
+	__sync_fetch_and_add(&m->cost, cost);
+}
+
+static inline void corr_update_bpf(void *map, __u32 id, __u32 metric,
 				   __u64 netns_cookie,
 				   __u64 x, __u64 y)
 {
-	struct corr_key key = { .id = id, .netns_cookie = netns_cookie };
+	struct corr_key key = { .id = id, .metric = metric,
+				.netns_cookie = netns_cookie };
 	struct corr *corrp = bpf_map_lookup_elem(map, &key);
 
 	if (!corrp) {
@@ -28,6 +28,11 @@
 
 #define BPFTUNE_MAX_SCENARIOS		16
 
+/* sizes of maps shared by all tuners */
+#define BPFTUNE_RINGBUF_SIZE		(128 * 1024)
+#define BPFTUNE_NETNS_MAP_MAX		65536
+#define BPFTUNE_LAST_EVENT_MAX		65536
+
 #define BPFTUNE_DELTA_MIN		0	/* 1% */
 #define BPFTUNE_DELTA_MAX		4	/* 25% */
 
@@ -87,6 +92,40 @@ struct bpftunable_scenario {
 
 #define BPFTUNABLE_NAMESPACED	0x1	/* settable in non-global namespace? */
 #define BPFTUNABLE_OPTIONAL	0x2	/* do not fail it tunable not found (e.g. ipv6 */
+#define BPFTUNABLE_CPUMASK	0x4	/* sysctl is a CPU mask; value is CPU count */
+#define BPFTUNABLE_VERIFY	0x8	/* verify increases against cost metric */
+
+/* CPU masks are handled as arrays of 64-bit words */
+#define BPFTUNE_MAX_CPUS	4096
+#define BPFTUNE_CPUMASK_WORDS	(BPFTUNE_MAX_CPUS / 64)
+
+/* NUMA nodes for which free memory is tracked */
+#define BPFTUNE_MAX_NODES	64
+
+/* socket memory limits are derived from these, as in the kernel.  Tuners
+ * which size memory limits keep a copy in a BPF global, refreshed via
+ * bpftune_mem_refresh().
+ */
+struct bpftune_mem {
+	unsigned long buffer_pages;	/* nr_free_buffer_pages() estimate */
+	unsigned int num_nodes;
+	/* pages free above the high watermark; -1 for nodes without
+	 * memory of their own.  Only the first num_nodes are valid.
+	 */
+	long node_free_pages[BPFTUNE_MAX_NODES];
+};
+
+/* cgroup subtrees per-connection programs can be scoped to */
+#define BPFTUNE_MAX_CGROUPS	16
+
+/* key for per-remote-host state.  cgroup_id is 0 unless tuning is scoped
+ * to cgroups ("-o bpftune.cgroups=..."), in which case each cgroup learns
+ * its own state for a remote host.
+ */
+struct bpftune_host_key {
+	__u32 addr[4];		/* IPv4 addresses use the first word */
+	__u64 cgroup_id;
+};
 
 struct bpftunable_desc {
 	unsigned int id;
@@ -99,6 +138,7 @@ struct bpftunable_desc {
 struct bpftunable_stats {
 	unsigned long global_ns[BPFTUNE_MAX_SCENARIOS];
 	unsigned long nonglobal_ns[BPFTUNE_MAX_SCENARIOS];
+	unsigned long rollbacks;	/* changes undone by verification */
 };
 
 struct bpftunable {
@@ -118,13 +158,86 @@ struct bpftunable_update {
 #define BPFTUNE_MAX_NAME	128
 #define BPFTUNE_MAX_DATA	128
 
+/* sysctl writes are matched against watched sysctls via an FNV-1a hash
+ * of "parent/procname" (e.g. "ipv4/tcp_rmem"), computed in BPF when the
+ * write occurs and in userspace for tunables.
+ */
+#define BPFTUNE_SYSCTL_HASH_INIT	2166136261U
+#define BPFTUNE_SYSCTL_HASH_PRIME	16777619U
+#define bpftune_sysctl_hash_add(hash, c)				\
+	(((hash) ^ (__u8)(c)) * BPFTUNE_SYSCTL_HASH_PRIME)
+
+#define BPFTUNE_SYSCTL_WATCH_MAX	1024
+
 #define BPFTUNE_MAX_UPDATES	4
 
+/* With coalescing enabled, repeated sysctl events for the same netns and
+ * event id within the coalescing window are accumulated in a per-tuner
+ * "coalesce_map" rather than each being sent, and a single summarized
+ * event with the initial old and latest new values is sent per window.
+ */
+struct bpftune_coalesce_key {
+	__u64 netns_cookie;
+	__u32 event_id;
+	__u32 pad;
+};
+
+struct bpftune_coalesce {
+	__u64 first;		/* time of first event in window */
+	__u64 last;		/* time of latest event */
+	__u32 count;		/* events coalesced, not yet sent */
+	__u32 scenario_id;	/* latest scenario */
+	long old[BPFTUNE_MAX_VALUES];
+	long new[BPFTUNE_MAX_VALUES];
+};
+
+#define BPFTUNE_COALESCE_MAX	65536
+
+/* Changes to tunables flagged BPFTUNABLE_VERIFY are verified against a
+ * cost metric - drops, memory pressure events etc - that BPF programs
+ * accumulate per tunable and netns; see bpftune_verify_cost_add().
+ */
+struct bpftune_verify_key {
+	__u64 netns_cookie;
+	__u32 tunable;
+	__u32 pad;
+};
+
+struct bpftune_verify_metric {
+	__u64 cost;
+	__u64 start;		/* time cost was first recorded */
+};
+
+#define BPFTUNE_VERIFY_MAX	4096
+
+/* per-tuner per-CPU counters maintained by BPF programs */
+enum bpftune_counters {
+	BPFTUNE_COUNTER_RINGBUF_DROPS,	/* bpf_ringbuf_output() failures */
+	BPFTUNE_COUNTER_ONDEMAND_TRIGGER, /* on-demand programs needed */
+	BPFTUNE_COUNTER_SAMPLE_YIELD,	/* useful samples */
+	BPFTUNE_NUM_COUNTERS,
+};
+
+/* Ring buffer records are either a full struct bpftune_event, or the
+ * event header followed only by the payload its type needs; userspace
+ * expands the latter into a zero-filled struct bpftune_event.
+ */
+enum bpftune_event_type {
+	BPFTUNE_EVENT_FULL,	/* full struct bpftune_event */
+	BPFTUNE_EVENT_HDR,	/* header only */
+	BPFTUNE_EVENT_UPDATES,	/* header + num_updates updates */
+	BPFTUNE_EVENT_STR,	/* header + str (up to BPFTUNE_MAX_NAME) */
+	BPFTUNE_EVENT_RAW,	/* header + raw_data (up to BPFTUNE_MAX_DATA) */
+};
+
 struct bpftune_event {
 	unsigned int tuner_id;
 	unsigned int scenario_id;
 	unsigned long netns_cookie;
 	int pid;
+	unsigned int count;	/* if coalesced, number of events summarized */
+	unsigned int num_updates; /* valid updates; 0 is treated as 1 */
+	unsigned int type;	/* enum bpftune_event_type */
 	union {
 		struct bpftunable_update update[BPFTUNE_MAX_UPDATES];
 		char str[BPFTUNE_MAX_NAME];
@@ -132,8 +245,10 @@ struct bpftune_event {
 	};
 };
 
+#define BPFTUNE_EVENT_HDR_SIZE	__builtin_offsetof(struct bpftune_event, update)
+
+/* per-tuner state of a network namespace */
 struct bpftuner_netns {
-	struct bpftuner_netns *next;	
 	unsigned long netns_cookie;
 	enum bpftune_state state;
 };
@@ -148,12 +263,20 @@ struct bpftuner_strategy {
 	unsigned long timeout;	/* time in seconds until evaluation */
 	const char **bpf_progs;	/* programs to load in BPF skeleton for this
 				 * strategy; if NULL, all */
+	/* optional; measured outcome (higher is better) over the period the
+	 * strategy was active.  If set, strategies are scored by their mean
+	 * reward rather than evaluate(), and exploration is used.
+	 */
+	double (*reward)(struct bpftuner *tuner,
+			 struct bpftuner_strategy *strategy);
+	/* maintained by bpftune */
+	unsigned long pulls;	/* number of rewards collected */
+	double mean_reward;
 };
 
 struct bpftuner {
 	unsigned int id;
 	enum bpftune_state state;
-	struct bpftuner_netns netns;
 	const char *path;
 	void *handle;
 	const char *name;
@@ -165,18 +288,32 @@ struct bpftuner {
 	void (*fini)(struct bpftuner *tuner);
 	struct bpftuner_strategy **strategies;
 	struct bpftuner_strategy *strategy;
+	__u64 strategy_start;	/* time current strategy was set */
+	__u64 strategy_next;	/* time of next evaluation; 0 if none */
 	void *ring_buffer_map;
 	int ring_buffer_map_fd;
 	void *corr_map;
 	int corr_map_fd;
 	void *netns_map;
 	int netns_map_fd;
+	void *last_event_map;
+	int last_event_map_fd;
 	void (*event_handler)(struct bpftuner *tuner,
 			      struct bpftune_event *event, void *ctx);
+	/* optional; called from the event loop for deferred work */
+	void (*periodic)(struct bpftuner *tuner);
 	unsigned int num_tunables;
 	struct bpftunable *tunables;
 	unsigned int num_scenarios;
 	struct bpftunable_scenario *scenarios;
+	int coalesce_map_fd;
+	int counters_map_fd;
+	int verify_map_fd;
+	__u64 load_time_ns;
+	/* NULL-terminated names of maps holding learned state; these are
+	 * pinned if state is persisted (-p).  Set prior to bpftuner_bpf_load.
+	 */
+	const char **persist_maps;
 };
 
 /* from include/linux/log2.h */
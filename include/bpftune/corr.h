@@ -25,19 +25,43 @@
 /* threshold at which we determine correlation is significant */
 #define CORR_THRESHOLD		((long double)0.7)
 
-/* correlate tunables via id + netns cookie */
+/* Statistics are exponentially decayed with weight 1/2^CORR_EWMA_SHIFT
+ * for each new sample, so they reflect roughly the last 2^CORR_EWMA_SHIFT
+ * samples and never need to be reset.  As with srtt in the kernel, the
+ * means and (co)variances are stored scaled by 2^CORR_EWMA_SHIFT to retain
+ * precision in fixed point.
+ */
+#define CORR_EWMA_SHIFT		4
+
+/* deviations from the mean are clamped to this to avoid overflow of
+ * squared values; callers should scale metrics (e.g. to KB) if needed.
+ */
+#define CORR_MAX_DIFF		((1LL << 27) - 1)
+
+/* metrics tunables can be correlated with; a tunable may be correlated
+ * with several of these.
+ */
+enum corr_metric {
+	CORR_METRIC_SRTT,
+	CORR_METRIC_RETRANS,
+	CORR_METRIC_DELIVERY_RATE,
+	CORR_NUM_METRICS
+};
+
+/* correlate tunables via id + metric + netns cookie */
 struct corr_key {
-	__u64 id;
+	__u32 id;
+	__u32 metric;
 	unsigned long netns_cookie;
 };
 
 struct corr {
 	__u64 n;
-	__u64 sum_x;
-	__u64 sum_x_sq;
-	__u64 sum_y;
-	__u64 sum_y_sq;
-	__u64 sum_prod_x_y;
+	__s64 mean_x;
+	__s64 mean_y;
+	__s64 var_x;
+	__s64 var_y;
+	__s64 covar;
 };
 
 static inline void corr_reset(struct corr *c)
@@ -45,74 +69,54 @@ static inline void corr_reset(struct corr *c)
 	__builtin_memset(c, 0, sizeof(*c));
 }
 
-/* reset correlation if we overflow any values */
-#define corr_update_var(c, var, delta)			\
-	do {						\
-		if (((c->var) + (delta)) < c->var) {	\
-			corr_reset(c);			\
-			return;				\
-		}					\
-		(c->var) += (delta);			\
-	} while (0)
+static inline __s64 corr_clamp(__s64 diff)
+{
+	if (diff > CORR_MAX_DIFF)
+		return CORR_MAX_DIFF;
+	if (diff < -CORR_MAX_DIFF)
+		return -CORR_MAX_DIFF;
+	return diff;
+}
 
 static inline void corr_update(struct corr *c, __u64 x, __u64 y)
 {
-	corr_update_var(c, n, 1);
-	corr_update_var(c, sum_x, x);
-	corr_update_var(c, sum_x_sq, x*x);
-	corr_update_var(c, sum_y, y);
-	corr_update_var(c, sum_y_sq, y*y);
-	corr_update_var(c, sum_prod_x_y, x*y);
+	__s64 dx, dy;
+
+	if (c->n == 0) {
+		c->mean_x = (__s64)x << CORR_EWMA_SHIFT;
+		c->mean_y = (__s64)y << CORR_EWMA_SHIFT;
+		c->n = 1;
+		return;
+	}
+	dx = corr_clamp((__s64)x - (c->mean_x >> CORR_EWMA_SHIFT));
+	dy = corr_clamp((__s64)y - (c->mean_y >> CORR_EWMA_SHIFT));
+	c->mean_x += dx;
+	c->mean_y += dy;
+	c->var_x += dx * dx - (c->var_x >> CORR_EWMA_SHIFT);
+	c->var_y += dy * dy - (c->var_y >> CORR_EWMA_SHIFT);
+	c->covar += dx * dy - (c->covar >> CORR_EWMA_SHIFT);
+	if (c->n < CORR_MIN_SAMPLES)
+		c->n++;
 }
 
 #ifndef __KERNEL__
 
 #include <math.h>
 
-/* covar(x,y) = sum((x - mean(x))(y - mean(y)))/(N-1)
- *
- * the above numerator simplifies to
- *
- * sum(x*y) + (N*mean(x)*mean(y)) - (2*sum(x)*mean(y)) - (2*sum(y)*mean(x))
- * -> ...since mean(x) = sum(x)/N...
- * sum(x*y) + (sum(x)*sum(y)/N - sum(x)*sum(y)/N - sum(y)*sum(x)/N
- *
- * So
- * covar(x,y) =
- * ->
- * ((sum(x*y)) - (sum(x)*sum(y)))/N/(N-1)
- */
 static inline long double covar_compute(struct corr *c)
 {
-	long double result;
-
 	if (c->n < CORR_MIN_SAMPLES)
 		return 0;
-
-	result = (long double)c->sum_prod_x_y -
-		 ((long double)(c->sum_x * c->sum_y)/c->n);
-	result /= (c->n - 1);
-
-	return result;
+	return (long double)c->covar / (1 << CORR_EWMA_SHIFT);
 }
 
+/* corr(x,y) = covar(x,y)/(stddev(x) * stddev(y)); scaling cancels out. */
 static inline long double corr_compute(struct corr *c)
 {
-	long double cov = covar_compute(c);
-	long double var_x, var_y;
-
-	if (c->n < 2)
-		return 0;
-	var_x = ((long double)c->sum_x_sq -
-		 ((long double)(c->sum_x * c->sum_x)/c->n))/
-		(c->n - 1);
-	var_y = ((long double)c->sum_y_sq -
-		 ((long double)(c->sum_y * c->sum_y)/c->n))/
-		(c->n - 1);
-
-	if (var_x == 0 || var_y == 0)	
+	if (c->n < CORR_MIN_SAMPLES || c->var_x <= 0 || c->var_y <= 0)
 		return 0;
-	return cov/(sqrtl(var_x)*sqrtl(var_y));
+	return (long double)c->covar /
+	       (sqrtl((long double)c->var_x) * sqrtl((long double)c->var_y));
 }
 #endif /* __KERNEL__ */
 
@@ -44,6 +44,7 @@
 
 #define BPFTUNE_RUN_DIR			"/var/run/bpftune"
 #define BPFTUNER_CGROUP_DIR		BPFTUNE_RUN_DIR "/cgroupv2"
+#define BPFTUNE_STATE_DIR		BPFTUNE_RUN_DIR "/state"
 #define BPFTUNER_LIB_DIR		"/usr/lib64/bpftune/"
 #define BPFTUNER_LOCAL_LIB_DIR		"/usr/local/lib64/bpftune/"
 #define BPFTUNER_LIB_SUFFIX		"_tuner.so"
@@ -80,6 +81,23 @@ extern unsigned short bpftune_learning_rate;
 
 void bpftune_set_learning_rate(unsigned short rate);
 
+extern unsigned int bpftune_coalesce_msec;
+
+void bpftune_set_coalesce(unsigned int window_msec);
+
+extern unsigned int bpftune_verify_sec;
+
+void bpftune_set_verify(unsigned int window_sec);
+void bpftune_set_no_attach(bool no_attach);
+void bpftune_set_persist(bool persist);
+int bpftune_option_set(const char *nameval);
+const char *bpftune_option(const char *name);
+long bpftune_option_long(const char *name, long def);
+__u64 bpftune_ktime_ns(void);
+int bpftune_coalesce_drain(bool all);
+
+extern bool bpftune_cgroup_scoped;
+
 int bpftune_cgroup_init(const char *cgroup_path);
 const char *bpftune_cgroup_name(void);
 int bpftune_cgroup_fd(void);
@@ -88,6 +106,11 @@ int bpftuner_cgroup_attach(struct bpftuner *tuner, const char *prog_name,
 			   enum bpf_attach_type attach_type);
 void bpftuner_cgroup_detach(struct bpftuner *tuner, const char *prog_name,
 			    enum bpf_attach_type attach_type);
+int bpftuner_bpf_prog_attach(struct bpftuner *tuner, const char *prog_name);
+void bpftuner_bpf_prog_detach(struct bpftuner *tuner, const char *prog_name);
+int bpftuner_bpf_progs_ondemand(struct bpftuner *tuner, const char **progs,
+				unsigned long idle_secs,
+				unsigned long probe_secs);
 
 
 struct bpftuner *bpftuner_init(const char *path);
@@ -121,6 +144,19 @@ int bpftuner_tunable_sysctl_write(struct bpftuner *tuner,
 				  __u8 num_values, long *values,
 				  const char *fmt, ...);
 
+int bpftuner_tunable_sysctls_write(struct bpftuner *tuner,
+				   unsigned int scenario,
+				   unsigned long netns_cookie,
+				   unsigned int num_updates,
+				   struct bpftunable_update *updates,
+				   const char *reason);
+
+int bpftuner_tunable_cpumask_write(struct bpftuner *tuner,
+				   unsigned int tunable,
+				   unsigned int scenario,
+				   const __u64 *mask, unsigned int nwords,
+				   const char *fmt, ...);
+
 int bpftuner_tunable_update(struct bpftuner *tuner,
 			    unsigned int tunable,
 			    unsigned int scenario,
@@ -129,8 +165,10 @@ int bpftuner_tunable_update(struct bpftuner *tuner,
 
 struct bpftuner *bpftune_tuner(unsigned int index);
 unsigned int bpftune_tuner_num(void);
+/* ids of tuners still initializing (or that failed to) have no tuner */
 #define bpftune_for_each_tuner(tuner)					     \
-	for (unsigned int __it = 0; (tuner = bpftune_tuner(__it)) != NULL; __it++)
+	for (unsigned int __it = 0; __it < bpftune_tuner_num(); __it++)	     \
+		if ((tuner = bpftune_tuner(__it)) == NULL) {} else
 
 void bpftuner_fini(struct bpftuner *tuner, enum bpftune_state state);
 void bpftuner_bpf_fini(struct bpftuner *tuner);
@@ -155,6 +193,9 @@ void bpftuner_tunables_fini(struct bpftuner *tuner);
 			tuner->skeleton = __skel->skeleton;		     \
 			__skel->bss->debug = bpftune_log_level() >= LOG_DEBUG;\
 			__skel->bss->bpftune_pid = getpid();		     \
+			__skel->bss->bpftune_coalesce_msec = bpftune_coalesce_msec;\
+			__skel->bss->bpftune_verify_sec = bpftune_verify_sec;\
+			__skel->bss->bpftune_cgroup_scoped = bpftune_cgroup_scoped;\
 			__skel->bss->bpftune_learning_rate = bpftune_learning_rate;\
 			tuner->obj = __skel->obj;			     \
 			tuner->ring_buffer_map = __skel->maps.ring_buffer_map;\
@@ -167,6 +208,9 @@ void bpftuner_tunables_fini(struct bpftuner *tuner);
 			__lskel->bss->debug = bpftune_log_level() >= LOG_DEBUG;\
 			__lskel->bss->bpftune_learning_rate = bpftune_learning_rate;\
 			__lskel->bss->bpftune_pid = getpid();		     \
+			__lskel->bss->bpftune_coalesce_msec = bpftune_coalesce_msec;\
+			__lskel->bss->bpftune_verify_sec = bpftune_verify_sec;\
+			__lskel->bss->bpftune_cgroup_scoped = bpftune_cgroup_scoped;\
 			tuner->obj = __lskel->obj;			     \
 			tuner->ring_buffer_map = __lskel->maps.ring_buffer_map;\
 			tuner->netns_map = __lskel->maps.netns_map;	     \
@@ -203,9 +247,9 @@ void bpftuner_tunables_fini(struct bpftuner *tuner);
 			break;						     \
 		}							     \
 		if (!tuner->bpf_legacy)					     \
-			__skel->bss->tuner_id = bpftune_tuner_num();	     \
+			__skel->bss->tuner_id = tuner->id;		     \
 		else							     \
-			__lskel->bss->tuner_id = bpftune_tuner_num();	     \
+			__lskel->bss->tuner_id = tuner->id;		     \
 	} while (0);							     \
 	__err;								     \
 	})
@@ -262,6 +306,16 @@ void bpftuner_tunables_fini(struct bpftuner *tuner);
 	 ((struct tuner_name##_tuner_bpf_legacy *)tuner->skel)->bss->var :   \
 	 ((struct tuner_name##_tuner_bpf *)tuner->skel)->bss->var)
 
+#define bpftuner_bpf_var_ptr(tuner_name, tuner, var)			     \
+	(tuner->bpf_legacy ?						     \
+	 &((struct tuner_name##_tuner_bpf_legacy *)tuner->skel)->bss->var :  \
+	 &((struct tuner_name##_tuner_bpf *)tuner->skel)->bss->var)
+
+#define bpftuner_bpf_map_get(tuner_name, tuner, map)			     \
+	(tuner->bpf_legacy ?						     \
+	 ((struct tuner_name##_tuner_bpf_legacy *)tuner->skel)->maps.map :   \
+	 ((struct tuner_name##_tuner_bpf *)tuner->skel)->maps.map)
+
 enum bpftune_support_level {
 	BPFTUNE_NONE = -1,
 	BPFTUNE_LEGACY,
@@ -272,26 +326,128 @@ enum bpftune_support_level bpftune_bpf_support(void);
 void bpftuner_force_bpf_legacy(void);
 bool bpftuner_bpf_legacy(void);
 int bpftuner_ring_buffer_map_fd(struct bpftuner *tuner);
+int bpftune_percpu_counter_sum(int map_fd, __u32 idx, __s64 *sum);
+int bpftune_ring_buffer_group_add(const char *tuners, unsigned int size,
+				  int priority);
+void bpftune_ring_buffer_set_per_tuner(bool per_tuner);
+int bpftune_shared_maps_init(void);
+__u32 bpftune_map_max_entries(const char *tuner_name, const char *map_name,
+			      __u32 def);
+unsigned long bpftune_map_memlock(int map_fd);
 void *bpftune_ring_buffer_init(int ringbuf_map_fd, void *ctx);
+int bpftune_ringbuf_event_read(void *ctx, void *data, size_t size);
 int bpftune_ring_buffer_poll(void *ring_buffer, int interval);
 void bpftune_ring_buffer_fini(void *ring_buffer);
 
+int bpftune_workers_init(unsigned int num_workers);
+void bpftune_workers_fini(void);
+
+#define BPFTUNE_METRICS_PATH		BPFTUNE_RUN_DIR "/metrics"
+
+int bpftune_metrics_init(const char *path);
+void bpftune_metrics_fini(void);
+
+int bpftune_prog_stats_init(double budget_pct);
+void bpftune_prog_stats_fini(void);
+
+/* Event traces are binary logs of the events bpftune handles and the
+ * sysctl changes it applies, for offline replay through the tuners.  A
+ * trace is a struct bpftune_trace_header followed by records, each a
+ * struct bpftune_trace_record followed by size bytes of payload, padded
+ * to a multiple of 8 bytes so records can be read in place from an
+ * mmap()ed trace.  Timestamps are CLOCK_MONOTONIC nanoseconds.
+ */
+#define BPFTUNE_TRACE_MAGIC		"BPFTUNET"
+#define BPFTUNE_TRACE_VERSION		1
+#define BPFTUNE_TRACE_ALIGN(size)	(((size) + 7) & ~7UL)
+
+struct bpftune_trace_header {
+	char magic[8];
+	__u32 version;
+	__u32 header_size;
+	__u64 start_ns;
+	__u64 start_realtime_ns;
+};
+
+enum bpftune_trace_type {
+	BPFTUNE_TRACE_TUNER,		/* struct bpftune_trace_tuner */
+	BPFTUNE_TRACE_EVENT,		/* struct bpftune_event as received */
+	BPFTUNE_TRACE_SYSCTL,		/* struct bpftune_trace_sysctl */
+};
+
+struct bpftune_trace_record {
+	__u64 ts;
+	__u32 type;
+	__u32 size;
+};
+
+/* maps tuner ids in later records to tuner names */
+struct bpftune_trace_tuner {
+	__u32 id;
+	char name[BPFTUNE_MAX_NAME];
+};
+
+#define BPFTUNE_TRACE_SYSCTL_OLD	0x1	/* old values are known */
+
+struct bpftune_trace_sysctl {
+	__u64 netns_cookie;
+	__u32 tuner_id;
+	__u32 tunable;
+	__u32 scenario;
+	__u16 num_values;
+	__u16 flags;
+	long old[BPFTUNE_MAX_VALUES];
+	long new[BPFTUNE_MAX_VALUES];
+};
+
+int bpftune_trace_open(const char *path);
+void bpftune_trace_close(void);
+int bpftune_trace_replay(const char *path, int interval);
+void bpftune_set_dry_run(bool dry_run);
+bool bpftune_dry_run_enabled(void);
+
 void bpftune_sysctl_name_to_path(const char *name, char *path, size_t path_sz);
 int bpftune_sysctl_read(int netns_fd, const char *name, long *values);
 int bpftune_sysctl_write(int netns_fd, const char *name, __u8 num_values, long *values);
+int bpftune_sysctl_cpumask_read(const char *name, __u64 *mask,
+				unsigned int nwords);
+int bpftune_sysctl_cpumask_write(const char *name, const __u64 *mask,
+				 unsigned int nwords);
+unsigned int bpftune_cpumask_weight(const __u64 *mask, unsigned int nwords);
+
+int bpftune_mem_read(struct bpftune_mem *mem);
+void bpftune_mem_refresh(struct bpftune_mem *mem, __u64 *last,
+			 __u64 min_interval);
+
+struct bpftune_sysctl_value {
+	const char *name;
+	__u8 num_values;
+	long values[BPFTUNE_MAX_VALUES];
+	int ret;
+};
+
+int bpftune_sysctls_write(int netns_fd, unsigned long netns_cookie,
+			  unsigned int num_sysctls,
+			  struct bpftune_sysctl_value *sysctls);
+void bpftune_sysctl_cache_flush(unsigned long netns_cookie);
+
+__u32 bpftune_sysctl_watch_hash(const char *key);
+int bpftune_sysctl_watch_init(int map_fd);
+__u64 bpftune_sysctl_watch_lookup(const char *key);
 
 bool bpftune_netns_cookie_supported(void);
 int bpftune_netns_set(int fd, int *orig_fd);
 int bpftune_netns_info(int pid, int *fd, unsigned long *cookie);
 int bpftune_netns_init_all(void);
+void bpftune_netns_fini_all(void);
+int bpftune_netns_index_add(unsigned long cookie, int pid, const char *path);
+void bpftune_netns_index_remove(unsigned long cookie);
 void bpftuner_netns_init(struct bpftuner *tuner, unsigned long cookie);
 void bpftuner_netns_fini(struct bpftuner *tuner, unsigned long cookie, enum bpftune_state state);
-struct bpftuner_netns *bpftuner_netns_from_cookie(unsigned long tuner_id, unsigned long cookie);
+int bpftuner_netns_from_cookie(unsigned long tuner_id, unsigned long cookie,
+			       struct bpftuner_netns *netns);
 int bpftuner_netns_fd_from_cookie(struct bpftuner *tuner, unsigned long cookie);
 
-#define bpftuner_for_each_netns(tuner, netns)				\
-	for (netns = &tuner->netns; netns != NULL; netns = netns->next)
-
 int bpftune_module_load(const char *name);
 int bpftune_module_unload(const char *name);
 
@@ -31,7 +31,7 @@ BPF_FENTRY(proc_dostring_coredump, struct ctl_table *table, int write,
 	 */
 	event.tuner_id = tuner_id;
 	event.scenario_id = scenario_id;
-	ret = bpf_ringbuf_output(&ring_buffer_map, &event, sizeof(event), 0);
+	ret = bpftune_ringbuf_output(&event, sizeof(event));
 	bpftune_debug("tuner [%d] scenario [%d]: event send: %d ",
 		      tuner_id, scenario_id, ret);
 	return 0;
@@ -85,6 +85,7 @@ void fini(void)
 
 	bpftune_for_each_tuner(tuner)
 		bpftuner_fini(tuner, BPFTUNE_INACTIVE);
+	bpftune_netns_fini_all();
 	bpftune_cgroup_fini();
 }
 
@@ -151,12 +152,48 @@ void *inotify_thread(void *arg)
 	return NULL;
 }
 
+/* parse ring buffer group spec tuner[,tuner...][:size_kb[:priority]] */
+static int ring_buffer_group_parse(char *spec)
+{
+	unsigned int size = 0;
+	int priority = 0;
+	char *s;
+
+	s = strchr(spec, ':');
+	if (s) {
+		*(s++) = '\0';
+		size = strtoul(s, &s, 10) * 1024;
+		if (*s == ':')
+			priority = atoi(++s);
+		else if (*s != '\0')
+			return -EINVAL;
+	}
+	return bpftune_ring_buffer_group_add(spec, size, priority);
+}
+
+struct tuner_load {
+	char library_path[512];
+	pthread_t tid;
+	bool started;
+	struct bpftuner *tuner;
+};
+
+static void *tuner_load_thread(void *arg)
+{
+	struct tuner_load *load = arg;
+
+	load->tuner = bpftuner_init(load->library_path);
+	return NULL;
+}
+
 int init(const char *library_dir)
 {
+	static struct tuner_load loads[BPFTUNE_MAX_TUNERS];
+	unsigned int i, num_loads = 0, num_tuners = 0;
 	pthread_attr_t attr = {};
-	char library_path[512];
 	struct dirent *dirent;
 	pthread_t inotify_tid;
+	__u64 start;
 	DIR *dir;
 	int err;
 
@@ -169,8 +206,7 @@ int init(const char *library_dir)
 	}
 
 	bpftune_log(LOG_DEBUG, "searching %s for plugins...\n", library_dir);
-	while ((dirent = readdir(dir)) != NULL) {
-		struct bpftuner *tuner;
+	while ((dirent = readdir(dir)) != NULL && num_loads < BPFTUNE_MAX_TUNERS) {
 		bool allowed = true;
 
 		/* check if tuner is on optional allowlist */
@@ -193,16 +229,44 @@ int init(const char *library_dir)
 					
 		if (strstr(dirent->d_name, BPFTUNER_LIB_SUFFIX) == NULL)
 			continue;
-		snprintf(library_path, sizeof(library_path), "%s/%s",
+		snprintf(loads[num_loads].library_path,
+			 sizeof(loads[num_loads].library_path), "%s/%s",
 			 library_dir, dirent->d_name);
-		bpftune_log(LOG_DEBUG, "found lib %s, init\n", library_path);
-		tuner = bpftuner_init(library_path);
+		bpftune_log(LOG_DEBUG, "found lib %s, init\n",
+			    loads[num_loads].library_path);
+		num_loads++;
+	}
+	closedir(dir);
+
+	/* with shared maps in place, tuners do not depend on each other's
+	 * fds and can be loaded (and verified) concurrently.  If we cannot
+	 * create them, fall back to loading one at a time.
+	 */
+	start = bpftune_ktime_ns();
+	err = bpftune_shared_maps_init();
+	if (err)
+		bpftune_log(LOG_DEBUG, "could not create shared maps (%s); loading tuners serially\n",
+			    strerror(-err));
+	for (i = 0; i < num_loads; i++) {
+		if (!err && !pthread_create(&loads[i].tid, NULL,
+					    tuner_load_thread, &loads[i]))
+			loads[i].started = true;
+		else
+			tuner_load_thread(&loads[i]);
+	}
+	for (i = 0; i < num_loads; i++) {
+		if (loads[i].started)
+			pthread_join(loads[i].tid, NULL);
 		/* individual tuner failure shouldn't prevent progress */
-		if (!tuner)
+		if (!loads[i].tuner)
 			continue;
+		num_tuners++;
 		if (ringbuf_map_fd == 0)
-			ringbuf_map_fd = bpftuner_ring_buffer_map_fd(tuner);
+			ringbuf_map_fd = bpftuner_ring_buffer_map_fd(loads[i].tuner);
 	}
+	bpftune_log(BPFTUNE_LOG_LEVEL, "initialized %u of %u tuners in %.3f seconds\n",
+		    num_tuners, num_loads,
+		    (double)(bpftune_ktime_ns() - start) / SECOND);
 
 	if (pthread_attr_init(&attr) ||
 	    pthread_create(&inotify_tid, &attr, inotify_thread, (void *)library_dir))
@@ -227,14 +291,25 @@ void do_help(void)
 	fprintf(stderr,
 		"Usage: %s [OPTIONS]\n"
 		"	OPTIONS := { { -a|--allow tuner}\n"
+		"		     { -b|--budget cpu_pct}\n"
 		"		     { -d|--debug} {-D|--daemon}\n"
 		"		     { -c|--cgroup_path cgroup_path}\n"
+		"		     { -C|--coalesce window_msec}\n"
+		"		     { -v|--verify window_sec}\n"
+		"		     { -g|--ringbuf_group tuner[,tuner...][:size_kb[:priority]]}\n"
 		"		     { -L|--legacy}\n"
 		"		     { -h|--help}}\n"
 		"		     { -l|--library_path library_path}\n"
+		"		     { -m|--multi_ringbuf}\n"
+		"		     { -M|--metrics socket_path}\n"
+		"		     { -o|--option tuner.option=value}\n"
+		"		     { -p|--persist}\n"
+		"		     { -P|--replay trace_file}\n"
 		"		     { -r|--learning_rate learning_rate}\n"
+		"		     { -R|--record trace_file}\n"
 		"		     { -s|--stderr}\n"
 		"		     { -S|--suppport}\n"
+		"		     { -w|--workers num_workers}\n"
 		"		     { -V|--version}}\n",
 		bin_name);
 }
@@ -274,16 +349,27 @@ int main(int argc, char *argv[])
 {
 	static const struct option options[] = {
 		{ "allow",	required_argument,	NULL,	'a' },
+		{ "budget",	required_argument,	NULL,	'b' },
 		{ "cgroup",	required_argument,	NULL,	'c' },
+		{ "coalesce",	required_argument,	NULL,	'C' },
 		{ "daemon", 	no_argument,		NULL,	'D' },
 		{ "debug",	no_argument,		NULL,	'd' },
+		{ "ringbuf_group", required_argument,	NULL,	'g' },
 		{ "legacy",	no_argument,		NULL,	'L' },
 		{ "help",	no_argument,		NULL,	'h' },
 		{ "libdir",	required_argument,	NULL,	'l' },
+		{ "multi_ringbuf", no_argument,		NULL,	'm' },
+		{ "metrics",	required_argument,	NULL,	'M' },
+		{ "option",	required_argument,	NULL,	'o' },
+		{ "persist",	no_argument,		NULL,	'p' },
+		{ "replay",	required_argument,	NULL,	'P' },
+		{ "record",	required_argument,	NULL,	'R' },
 		{ "learning_rate", required_argument,	NULL,	'r' },
+		{ "verify",	required_argument,	NULL,	'v' },
 		{ "stderr", 	no_argument,		NULL,	's' },
 		{ "support",	no_argument,		NULL,	'S' },
 		{ "version",	no_argument,		NULL,	'V' },
+		{ "workers",	required_argument,	NULL,	'w' },
 		{ 0 }
 	};
 	struct rlimit r = {RLIM_INFINITY, RLIM_INFINITY};
@@ -294,20 +380,36 @@ int main(int argc, char *argv[])
 	int log_level = BPFTUNE_LOG_LEVEL;
 	struct sigaction sa = {}, oldsa = {};
 	bool support_only = false;
+	unsigned int num_workers = 0;
+	char *metrics_path = NULL;
+	char *record_path = NULL;
+	char *replay_path = NULL;
+	bool persist = false;
+	double budget = -1;
 	int interval = 100;
 	int err, opt;
 
 	bin_name = argv[0];
 
-	while ((opt = getopt_long(argc, argv, "a:c:dDhl:Lr:sSV", options, NULL))
+	while ((opt = getopt_long(argc, argv, "a:b:c:C:dDg:hl:LmM:o:pP:r:R:sSv:Vw:", options, NULL))
 		>= 0) {
 		switch (opt) {
 		case 'a':
 			allowlist[nr_allowlist++] = optarg;
 			break;
+		case 'b':
+			budget = strtod(optarg, NULL);
+			if (budget < 0) {
+				fprintf(stderr, "invalid budget '%s'\n", optarg);
+				return 1;
+			}
+			break;
 		case 'c':
 			cgroup_dir = optarg;
 			break;
+		case 'C':
+			bpftune_set_coalesce(atoi(optarg));
+			break;
 		case 'd':
 			log_level = LOG_DEBUG;
 			break;
@@ -318,6 +420,13 @@ int main(int argc, char *argv[])
 				return 1;
 			}
 			break;
+		case 'g':
+			if (ring_buffer_group_parse(optarg)) {
+				fprintf(stderr, "invalid ring buffer group '%s'\n",
+					optarg);
+				return 1;
+			}
+			break;
 		case 'h':
 			do_help();
 			return 0;
@@ -327,6 +436,26 @@ int main(int argc, char *argv[])
 		case 'L':
 			bpftuner_force_bpf_legacy();
 			break;
+		case 'm':
+			bpftune_ring_buffer_set_per_tuner(true);
+			break;
+		case 'M':
+			metrics_path = optarg;
+			break;
+		case 'o':
+			if (bpftune_option_set(optarg)) {
+				fprintf(stderr, "invalid option '%s'; expected name=value\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'p':
+			bpftune_set_persist(true);
+			persist = true;
+			break;
+		case 'P':
+			replay_path = optarg;
+			break;
 		case 'r':
 			rate = atoi(optarg);
 			if (rate > BPFTUNE_DELTA_MAX) {
@@ -335,6 +464,9 @@ int main(int argc, char *argv[])
 				return 1;
 			}
 			break;
+		case 'R':
+			record_path = optarg;
+			break;
 		case 's':
 			use_stderr = true;
 			break;
@@ -342,9 +474,15 @@ int main(int argc, char *argv[])
 			use_stderr = true;
 			support_only = true;
 			break;
+		case 'v':
+			bpftune_set_verify(atoi(optarg));
+			break;
 		case 'V':
 			do_version();
 			return 0;
+		case 'w':
+			num_workers = atoi(optarg);
+			break;
 		default:
 			fprintf(stderr, "unrecognized option '%s'\n",
 				argv[optind - 1]);
@@ -356,6 +494,18 @@ int main(int argc, char *argv[])
 
 	bpftune_set_learning_rate(rate);
 
+	if (replay_path) {
+		if (persist) {
+			fprintf(stderr, "cannot persist state when replaying a trace\n");
+			return 1;
+		}
+		/* tuners see only trace events, and change nothing */
+		bpftune_set_no_attach(true);
+		bpftune_set_dry_run(true);
+		/* handle events inline, in trace order */
+		num_workers = 0;
+	}
+
 	if (setrlimit(RLIMIT_MEMLOCK, &r)) {
 		err = -errno;
 		bpftune_log(BPFTUNE_LOG_LEVEL, "cannot unlock memory limit: %s.\nAre you running with CAP_SYS_ADMIN/via sudo/as root?\n",
@@ -388,6 +538,9 @@ int main(int argc, char *argv[])
 
 	bpftune_cap_drop();
 
+	if (record_path && bpftune_trace_open(record_path))
+		exit(EXIT_FAILURE);
+
 	if (init(BPFTUNER_LIB_DIR)) {
 		bpftune_log(LOG_ERR, "could not initialize tuners in '%s'\n",
 			    BPFTUNER_LIB_DIR);
@@ -405,10 +558,22 @@ int main(int argc, char *argv[])
 		bpftune_log(LOG_ERR, "signal handling failure: %s\n",
 			    strerror(-err));
 	} else {
-		err = bpftune_ring_buffer_poll(ring_buffer, interval);
+		err = bpftune_workers_init(num_workers);
+		if (!err && budget >= 0)
+			err = bpftune_prog_stats_init(budget);
+		if (!err && metrics_path)
+			err = bpftune_metrics_init(metrics_path);
+		if (!err && replay_path)
+			err = bpftune_trace_replay(replay_path, interval);
+		else if (!err)
+			err = bpftune_ring_buffer_poll(ring_buffer, interval);
+		bpftune_metrics_fini();
+		bpftune_prog_stats_fini();
+		bpftune_workers_fini();
 	}
 
 	fini();
+	bpftune_trace_close();
 
 	if (use_stderr)
 		fflush(stderr);
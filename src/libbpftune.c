@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <dlfcn.h>
 #include <errno.h>
@@ -39,6 +40,8 @@
 #include <linux/types.h>
 #include <sys/mount.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
 #include <sys/utsname.h>
 #include <sched.h>
 #include <mntent.h>
@@ -46,13 +49,19 @@
 #include <pthread.h>
 #include <signal.h>
 #include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 
 unsigned short bpftune_learning_rate;
+unsigned int bpftune_coalesce_msec;
+unsigned int bpftune_verify_sec;
 
 #include <bpftune/libbpftune.h>
 
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
+#include <bpf/btf.h>
 
 #include "probe.skel.h"
 #include "probe.skel.legacy.h"
@@ -68,6 +77,7 @@ int bpftune_loglevel = BPFTUNE_LOG_LEVEL;
 struct ring_buffer *ring_buffer;
 int ring_buffer_map_fd;
 int netns_map_fd;
+int last_event_map_fd;
 
 int bpftune_log_level(void)
 {
@@ -187,21 +197,34 @@ static pthread_key_t cap_key;
 static pthread_once_t cap_once = PTHREAD_ONCE_INIT;
 
 /* capabilities are thread-specific, maintain a count for nested calls
- * so we only drop caps when it reaches zero.
+ * so we only drop caps when it reaches zero.  The count is freed on
+ * thread exit via the key destructor.
  */
 static int *cap_count(void)
 {
 	int *count = pthread_getspecific(cap_key);
+	int err;
+
 	if (count)
 		return count;
 	count = calloc(1, sizeof(int));
-	pthread_setspecific(cap_key, count);
+	if (!count) {
+		bpftune_log(LOG_ERR, "could not allocate cap count\n");
+		return NULL;
+	}
+	err = pthread_setspecific(cap_key, count);
+	if (err) {
+		bpftune_log(LOG_ERR, "could not set cap count: %s\n",
+			    strerror(err));
+		free(count);
+		return NULL;
+	}
 	return count;
 }
 
 static void bpftune_cap_init(void)
 {
-	int err = pthread_key_create(&cap_key, NULL);
+	int err = pthread_key_create(&cap_key, free);
 
 	if (err)
 		bpftune_log(LOG_ERR, "could not create cap key: %s\n",
@@ -225,6 +248,8 @@ int bpftune_cap_add(void)
 	(void) pthread_once(&cap_once, bpftune_cap_init);
 
 	count = cap_count();
+	if (!count)
+		return -ENOMEM;
 	(*count)++;
 	bpftune_log(LOG_DEBUG, "set caps (count %d)\n", *count);
 	if (*count == 1) {
@@ -246,6 +271,8 @@ void bpftune_cap_drop(void)
 	(void) pthread_once(&cap_once, bpftune_cap_init);
 
 	count = cap_count();
+	if (!count)
+		return;
 	if (*count > 0)
 		(*count)--;
 	bpftune_log(LOG_DEBUG, "drop caps (count %d)\n", *count);
@@ -259,6 +286,115 @@ void bpftune_cap_drop(void)
 static char bpftune_cgroup_path[PATH_MAX];
 static int __bpftune_cgroup_fd;
 
+/* cgroup subtrees (relative to the cgroup2 mount) that per-connection
+ * programs are attached to, set via "-o bpftune.cgroups=path[,path...]";
+ * if none are specified, programs attach to the root cgroup.
+ */
+struct bpftune_cgroup_scope {
+	int fd;
+	char *path;
+};
+
+static struct bpftune_cgroup_scope bpftune_cgroup_scopes[BPFTUNE_MAX_CGROUPS];
+static unsigned int bpftune_num_cgroup_scopes;
+
+/* if set, BPF programs key per-connection state by cgroup id */
+bool bpftune_cgroup_scoped;
+
+static void bpftune_cgroup_scopes_fini(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < bpftune_num_cgroup_scopes; i++) {
+		close(bpftune_cgroup_scopes[i].fd);
+		free(bpftune_cgroup_scopes[i].path);
+	}
+	bpftune_num_cgroup_scopes = 0;
+	bpftune_cgroup_scoped = false;
+}
+
+/* BPF programs find the cgroup of a socket via sk->sk_cgrp_data.cgroup;
+ * without it every socket would appear to be outside the scoped subtrees.
+ */
+static bool bpftune_sk_cgroup_supported(void)
+{
+	const struct btf_member *m;
+	const struct btf_type *t;
+	struct btf *btf;
+	bool found = false;
+	int id, i;
+
+	btf = btf__load_vmlinux_btf();
+	if (libbpf_get_error(btf))
+		return false;
+	id = btf__find_by_name_kind(btf, "sock_cgroup_data", BTF_KIND_STRUCT);
+	if (id > 0) {
+		t = btf__type_by_id(btf, id);
+		for (i = 0, m = btf_members(t); i < btf_vlen(t) && !found; i++, m++)
+			found = strcmp(btf__name_by_offset(btf, m->name_off), "cgroup") == 0;
+	}
+	btf__free(btf);
+	return found;
+}
+
+static int bpftune_cgroup_scopes_init(void)
+{
+	const char *cgroups = bpftune_option("bpftune.cgroups");
+	char *paths, *path, *saveptr = NULL;
+	char subtree[PATH_MAX];
+	int fd, err = 0;
+
+	if (!cgroups || !*cgroups)
+		return 0;
+	if (!bpftune_sk_cgroup_supported()) {
+		bpftune_log(LOG_ERR, "kernel does not record socket cgroups; cannot scope tuning to cgroups '%s'\n",
+			    cgroups);
+		return -EOPNOTSUPP;
+	}
+	paths = strdup(cgroups);
+	if (!paths)
+		return -ENOMEM;
+	for (path = strtok_r(paths, ",", &saveptr); path != NULL;
+	     path = strtok_r(NULL, ",", &saveptr)) {
+		if (bpftune_num_cgroup_scopes >= BPFTUNE_MAX_CGROUPS) {
+			bpftune_log(LOG_ERR, "at most %d cgroups can be specified\n",
+				    BPFTUNE_MAX_CGROUPS);
+			err = -E2BIG;
+			break;
+		}
+		while (*path == '/')
+			path++;
+		if (snprintf(subtree, sizeof(subtree), "%s/%s",
+			     bpftune_cgroup_path, path) >= (int)sizeof(subtree)) {
+			err = -ENAMETOOLONG;
+			break;
+		}
+		fd = open(subtree, O_RDONLY | O_DIRECTORY);
+		if (fd < 0) {
+			err = -errno;
+			bpftune_log(LOG_ERR, "cannot open cgroup '%s': %s\n",
+				    subtree, strerror(-err));
+			break;
+		}
+		bpftune_cgroup_scopes[bpftune_num_cgroup_scopes].path =
+			strdup(subtree);
+		if (!bpftune_cgroup_scopes[bpftune_num_cgroup_scopes].path) {
+			close(fd);
+			err = -ENOMEM;
+			break;
+		}
+		bpftune_cgroup_scopes[bpftune_num_cgroup_scopes++].fd = fd;
+		bpftune_log(LOG_DEBUG, "scoping per-connection tuning to cgroup '%s'\n",
+			    subtree);
+	}
+	free(paths);
+	if (err)
+		bpftune_cgroup_scopes_fini();
+	else
+		bpftune_cgroup_scoped = bpftune_num_cgroup_scopes > 0;
+	return err;
+}
+
 int bpftune_cgroup_init(const char *cgroup_path)
 {
 	int err = 0;
@@ -297,7 +433,7 @@ int bpftune_cgroup_init(const char *cgroup_path)
 		bpftune_log(LOG_ERR, "cannot open cgroup dir '%s': %s\n",
 			    cgroup_path, strerror(-err));
 	} else {
-		err = 0;
+		err = bpftune_cgroup_scopes_init();
 	}
 out:
 	bpftune_cap_drop();
@@ -316,26 +452,76 @@ int bpftune_cgroup_fd(void)
 
 void bpftune_cgroup_fini(void)
 {
+	bpftune_cgroup_scopes_fini();
 	if (__bpftune_cgroup_fd)
 		close(__bpftune_cgroup_fd);
 }
 
+/* per-connection programs are attached to the cgroup subtrees tuning is
+ * scoped to, if any; sysctl programs always attach to the root cgroup so
+ * that all sysctl writes are seen.
+ */
+static bool bpftune_cgroup_attach_scoped(enum bpf_attach_type attach_type)
+{
+	return bpftune_num_cgroup_scopes > 0 && attach_type != BPF_CGROUP_SYSCTL;
+}
+
+/* if set, tuner BPF programs are loaded but not attached; used to
+ * benchmark userspace event handling with synthetic events.
+ */
+static bool bpftune_no_attach;
+
+/* must be called prior to tuner init to take effect */
+void bpftune_set_no_attach(bool no_attach)
+{
+	bpftune_no_attach = no_attach;
+}
+
+/* if set, learned state - tuner hash maps (pinned under BPFTUNE_PIN) and
+ * tunable/netns state (saved under BPFTUNE_STATE_DIR) - survives restart.
+ */
+static bool bpftune_persist;
+
+/* must be called prior to tuner init to take effect */
+void bpftune_set_persist(bool persist)
+{
+	bpftune_persist = persist;
+}
+
+/* if set, sysctl writes are logged but not made; used for trace replay. */
+static bool bpftune_dry_run;
+
+void bpftune_set_dry_run(bool dry_run)
+{
+	bpftune_dry_run = dry_run;
+}
+
+/* tuners making changes other than via sysctl (e.g. netlink) must skip
+ * them if this is set.
+ */
+bool bpftune_dry_run_enabled(void)
+{
+	return bpftune_dry_run;
+}
+
 int bpftuner_cgroup_attach(struct bpftuner *tuner, const char *prog_name,
 			   enum bpf_attach_type attach_type)
 {
 	int prog_fd, cgroup_fd, err = 0;
+	unsigned int i, num_cgroups = 1;
 	struct bpf_program *prog;
 	const char *cgroup_dir;
+	bool scoped;
 
 	/* if cgroup prog is not in current strategy prog list, skip attach */
-	if (!bpftuner_bpf_prog_in_strategy(tuner, prog_name))
+	if (!bpftuner_bpf_prog_in_strategy(tuner, prog_name) || bpftune_no_attach)
 		return 0;
 
 	err = bpftune_cap_add();
 	if (err)
 		return err;
 	
-	/* attach to root cgroup */
+	/* attach to root cgroup, or to the subtrees tuning is scoped to */
 	cgroup_dir = bpftune_cgroup_name();
 
 	if (!cgroup_dir) {
@@ -343,7 +529,6 @@ int bpftuner_cgroup_attach(struct bpftuner *tuner, const char *prog_name,
 		err = 1;
 		goto out;
 	}
-	cgroup_fd = bpftune_cgroup_fd();
 	prog = bpf_object__find_program_by_name(tuner->obj, prog_name);
 	if (!prog) {
 		bpftune_log(LOG_ERR, "no prog '%s'\n", prog_name);
@@ -352,11 +537,25 @@ int bpftuner_cgroup_attach(struct bpftuner *tuner, const char *prog_name,
 	}
 	prog_fd = bpf_program__fd(prog);
 
-	if (bpf_prog_attach(prog_fd, cgroup_fd, attach_type,
-			    BPF_F_ALLOW_MULTI)) {
+	scoped = bpftune_cgroup_attach_scoped(attach_type);
+	if (scoped)
+		num_cgroups = bpftune_num_cgroup_scopes;
+	for (i = 0; i < num_cgroups; i++) {
+		cgroup_fd = scoped ? bpftune_cgroup_scopes[i].fd :
+				     bpftune_cgroup_fd();
+		if (!bpf_prog_attach(prog_fd, cgroup_fd, attach_type,
+				     BPF_F_ALLOW_MULTI))
+			continue;
 		err = -errno;
 		bpftune_log(LOG_ERR, "cannot attach '%s' to cgroup '%s': %s\n",
-			    prog_name, cgroup_dir, strerror(-err));
+			    prog_name,
+			    scoped ? bpftune_cgroup_scopes[i].path : cgroup_dir,
+			    strerror(-err));
+		/* do not leave program attached to some subtrees only */
+		while (i-- > 0)
+			bpf_prog_detach2(prog_fd, bpftune_cgroup_scopes[i].fd,
+					 attach_type);
+		break;
 	}
 out:
 	bpftune_cap_drop();
@@ -368,10 +567,12 @@ void bpftuner_cgroup_detach(struct bpftuner *tuner, const char *prog_name,
 			   enum bpf_attach_type attach_type)
 {
 	int prog_fd, cgroup_fd, err = 0;
+	unsigned int i, num_cgroups = 1;
 	struct bpf_program *prog;
+	bool scoped;
 
 	/* if cgroup prog is not in current strategy prog list, skip attach */
-	if (!bpftuner_bpf_prog_in_strategy(tuner, prog_name))
+	if (!bpftuner_bpf_prog_in_strategy(tuner, prog_name) || bpftune_no_attach)
 		return;
 
 	err = bpftune_cap_add();
@@ -380,17 +581,171 @@ void bpftuner_cgroup_detach(struct bpftuner *tuner, const char *prog_name,
 	prog = bpf_object__find_program_by_name(tuner->obj, prog_name);
 	if (prog) {
 		prog_fd = bpf_program__fd(prog);
-		cgroup_fd = bpftune_cgroup_fd();
-
-		if (bpf_prog_detach2(prog_fd, cgroup_fd, attach_type)) {
-                        err = -errno;
-                        bpftune_log(LOG_ERR, "error detaching prog fd %d, cgroup fd %d: %s\n",
-                                prog_fd, cgroup_fd, strerror(-err));
-                }
+		scoped = bpftune_cgroup_attach_scoped(attach_type);
+		if (scoped)
+			num_cgroups = bpftune_num_cgroup_scopes;
+		for (i = 0; i < num_cgroups; i++) {
+			cgroup_fd = scoped ? bpftune_cgroup_scopes[i].fd :
+					     bpftune_cgroup_fd();
+			if (bpf_prog_detach2(prog_fd, cgroup_fd, attach_type)) {
+				err = -errno;
+				bpftune_log(LOG_ERR, "error detaching prog fd %d, cgroup fd %d: %s\n",
+					    prog_fd, cgroup_fd, strerror(-err));
+			}
+		}
         }
 	bpftune_cap_drop();
 }
 
+/* attach/detach individual skeleton programs; called with caps set.
+ * Programs not in the current strategy are never attached.
+ */
+static struct bpf_link **bpftuner_prog_link(struct bpftuner *tuner,
+					    const char *prog_name)
+{
+	struct bpf_object_skeleton *s = tuner->skeleton;
+	int i;
+
+	if (!s)
+		return NULL;
+	for (i = 0; i < s->prog_cnt; i++) {
+		struct bpf_prog_skeleton *ps = (struct bpf_prog_skeleton *)
+			((char *)s->progs + i * s->prog_skel_sz);
+
+		if (strcmp(ps->name, prog_name) == 0)
+			return ps->link;
+	}
+	return NULL;
+}
+
+int bpftuner_bpf_prog_attach(struct bpftuner *tuner, const char *prog_name)
+{
+	struct bpf_link **link = bpftuner_prog_link(tuner, prog_name);
+	struct bpf_program *prog;
+	int err;
+
+	if (!bpftuner_bpf_prog_in_strategy(tuner, prog_name) || bpftune_no_attach)
+		return 0;
+	if (!link)
+		return -ENOENT;
+	if (*link)
+		return 0;
+	prog = bpf_object__find_program_by_name(tuner->obj, prog_name);
+	if (!prog)
+		return -ENOENT;
+	err = bpftune_cap_add();
+	if (err)
+		return err;
+	*link = bpf_program__attach(prog);
+	err = libbpf_get_error(*link);
+	if (err) {
+		*link = NULL;
+		bpftune_log(LOG_ERR, "%s: could not attach '%s': %s\n",
+			    tuner->name, prog_name, strerror(-err));
+	}
+	bpftune_cap_drop();
+	return err;
+}
+
+void bpftuner_bpf_prog_detach(struct bpftuner *tuner, const char *prog_name)
+{
+	struct bpf_link **link = bpftuner_prog_link(tuner, prog_name);
+
+	if (!link || !*link || bpftune_cap_add())
+		return;
+	bpf_link__destroy(*link);
+	*link = NULL;
+	bpftune_cap_drop();
+}
+
+/* On-demand programs are loaded with the tuner but kept detached until
+ * needed.  Tuner BPF code signals need by calling bpftune_ondemand_trigger()
+ * from a cheap program, and usefulness by passing useful samples to
+ * bpftune_sample_yield() from the on-demand programs; both are per-CPU
+ * bpftune_counters.  On-demand programs are attached when triggered, or
+ * every probe seconds to check if they have become useful, and detached
+ * again once they have produced no useful samples for idle seconds.
+ * This complements strategies, which choose which programs are loaded.
+ */
+struct bpftuner_ondemand {
+	const char **progs;
+	unsigned long idle;
+	unsigned long probe;
+	bool attached;
+	__u64 last_change;
+	__u64 last_yield;
+	__s64 triggers;
+	__s64 yields;
+};
+
+static struct bpftuner_ondemand bpftuner_ondemand[BPFTUNE_MAX_TUNERS];
+
+static void bpftuner_ondemand_attach(struct bpftuner *tuner, bool attach)
+{
+	struct bpftuner_ondemand *o = &bpftuner_ondemand[tuner->id];
+	int i;
+
+	for (i = 0; o->progs[i]; i++) {
+		if (attach)
+			bpftuner_bpf_prog_attach(tuner, o->progs[i]);
+		else
+			bpftuner_bpf_prog_detach(tuner, o->progs[i]);
+	}
+	o->attached = attach;
+	bpftune_log(LOG_DEBUG, "%s: %s on-demand programs\n", tuner->name,
+		    attach ? "attached" : "detached");
+}
+
+/* call after attach; detaches progs until they are needed */
+int bpftuner_bpf_progs_ondemand(struct bpftuner *tuner, const char **progs,
+				unsigned long idle_secs,
+				unsigned long probe_secs)
+{
+	struct bpftuner_ondemand *o;
+
+	if (tuner->id >= BPFTUNE_MAX_TUNERS || !progs)
+		return -EINVAL;
+	o = &bpftuner_ondemand[tuner->id];
+	memset(o, 0, sizeof(*o));
+	o->progs = progs;
+	o->idle = idle_secs;
+	o->probe = probe_secs;
+	bpftuner_ondemand_attach(tuner, false);
+	return 0;
+}
+
+static void bpftuner_ondemand_update(struct bpftuner *tuner, __u64 now)
+{
+	struct bpftuner_ondemand *o = &bpftuner_ondemand[tuner->id];
+	__s64 triggers = 0, yields = 0;
+
+	if (!o->progs || !tuner->counters_map_fd)
+		return;
+	if (bpftune_percpu_counter_sum(tuner->counters_map_fd,
+				       BPFTUNE_COUNTER_ONDEMAND_TRIGGER,
+				       &triggers) ||
+	    bpftune_percpu_counter_sum(tuner->counters_map_fd,
+				       BPFTUNE_COUNTER_SAMPLE_YIELD, &yields))
+		return;
+	if (!o->last_change)
+		o->last_change = now;
+	if (yields != o->yields)
+		o->last_yield = now;
+	if (!o->attached) {
+		if (triggers != o->triggers ||
+		    (o->probe && now - o->last_change >= o->probe * SECOND)) {
+			bpftuner_ondemand_attach(tuner, true);
+			o->last_change = o->last_yield = now;
+		}
+	} else if (now - o->last_yield >= o->idle * SECOND &&
+		   now - o->last_change >= o->idle * SECOND) {
+		bpftuner_ondemand_attach(tuner, false);
+		o->last_change = now;
+	}
+	o->triggers = triggers;
+	o->yields = yields;
+}
+
 static bool force_bpf_legacy;
 static bool netns_cookie_supported;
 
@@ -484,6 +839,96 @@ bool bpftuner_bpf_legacy(void)
 	return support_level < BPFTUNE_NORMAL;
 }
 
+static bool bpftuner_map_persistent(struct bpftuner *tuner, const char *name)
+{
+	int i;
+
+	for (i = 0; tuner->persist_maps && tuner->persist_maps[i]; i++) {
+		if (strcmp(name, tuner->persist_maps[i]) == 0)
+			return true;
+	}
+	return false;
+}
+
+/* remove pins under BPFTUNE_PIN/<tuner> for maps the tuner no longer
+ * persists (or all of them if state is not persisted), so that stale
+ * state is not picked up by a later run.  Called with caps set.
+ */
+static void bpftuner_maps_unpin(struct bpftuner *tuner)
+{
+	char dir[PATH_MAX], path[PATH_MAX];
+	struct dirent *d;
+	DIR *dp;
+
+	snprintf(dir, sizeof(dir), "%s/%s", BPFTUNE_PIN, tuner->name);
+	dp = opendir(dir);
+	if (!dp)
+		return;
+	while ((d = readdir(dp)) != NULL) {
+		if (d->d_name[0] == '.' ||
+		    (bpftune_persist && bpftuner_map_persistent(tuner, d->d_name)))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, d->d_name);
+		bpftune_log(LOG_DEBUG, "removing stale pinned map '%s'\n", path);
+		unlink(path);
+	}
+	closedir(dp);
+	if (!bpftune_persist)
+		rmdir(dir);
+}
+
+/* pin the tuner maps which hold learned per-host/per-flow state (listed
+ * in tuner->persist_maps) so that they are reused when the tuner is next
+ * loaded.  If a pinned map no longer matches the definition (e.g. after
+ * an upgrade changed a value struct) it is discarded.  Called with caps
+ * set.
+ */
+static void bpftuner_maps_pin(struct bpftuner *tuner)
+{
+	char path[PATH_MAX];
+	struct bpf_map *m;
+
+	bpftuner_maps_unpin(tuner);
+	if (!tuner->persist_maps)
+		return;
+	snprintf(path, sizeof(path), "%s/%s", BPFTUNE_PIN, tuner->name);
+	if ((mkdir(BPFTUNE_PIN, 0700) && errno != EEXIST) ||
+	    (mkdir(path, 0700) && errno != EEXIST)) {
+		bpftune_log(LOG_DEBUG, "could not create '%s': %s\n",
+			    path, strerror(errno));
+		return;
+	}
+	bpf_object__for_each_map(m, tuner->obj) {
+		struct bpf_map_info info = {};
+		__u32 len = sizeof(info);
+		int fd;
+
+		if (!bpftuner_map_persistent(tuner, bpf_map__name(m)))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s/%s", BPFTUNE_PIN,
+			 tuner->name, bpf_map__name(m));
+		fd = bpf_obj_get(path);
+		if (fd >= 0) {
+			if (bpf_obj_get_info_by_fd(fd, &info, &len) ||
+			    info.type != bpf_map__type(m) ||
+			    info.key_size != bpf_map__key_size(m) ||
+			    info.value_size != bpf_map__value_size(m) ||
+			    info.max_entries != bpf_map__max_entries(m)) {
+				bpftune_log(LOG_DEBUG, "discarding incompatible pinned map '%s'\n",
+					    path);
+				unlink(path);
+			} else {
+				bpftune_log(LOG_DEBUG, "reusing pinned map '%s'\n",
+					    path);
+			}
+			close(fd);
+		}
+		if (bpf_map__set_pin_path(m, path))
+			bpftune_log(LOG_DEBUG, "could not set pin path '%s'\n",
+				    path);
+	}
+}
+
 /* called with caps set */
 static int bpftuner_map_reuse(const char *name, struct bpf_map *map,
 			      int fd, int *tuner_fdp)
@@ -530,65 +975,451 @@ static void bpftuner_map_init(struct bpftuner *tuner, const char *name,
 	}
 }
 
-int __bpftuner_bpf_load(struct bpftuner *tuner, const char **optionals)
+/* By default all tuners share one ring buffer.  Optionally, each tuner
+ * (or a group of tuners) can get its own ring buffer with its own size and
+ * priority, so that a burst of events from a noisy tuner cannot cause drops
+ * of, or delay, events from other tuners.
+ */
+#define BPFTUNE_MAX_RING_BUFFERS	BPFTUNE_MAX_TUNERS
+
+struct bpftune_ring_buffer {
+	char tuners[BPFTUNE_MAX_NAME];	/* comma-separated tuner names */
+	unsigned int size;		/* size in bytes; 0 for default */
+	int priority;			/* higher values consumed first */
+	int map_fd;
+	bool added;
+};
+
+static struct bpftune_ring_buffer bpftune_ring_buffers[BPFTUNE_MAX_RING_BUFFERS];
+static struct bpftune_ring_buffer bpftune_default_ring_buffer = {
+	.tuners = "default",
+};
+static unsigned int bpftune_num_ring_buffers;
+static bool bpftune_ring_buffer_per_tuner;
+static pthread_mutex_t bpftune_ring_buffer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int bpftune_ring_buffer_add(struct bpftune_ring_buffer *rbuf);
+
+/* ring buffer size must be a power-of-2 multiple of page size. */
+static unsigned int bpftune_ring_buffer_size(unsigned int size)
 {
-	int err = 0;
+	unsigned int page_size = sysconf(_SC_PAGESIZE);
+	unsigned int rsize = page_size;
 
-	err = bpftune_cap_add();
+	if (!size)
+		return 0;
+	while (rsize < size && rsize < (1U << 31))
+		rsize <<= 1;
+	return rsize;
+}
 
-	if (err)
-		return err;
+int bpftune_ring_buffer_group_add(const char *tuners, unsigned int size,
+				  int priority)
+{
+	struct bpftune_ring_buffer *rbuf;
 
-	if (bpftuner_map_reuse("ring_buffer", tuner->ring_buffer_map,
-			       ring_buffer_map_fd, &tuner->ring_buffer_map_fd) ||
-	    bpftuner_map_reuse("netns_map", tuner->netns_map,
-			       netns_map_fd, &tuner->netns_map_fd)) {
-		err = -1;
-		goto out;
+	if (!tuners || strlen(tuners) >= sizeof(rbuf->tuners))
+		return -EINVAL;
+	if (bpftune_num_ring_buffers >= BPFTUNE_MAX_RING_BUFFERS)
+		return -ENOSPC;
+	rbuf = &bpftune_ring_buffers[bpftune_num_ring_buffers++];
+	strncpy(rbuf->tuners, tuners, sizeof(rbuf->tuners) - 1);
+	rbuf->size = bpftune_ring_buffer_size(size);
+	rbuf->priority = priority;
+	bpftune_log(LOG_DEBUG, "added ring buffer group '%s' (size %u, priority %d)\n",
+		    rbuf->tuners, rbuf->size, rbuf->priority);
+	return 0;
+}
+
+void bpftune_ring_buffer_set_per_tuner(bool per_tuner)
+{
+	bpftune_ring_buffer_per_tuner = per_tuner;
+}
+
+static bool bpftune_ring_buffers_multi(void)
+{
+	return bpftune_ring_buffer_per_tuner || bpftune_num_ring_buffers > 0;
+}
+
+static bool bpftune_ring_buffer_has_tuner(struct bpftune_ring_buffer *rbuf,
+					  const char *name)
+{
+	size_t len = strlen(name);
+	const char *s = rbuf->tuners;
+
+	while ((s = strstr(s, name)) != NULL) {
+		if ((s == rbuf->tuners || s[-1] == ',') &&
+		    (s[len] == '\0' || s[len] == ','))
+			return true;
+		s += len;
 	}
+	return false;
+}
 
-	if (optionals) {
-		int i;
+/* find ring buffer group for tuner; in per-tuner mode, tuners that are not
+ * a member of a group get a ring buffer of their own.  Other tuners use
+ * the default ring buffer.  Returns NULL if ring buffers are not in use,
+ * i.e. all tuners share ring_buffer_map_fd.
+ */
+static struct bpftune_ring_buffer *bpftune_ring_buffer_find(struct bpftuner *tuner)
+{
+	struct bpftune_ring_buffer *rbuf = &bpftune_default_ring_buffer;
+	unsigned int i;
 
-		for (i = 0; optionals[i] != NULL; i++) {
-			struct bpf_program *prog;
+	if (!bpftune_ring_buffers_multi())
+		return NULL;
 
-			prog = bpf_object__find_program_by_name(tuner->obj,
-								optionals[i]);
-			if (prog) {
-				bpftune_log(LOG_DEBUG, "marking '%s' as optional\n",
-					    optionals[i]);
-				bpf_program__set_autoload(prog, false);
-			}
+	pthread_mutex_lock(&bpftune_ring_buffer_lock);
+	for (i = 0; i < bpftune_num_ring_buffers; i++) {
+		if (bpftune_ring_buffer_has_tuner(&bpftune_ring_buffers[i],
+						  tuner->name)) {
+			rbuf = &bpftune_ring_buffers[i];
+			goto out;
 		}
 	}
-	err = bpf_object__load_skeleton(tuner->skeleton);
-	if (err) {
-		bpftune_log_bpf_err(err, "could not load skeleton: %s\n");
-		goto out;
+	if (bpftune_ring_buffer_per_tuner &&
+	    bpftune_num_ring_buffers < BPFTUNE_MAX_RING_BUFFERS) {
+		rbuf = &bpftune_ring_buffers[bpftune_num_ring_buffers++];
+		strncpy(rbuf->tuners, tuner->name, sizeof(rbuf->tuners) - 1);
 	}
-
-	bpftuner_map_init(tuner, "ring_buffer_map", &tuner->ring_buffer_map,
-			  &ring_buffer_map_fd, &tuner->ring_buffer_map_fd);
-	bpftuner_map_init(tuner, "netns_map", &tuner->netns_map,
-			  &netns_map_fd, &tuner->netns_map_fd);
 out:
-	bpftune_cap_drop();
-	return err;
+	pthread_mutex_unlock(&bpftune_ring_buffer_lock);
+	return rbuf;
 }
 
-int __bpftuner_bpf_attach(struct bpftuner *tuner)
+static int bpftune_ring_buffer_create(const char *name, unsigned int size)
 {
-	int err;
+	int fd = bpf_map_create(BPF_MAP_TYPE_RINGBUF, name, 0, 0,
+				size ? size : BPFTUNE_RINGBUF_SIZE, NULL);
+
+	if (fd < 0)
+		bpftune_log(LOG_ERR, "could not create ring buffer '%s': %s\n",
+			    name, strerror(errno));
+	return fd;
+}
+
+/* Create maps shared across tuners up front.  Otherwise the first tuner
+ * to load creates them and later tuners reuse its fds, which requires
+ * tuners to be loaded one at a time.  Ring buffers for tuner groups are
+ * created here too; in per-tuner mode, a tuner outside any group gets a
+ * ring buffer of its own, so that one is created at load time.
+ */
+int bpftune_shared_maps_init(void)
+{
+	unsigned long memlock;
+	unsigned int i;
+	int err, fd;
 
 	err = bpftune_cap_add();
 	if (err)
 		return err;
-	err = bpf_object__attach_skeleton(tuner->skeleton);
-	if (err) {
-		bpftune_log_bpf_err(err, "could not attach skeleton: %s\n");
-	} else {
-		tuner->ring_buffer_map_fd = bpf_map__fd(tuner->ring_buffer_map);
+	if (!bpftune_ring_buffers_multi() && ring_buffer_map_fd <= 0) {
+		fd = bpftune_ring_buffer_create("ring_buffer_map", 0);
+		if (fd < 0)
+			goto err;
+		ring_buffer_map_fd = fd;
+	}
+	if (bpftune_ring_buffers_multi() && !bpftune_ring_buffer_per_tuner &&
+	    bpftune_default_ring_buffer.map_fd <= 0) {
+		fd = bpftune_ring_buffer_create("ring_buffer_map", 0);
+		if (fd < 0)
+			goto err;
+		bpftune_default_ring_buffer.map_fd = fd;
+	}
+	for (i = 0; i < bpftune_num_ring_buffers; i++) {
+		struct bpftune_ring_buffer *rbuf = &bpftune_ring_buffers[i];
+
+		if (rbuf->map_fd > 0)
+			continue;
+		fd = bpftune_ring_buffer_create("ring_buffer_map", rbuf->size);
+		if (fd < 0)
+			goto err;
+		rbuf->map_fd = fd;
+	}
+	if (netns_map_fd <= 0) {
+		fd = bpf_map_create(BPF_MAP_TYPE_HASH, "netns_map",
+				    sizeof(__u64), sizeof(__u64),
+				    bpftune_map_max_entries("bpftune", "netns_map",
+							    BPFTUNE_NETNS_MAP_MAX),
+				    NULL);
+		if (fd < 0) {
+			bpftune_log(LOG_ERR, "could not create netns map: %s\n",
+				    strerror(errno));
+			goto err;
+		}
+		netns_map_fd = fd;
+	}
+	if (last_event_map_fd <= 0) {
+		fd = bpf_map_create(BPF_MAP_TYPE_LRU_HASH, "last_event_map",
+				    sizeof(__u64), sizeof(__u64),
+				    bpftune_map_max_entries("bpftune", "last_event_map",
+							    BPFTUNE_LAST_EVENT_MAX),
+				    NULL);
+		if (fd < 0) {
+			bpftune_log(LOG_ERR, "could not create last event map: %s\n",
+				    strerror(errno));
+			goto err;
+		}
+		last_event_map_fd = fd;
+	}
+	memlock = bpftune_map_memlock(netns_map_fd) +
+		  bpftune_map_memlock(last_event_map_fd) +
+		  bpftune_map_memlock(ring_buffer_map_fd) +
+		  bpftune_map_memlock(bpftune_default_ring_buffer.map_fd);
+	for (i = 0; i < bpftune_num_ring_buffers; i++)
+		memlock += bpftune_map_memlock(bpftune_ring_buffers[i].map_fd);
+	bpftune_log(LOG_INFO, "shared maps use %lu bytes of locked memory\n",
+		    memlock);
+	bpftune_cap_drop();
+	return 0;
+err:
+	err = -errno;
+	bpftune_cap_drop();
+	return err;
+}
+
+/* Map sizes can be set at load time via options; "<tuner>.<map>.max_entries"
+ * sets the size of a tuner map (or "bpftune.<map>.max_entries" for maps
+ * shared by all tuners), while "bpftune.map_max_entries" caps the size of
+ * all hash maps.  Sizes are rounded up to a power of 2 by the kernel for
+ * some map types, so are best specified as powers of 2.
+ */
+__u32 bpftune_map_max_entries(const char *tuner_name, const char *map_name,
+			      __u32 def)
+{
+	char name[BPFTUNE_MAX_NAME];
+	long cap, val;
+
+	snprintf(name, sizeof(name), "%s.%s.max_entries", tuner_name, map_name);
+	val = bpftune_option_long(name, def);
+	cap = bpftune_option_long("bpftune.map_max_entries", 0);
+	if (cap > 0 && val > cap)
+		val = cap;
+	if (val <= 0 || val > UINT_MAX) {
+		bpftune_log(LOG_ERR, "invalid size %ld for map '%s'; using %u\n",
+			    val, map_name, def);
+		return def;
+	}
+	return (__u32)val;
+}
+
+/* locked memory used by map, as reported via fdinfo. */
+unsigned long bpftune_map_memlock(int map_fd)
+{
+	unsigned long memlock = 0;
+	char path[PATH_MAX];
+	char line[128];
+	FILE *fp;
+
+	if (map_fd <= 0)
+		return 0;
+	snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", map_fd);
+	fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "memlock: %lu", &memlock) == 1)
+			break;
+	}
+	fclose(fp);
+	return memlock;
+}
+
+static bool bpftuner_map_shared(struct bpf_map *m)
+{
+	const char *name = bpf_map__name(m);
+
+	return strcmp(name, "ring_buffer_map") == 0 ||
+	       strcmp(name, "netns_map") == 0 ||
+	       strcmp(name, "last_event_map") == 0;
+}
+
+/* apply configured sizes to tuner hash maps; called prior to load. */
+static int bpftuner_maps_size(struct bpftuner *tuner)
+{
+	struct bpf_map *m;
+	int err;
+
+	bpf_object__for_each_map(m, tuner->obj) {
+		__u32 max_entries;
+
+		switch (bpf_map__type(m)) {
+		case BPF_MAP_TYPE_HASH:
+		case BPF_MAP_TYPE_LRU_HASH:
+		case BPF_MAP_TYPE_PERCPU_HASH:
+		case BPF_MAP_TYPE_LRU_PERCPU_HASH:
+			break;
+		default:
+			continue;
+		}
+		/* shared maps are sized when created */
+		if (bpftuner_map_shared(m))
+			continue;
+		max_entries = bpftune_map_max_entries(tuner->name,
+						      bpf_map__name(m),
+						      bpf_map__max_entries(m));
+		if (max_entries == bpf_map__max_entries(m))
+			continue;
+		err = bpf_map__set_max_entries(m, max_entries);
+		if (err) {
+			bpftune_log_bpf_err(err, "could not set map size: %s\n");
+			return err;
+		}
+		bpftune_log(LOG_DEBUG, "%s: map '%s' has %u entries\n",
+			    tuner->name, bpf_map__name(m), max_entries);
+	}
+	return 0;
+}
+
+/* report locked memory used by tuner maps after load. */
+static void bpftuner_maps_report(struct bpftuner *tuner)
+{
+	unsigned long memlock = 0, shared = 0;
+	unsigned int num_maps = 0;
+	struct bpf_map *m;
+
+	bpf_object__for_each_map(m, tuner->obj) {
+		unsigned long mem = bpftune_map_memlock(bpf_map__fd(m));
+
+		if (bpftuner_map_shared(m)) {
+			shared += mem;
+			continue;
+		}
+		memlock += mem;
+		num_maps++;
+	}
+	bpftune_log(LOG_INFO, "%s: %u maps use %lu bytes of locked memory (shared maps %lu bytes)\n",
+		    tuner->name, num_maps, memlock, shared);
+}
+
+int __bpftuner_bpf_load(struct bpftuner *tuner, const char **optionals)
+{
+	struct bpftune_ring_buffer *rbuf = bpftune_ring_buffer_find(tuner);
+	int *rb_fdp = rbuf ? &rbuf->map_fd : &ring_buffer_map_fd;
+	struct bpf_map *last_event_map;
+	struct bpf_map *m;
+	int err = 0;
+
+	err = bpftune_cap_add();
+
+	if (err)
+		return err;
+
+	if (rbuf && rbuf->size && *rb_fdp <= 0) {
+		err = bpf_map__set_max_entries(tuner->ring_buffer_map,
+					       rbuf->size);
+		if (err) {
+			bpftune_log_bpf_err(err, "could not set ring buffer size: %s\n");
+			goto out;
+		}
+	}
+	if (bpftuner_map_reuse("ring_buffer", tuner->ring_buffer_map,
+			       *rb_fdp, &tuner->ring_buffer_map_fd) ||
+	    bpftuner_map_reuse("netns_map", tuner->netns_map,
+			       netns_map_fd, &tuner->netns_map_fd)) {
+		err = -1;
+		goto out;
+	}
+	last_event_map = bpf_object__find_map_by_name(tuner->obj,
+						      "last_event_map");
+	if (last_event_map) {
+		if (last_event_map_fd <= 0) {
+			err = bpf_map__set_max_entries(last_event_map,
+						       bpftune_map_max_entries("bpftune",
+									       "last_event_map",
+									       BPFTUNE_LAST_EVENT_MAX));
+			if (err) {
+				bpftune_log_bpf_err(err, "could not set map size: %s\n");
+				goto out;
+			}
+		}
+		if (bpftuner_map_reuse("last_event_map", last_event_map,
+				       last_event_map_fd,
+				       &tuner->last_event_map_fd)) {
+			err = -1;
+			goto out;
+		}
+	}
+	err = bpftuner_maps_size(tuner);
+	if (err)
+		goto out;
+
+	if (optionals) {
+		int i;
+
+		for (i = 0; optionals[i] != NULL; i++) {
+			struct bpf_program *prog;
+
+			prog = bpf_object__find_program_by_name(tuner->obj,
+								optionals[i]);
+			if (prog) {
+				bpftune_log(LOG_DEBUG, "marking '%s' as optional\n",
+					    optionals[i]);
+				bpf_program__set_autoload(prog, false);
+			}
+		}
+	}
+	if (bpftune_persist)
+		bpftuner_maps_pin(tuner);
+	else
+		bpftuner_maps_unpin(tuner);
+	err = bpf_object__load_skeleton(tuner->skeleton);
+	if (err) {
+		bpftune_log_bpf_err(err, "could not load skeleton: %s\n");
+		goto out;
+	}
+
+	bpftuner_map_init(tuner, "ring_buffer_map", &tuner->ring_buffer_map,
+			  rb_fdp, &tuner->ring_buffer_map_fd);
+	bpftuner_map_init(tuner, "netns_map", &tuner->netns_map,
+			  &netns_map_fd, &tuner->netns_map_fd);
+	if (last_event_map)
+		bpftuner_map_init(tuner, "last_event_map",
+				  &tuner->last_event_map, &last_event_map_fd,
+				  &tuner->last_event_map_fd);
+	m = bpf_object__find_map_by_name(tuner->obj, "coalesce_map");
+	tuner->coalesce_map_fd = m ? bpf_map__fd(m) : 0;
+	m = bpf_object__find_map_by_name(tuner->obj, "bpftune_counters");
+	tuner->counters_map_fd = m ? bpf_map__fd(m) : 0;
+	m = bpf_object__find_map_by_name(tuner->obj, "verify_map");
+	tuner->verify_map_fd = m ? bpf_map__fd(m) : 0;
+	/* tuners which correlate tunables with metrics use corr_map */
+	tuner->corr_map = bpf_object__find_map_by_name(tuner->obj, "corr_map");
+	tuner->corr_map_fd = tuner->corr_map ? bpf_map__fd(tuner->corr_map) : 0;
+	if (rbuf) {
+		bpftune_log(LOG_DEBUG, "tuner %s uses ring buffer group '%s'\n",
+			    tuner->name, rbuf->tuners);
+		bpftune_ring_buffer_add(rbuf);
+	}
+	bpftuner_maps_report(tuner);
+out:
+	bpftune_cap_drop();
+	return err;
+}
+
+static void bpftuner_strategy_attach(struct bpftuner *tuner);
+
+int __bpftuner_bpf_attach(struct bpftuner *tuner)
+{
+	int err;
+
+	err = bpftune_cap_add();
+	if (err)
+		return err;
+	if (bpftune_no_attach) {
+		bpftune_log(LOG_DEBUG, "%s: skipping attach\n", tuner->name);
+		tuner->ring_buffer_map_fd = bpf_map__fd(tuner->ring_buffer_map);
+		bpftune_cap_drop();
+		return 0;
+	}
+	err = bpf_object__attach_skeleton(tuner->skeleton);
+	if (err) {
+		bpftune_log_bpf_err(err, "could not attach skeleton: %s\n");
+	} else {
+		tuner->ring_buffer_map_fd = bpf_map__fd(tuner->ring_buffer_map);
+		/* programs of other strategies are loaded, but detached */
+		if (tuner->strategies)
+			bpftuner_strategy_attach(tuner);
 	}
 	bpftune_cap_drop();
 	return err;
@@ -598,29 +1429,89 @@ static unsigned int bpftune_num_tuners;
 
 void bpftuner_bpf_fini(struct bpftuner *tuner)
 {
+	if (tuner->id < BPFTUNE_MAX_TUNERS)
+		memset(&bpftuner_ondemand[tuner->id], 0,
+		       sizeof(bpftuner_ondemand[tuner->id]));
 	if (bpftune_cap_add())
 		return;
 	bpf_object__destroy_skeleton(tuner->skeleton);
 	free(tuner->skel);
+	tuner->skel = NULL;
+	tuner->skeleton = NULL;
+	tuner->obj = NULL;
 	if (bpftune_num_tuners == 0) {
 		if (ring_buffer_map_fd > 0)
 			close(ring_buffer_map_fd);
 		if (netns_map_fd > 0)
 			close(netns_map_fd);
-		ring_buffer_map_fd = netns_map_fd = 0;
+		if (last_event_map_fd > 0)
+			close(last_event_map_fd);
+		ring_buffer_map_fd = netns_map_fd = last_event_map_fd = 0;
 	}
 	bpftune_cap_drop();
 }
 
 static struct bpftuner *bpftune_tuners[BPFTUNE_MAX_TUNERS];
+/* serializes tuner id reservation; readers use bpftune_tuner(), which
+ * sees a tuner only once it has been fully initialized.
+ */
+static pthread_mutex_t bpftune_tuners_lock = PTHREAD_MUTEX_INITIALIZER;
+/* ids handed out; a tuner's id is reserved before its init() so that
+ * tuners can initialize concurrently, each knowing the id its BPF
+ * programs should send events with.
+ */
+static __u64 bpftune_tuner_ids;
+
+static int bpftuner_id_reserve(void)
+{
+	int id;
+
+	pthread_mutex_lock(&bpftune_tuners_lock);
+	for (id = 0; id < BPFTUNE_MAX_TUNERS; id++) {
+		if (!(bpftune_tuner_ids & (1ULL << id)))
+			break;
+	}
+	if (id < BPFTUNE_MAX_TUNERS) {
+		bpftune_tuner_ids |= 1ULL << id;
+		if ((unsigned int)id >= bpftune_num_tuners)
+			__atomic_store_n(&bpftune_num_tuners, id + 1,
+					 __ATOMIC_RELEASE);
+	} else {
+		id = -ENOSPC;
+	}
+	pthread_mutex_unlock(&bpftune_tuners_lock);
+	return id;
+}
+
+/* failed init; id can be reused as no tuner was published for it */
+static void bpftuner_id_release(unsigned int id)
+{
+	pthread_mutex_lock(&bpftune_tuners_lock);
+	bpftune_tuner_ids &= ~(1ULL << id);
+	pthread_mutex_unlock(&bpftune_tuners_lock);
+}
 
 /* add a tuner to the list of tuners, or replace existing inactive tuner.
  * If successful, call init().
  */
+static void bpftuner_sysctl_watch_add(struct bpftuner *tuner);
+static void bpftuner_sysctl_watch_del(struct bpftuner *tuner);
+static void bpftuner_state_save(struct bpftuner *tuner);
+static void bpftuner_state_restore(struct bpftuner *tuner);
+static void bpftuner_verify_del(struct bpftuner *tuner, bool all,
+				unsigned long netns_cookie);
+static void bpftune_verify_update(__u64 now);
+static void bpftuner_strategy_update(struct bpftuner *tuner);
+static void bpftune_trace_tuner(struct bpftuner *tuner);
+
+/* safe to call concurrently for different tuners, provided shared maps
+ * have been set up with bpftune_shared_maps_init() first.
+ */
 struct bpftuner *bpftuner_init(const char *path)
 {
+	__u64 start = bpftune_ktime_ns();
 	struct bpftuner *tuner = NULL;
-	int err, retries;
+	int err, retries, id;
 
 	tuner = calloc(1, sizeof(*tuner));
 	if (!tuner) {
@@ -655,6 +1546,7 @@ struct bpftuner *bpftuner_init(const char *path)
 	tuner->init = dlsym(tuner->handle, "init");
 	tuner->fini = dlsym(tuner->handle, "fini");
 	tuner->event_handler = dlsym(tuner->handle, "event_handler");
+	tuner->periodic = dlsym(tuner->handle, "periodic");
 	if (!tuner->init || !tuner->fini || !tuner->event_handler) {	
 		bpftune_log(LOG_ERR, "missing definitions in '%s': need 'init', 'fini' and 'event_handler'\n",
 			    path);
@@ -662,20 +1554,34 @@ struct bpftuner *bpftuner_init(const char *path)
 		free(tuner);
 		return NULL;
 	}
+	id = bpftuner_id_reserve();
+	if (id < 0) {
+		bpftune_log(LOG_ERR, "too many tuners, cannot add '%s'\n", path);
+		dlclose(tuner->handle);
+		free(tuner);
+		return NULL;
+	}
+	tuner->id = id;
 	bpftune_log(LOG_DEBUG, "calling init for '%s\n", path);
 	err = tuner->init(tuner);
 	if (err) {
 		dlclose(tuner->handle);
 		bpftune_log(LOG_ERR, "error initializing '%s: %s\n",
 			    path, strerror(-err));
+		bpftuner_id_release(id);
 		free(tuner);
 		return NULL;
 	}
-	tuner->id = bpftune_num_tuners;
 	tuner->state = BPFTUNE_ACTIVE;
-	bpftune_tuners[bpftune_num_tuners++] = tuner;
-	bpftune_log(LOG_DEBUG, "sucessfully initialized tuner %s[%d]\n",
-		    tuner->name, tuner->id);
+	if (bpftune_persist)
+		bpftuner_state_restore(tuner);
+	bpftuner_sysctl_watch_add(tuner);
+	tuner->load_time_ns = bpftune_ktime_ns() - start;
+	__atomic_store_n(&bpftune_tuners[tuner->id], tuner, __ATOMIC_RELEASE);
+	bpftune_trace_tuner(tuner);
+	bpftune_log(BPFTUNE_LOG_LEVEL, "initialized tuner %s[%d] in %.3f seconds\n",
+		    tuner->name, tuner->id,
+		    (double)tuner->load_time_ns / SECOND);
 	return tuner;
 }
 
@@ -686,12 +1592,23 @@ static void bpftuner_scenario_log(struct bpftuner *tuner, unsigned int tunable,
 
 static unsigned long global_netns_cookie;
 
+/* held for writing while a tuner is torn down, since that frees its BPF
+ * object and tunables; threads other than event handlers which walk tuner
+ * state (e.g. metrics) hold it for reading.
+ */
+static pthread_rwlock_t bpftune_tuner_fini_lock = PTHREAD_RWLOCK_INITIALIZER;
+
 void bpftuner_fini(struct bpftuner *tuner, enum bpftune_state state)
 {
 	unsigned int i, j;
 
-	if (!tuner || tuner->state != BPFTUNE_ACTIVE)
+	if (!tuner)
 		return;
+	pthread_rwlock_wrlock(&bpftune_tuner_fini_lock);
+	if (tuner->state != BPFTUNE_ACTIVE) {
+		pthread_rwlock_unlock(&bpftune_tuner_fini_lock);
+		return;
+	}
 
 	bpftune_log(LOG_DEBUG, "cleaning up tuner %s with %d tunables, %d scenarios\n",
 		    tuner->name, tuner->num_tunables, tuner->num_scenarios);
@@ -704,23 +1621,32 @@ void bpftuner_fini(struct bpftuner *tuner, enum bpftune_state state)
 			bpftuner_scenario_log(tuner, i, j, 0, true, NULL, args);
 			bpftuner_scenario_log(tuner, i, j, 1, true, NULL, args);
 		}
+		if (tuner->tunables[i].stats.rollbacks)
+			bpftune_log(BPFTUNE_LOG_LEVEL, "Summary: %lu changes of tunable '%s' were rolled back after verification\n",
+				    tuner->tunables[i].stats.rollbacks,
+				    tuner->tunables[i].desc.name);
 	}
+	if (bpftune_persist)
+		bpftuner_state_save(tuner);
+	bpftuner_verify_del(tuner, true, 0);
+	bpftuner_sysctl_watch_del(tuner);
 	if (tuner->fini)
 		tuner->fini(tuner);
 
 	tuner->state = state;
+	pthread_rwlock_unlock(&bpftune_tuner_fini_lock);
 }
 
 struct bpftuner *bpftune_tuner(unsigned int index)
 {
-	if (index < bpftune_num_tuners)
-		return bpftune_tuners[index];
+	if (index < __atomic_load_n(&bpftune_num_tuners, __ATOMIC_ACQUIRE))
+		return __atomic_load_n(&bpftune_tuners[index], __ATOMIC_ACQUIRE);
 	return NULL;
 }
 
 unsigned int bpftune_tuner_num(void)
 {
-	return bpftune_num_tuners;
+	return __atomic_load_n(&bpftune_num_tuners, __ATOMIC_ACQUIRE);
 }
 
 void bpftune_set_learning_rate(unsigned short rate)
@@ -728,200 +1654,2241 @@ void bpftune_set_learning_rate(unsigned short rate)
 	bpftune_learning_rate = rate;
 }
 
-static int bpftune_ringbuf_event_read(void *ctx, void *data, size_t size)
+/* must be called prior to tuner init to take effect */
+void bpftune_set_coalesce(unsigned int window_msec)
 {
-	struct bpftune_event *event = data;
-	struct bpftuner *tuner;
+	bpftune_coalesce_msec = window_msec;
+}
 
-	if (size < sizeof(*event)) {
-		bpftune_log(LOG_ERR, "unexpected size event %d\n", size);
-		return 0;
-	}
-	if (event->tuner_id > BPFTUNE_MAX_TUNERS) {
-		bpftune_log(LOG_ERR, "invalid tuner id %d\n", event->tuner_id);
-		return 0;
-	}
-	tuner = bpftune_tuner(event->tuner_id);
-	if (!tuner) {
-		bpftune_log(LOG_ERR, "no tuner for id %d\n", event->tuner_id);
-		return 0;
-	}
-	bpftune_log(LOG_DEBUG,
-		    "event scenario [%d] for tuner %s[%d] netns %ld (%s)\n",
-		    event->scenario_id, tuner->name, tuner->id,
-		    event->netns_cookie,
-		    event->netns_cookie && event->netns_cookie != global_netns_cookie ?
-		    "non-global netns" : "global netns");
-	tuner->event_handler(tuner, event, ctx);
+/* tuner-specific options, specified as "name=value"; by convention name
+ * is prefixed with the tuner name, e.g. "tcp_buffer.per_socket=1".
+ */
+#define BPFTUNE_MAX_OPTIONS	32
 
-	return 0;
-}
+static char *bpftune_options[BPFTUNE_MAX_OPTIONS];
+static unsigned int bpftune_num_options;
 
-int bpftuner_ring_buffer_map_fd(struct bpftuner *tuner)
+/* must be called prior to tuner init to take effect */
+int bpftune_option_set(const char *nameval)
 {
-	return tuner->ring_buffer_map_fd;
+	const char *eq = strchr(nameval, '=');
+	size_t namelen;
+	unsigned int i;
+	char *opt;
+
+	if (!eq || eq == nameval)
+		return -EINVAL;
+	namelen = eq - nameval;
+	opt = strdup(nameval);
+	if (!opt)
+		return -ENOMEM;
+	for (i = 0; i < bpftune_num_options; i++) {
+		if (strncmp(bpftune_options[i], nameval, namelen + 1) == 0) {
+			free(bpftune_options[i]);
+			bpftune_options[i] = opt;
+			return 0;
+		}
+	}
+	if (bpftune_num_options >= BPFTUNE_MAX_OPTIONS) {
+		free(opt);
+		return -E2BIG;
+	}
+	bpftune_options[bpftune_num_options++] = opt;
+	return 0;
 }
 
-void *bpftune_ring_buffer_init(int ring_buffer_map_fd, void *ctx)
+const char *bpftune_option(const char *name)
 {
-	struct ring_buffer *rb;
-	int err;
+	size_t namelen = strlen(name);
+	unsigned int i;
 
-	bpftune_log(LOG_DEBUG, "calling ring_buffer__new, ringbuf_map_fd %d\n",
-		    ring_buffer_map_fd);
-	err = bpftune_cap_add();
-	if (err)
-		return NULL;
-	rb = ring_buffer__new(ring_buffer_map_fd, bpftune_ringbuf_event_read, ctx, NULL);
-	err = libbpf_get_error(rb);
-	if (err) {
-		bpftune_log_bpf_err(err, "couldnt create ring buffer: %s\n");
-		rb = NULL;
+	for (i = 0; i < bpftune_num_options; i++) {
+		if (strncmp(bpftune_options[i], name, namelen) == 0 &&
+		    bpftune_options[i][namelen] == '=')
+			return bpftune_options[i] + namelen + 1;
 	}
-	bpftune_cap_drop();
-	return rb;
+	return NULL;
 }
 
-static int ring_buffer_done;
-
-int bpftune_ring_buffer_poll(void *ring_buffer, int interval)
+long bpftune_option_long(const char *name, long def)
 {
-	struct ring_buffer *rb = ring_buffer;
-	int err;
-
-	while (!ring_buffer_done) {
-		err = ring_buffer__poll(rb, interval);
-		if (err < 0) {
-			bpftune_log_bpf_err(err, "ring_buffer__poll: %s\n");
-			break;
-		}
+	const char *val = bpftune_option(name);
+	char *end;
+	long ret;
+
+	if (!val)
+		return def;
+	errno = 0;
+	ret = strtol(val, &end, 0);
+	if (errno || end == val || *end != '\0') {
+		bpftune_log(LOG_ERR, "invalid value '%s' for option '%s'; using %ld\n",
+			    val, name, def);
+		return def;
 	}
-	ring_buffer__free(rb);
-	return 0;
+	return ret;
 }
 
-void bpftune_ring_buffer_fini(__attribute__((unused)) void *ring_buffer)
+/* during trace replay, time follows trace timestamps */
+static __u64 bpftune_replay_now;
+
+__u64 bpftune_ktime_ns(void)
 {
-	ring_buffer_done = true;
+	__u64 replay_now = __atomic_load_n(&bpftune_replay_now, __ATOMIC_ACQUIRE);
+	struct timespec ts;
+
+	if (replay_now)
+		return replay_now;
+	/* same clock as bpf_ktime_get_ns() */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
+/* With persistence enabled, per-tuner state not held in BPF maps is
+ * saved as text to BPFTUNE_STATE_DIR/<tuner name> periodically and at
+ * tuner fini, and restored at tuner init.  Since sysctls keep their
+ * tuned values across a restart, what needs saving is the pre-tuning
+ * values (so summaries still report the original), scenario counts and
+ * network namespaces in which the tuner was manually disabled:
+ *
+ * version 1
+ * initial <sysctl name> <value> [<value>...]
+ * stats <scenario> <global ns count> <non-global ns count> <tunable name>
+ * manual <netns cookie>
+ */
+#define BPFTUNE_STATE_VERSION		1
+#define BPFTUNE_STATE_SAVE_INTERVAL	60	/* seconds */
 
-#define BPFTUNE_PROC_SYS	"/proc/sys/"
-void bpftune_sysctl_name_to_path(const char *name, char *path, size_t path_sz)
-{
-	size_t i;
+static void bpftuner_netns_manual_save(struct bpftuner *tuner, FILE *fp);
+static void bpftuner_netns_manual_restore(struct bpftuner *tuner,
+					  unsigned long cookie);
 
-	snprintf(path, path_sz, BPFTUNE_PROC_SYS "%s", name);
-	for (i = 0; i < path_sz && path[i] != 0; i++)
-		if (path[i] == '.')
-			path[i] = '/';
+static void bpftuner_state_path(struct bpftuner *tuner, char *path,
+				size_t path_sz)
+{
+	snprintf(path, path_sz, "%s/%s", BPFTUNE_STATE_DIR, tuner->name);
 }
 
-int bpftune_sysctl_read(int netns_fd, const char *name, long *values)
+static void bpftuner_state_save(struct bpftuner *tuner)
 {
-	int i, orig_netns_fd = 0, num_values = 0;
-	char path[PATH_MAX];
-	int err = 0;	
+	char path[PATH_MAX], tmppath[PATH_MAX + 4];
+	struct bpftunable *t;
+	unsigned int i;
 	FILE *fp;
 
-	err = bpftune_cap_add();
-	if (err)
-		return err;
+	if (mkdir(BPFTUNE_STATE_DIR, 0700) && errno != EEXIST) {
+		bpftune_log(LOG_DEBUG, "could not create '%s': %s\n",
+			    BPFTUNE_STATE_DIR, strerror(errno));
+		return;
+	}
+	bpftuner_state_path(tuner, path, sizeof(path));
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+	fp = fopen(tmppath, "w");
+	if (!fp) {
+		bpftune_log(LOG_DEBUG, "could not open '%s': %s\n",
+			    tmppath, strerror(errno));
+		return;
+	}
+	fprintf(fp, "version %d\n", BPFTUNE_STATE_VERSION);
+	bpftuner_for_each_tunable(tuner, t) {
+		if (t->desc.type == BPFTUNABLE_SYSCTL && t->desc.num_values) {
+			fprintf(fp, "initial %s", t->desc.name);
+			for (i = 0; i < t->desc.num_values; i++)
+				fprintf(fp, " %ld", t->initial_values[i]);
+			fprintf(fp, "\n");
+		}
+		for (i = 0; i < tuner->num_scenarios && i < BPFTUNE_MAX_SCENARIOS; i++) {
+			if (!t->stats.global_ns[i] && !t->stats.nonglobal_ns[i])
+				continue;
+			fprintf(fp, "stats %u %lu %lu %s\n", i,
+				t->stats.global_ns[i], t->stats.nonglobal_ns[i],
+				t->desc.name);
+		}
+	}
+	bpftuner_netns_manual_save(tuner, fp);
+	if (fclose(fp) || rename(tmppath, path)) {
+		bpftune_log(LOG_DEBUG, "could not save state to '%s': %s\n",
+			    path, strerror(errno));
+		unlink(tmppath);
+	}
+}
 
-	bpftune_sysctl_name_to_path(name, path, sizeof(path));
+static struct bpftunable *bpftuner_tunable_by_name(struct bpftuner *tuner,
+						   const char *name)
+{
+	struct bpftunable *t;
 
-	err = bpftune_netns_set(netns_fd, &orig_netns_fd);
-	if (err < 0)
-		goto out_unset;
+	bpftuner_for_each_tunable(tuner, t) {
+		if (strcmp(t->desc.name, name) == 0)
+			return t;
+	}
+	return NULL;
+}
 
+static void bpftuner_state_restore(struct bpftuner *tuner)
+{
+	unsigned int restored = 0, scenario;
+	unsigned long global, nonglobal;
+	char path[PATH_MAX], line[512];
+	char name[BPFTUNE_MAX_NAME];
+	struct bpftunable *t;
+	int version = 0, n;
+	FILE *fp;
+
+	bpftuner_state_path(tuner, path, sizeof(path));
 	fp = fopen(path, "r");
-	if (!fp) {
+	if (!fp)
+		return;
+	while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (sscanf(line, "version %d", &version) == 1) {
+			if (version != BPFTUNE_STATE_VERSION)
+				break;
+			continue;
+		}
+		if (version != BPFTUNE_STATE_VERSION)
+			break;
+		if (sscanf(line, "initial %127s%n", name, &n) == 1) {
+			long values[BPFTUNE_MAX_VALUES];
+			char *s = line + n, *end;
+			__u8 i;
+
+			t = bpftuner_tunable_by_name(tuner, name);
+			if (!t || t->desc.type != BPFTUNABLE_SYSCTL)
+				continue;
+			for (i = 0; i < t->desc.num_values; i++) {
+				values[i] = strtol(s, &end, 10);
+				if (end == s)
+					break;
+				s = end;
+			}
+			/* only restore if value count still matches */
+			if (i != t->desc.num_values || *s != '\0')
+				continue;
+			memcpy(t->initial_values, values,
+			       t->desc.num_values * sizeof(values[0]));
+			restored++;
+		} else if (sscanf(line, "stats %u %lu %lu %n", &scenario,
+				  &global, &nonglobal, &n) == 3) {
+			t = bpftuner_tunable_by_name(tuner, line + n);
+			if (!t || scenario >= tuner->num_scenarios ||
+			    scenario >= BPFTUNE_MAX_SCENARIOS)
+				continue;
+			t->stats.global_ns[scenario] += global;
+			t->stats.nonglobal_ns[scenario] += nonglobal;
+			restored++;
+		} else if (strncmp(line, "manual ", 7) == 0) {
+			unsigned long cookie = strtoul(line + 7, NULL, 10);
+
+			if (!cookie)
+				continue;
+			bpftuner_netns_manual_restore(tuner, cookie);
+			restored++;
+		}
+	}
+	fclose(fp);
+	if (version != BPFTUNE_STATE_VERSION) {
+		bpftune_log(LOG_DEBUG, "ignoring state '%s' with version %d\n",
+			    path, version);
+		return;
+	}
+	bpftune_log(LOG_DEBUG, "restored %u state entries for '%s' from '%s'\n",
+		    restored, tuner->name, path);
+}
+
+/* save state for all active tuners */
+static void bpftune_state_save(void)
+{
+	struct bpftuner *tuner;
+
+	if (!bpftune_persist)
+		return;
+	bpftune_for_each_tuner(tuner) {
+		if (tuner->state == BPFTUNE_ACTIVE)
+			bpftuner_state_save(tuner);
+	}
+}
+
+/* handler latency histogram buckets; bucket 0 is < 1usec, bucket n
+ * covers [2^(n-1), 2^n) usec, and the last bucket everything above.
+ */
+#define BPFTUNE_LATENCY_BUCKETS		24
+
+struct bpftune_tuner_metrics {
+	__u64 events;
+	__u64 handler_ns;
+	__u64 latency[BPFTUNE_LATENCY_BUCKETS];
+};
+
+/* updated by event handling threads, read by metrics thread */
+static struct bpftune_tuner_metrics bpftune_tuner_metrics[BPFTUNE_MAX_TUNERS];
+
+static void bpftune_event_handle(struct bpftuner *tuner,
+				 struct bpftune_event *event, void *ctx)
+{
+	struct bpftune_tuner_metrics *m = &bpftune_tuner_metrics[tuner->id];
+	__u64 start, delta, usec;
+	unsigned int bucket;
+
+	bpftune_log(LOG_DEBUG,
+		    "event scenario [%d] for tuner %s[%d] netns %ld (%s)\n",
+		    event->scenario_id, tuner->name, tuner->id,
+		    event->netns_cookie,
+		    event->netns_cookie && event->netns_cookie != global_netns_cookie ?
+		    "non-global netns" : "global netns");
+	start = bpftune_ktime_ns();
+	tuner->event_handler(tuner, event, ctx);
+	delta = bpftune_ktime_ns() - start;
+
+	usec = delta / 1000;
+	bucket = usec ? ilog2(usec) + 1 : 0;
+	if (bucket >= BPFTUNE_LATENCY_BUCKETS)
+		bucket = BPFTUNE_LATENCY_BUCKETS - 1;
+	__atomic_add_fetch(&m->events, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&m->handler_ns, delta, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&m->latency[bucket], 1, __ATOMIC_RELAXED);
+}
+
+/* Optional worker threads for event handling.  Events are hashed by
+ * netns cookie to a worker, so events for a given namespace are handled
+ * in order by the same worker, while a slow namespace does not hold up
+ * event handling for others.  Each worker has a single-producer (the
+ * ring buffer poll thread), single-consumer queue of events; workers
+ * sleep on an eventfd when their queue is empty.
+ *
+ * Since all events for a netns are handled by one worker, per-netns
+ * state for that netns is only freed in the context of the worker that
+ * uses it.
+ */
+#define BPFTUNE_WORKER_QUEUE_SIZE	1024	/* must be power of 2 */
+#define BPFTUNE_MAX_WORKERS		64
+
+struct bpftune_worker {
+	pthread_t tid;
+	int efd;
+	bool sleeping;
+	unsigned long head;		/* written by consumer only */
+	unsigned long tail;		/* written by producer only */
+	void *ctx;
+	struct bpftune_event events[BPFTUNE_WORKER_QUEUE_SIZE];
+};
+
+static struct bpftune_worker *bpftune_workers;
+static unsigned int bpftune_num_workers;
+static bool bpftune_workers_done;
+
+static void bpftune_worker_wake(struct bpftune_worker *worker)
+{
+	__u64 val = 1;
+
+	if (write(worker->efd, &val, sizeof(val)) < 0)
+		bpftune_log(LOG_DEBUG, "could not wake worker: %s\n",
+			    strerror(errno));
+}
+
+static void bpftune_worker_enqueue(struct bpftune_worker *worker,
+				   struct bpftune_event *event, void *ctx)
+{
+	unsigned long tail = worker->tail;
+
+	/* queue full; wait for worker to catch up.  Meanwhile events will be
+	 * queued (or dropped) in BPF ring buffers.
+	 */
+	while (tail - __atomic_load_n(&worker->head, __ATOMIC_ACQUIRE) >=
+	       BPFTUNE_WORKER_QUEUE_SIZE) {
+		if (__atomic_load_n(&bpftune_workers_done, __ATOMIC_RELAXED))
+			return;
+		sched_yield();
+	}
+	memcpy(&worker->events[tail & (BPFTUNE_WORKER_QUEUE_SIZE - 1)], event,
+	       sizeof(*event));
+	worker->ctx = ctx;
+	__atomic_store_n(&worker->tail, tail + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&worker->sleeping, __ATOMIC_SEQ_CST))
+		bpftune_worker_wake(worker);
+}
+
+static void *bpftune_worker_thread(void *arg)
+{
+	struct bpftune_worker *worker = arg;
+	struct bpftune_event *event;
+	struct bpftuner *tuner;
+	unsigned long head;
+	__u64 val;
+
+	/* thread may inherit caps from its creator; start with them dropped. */
+	bpftune_cap_drop();
+
+	while (!__atomic_load_n(&bpftune_workers_done, __ATOMIC_RELAXED)) {
+		head = worker->head;
+		if (head == __atomic_load_n(&worker->tail, __ATOMIC_ACQUIRE)) {
+			__atomic_store_n(&worker->sleeping, true, __ATOMIC_SEQ_CST);
+			/* re-check to avoid missing a wakeup */
+			if (head == __atomic_load_n(&worker->tail, __ATOMIC_SEQ_CST) &&
+			    read(worker->efd, &val, sizeof(val)) < 0 &&
+			    errno != EINTR)
+				bpftune_log(LOG_ERR, "worker read failed: %s\n",
+					    strerror(errno));
+			__atomic_store_n(&worker->sleeping, false, __ATOMIC_SEQ_CST);
+			continue;
+		}
+		event = &worker->events[head & (BPFTUNE_WORKER_QUEUE_SIZE - 1)];
+		tuner = bpftune_tuner(event->tuner_id);
+		if (tuner)
+			bpftune_event_handle(tuner, event, worker->ctx);
+		__atomic_store_n(&worker->head, head + 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+int bpftune_workers_init(unsigned int num_workers)
+{
+	unsigned int i;
+	int err = 0;
+
+	if (!num_workers || bpftune_workers)
+		return 0;
+	if (num_workers > BPFTUNE_MAX_WORKERS)
+		return -EINVAL;
+
+	bpftune_workers = calloc(num_workers, sizeof(*bpftune_workers));
+	if (!bpftune_workers)
+		return -ENOMEM;
+
+	for (i = 0; i < num_workers; i++) {
+		struct bpftune_worker *worker = &bpftune_workers[i];
+
+		worker->efd = eventfd(0, EFD_CLOEXEC);
+		if (worker->efd < 0) {
+			err = -errno;
+			break;
+		}
+		err = -pthread_create(&worker->tid, NULL, bpftune_worker_thread,
+				      worker);
+		if (err) {
+			close(worker->efd);
+			break;
+		}
+		bpftune_num_workers++;
+	}
+	if (err) {
+		bpftune_log(LOG_ERR, "could not create event worker: %s\n",
+			    strerror(-err));
+		bpftune_workers_fini();
+		return err;
+	}
+	bpftune_log(LOG_DEBUG, "started %d event workers\n", num_workers);
+	return 0;
+}
+
+void bpftune_workers_fini(void)
+{
+	unsigned int i;
+
+	if (!bpftune_workers)
+		return;
+	__atomic_store_n(&bpftune_workers_done, true, __ATOMIC_SEQ_CST);
+	for (i = 0; i < bpftune_num_workers; i++) {
+		bpftune_worker_wake(&bpftune_workers[i]);
+		pthread_join(bpftune_workers[i].tid, NULL);
+		close(bpftune_workers[i].efd);
+	}
+	free(bpftune_workers);
+	bpftune_workers = NULL;
+	bpftune_num_workers = 0;
+	__atomic_store_n(&bpftune_workers_done, false, __ATOMIC_SEQ_CST);
+}
+
+/* ctx passed to ring buffer callbacks */
+static void *bpftune_ring_buffer_ctx;
+
+static void bpftune_event_dispatch(struct bpftune_event *event, void *ctx)
+{
+	struct bpftuner *tuner;
+
+	if (event->tuner_id > BPFTUNE_MAX_TUNERS) {
+		bpftune_log(LOG_ERR, "invalid tuner id %d\n", event->tuner_id);
+		return;
+	}
+	tuner = bpftune_tuner(event->tuner_id);
+	if (!tuner) {
+		bpftune_log(LOG_ERR, "no tuner for id %d\n", event->tuner_id);
+		return;
+	}
+	if (bpftune_num_workers) {
+		/* multiplicative hash to spread cookies over workers */
+		__u64 hash = (__u64)event->netns_cookie * 0x9E3779B97F4A7C15ULL;
+
+		bpftune_worker_enqueue(&bpftune_workers[(hash >> 32) %
+						       bpftune_num_workers],
+				       event, ctx);
+		return;
+	}
+	bpftune_event_handle(tuner, event, ctx);
+}
+
+/* event trace being recorded, if any; see struct bpftune_trace_header. */
+static FILE *bpftune_trace_fp;
+static pthread_mutex_t bpftune_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+/* sysctl changes made by tuners (or, in dry-run mode, that would be made) */
+static unsigned long bpftune_sysctl_changes;
+
+static void bpftune_trace_write(__u32 type, const void *data, size_t size)
+{
+	static const char pad[8];
+	struct bpftune_trace_record rec = {};
+	size_t padding = BPFTUNE_TRACE_ALIGN(size) - size;
+	FILE *fp;
+
+	if (!__atomic_load_n(&bpftune_trace_fp, __ATOMIC_ACQUIRE))
+		return;
+	rec.ts = bpftune_ktime_ns();
+	rec.type = type;
+	rec.size = size;
+	pthread_mutex_lock(&bpftune_trace_lock);
+	fp = bpftune_trace_fp;
+	if (fp && (fwrite(&rec, sizeof(rec), 1, fp) != 1 ||
+		   fwrite(data, size, 1, fp) != 1 ||
+		   (padding && fwrite(pad, padding, 1, fp) != 1))) {
+		bpftune_log(LOG_ERR, "could not write to trace, stopping: %s\n",
+			    strerror(errno));
+		fclose(fp);
+		__atomic_store_n(&bpftune_trace_fp, NULL, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&bpftune_trace_lock);
+}
+
+static void bpftune_trace_tuner(struct bpftuner *tuner)
+{
+	struct bpftune_trace_tuner t = {};
+
+	t.id = tuner->id;
+	strncpy(t.name, tuner->name, sizeof(t.name) - 1);
+	bpftune_trace_write(BPFTUNE_TRACE_TUNER, &t,
+			    __builtin_offsetof(struct bpftune_trace_tuner, name) +
+			    strlen(t.name) + 1);
+}
+
+/* record a sysctl change; old_values may be NULL if unknown. */
+static void bpftune_trace_sysctl(struct bpftuner *tuner, unsigned int tunable,
+				 unsigned int scenario,
+				 unsigned long netns_cookie, __u8 num_values,
+				 const long *old_values, const long *values)
+{
+	struct bpftune_trace_sysctl t = {};
+
+	__atomic_add_fetch(&bpftune_sysctl_changes, 1, __ATOMIC_RELAXED);
+	if (!__atomic_load_n(&bpftune_trace_fp, __ATOMIC_ACQUIRE))
+		return;
+	if (num_values > BPFTUNE_MAX_VALUES)
+		num_values = BPFTUNE_MAX_VALUES;
+	t.netns_cookie = netns_cookie;
+	t.tuner_id = tuner->id;
+	t.tunable = tunable;
+	t.scenario = scenario;
+	t.num_values = num_values;
+	if (old_values) {
+		t.flags |= BPFTUNE_TRACE_SYSCTL_OLD;
+		memcpy(t.old, old_values, num_values * sizeof(*old_values));
+	}
+	memcpy(t.new, values, num_values * sizeof(*values));
+	bpftune_trace_write(BPFTUNE_TRACE_SYSCTL, &t, sizeof(t));
+}
+
+/* Record events and sysctl changes to the trace at path, appending to it
+ * if it exists.  Tuner id/name mappings are recorded for tuners loaded
+ * now and as later tuners load, so a replay can map events to tuners
+ * whatever order they load in.
+ */
+int bpftune_trace_open(const char *path)
+{
+	struct bpftune_trace_header hdr = {};
+	struct bpftuner *tuner;
+	struct timespec ts;
+	struct stat st;
+	FILE *fp;
+	int err;
+
+	fp = fopen(path, "a+");
+	if (!fp) {
+		err = -errno;
+		bpftune_log(LOG_ERR, "could not open trace '%s': %s\n",
+			    path, strerror(-err));
+		return err;
+	}
+	if (fstat(fileno(fp), &st)) {
+		err = -errno;
+		goto err;
+	}
+	if (st.st_size == 0) {
+		memcpy(hdr.magic, BPFTUNE_TRACE_MAGIC, sizeof(hdr.magic));
+		hdr.version = BPFTUNE_TRACE_VERSION;
+		hdr.header_size = sizeof(hdr);
+		hdr.start_ns = bpftune_ktime_ns();
+		clock_gettime(CLOCK_REALTIME, &ts);
+		hdr.start_realtime_ns = (__u64)ts.tv_sec * 1000000000ULL +
+					ts.tv_nsec;
+		if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+			err = -errno;
+			goto err;
+		}
+	} else if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+		   memcmp(hdr.magic, BPFTUNE_TRACE_MAGIC, sizeof(hdr.magic)) ||
+		   hdr.version != BPFTUNE_TRACE_VERSION) {
+		bpftune_log(LOG_ERR, "'%s' is not a bpftune trace\n", path);
+		err = -EINVAL;
+		goto err;
+	}
+	/* switch from reading header to appending */
+	fseek(fp, 0, SEEK_END);
+	pthread_mutex_lock(&bpftune_trace_lock);
+	__atomic_store_n(&bpftune_trace_fp, fp, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&bpftune_trace_lock);
+	bpftune_for_each_tuner(tuner)
+		bpftune_trace_tuner(tuner);
+	bpftune_log(LOG_DEBUG, "recording trace to '%s'\n", path);
+	return 0;
+err:
+	if (err != -EINVAL)
+		bpftune_log(LOG_ERR, "could not write trace '%s': %s\n",
+			    path, strerror(-err));
+	fclose(fp);
+	return err;
+}
+
+static void bpftune_trace_flush(void)
+{
+	if (!__atomic_load_n(&bpftune_trace_fp, __ATOMIC_ACQUIRE))
+		return;
+	pthread_mutex_lock(&bpftune_trace_lock);
+	if (bpftune_trace_fp)
+		fflush(bpftune_trace_fp);
+	pthread_mutex_unlock(&bpftune_trace_lock);
+}
+
+void bpftune_trace_close(void)
+{
+	pthread_mutex_lock(&bpftune_trace_lock);
+	if (bpftune_trace_fp)
+		fclose(bpftune_trace_fp);
+	__atomic_store_n(&bpftune_trace_fp, NULL, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&bpftune_trace_lock);
+}
+
+int bpftune_ringbuf_event_read(void *ctx, void *data, size_t size)
+{
+	struct bpftune_event *rec = data, event;
+	size_t min_size = BPFTUNE_EVENT_HDR_SIZE;
+
+	if (size < BPFTUNE_EVENT_HDR_SIZE) {
+		bpftune_log(LOG_ERR, "unexpected size event %zu\n", size);
+		return 0;
+	}
+	bpftune_trace_write(BPFTUNE_TRACE_EVENT, data, size);
+	switch (rec->type) {
+	case BPFTUNE_EVENT_FULL:
+		if (size < sizeof(*rec)) {
+			bpftune_log(LOG_ERR, "unexpected size event %zu\n",
+				    size);
+			return 0;
+		}
+		bpftune_event_dispatch(rec, ctx);
+		return 0;
+	case BPFTUNE_EVENT_UPDATES:
+		if (rec->num_updates < 1 ||
+		    rec->num_updates > BPFTUNE_MAX_UPDATES) {
+			bpftune_log(LOG_ERR, "unexpected number of updates %u in event\n",
+				    rec->num_updates);
+			return 0;
+		}
+		min_size += rec->num_updates * sizeof(struct bpftunable_update);
+		break;
+	case BPFTUNE_EVENT_HDR:
+	case BPFTUNE_EVENT_STR:
+	case BPFTUNE_EVENT_RAW:
+		break;
+	default:
+		bpftune_log(LOG_ERR, "unexpected event type %u\n", rec->type);
+		return 0;
+	}
+	if (size < min_size || size > sizeof(event)) {
+		bpftune_log(LOG_ERR, "unexpected size %zu for event type %u\n",
+			    size, rec->type);
+		return 0;
+	}
+	/* expand into a full event; handlers see a zero-filled payload. */
+	memset(&event, 0, sizeof(event));
+	memcpy(&event, rec, size);
+	bpftune_event_dispatch(&event, ctx);
+
+	return 0;
+}
+
+/* idle coalesce map entries are removed after this many windows */
+#define BPFTUNE_COALESCE_IDLE_WINDOWS	16
+#define BPFTUNE_COALESCE_BATCH		64
+
+static void bpftuner_coalesce_send(struct bpftuner *tuner,
+				   struct bpftune_coalesce_key *key,
+				   struct bpftune_coalesce *c)
+{
+	struct bpftune_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.type = BPFTUNE_EVENT_UPDATES;
+	event.tuner_id = tuner->id;
+	event.scenario_id = c->scenario_id;
+	event.netns_cookie = key->netns_cookie;
+	event.count = c->count;
+	event.num_updates = 1;
+	event.update[0].id = key->event_id;
+	memcpy(event.update[0].old, c->old, sizeof(c->old));
+	memcpy(event.update[0].new, c->new, sizeof(c->new));
+	bpftune_trace_write(BPFTUNE_TRACE_EVENT, &event,
+			    BPFTUNE_EVENT_HDR_SIZE +
+			    sizeof(struct bpftunable_update));
+	bpftune_event_dispatch(&event, bpftune_ring_buffer_ctx);
+}
+
+/* Expired entries are atomically removed with lookup-and-delete, so every
+ * update coalesced up to removal is in the summary sent; an event arriving
+ * after removal finds no entry and is sent itself, starting a new window.
+ * Kernels without lookup-and-delete for hash maps (< 5.14) fall back to
+ * resetting the entry, where updates BPF programs coalesce between lookup
+ * and reset are lost.
+ */
+static int bpftuner_coalesce_drain(struct bpftuner *tuner, __u64 now,
+				   bool all)
+{
+	struct bpftune_coalesce_key key, next, keys[BPFTUNE_COALESCE_BATCH];
+	static bool lookup_and_delete_unsupported;
+	__u64 window = bpftune_coalesce_msec * MSEC;
+	int fd = tuner->coalesce_map_fd;
+	unsigned int i, num_keys;
+	struct bpftune_coalesce c;
+	int drained = 0;
+	void *prev;
+
+	do {
+		/* map entries cannot be removed during iteration, as a
+		 * missing key restarts it; collect a batch first.
+		 */
+		num_keys = 0;
+		prev = NULL;
+		while (num_keys < BPFTUNE_COALESCE_BATCH &&
+		       !bpf_map_get_next_key(fd, prev, &next)) {
+			key = next;
+			prev = &key;
+			if (bpf_map_lookup_elem(fd, &key, &c))
+				continue;
+			if (!c.count) {
+				if (now - c.last >= BPFTUNE_COALESCE_IDLE_WINDOWS * window)
+					keys[num_keys++] = key;
+				continue;
+			}
+			if (all || now - c.first >= window)
+				keys[num_keys++] = key;
+		}
+		for (i = 0; i < num_keys; i++) {
+			if (lookup_and_delete_unsupported) {
+				if (bpf_map_lookup_elem(fd, &keys[i], &c))
+					continue;
+				if (!c.count) {
+					bpf_map_delete_elem(fd, &keys[i]);
+					continue;
+				}
+				bpftuner_coalesce_send(tuner, &keys[i], &c);
+				c.count = 0;
+				c.first = now;
+				bpf_map_update_elem(fd, &keys[i], &c, BPF_EXIST);
+				drained++;
+				continue;
+			}
+			if (bpf_map_lookup_and_delete_elem(fd, &keys[i], &c)) {
+				if (errno != ENOENT) {
+					lookup_and_delete_unsupported = true;
+					i--;
+				}
+				continue;
+			}
+			/* an update may have been coalesced since the lookup
+			 * above; send it rather than dropping it with the
+			 * idle entry.
+			 */
+			if (!c.count)
+				continue;
+			bpftuner_coalesce_send(tuner, &keys[i], &c);
+			drained++;
+		}
+	/* in fallback mode drained entries remain, so do not rescan */
+	} while (num_keys == BPFTUNE_COALESCE_BATCH &&
+		 !lookup_and_delete_unsupported);
+
+	return drained;
+}
+
+/* send summarized events for coalesced events whose window has expired,
+ * or for all coalesced events if all is true.  Returns number of events
+ * sent.
+ */
+int bpftune_coalesce_drain(bool all)
+{
+	__u64 now = bpftune_ktime_ns();
+	struct bpftuner *tuner;
+	int drained = 0;
+
+	if (!bpftune_coalesce_msec)
+		return 0;
+	if (bpftune_cap_add())
+		return 0;
+	bpftune_for_each_tuner(tuner) {
+		if (tuner->state != BPFTUNE_ACTIVE || tuner->coalesce_map_fd <= 0)
+			continue;
+		drained += bpftuner_coalesce_drain(tuner, now, all);
+	}
+	bpftune_cap_drop();
+	if (drained)
+		bpftune_log(LOG_DEBUG, "drained %d coalesced events\n", drained);
+	return drained;
+}
+
+/* sum per-cpu values of counter idx in BPF_PERCPU_COUNTERS() map. */
+int bpftune_percpu_counter_sum(int map_fd, __u32 idx, __s64 *sum)
+{
+	int i, err, num_cpus = libbpf_num_possible_cpus();
+	__s64 *values;
+
+	if (num_cpus <= 0)
+		return num_cpus ? num_cpus : -EINVAL;
+	values = calloc(num_cpus, sizeof(*values));
+	if (!values)
+		return -ENOMEM;
+	err = bpftune_cap_add();
+	if (err)
+		goto out;
+	err = bpf_map_lookup_elem(map_fd, &idx, values);
+	if (err)
 		err = -errno;
+	bpftune_cap_drop();
+	if (err)
+		goto out;
+	for (*sum = 0, i = 0; i < num_cpus; i++)
+		*sum += values[i];
+out:
+	free(values);
+	return err;
+}
+
+int bpftuner_ring_buffer_map_fd(struct bpftuner *tuner)
+{
+	return tuner->ring_buffer_map_fd;
+}
+
+/* Ring buffers of the same priority share a libbpf ring buffer manager
+ * (via ring_buffer__add()); each manager's epoll fd is added to our epoll
+ * fd.  Levels are kept sorted by descending priority, so when multiple
+ * managers are ready, higher-priority ring buffers are consumed first.
+ */
+struct bpftune_ring_buffer_level {
+	int priority;
+	bool ready;
+	struct ring_buffer *rb;
+};
+
+static struct bpftune_ring_buffer_level bpftune_ring_buffer_levels[BPFTUNE_MAX_RING_BUFFERS];
+static unsigned int bpftune_num_ring_buffer_levels;
+static int bpftune_ring_buffer_epoll_fd = -1;
+
+/* called with bpftune_ring_buffer_lock held. */
+static int __bpftune_ring_buffer_add(int map_fd, int priority)
+{
+	struct bpftune_ring_buffer_level *level = NULL;
+	struct epoll_event ev = {};
+	struct ring_buffer *rb;
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < bpftune_num_ring_buffer_levels; i++) {
+		if (bpftune_ring_buffer_levels[i].priority == priority) {
+			level = &bpftune_ring_buffer_levels[i];
+			break;
+		}
+		if (bpftune_ring_buffer_levels[i].priority < priority)
+			break;
+	}
+	if (level) {
+		err = ring_buffer__add(level->rb, map_fd,
+				       bpftune_ringbuf_event_read,
+				       bpftune_ring_buffer_ctx);
+		if (err)
+			bpftune_log_bpf_err(err, "could not add ring buffer: %s\n");
+		return err;
+	}
+	if (bpftune_num_ring_buffer_levels >= BPFTUNE_MAX_RING_BUFFERS)
+		return -ENOSPC;
+
+	rb = ring_buffer__new(map_fd, bpftune_ringbuf_event_read,
+			      bpftune_ring_buffer_ctx, NULL);
+	err = libbpf_get_error(rb);
+	if (err) {
+		bpftune_log_bpf_err(err, "couldnt create ring buffer: %s\n");
+		return err;
+	}
+	/* insert at position i to keep levels sorted by priority; epoll data
+	 * holds the priority, since level positions shift on insertion.
+	 */
+	memmove(&bpftune_ring_buffer_levels[i + 1], &bpftune_ring_buffer_levels[i],
+		(bpftune_num_ring_buffer_levels - i) * sizeof(*level));
+	level = &bpftune_ring_buffer_levels[i];
+	level->priority = priority;
+	level->ready = false;
+	level->rb = rb;
+	bpftune_num_ring_buffer_levels++;
+
+	ev.events = EPOLLIN;
+	ev.data.u32 = (__u32)priority;
+	if (epoll_ctl(bpftune_ring_buffer_epoll_fd, EPOLL_CTL_ADD,
+		      ring_buffer__epoll_fd(rb), &ev) < 0) {
+		err = -errno;
+		bpftune_log(LOG_ERR, "could not add ring buffer to epoll: %s\n",
+			    strerror(-err));
+	}
+	return err;
+}
+
+static int bpftune_ring_buffer_add(struct bpftune_ring_buffer *rbuf)
+{
+	int err = 0;
+
+	pthread_mutex_lock(&bpftune_ring_buffer_lock);
+	/* not polling yet; will be added at bpftune_ring_buffer_init() */
+	if (bpftune_ring_buffer_epoll_fd < 0 || rbuf->added ||
+	    rbuf->map_fd <= 0)
+		goto out;
+	err = __bpftune_ring_buffer_add(rbuf->map_fd, rbuf->priority);
+	if (!err) {
+		rbuf->added = true;
+		bpftune_log(LOG_DEBUG, "polling ring buffer for '%s' (fd %d, priority %d)\n",
+			    rbuf->tuners, rbuf->map_fd, rbuf->priority);
+	}
+out:
+	pthread_mutex_unlock(&bpftune_ring_buffer_lock);
+	return err;
+}
+
+static void *bpftune_ring_buffers_init(void *ctx)
+{
+	unsigned int i;
+	int err = 0;
+
+	if (bpftune_ring_buffer_epoll_fd >= 0)
+		return &bpftune_ring_buffer_epoll_fd;
+
+	bpftune_ring_buffer_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (bpftune_ring_buffer_epoll_fd < 0) {
+		bpftune_log(LOG_ERR, "could not create epoll fd: %s\n",
+			    strerror(errno));
+		return NULL;
+	}
+	bpftune_ring_buffer_ctx = ctx;
+
+	err = bpftune_cap_add();
+	if (err)
+		return NULL;
+	err = bpftune_ring_buffer_add(&bpftune_default_ring_buffer);
+	for (i = 0; !err && i < bpftune_num_ring_buffers; i++)
+		err = bpftune_ring_buffer_add(&bpftune_ring_buffers[i]);
+	bpftune_cap_drop();
+
+	return err ? NULL : &bpftune_ring_buffer_epoll_fd;
+}
+
+static int bpftune_ring_buffers_poll(int interval)
+{
+	struct epoll_event events[BPFTUNE_MAX_RING_BUFFERS];
+	int i, j, n, err = 0;
+
+	n = epoll_wait(bpftune_ring_buffer_epoll_fd, events,
+		       BPFTUNE_MAX_RING_BUFFERS, interval);
+	if (n < 0)
+		return errno == EINTR ? 0 : -errno;
+
+	pthread_mutex_lock(&bpftune_ring_buffer_lock);
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < (int)bpftune_num_ring_buffer_levels; j++) {
+			if (bpftune_ring_buffer_levels[j].priority ==
+			    (int)events[i].data.u32)
+				bpftune_ring_buffer_levels[j].ready = true;
+		}
+	}
+	for (j = 0; j < (int)bpftune_num_ring_buffer_levels; j++) {
+		struct bpftune_ring_buffer_level *level = &bpftune_ring_buffer_levels[j];
+
+		if (!level->ready)
+			continue;
+		level->ready = false;
+		err = ring_buffer__consume(level->rb);
+		if (err < 0)
+			break;
+		err = 0;
+	}
+	pthread_mutex_unlock(&bpftune_ring_buffer_lock);
+	return err;
+}
+
+static void bpftune_ring_buffer_close(struct bpftune_ring_buffer *rbuf)
+{
+	if (rbuf->map_fd > 0)
+		close(rbuf->map_fd);
+	rbuf->map_fd = 0;
+	rbuf->added = false;
+}
+
+static void bpftune_ring_buffers_free(void)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&bpftune_ring_buffer_lock);
+	for (i = 0; i < bpftune_num_ring_buffer_levels; i++)
+		ring_buffer__free(bpftune_ring_buffer_levels[i].rb);
+	bpftune_num_ring_buffer_levels = 0;
+	bpftune_ring_buffer_close(&bpftune_default_ring_buffer);
+	for (i = 0; i < bpftune_num_ring_buffers; i++)
+		bpftune_ring_buffer_close(&bpftune_ring_buffers[i]);
+	if (bpftune_ring_buffer_epoll_fd >= 0)
+		close(bpftune_ring_buffer_epoll_fd);
+	bpftune_ring_buffer_epoll_fd = -1;
+	pthread_mutex_unlock(&bpftune_ring_buffer_lock);
+}
+
+void *bpftune_ring_buffer_init(int ring_buffer_map_fd, void *ctx)
+{
+	struct ring_buffer *rb;
+	int err;
+
+	if (bpftune_ring_buffers_multi())
+		return bpftune_ring_buffers_init(ctx);
+
+	bpftune_ring_buffer_ctx = ctx;
+	bpftune_log(LOG_DEBUG, "calling ring_buffer__new, ringbuf_map_fd %d\n",
+		    ring_buffer_map_fd);
+	err = bpftune_cap_add();
+	if (err)
+		return NULL;
+	rb = ring_buffer__new(ring_buffer_map_fd, bpftune_ringbuf_event_read, ctx, NULL);
+	err = libbpf_get_error(rb);
+	if (err) {
+		bpftune_log_bpf_err(err, "couldnt create ring buffer: %s\n");
+		rb = NULL;
+	}
+	bpftune_cap_drop();
+	return rb;
+}
+
+/* BPF program run-time accounting.  While the BPF_ENABLE_STATS fd is
+ * held, the kernel accounts run counts and run time for all BPF programs;
+ * we sample these periodically for each tuner's programs, and compute
+ * the share of total CPU time the tuner's programs use.  If a budget is
+ * set and a tuner exceeds it for BPFTUNE_PROG_BUDGET_INTERVALS in a row,
+ * it is switched to its cheapest strategy (the one with the fewest
+ * programs), or if it has none, it is deactivated.
+ */
+#define BPFTUNE_PROG_STATS_INTERVAL	10	/* seconds */
+#define BPFTUNE_PROG_BUDGET_INTERVALS	3
+
+struct bpftune_prog_stats {
+	__u64 run_time_ns;
+	__u64 run_cnt;
+	double cpu_pct;		/* share of total cpu in last interval */
+	unsigned int over_budget;
+};
+
+static struct bpftune_prog_stats bpftune_prog_stats[BPFTUNE_MAX_TUNERS];
+static int bpftune_stats_fd = -1;
+static double bpftune_prog_budget;
+static __u64 bpftune_prog_stats_last;
+
+static unsigned int bpftuner_strategy_num_progs(struct bpftuner_strategy *strategy)
+{
+	unsigned int n = 0;
+
+	if (!strategy || !strategy->bpf_progs)
+		return UINT_MAX;
+	while (strategy->bpf_progs[n])
+		n++;
+	return n;
+}
+
+static void bpftuner_prog_budget_enforce(struct bpftuner *tuner)
+{
+	struct bpftuner_strategy *strategy, *cheapest = NULL;
+	unsigned int min = bpftuner_strategy_num_progs(tuner->strategy);
+	double cpu_pct = bpftune_prog_stats[tuner->id].cpu_pct;
+
+	if (tuner->strategies) {
+		bpftuner_for_each_strategy(tuner, strategy) {
+			unsigned int n = bpftuner_strategy_num_progs(strategy);
+
+			if (strategy == tuner->strategy || n >= min)
+				continue;
+			min = n;
+			cheapest = strategy;
+		}
+	}
+	memset(&bpftune_prog_stats[tuner->id], 0, sizeof(bpftune_prog_stats[0]));
+	if (cheapest) {
+		bpftune_log(BPFTUNE_LOG_LEVEL,
+			    "tuner '%s' BPF programs use %.3f%% of cpu, over budget of %.3f%%; switching to strategy '%s'\n",
+			    tuner->name, cpu_pct, bpftune_prog_budget,
+			    cheapest->name);
+		if (!bpftuner_strategy_set(tuner, cheapest))
+			return;
+	}
+	bpftune_log(BPFTUNE_LOG_LEVEL,
+		    "tuner '%s' BPF programs use %.3f%% of cpu, over budget of %.3f%%; disabling '%s'\n",
+		    tuner->name, cpu_pct, bpftune_prog_budget, tuner->name);
+	bpftuner_fini(tuner, BPFTUNE_INACTIVE);
+}
+
+static void bpftuner_prog_stats_update(struct bpftuner *tuner,
+				       __u64 elapsed_ns, long num_cpus)
+{
+	struct bpftune_prog_stats *stats = &bpftune_prog_stats[tuner->id];
+	__u64 run_time_ns = 0, run_cnt = 0, delta;
+	struct bpf_program *prog;
+
+	bpf_object__for_each_program(prog, tuner->obj) {
+		struct bpf_prog_info info = {};
+		__u32 len = sizeof(info);
+		int fd = bpf_program__fd(prog);
+
+		if (fd < 0 || bpf_obj_get_info_by_fd(fd, &info, &len))
+			continue;
+		run_time_ns += info.run_time_ns;
+		run_cnt += info.run_cnt;
+		bpftune_log(LOG_DEBUG, "%s: prog '%s': %llu runs, %llu ns/run\n",
+			    tuner->name, bpf_program__name(prog),
+			    (unsigned long long)info.run_cnt,
+			    (unsigned long long)(info.run_cnt ?
+						 info.run_time_ns / info.run_cnt : 0));
+	}
+	/* counts restart if programs were reloaded (e.g. strategy change) */
+	delta = run_time_ns >= stats->run_time_ns ? run_time_ns - stats->run_time_ns :
+						     run_time_ns;
+	stats->run_time_ns = run_time_ns;
+	stats->run_cnt = run_cnt;
+	if (!elapsed_ns)
+		return;
+	stats->cpu_pct = 100.0 * delta / ((double)elapsed_ns * num_cpus);
+	bpftune_log(LOG_DEBUG, "%s: BPF programs used %.4f%% of cpu\n",
+		    tuner->name, stats->cpu_pct);
+
+	if (bpftune_prog_budget <= 0 || stats->cpu_pct <= bpftune_prog_budget) {
+		stats->over_budget = 0;
+		return;
+	}
+	if (++stats->over_budget >= BPFTUNE_PROG_BUDGET_INTERVALS)
+		bpftuner_prog_budget_enforce(tuner);
+}
+
+static void bpftune_prog_stats_update(__u64 now)
+{
+	__u64 elapsed_ns = bpftune_prog_stats_last ? now - bpftune_prog_stats_last : 0;
+	long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	struct bpftuner *tuner;
+
+	bpftune_prog_stats_last = now;
+	if (num_cpus <= 0)
+		num_cpus = 1;
+	if (bpftune_cap_add())
+		return;
+	bpftune_for_each_tuner(tuner) {
+		if (tuner->state != BPFTUNE_ACTIVE || !tuner->obj)
+			continue;
+		bpftuner_prog_stats_update(tuner, elapsed_ns, num_cpus);
+	}
+	bpftune_cap_drop();
+}
+
+/* enable BPF program run-time stats; if budget_pct > 0, tuners whose
+ * programs use more than budget_pct percent of total cpu time are
+ * switched to a cheaper strategy or disabled.
+ */
+int bpftune_prog_stats_init(double budget_pct)
+{
+	int err;
+
+	err = bpftune_cap_add();
+	if (err)
+		return err;
+	bpftune_stats_fd = bpf_enable_stats(BPF_STATS_RUN_TIME);
+	if (bpftune_stats_fd < 0) {
+		err = -errno;
+		bpftune_log(LOG_ERR, "could not enable BPF program stats: %s\n",
+			    strerror(-err));
+	}
+	bpftune_cap_drop();
+	if (err)
+		return err;
+	bpftune_prog_budget = budget_pct;
+	/* establish baseline */
+	bpftune_prog_stats_update(bpftune_ktime_ns());
+	return 0;
+}
+
+void bpftune_prog_stats_fini(void)
+{
+	if (bpftune_stats_fd < 0)
+		return;
+	close(bpftune_stats_fd);
+	bpftune_stats_fd = -1;
+}
+
+static int ring_buffer_done;
+
+/* periodic work done from the poll loop */
+static void bpftune_periodic(void)
+{
+	static __u64 last_drain, last_save;
+	__u64 now = bpftune_ktime_ns();
+	struct bpftuner *tuner;
+
+	if (bpftune_coalesce_msec &&
+	    now - last_drain >= bpftune_coalesce_msec * MSEC) {
+		bpftune_coalesce_drain(false);
+		last_drain = now;
+	}
+	if (bpftune_stats_fd >= 0 &&
+	    now - bpftune_prog_stats_last >= BPFTUNE_PROG_STATS_INTERVAL * 1000 * MSEC)
+		bpftune_prog_stats_update(now);
+	if (bpftune_persist &&
+	    now - last_save >= BPFTUNE_STATE_SAVE_INTERVAL * 1000 * MSEC) {
+		if (last_save)
+			bpftune_state_save();
+		last_save = now;
+	}
+	if (bpftune_verify_sec)
+		bpftune_verify_update(now);
+	bpftune_trace_flush();
+	bpftune_for_each_tuner(tuner) {
+		if (tuner->state != BPFTUNE_ACTIVE)
+			continue;
+		bpftuner_ondemand_update(tuner, now);
+		if (tuner->strategy_next && now >= tuner->strategy_next)
+			bpftuner_strategy_update(tuner);
+		if (tuner->periodic)
+			tuner->periodic(tuner);
+	}
+}
+
+int bpftune_ring_buffer_poll(void *ring_buffer, int interval)
+{
+	struct ring_buffer *rb = ring_buffer;
+	bool multi = bpftune_ring_buffers_multi();
+	int err;
+
+	while (!ring_buffer_done) {
+		if (multi)
+			err = bpftune_ring_buffers_poll(interval);
+		else
+			err = ring_buffer__poll(rb, interval);
+		if (err < 0) {
+			bpftune_log_bpf_err(err, "ring_buffer__poll: %s\n");
+			break;
+		}
+		bpftune_periodic();
+	}
+	if (multi)
+		bpftune_ring_buffers_free();
+	else
+		ring_buffer__free(rb);
+	return 0;
+}
+
+void bpftune_ring_buffer_fini(__attribute__((unused)) void *ring_buffer)
+{
+	ring_buffer_done = true;
+}
+
+static void bpftune_values_str(char *buf, size_t bufsz, __u8 num_values,
+			       long *values);
+
+/* map tuner in trace to loaded tuner of the same name */
+static int bpftune_trace_tuner_id(const struct bpftune_trace_tuner *t,
+				  __u32 size)
+{
+	__u32 name_size = size - __builtin_offsetof(struct bpftune_trace_tuner,
+						    name);
+	struct bpftuner *tuner;
+
+	if (!memchr(t->name, '\0', name_size))
+		return -1;
+	bpftune_for_each_tuner(tuner) {
+		if (strcmp(tuner->name, t->name) == 0)
+			return tuner->id;
+	}
+	bpftune_log(LOG_DEBUG, "tuner '%s' in trace is not loaded; skipping its events\n",
+		    t->name);
+	return -1;
+}
+
+/* Feed events in the trace at path to the loaded tuners as fast as
+ * possible.  Time as seen via bpftune_ktime_ns() follows the trace
+ * timestamps, and periodic work is done every interval msec of trace
+ * time, so rate-based tuner logic behaves as it did when the trace was
+ * recorded.  Tuners should be loaded without attaching and with sysctl
+ * writes disabled; see bpftune_set_no_attach() and bpftune_set_dry_run().
+ * Recorded sysctl changes are logged at debug level for comparison with
+ * those the replay makes.
+ */
+int bpftune_trace_replay(const char *path, int interval)
+{
+	unsigned long events = 0, skipped = 0, trace_changes = 0, changes;
+	__u64 start = bpftune_ktime_ns(), now = start, last = 0;
+	__u64 last_periodic = start, span = 0;
+	const struct bpftune_trace_header *hdr;
+	int ids[BPFTUNE_MAX_TUNERS];
+	struct stat st;
+	char *trace;
+	size_t off;
+	int fd, i;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		int err = -errno;
+
+		bpftune_log(LOG_ERR, "could not open trace '%s': %s\n",
+			    path, strerror(-err));
+		if (fd >= 0)
+			close(fd);
+		return err;
+	}
+	if ((size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
+		bpftune_log(LOG_ERR, "'%s' is not a bpftune trace\n", path);
+		return -EINVAL;
+	}
+	trace = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (trace == MAP_FAILED) {
+		int err = -errno;
+
+		bpftune_log(LOG_ERR, "could not map trace '%s': %s\n",
+			    path, strerror(-err));
+		return err;
+	}
+	hdr = (const struct bpftune_trace_header *)trace;
+	if (memcmp(hdr->magic, BPFTUNE_TRACE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != BPFTUNE_TRACE_VERSION ||
+	    hdr->header_size < sizeof(*hdr) ||
+	    hdr->header_size > (size_t)st.st_size) {
+		bpftune_log(LOG_ERR, "'%s' is not a bpftune trace\n", path);
+		munmap(trace, st.st_size);
+		return -EINVAL;
+	}
+	/* ids are unchanged until tuner records map them */
+	for (i = 0; i < BPFTUNE_MAX_TUNERS; i++)
+		ids[i] = i;
+	changes = __atomic_load_n(&bpftune_sysctl_changes, __ATOMIC_RELAXED);
+
+	for (off = BPFTUNE_TRACE_ALIGN(hdr->header_size);
+	     off + sizeof(struct bpftune_trace_record) <= (size_t)st.st_size;) {
+		const struct bpftune_trace_record *rec = (const void *)(trace + off);
+		const void *data = rec + 1;
+
+		if (rec->size > st.st_size - off - sizeof(*rec)) {
+			bpftune_log(LOG_ERR, "trace '%s' truncated at offset %zu\n",
+				    path, off);
+			break;
+		}
+		off += sizeof(*rec) + BPFTUNE_TRACE_ALIGN(rec->size);
+
+		/* traces appended to after a reboot may go back in time */
+		if (last && rec->ts > last) {
+			now += rec->ts - last;
+			span += rec->ts - last;
+		}
+		last = rec->ts;
+		__atomic_store_n(&bpftune_replay_now, now, __ATOMIC_RELEASE);
+		if (now - last_periodic >= interval * MSEC) {
+			bpftune_periodic();
+			last_periodic = now;
+		}
+
+		switch (rec->type) {
+		case BPFTUNE_TRACE_TUNER: {
+			const struct bpftune_trace_tuner *t = data;
+
+			if (rec->size <= __builtin_offsetof(struct bpftune_trace_tuner, name) ||
+			    t->id >= BPFTUNE_MAX_TUNERS)
+				break;
+			ids[t->id] = bpftune_trace_tuner_id(t, rec->size);
+			break;
+		}
+		case BPFTUNE_TRACE_EVENT: {
+			struct bpftune_event event;
+
+			if (rec->size < BPFTUNE_EVENT_HDR_SIZE ||
+			    rec->size > sizeof(event)) {
+				skipped++;
+				break;
+			}
+			memcpy(&event, data, rec->size);
+			if (event.tuner_id >= BPFTUNE_MAX_TUNERS ||
+			    ids[event.tuner_id] < 0) {
+				skipped++;
+				break;
+			}
+			event.tuner_id = ids[event.tuner_id];
+			bpftune_ringbuf_event_read(bpftune_ring_buffer_ctx,
+						   &event, rec->size);
+			events++;
+			break;
+		}
+		case BPFTUNE_TRACE_SYSCTL: {
+			struct bpftune_trace_sysctl t = {};
+			char oldvals[BPFTUNE_MAX_NAME], newvals[BPFTUNE_MAX_NAME];
+
+			trace_changes++;
+			if (bpftune_log_level() < LOG_DEBUG)
+				break;
+			memcpy(&t, data, min(rec->size, sizeof(t)));
+			if (t.num_values > BPFTUNE_MAX_VALUES)
+				break;
+			bpftune_values_str(oldvals, sizeof(oldvals),
+					   t.num_values, t.old);
+			bpftune_values_str(newvals, sizeof(newvals),
+					   t.num_values, t.new);
+			bpftune_log(LOG_DEBUG, "trace: tuner %u changed tunable %u (scenario %u, netns cookie %llu) from (%s) -> (%s)\n",
+				    t.tuner_id, t.tunable, t.scenario,
+				    (unsigned long long)t.netns_cookie,
+				    t.flags & BPFTUNE_TRACE_SYSCTL_OLD ?
+				    oldvals : "?", newvals);
+			break;
+		}
+		default:
+			skipped++;
+			break;
+		}
+	}
+	/* deliver events still being coalesced */
+	bpftune_coalesce_drain(true);
+	__atomic_store_n(&bpftune_replay_now, 0, __ATOMIC_RELEASE);
+	munmap(trace, st.st_size);
+
+	bpftune_log(BPFTUNE_LOG_LEVEL, "replayed %lu events (%lu skipped) spanning %.3f seconds in %.3f seconds; trace has %lu sysctl changes, replay made %lu\n",
+		    events, skipped, (double)span / SECOND,
+		    (double)(bpftune_ktime_ns() - start) / SECOND,
+		    trace_changes,
+		    __atomic_load_n(&bpftune_sysctl_changes, __ATOMIC_RELAXED) -
+		    changes);
+	return 0;
+}
+
+
+#define BPFTUNE_PROC_SYS	"/proc/sys/"
+void bpftune_sysctl_name_to_path(const char *name, char *path, size_t path_sz)
+{
+	size_t i;
+
+	snprintf(path, path_sz, BPFTUNE_PROC_SYS "%s", name);
+	for (i = 0; i < path_sz && path[i] != 0; i++)
+		if (path[i] == '.')
+			path[i] = '/';
+}
+
+/* minimal integer formatting/parsing for sysctl values, avoiding stdio. */
+static int bpftune_sysctl_format(char *buf, size_t bufsz, __u8 num_values,
+				 long *values)
+{
+	size_t len = 0;
+	__u8 i;
+
+	for (i = 0; i < num_values; i++) {
+		unsigned long v = values[i] < 0 ? -(unsigned long)values[i] :
+						  (unsigned long)values[i];
+		char digits[24];
+		int n = 0;
+
+		do {
+			digits[n++] = '0' + (v % 10);
+			v /= 10;
+		} while (v);
+		if (values[i] < 0)
+			digits[n++] = '-';
+		if (len + n + 1 >= bufsz)
+			return -E2BIG;
+		while (n > 0)
+			buf[len++] = digits[--n];
+		buf[len++] = i + 1 < num_values ? ' ' : '\n';
+	}
+	buf[len] = '\0';
+	return len;
+}
+
+static int bpftune_sysctl_parse(const char *buf, long *values)
+{
+	const char *s = buf;
+	int num_values;
+	char *end;
+
+	for (num_values = 0; num_values < BPFTUNE_MAX_VALUES; num_values++) {
+		values[num_values] = strtol(s, &end, 10);
+		if (end == s)
+			break;
+		s = end;
+	}
+	return num_values ? num_values : -ENOENT;
+}
+
+static int bpftune_sysctl_fd_read(int fd, long *values)
+{
+	char buf[BPFTUNE_MAX_NAME];
+	ssize_t len;
+
+	len = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len < 0)
+		return -errno;
+	buf[len] = '\0';
+	return bpftune_sysctl_parse(buf, values);
+}
+
+static int bpftune_sysctl_fd_write(int fd, __u8 num_values, long *values)
+{
+	char buf[BPFTUNE_MAX_NAME];
+	int len;
+
+	len = bpftune_sysctl_format(buf, sizeof(buf), num_values, values);
+	if (len < 0)
+		return len;
+	if (pwrite(fd, buf, len, 0) < 0)
+		return -errno;
+	return 0;
+}
+
+static int bpftune_sysctl_open(const char *name, int flags)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	bpftune_sysctl_name_to_path(name, path, sizeof(path));
+	fd = open(path, flags | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	return fd;
+}
+
+int bpftune_sysctl_read(int netns_fd, const char *name, long *values)
+{
+	int i, fd, orig_netns_fd = 0, num_values = 0;
+	int err = 0;	
+
+	err = bpftune_cap_add();
+	if (err)
+		return err;
+
+	err = bpftune_netns_set(netns_fd, &orig_netns_fd);
+	if (err < 0)
+		goto out_unset;
+
+	fd = bpftune_sysctl_open(name, O_RDONLY);
+	if (fd < 0) {
+		err = fd;
 		bpftune_log(LOG_ERR, "could not open %s (netns fd %d) for reading: %s\n",
-			    path, netns_fd, strerror(-err));
+			    name, netns_fd, strerror(-err));
+		goto out;
+	}
+	num_values = bpftune_sysctl_fd_read(fd, values);
+	close(fd);
+	if (num_values < 0) {
+		err = num_values;
+		bpftune_log(LOG_ERR, "could not read from %s: %s\n", name,
+			    strerror(-err));
+		goto out;
+	}
+
+	for (i = 0; i < num_values; i++) {
+		bpftune_log(LOG_DEBUG, "Read %s[%d] = %ld\n",
+			    name, i, values[i]);
+	}
+
+out:
+	bpftune_netns_set(orig_netns_fd, NULL);
+	if (orig_netns_fd > 0)
+		close(orig_netns_fd);
+out_unset:
+	bpftune_cap_drop();
+	return err ? err : num_values;
+}
+
+/* write values unless already set to them. */
+static int __bpftune_sysctl_write(int fd, const char *name, __u8 num_values,
+				  long *values, __u8 old_num_values,
+				  long *old_values)
+{
+	int i, err;
+
+	if (num_values == old_num_values) {
+		for (i = 0; i < num_values; i++) {
+			if (old_values[i] != values[i])
+				break;
+		}
+		if (i == num_values)
+			return 0;
+	}
+	if (bpftune_dry_run) {
+		for (i = 0; i < num_values; i++) {
+			bpftune_log(LOG_DEBUG, "Dry run: not writing %s[%d] = %ld\n",
+				    name, i, values[i]);
+		}
+		return 0;
+	}
+	err = bpftune_sysctl_fd_write(fd, num_values, values);
+	if (err) {
+		bpftune_log(LOG_DEBUG, "could not write %s: %s\n",
+			    name, strerror(-err));
+		return err;
+	}
+	for (i = 0; i < num_values; i++) {
+		bpftune_log(LOG_DEBUG, "Wrote %s[%d] = %ld\n",
+			    name, i, values[i]);
+	}
+	return 0;
+}
+
+int bpftune_sysctl_write(int netns_fd, const char *name, __u8 num_values, long *values)
+{
+	long old_values[BPFTUNE_MAX_VALUES] = {};
+	int err = 0, orig_netns_fd = 0;
+	int fd, old_num_values;
+
+	bpftune_log(LOG_DEBUG, "writing sysctl '%s' for netns_fd %d\n",
+		    name, netns_fd);
+
+	err = bpftune_cap_add();
+	if (err)
+		return err;
+	err = bpftune_netns_set(netns_fd, &orig_netns_fd);
+	if (err < 0)
+		goto out_unset;
+
+	fd = bpftune_sysctl_open(name, O_RDWR);
+	if (fd < 0) {
+		err = fd;
+		bpftune_log(LOG_DEBUG, "could not open %s for writing: %s\n",
+			    name, strerror(-err));
+		goto out;
+	}
+	/* If value is already set to val, do nothing. */
+	old_num_values = bpftune_sysctl_fd_read(fd, old_values);
+	if (old_num_values < 0)
+		err = old_num_values;
+	else
+		err = __bpftune_sysctl_write(fd, name, num_values, values,
+					     old_num_values, old_values);
+	close(fd);
+out:
+	bpftune_netns_set(orig_netns_fd, NULL);
+	if (orig_netns_fd > 0)
+		close(orig_netns_fd);
+out_unset:
+	bpftune_cap_drop();
+        return err;
+}
+
+/* CPU mask sysctls such as net.core.flow_limit_cpu_bitmap use the kernel
+ * bitmap format: comma-separated groups of 32 bits in hex, most
+ * significant group first ("00000000,00000003" for CPUs 0 and 1).
+ * Masks are only handled for the global netns.
+ */
+static int bpftune_cpumask_parse(const char *buf, __u64 *mask,
+				 unsigned int nwords)
+{
+	unsigned int group = 0, digits = 0;
+	size_t len = strlen(buf);
+
+	memset(mask, 0, nwords * sizeof(*mask));
+	while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == ' '))
+		len--;
+	if (!len)
+		return -ENOENT;
+	for (; len > 0; len--) {
+		char c = buf[len - 1];
+		unsigned int bit, b;
+		int v;
+
+		if (c == ',') {
+			group++;
+			digits = 0;
+			continue;
+		}
+		if (c >= '0' && c <= '9')
+			v = c - '0';
+		else if (c >= 'a' && c <= 'f')
+			v = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			v = c - 'A' + 10;
+		else
+			return -EINVAL;
+		if (digits == 8)
+			return -EINVAL;
+		bit = group * 32 + digits * 4;
+		digits++;
+		for (b = 0; b < 4; b++) {
+			if (!(v & (1 << b)))
+				continue;
+			if (bit + b >= nwords * 64)
+				return -ERANGE;
+			mask[(bit + b) / 64] |= 1ULL << ((bit + b) % 64);
+		}
+	}
+	return 0;
+}
+
+static int bpftune_cpumask_format(char *buf, size_t bufsz, const __u64 *mask,
+				  unsigned int nwords)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned int groups = 1, g;
+	size_t len = 0;
+
+	for (g = 0; g < nwords * 2; g++) {
+		if ((mask[g / 2] >> ((g % 2) * 32)) & 0xffffffff)
+			groups = g + 1;
+	}
+	if (groups * 9 + 1 > bufsz)
+		return -E2BIG;
+	for (g = groups; g > 0; g--) {
+		__u32 v = (mask[(g - 1) / 2] >> (((g - 1) % 2) * 32)) & 0xffffffff;
+		int d;
+
+		for (d = 7; d >= 0; d--)
+			buf[len++] = hex[(v >> (d * 4)) & 0xf];
+		buf[len++] = g > 1 ? ',' : '\n';
+	}
+	buf[len] = '\0';
+	return len;
+}
+
+unsigned int bpftune_cpumask_weight(const __u64 *mask, unsigned int nwords)
+{
+	unsigned int i, weight = 0;
+
+	for (i = 0; i < nwords; i++)
+		weight += __builtin_popcountll(mask[i]);
+	return weight;
+}
+
+int bpftune_sysctl_cpumask_read(const char *name, __u64 *mask,
+				unsigned int nwords)
+{
+	char buf[PATH_MAX];
+	ssize_t len;
+	int fd, err;
+
+	err = bpftune_cap_add();
+	if (err)
+		return err;
+	fd = bpftune_sysctl_open(name, O_RDONLY);
+	if (fd < 0) {
+		err = fd;
+		bpftune_log(LOG_ERR, "could not open %s for reading: %s\n",
+			    name, strerror(-err));
+		goto out;
+	}
+	len = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len < 0)
+		err = -errno;
+	close(fd);
+	if (!err) {
+		buf[len] = '\0';
+		err = bpftune_cpumask_parse(buf, mask, nwords);
+	}
+	if (err)
+		bpftune_log(LOG_ERR, "could not read CPU mask from %s: %s\n",
+			    name, strerror(-err));
+	else
+		bpftune_log(LOG_DEBUG, "Read %s (%u CPUs)\n", name,
+			    bpftune_cpumask_weight(mask, nwords));
+out:
+	bpftune_cap_drop();
+	return err;
+}
+
+int bpftune_sysctl_cpumask_write(const char *name, const __u64 *mask,
+				 unsigned int nwords)
+{
+	char buf[PATH_MAX];
+	int fd, len, err;
+
+	len = bpftune_cpumask_format(buf, sizeof(buf), mask, nwords);
+	if (len < 0)
+		return len;
+	if (bpftune_dry_run) {
+		bpftune_log(LOG_DEBUG, "Dry run: not writing %s = %s", name, buf);
+		return 0;
+	}
+	err = bpftune_cap_add();
+	if (err)
+		return err;
+	fd = bpftune_sysctl_open(name, O_WRONLY);
+	if (fd < 0) {
+		err = fd;
+		bpftune_log(LOG_DEBUG, "could not open %s for writing: %s\n",
+			    name, strerror(-err));
 		goto out;
 	}
-	num_values = fscanf(fp, "%ld %ld %ld",
-			    &values[0], &values[1], &values[2]);
-	if (num_values == 0)
-		err = -ENOENT;
-	else if (num_values < 0)
-		err = -errno;
+	if (pwrite(fd, buf, len, 0) < 0) {
+		err = -errno;
+		bpftune_log(LOG_DEBUG, "could not write %s: %s\n",
+			    name, strerror(-err));
+	} else {
+		bpftune_log(LOG_DEBUG, "Wrote %s = %s", name, buf);
+	}
+	close(fd);
+out:
+	bpftune_cap_drop();
+	return err;
+}
+
+/* zones socket memory is allocated from, i.e. those at or below ZONE_NORMAL */
+static bool bpftune_mem_zone_usable(const char *zone)
+{
+	return strcmp(zone, "DMA") == 0 || strcmp(zone, "DMA32") == 0 ||
+	       strcmp(zone, "Normal") == 0;
+}
+
+/* Parse /proc/zoneinfo; this is the equivalent of the kernel's
+ * nr_free_buffer_pages() estimate used to size tcp_mem and udp_mem at boot,
+ * i.e. managed pages less the high watermark:
+ *
+ * Node 0, zone   Normal
+ *   pages free     145661
+ *         min      13560
+ *         low      16950
+ *         high     20340
+ *         spanned  3282944
+ *         present  3282944
+ *         managed  3199514
+ *
+ * On < 4GB systems, zone Normals report 0 and zone DMA32 contains
+ * the managed pages; as in the kernel, we sum over DMA, DMA32 and Normal.
+ *
+ * Buffer pages are summed over usable zones of all nodes, and per-node
+ * free pages are those above the high watermark in the node's usable zones.
+ * Only the few lines per zone we need are parsed, so this is cheap
+ * enough to repeat.  Nodes without usable zones get -1.
+ */
+int bpftune_mem_read(struct bpftune_mem *mem)
+{
+	long free = 0, high = 0, managed = 0;
+	bool node_seen[BPFTUNE_MAX_NODES] = {};
+	char line[256], zone[32];
+	bool usable = false;
+	int node = -1, err;
+	unsigned int i;
+	FILE *fp;
+
+	memset(mem, 0, sizeof(*mem));
+	err = bpftune_cap_add();
+	if (err)
+		return err;
+	fp = fopen("/proc/zoneinfo", "r");
+	if (!fp) {
+		err = -errno;
+		bpftune_log(LOG_DEBUG, "could not open /proc/zoneinfo: %s\n",
+			    strerror(-err));
+		bpftune_cap_drop();
+		return err;
+	}
+	for (;;) {
+		bool done = !fgets(line, sizeof(line), fp);
+		const char *l = line;
+
+		if (done || strncmp(line, "Node ", 5) == 0) {
+			/* account for the zone just parsed */
+			if (usable && managed > high)
+				mem->buffer_pages += managed - high;
+			if (usable && node >= 0 && node < BPFTUNE_MAX_NODES &&
+			    managed > 0) {
+				node_seen[node] = true;
+				mem->node_free_pages[node] += free - high;
+			}
+			if (done)
+				break;
+			usable = sscanf(line, "Node %d, zone %31s", &node, zone) == 2 &&
+				 bpftune_mem_zone_usable(zone);
+			if (node >= 0 && node < BPFTUNE_MAX_NODES &&
+			    (unsigned int)node >= mem->num_nodes)
+				mem->num_nodes = node + 1;
+			free = high = managed = 0;
+			continue;
+		}
+		if (!usable)
+			continue;
+		while (*l == ' ' || *l == '\t')
+			l++;
+		if (strncmp(l, "pages free ", 11) == 0)
+			free = strtol(l + 11, NULL, 10);
+		else if (strncmp(l, "high ", 5) == 0)
+			high = strtol(l + 5, NULL, 10);
+		else if (strncmp(l, "managed ", 8) == 0)
+			managed = strtol(l + 8, NULL, 10);
+	}
 	fclose(fp);
+	bpftune_cap_drop();
 
-	if (err) {
-		bpftune_log(LOG_ERR, "could not read from %s: %s\n", path,
-			    strerror(-err));
-		goto out;
+	for (i = 0; i < mem->num_nodes; i++) {
+		if (!node_seen[i])
+			mem->node_free_pages[i] = -1;
+		else if (mem->node_free_pages[i] < 0)
+			mem->node_free_pages[i] = 0;
 	}
+	return mem->buffer_pages ? 0 : -ENOENT;
+}
 
-	for (i = 0; i < num_values; i++) {
-		bpftune_log(LOG_DEBUG, "Read %s[%d] = %ld\n",
-			    name, i, values[i]);
-	}
+static pthread_mutex_t bpftune_mem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* update mem - a tuner's BPF copy of memory state - unless it was
+ * refreshed (at *last) in the last min_interval nanoseconds.  The last
+ * values are kept if zoneinfo cannot be read.
+ */
+void bpftune_mem_refresh(struct bpftune_mem *mem, __u64 *last,
+			 __u64 min_interval)
+{
+	__u64 now = bpftune_ktime_ns();
+	struct bpftune_mem cur;
+	unsigned int i;
 
+	pthread_mutex_lock(&bpftune_mem_lock);
+	if (*last && now - *last < min_interval)
+		goto out;
+	*last = now;
+	if (bpftune_mem_read(&cur))
+		goto out;
+	for (i = 0; i < cur.num_nodes; i++)
+		bpftune_log(LOG_DEBUG, "node %u has %ld free pages above high watermark\n",
+			    i, cur.node_free_pages[i]);
+	*mem = cur;
 out:
-	bpftune_netns_set(orig_netns_fd, NULL);
-out_unset:
-	bpftune_cap_drop();
-	return err ? err : num_values;
+	pthread_mutex_unlock(&bpftune_mem_lock);
 }
 
-int bpftune_sysctl_write(int netns_fd, const char *name, __u8 num_values, long *values)
+/* Cache of open /proc/sys fds, indexed by (netns cookie, sysctl name).
+ * A /proc/sys/net file opened in a network namespace refers to that
+ * namespace's sysctl, so once opened, reads and writes need no setns().
+ * Last-known values are cached too, so unchanged values are not written,
+ * and values need not be re-read before writing.  The cache is
+ * direct-mapped; a colliding entry is evicted.
+ */
+#define BPFTUNE_SYSCTL_CACHE_SIZE	1024	/* must be power of 2 */
+
+struct bpftune_sysctl_entry {
+	unsigned long netns_cookie;	/* 0 for global netns */
+	char name[BPFTUNE_MAX_NAME];
+	int fd;
+	__u8 num_values;		/* 0 if values are unknown */
+	long values[BPFTUNE_MAX_VALUES];
+};
+
+static struct bpftune_sysctl_entry bpftune_sysctl_cache[BPFTUNE_SYSCTL_CACHE_SIZE];
+static pthread_mutex_t bpftune_sysctl_lock = PTHREAD_MUTEX_INITIALIZER;
+/* time spent in/number of calls to bpftune_sysctls_write() */
+static __u64 bpftune_sysctl_write_ns;
+static __u64 bpftune_sysctl_write_count;
+
+static struct bpftune_sysctl_entry *bpftune_sysctl_entry(unsigned long cookie,
+							 const char *name)
 {
-	long old_values[BPFTUNE_MAX_VALUES] = {};
-	int i, err = 0, orig_netns_fd = 0;
-	int old_num_values;
-	char path[PATH_MAX];
-	FILE *fp;
+	__u64 hash = 0xcbf29ce484222325ULL ^ cookie;
+	const char *c;
 
-	bpftune_sysctl_name_to_path(name, path, sizeof(path));
+	for (c = name; *c; c++)
+		hash = (hash ^ (__u8)*c) * 0x100000001b3ULL;
+	return &bpftune_sysctl_cache[hash & (BPFTUNE_SYSCTL_CACHE_SIZE - 1)];
+}
 
-	bpftune_log(LOG_DEBUG, "writing sysctl '%s' for netns_fd %d\n",
-		    path, netns_fd);
+static bool bpftune_sysctl_entry_match(struct bpftune_sysctl_entry *e,
+				       unsigned long cookie, const char *name)
+{
+	return e->fd > 0 && e->netns_cookie == cookie &&
+	       strcmp(e->name, name) == 0;
+}
+
+static void bpftune_sysctl_entry_clear(struct bpftune_sysctl_entry *e)
+{
+	if (e->fd > 0)
+		close(e->fd);
+	memset(e, 0, sizeof(*e));
+}
+
+/* close cached fds for netns cookie; all fds if cookie is ~0UL. */
+void bpftune_sysctl_cache_flush(unsigned long cookie)
+{
+	unsigned int i;
+
+	if (cookie == global_netns_cookie)
+		cookie = 0;
+	pthread_mutex_lock(&bpftune_sysctl_lock);
+	for (i = 0; i < BPFTUNE_SYSCTL_CACHE_SIZE; i++) {
+		struct bpftune_sysctl_entry *e = &bpftune_sysctl_cache[i];
+
+		if (e->fd > 0 && (cookie == ~0UL || e->netns_cookie == cookie))
+			bpftune_sysctl_entry_clear(e);
+	}
+	pthread_mutex_unlock(&bpftune_sysctl_lock);
+}
+
+/* Write multiple sysctls for the netns specified by netns_cookie, under a
+ * single capability raise and at most one setns() to open sysctls not
+ * already cached.  netns_fd is only needed if not all sysctls are cached
+ * for the (non-global) netns; in such cases, if netns_fd is not specified,
+ * -EBADF is returned and the caller can retry with a netns fd.  The
+ * status of individual writes is stored in sysctls[i].ret.
+ */
+int bpftune_sysctls_write(int netns_fd, unsigned long netns_cookie,
+			  unsigned int num_sysctls,
+			  struct bpftune_sysctl_value *sysctls)
+{
+	__u64 start = bpftune_ktime_ns();
+	struct bpftune_sysctl_entry *e;
+	int err, orig_netns_fd = 0;
+	bool need_open = false;
+	unsigned int i;
+
+	if (netns_cookie == global_netns_cookie)
+		netns_cookie = 0;
 
 	err = bpftune_cap_add();
 	if (err)
 		return err;
-	err = bpftune_netns_set(netns_fd, &orig_netns_fd);
-	if (err < 0)
-		goto out_unset;
 
-	/* If value is already set to val, do nothing. */
-	old_num_values = bpftune_sysctl_read(0, name, old_values);
-	if (old_num_values < 0) {
-		err = old_num_values;
-		goto out;
+	pthread_mutex_lock(&bpftune_sysctl_lock);
+	for (i = 0; i < num_sysctls; i++) {
+		e = bpftune_sysctl_entry(netns_cookie, sysctls[i].name);
+		sysctls[i].ret = 0;
+		if (!bpftune_sysctl_entry_match(e, netns_cookie, sysctls[i].name))
+			need_open = true;
 	}
-	if (num_values == old_num_values) {
-		for (i = 0; i < num_values; i++) {
-			if (old_values[i] != values[i])
-				break;
+	if (need_open) {
+		if (netns_cookie && netns_fd <= 0) {
+			err = -EBADF;
+			goto out;
 		}
-		if (i == num_values)
+		err = bpftune_netns_set(netns_cookie ? netns_fd : 0,
+					&orig_netns_fd);
+		if (err < 0)
 			goto out;
+		for (i = 0; i < num_sysctls; i++) {
+			e = bpftune_sysctl_entry(netns_cookie, sysctls[i].name);
+			if (bpftune_sysctl_entry_match(e, netns_cookie,
+						       sysctls[i].name))
+				continue;
+			bpftune_sysctl_entry_clear(e);
+			e->fd = bpftune_sysctl_open(sysctls[i].name, O_RDWR);
+			if (e->fd < 0) {
+				sysctls[i].ret = e->fd;
+				bpftune_log(LOG_DEBUG, "could not open %s for writing: %s\n",
+					    sysctls[i].name, strerror(-e->fd));
+				e->fd = 0;
+				continue;
+			}
+			e->netns_cookie = netns_cookie;
+			strncpy(e->name, sysctls[i].name, sizeof(e->name) - 1);
+		}
+		bpftune_netns_set(orig_netns_fd, NULL);
+		if (orig_netns_fd > 0)
+			close(orig_netns_fd);
 	}
-        fp = fopen(path, "w");
-        if (!fp) {
-                err = -errno;
-                bpftune_log(LOG_DEBUG, "could not open %s for writing: %s\n",
-			    path, strerror(-err));
-		goto out;
-        }
-
-	for (i = 0; i < num_values; i++)
-		fprintf(fp, "%ld ", values[i]);
-        fclose(fp);
+	for (i = 0; i < num_sysctls; i++) {
+		if (sysctls[i].ret)
+			continue;
+		e = bpftune_sysctl_entry(netns_cookie, sysctls[i].name);
+		if (!e->num_values) {
+			int num_values = bpftune_sysctl_fd_read(e->fd, e->values);
 
-	for (i = 0; i < num_values; i++) {
-		bpftune_log(LOG_DEBUG, "Wrote %s[%d] = %ld\n",
-			    name, i, values[i]);
+			if (num_values < 0) {
+				sysctls[i].ret = num_values;
+				continue;
+			}
+			e->num_values = num_values;
+		}
+		sysctls[i].ret = __bpftune_sysctl_write(e->fd, e->name,
+							sysctls[i].num_values,
+							sysctls[i].values,
+							e->num_values,
+							e->values);
+		if (sysctls[i].ret) {
+			/* values may be unknown now; re-read next time */
+			e->num_values = 0;
+			continue;
+		}
+		e->num_values = sysctls[i].num_values;
+		memcpy(e->values, sysctls[i].values, sizeof(e->values));
+	}
+	for (i = 0; i < num_sysctls; i++) {
+		if (sysctls[i].ret) {
+			err = sysctls[i].ret;
+			break;
+		}
 	}
 out:
-	bpftune_netns_set(orig_netns_fd, NULL);
-out_unset:
+	pthread_mutex_unlock(&bpftune_sysctl_lock);
 	bpftune_cap_drop();
-        return err;
+	__atomic_add_fetch(&bpftune_sysctl_write_ns, bpftune_ktime_ns() - start,
+			   __ATOMIC_RELAXED);
+	__atomic_add_fetch(&bpftune_sysctl_write_count, 1, __ATOMIC_RELAXED);
+	return err;
+}
+
+/* Watched sysctls are indexed by hash of their "parent/procname" key,
+ * the form in which the sysctl tuner sees writes.  The same hashes key
+ * the sysctl tuner's BPF map, whose values are masks of the tuners using
+ * each sysctl, so unwatched writes are dropped in BPF.
+ */
+#define BPFTUNE_SYSCTL_WATCH_BUCKETS	256	/* must be power of 2 */
+
+struct bpftune_sysctl_watch {
+	struct bpftune_sysctl_watch *next;
+	__u32 hash;
+	unsigned int tuner_id;
+	char key[BPFTUNE_MAX_NAME];
+};
+
+static struct bpftune_sysctl_watch *bpftune_sysctl_watches[BPFTUNE_SYSCTL_WATCH_BUCKETS];
+static int bpftune_sysctl_watch_map_fd;
+static pthread_mutex_t bpftune_sysctl_watch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+__u32 bpftune_sysctl_watch_hash(const char *key)
+{
+	__u32 hash = BPFTUNE_SYSCTL_HASH_INIT;
+
+	for (; *key; key++)
+		hash = bpftune_sysctl_hash_add(hash, *key);
+	return hash;
+}
+
+/* "net.ipv4.tcp_rmem" -> "ipv4/tcp_rmem" */
+static void bpftune_sysctl_watch_key(const char *name, char *key, size_t key_sz)
+{
+	const char *last = strrchr(name, '.'), *start = name, *c;
+
+	if (last) {
+		for (c = name; c < last; c++) {
+			if (*c == '.')
+				start = c + 1;
+		}
+	}
+	snprintf(key, key_sz, "%s", start);
+	if (last)
+		key[last - start] = '/';
+}
+
+static __u64 __bpftune_sysctl_watch_tuners(__u32 hash, const char *key)
+{
+	struct bpftune_sysctl_watch *w;
+	__u64 tuners = 0;
+
+	for (w = bpftune_sysctl_watches[hash & (BPFTUNE_SYSCTL_WATCH_BUCKETS - 1)];
+	     w != NULL; w = w->next) {
+		if (w->hash == hash && (!key || strcmp(w->key, key) == 0))
+			tuners |= 1ULL << w->tuner_id;
+	}
+	return tuners;
+}
+
+/* sync BPF map entry for hash with watch list. */
+static void __bpftune_sysctl_watch_map_update(__u32 hash)
+{
+	__u64 tuners;
+
+	if (bpftune_sysctl_watch_map_fd <= 0)
+		return;
+	tuners = __bpftune_sysctl_watch_tuners(hash, NULL);
+	if (tuners) {
+		if (bpf_map_update_elem(bpftune_sysctl_watch_map_fd, &hash,
+					&tuners, BPF_ANY))
+			bpftune_log(LOG_ERR, "could not add sysctl watch: %s\n",
+				    strerror(errno));
+	} else {
+		bpf_map_delete_elem(bpftune_sysctl_watch_map_fd, &hash);
+	}
+}
+
+static void bpftuner_sysctl_watch_add(struct bpftuner *tuner)
+{
+	struct bpftune_sysctl_watch *w, **bucket;
+	struct bpftunable *t;
+
+	pthread_mutex_lock(&bpftune_sysctl_watch_lock);
+	bpftuner_for_each_tunable(tuner, t) {
+		if (t->desc.type != BPFTUNABLE_SYSCTL)
+			continue;
+		w = calloc(1, sizeof(*w));
+		if (!w) {
+			bpftune_log(LOG_ERR, "could not allocate sysctl watch\n");
+			break;
+		}
+		bpftune_sysctl_watch_key(t->desc.name, w->key, sizeof(w->key));
+		w->hash = bpftune_sysctl_watch_hash(w->key);
+		w->tuner_id = tuner->id;
+		bucket = &bpftune_sysctl_watches[w->hash & (BPFTUNE_SYSCTL_WATCH_BUCKETS - 1)];
+		w->next = *bucket;
+		*bucket = w;
+		__bpftune_sysctl_watch_map_update(w->hash);
+		bpftune_log(LOG_DEBUG, "watching sysctl '%s' (%u) for tuner '%s'\n",
+			    w->key, w->hash, tuner->name);
+	}
+	pthread_mutex_unlock(&bpftune_sysctl_watch_lock);
+}
+
+static void bpftuner_sysctl_watch_del(struct bpftuner *tuner)
+{
+	struct bpftune_sysctl_watch **wp, *w;
+	unsigned int i;
+
+	pthread_mutex_lock(&bpftune_sysctl_watch_lock);
+	for (i = 0; i < BPFTUNE_SYSCTL_WATCH_BUCKETS; i++) {
+		for (wp = &bpftune_sysctl_watches[i]; (w = *wp) != NULL; ) {
+			if (w->tuner_id != tuner->id) {
+				wp = &w->next;
+				continue;
+			}
+			*wp = w->next;
+			__bpftune_sysctl_watch_map_update(w->hash);
+			free(w);
+		}
+	}
+	pthread_mutex_unlock(&bpftune_sysctl_watch_lock);
+}
+
+/* set BPF map used to filter sysctl writes, and populate it with current
+ * watches; map_fd of 0 stops map updates.
+ */
+int bpftune_sysctl_watch_init(int map_fd)
+{
+	struct bpftune_sysctl_watch *w;
+	unsigned int i;
+
+	pthread_mutex_lock(&bpftune_sysctl_watch_lock);
+	bpftune_sysctl_watch_map_fd = map_fd;
+	for (i = 0; i < BPFTUNE_SYSCTL_WATCH_BUCKETS; i++) {
+		for (w = bpftune_sysctl_watches[i]; w != NULL; w = w->next)
+			__bpftune_sysctl_watch_map_update(w->hash);
+	}
+	pthread_mutex_unlock(&bpftune_sysctl_watch_lock);
+	return 0;
+}
+
+/* return mask of ids of tuners using sysctl with "parent/procname" key. */
+__u64 bpftune_sysctl_watch_lookup(const char *key)
+{
+	__u64 tuners;
+
+	pthread_mutex_lock(&bpftune_sysctl_watch_lock);
+	tuners = __bpftune_sysctl_watch_tuners(bpftune_sysctl_watch_hash(key),
+					       key);
+	pthread_mutex_unlock(&bpftune_sysctl_watch_lock);
+	return tuners;
 }
 
 int bpftuner_tunables_init(struct bpftuner *tuner, unsigned int num_descs,
@@ -948,6 +3915,20 @@ int bpftuner_tunables_init(struct bpftuner *tuner, unsigned int num_descs,
 
 		if (descs[i].type != BPFTUNABLE_SYSCTL)
 			continue;
+		if (descs[i].flags & BPFTUNABLE_CPUMASK) {
+			__u64 mask[BPFTUNE_CPUMASK_WORDS];
+			int err;
+
+			err = bpftune_sysctl_cpumask_read(descs[i].name, mask,
+							  BPFTUNE_CPUMASK_WORDS);
+			if (err)
+				return err;
+			tuner->tunables[i].current_values[0] =
+				bpftune_cpumask_weight(mask, BPFTUNE_CPUMASK_WORDS);
+			tuner->tunables[i].initial_values[0] =
+				tuner->tunables[i].current_values[0];
+			continue;
+		}
 		num_values = bpftune_sysctl_read(0, descs[i].name,
 				tuner->tunables[i].current_values);
 		if (num_values < 0) {
@@ -983,10 +3964,13 @@ struct bpftunable *bpftuner_tunable(struct bpftuner *tuner, unsigned int index)
 static void bpftuner_tunable_stats_update(struct bpftunable *tunable,
 					  unsigned int scenario, bool global_ns)
 {
+	/* events may be handled by multiple workers */
 	if (global_ns)
-		(tunable->stats.global_ns[scenario])++;
+		__atomic_add_fetch(&tunable->stats.global_ns[scenario], 1,
+				   __ATOMIC_RELAXED);
 	else
-		(tunable->stats.nonglobal_ns[scenario])++;
+		__atomic_add_fetch(&tunable->stats.nonglobal_ns[scenario], 1,
+				   __ATOMIC_RELAXED);
 	bpftune_log(LOG_DEBUG," updated stat for tunable %s, scenario %d: %lu\n",
 		    tunable->desc.name, scenario,
 		    global_ns ? tunable->stats.global_ns[scenario] :
@@ -1014,32 +3998,388 @@ static void bpftuner_scenario_log(struct bpftuner *tuner, unsigned int tunable,
 			    t->desc.name,
 			    global_ns ? "" : "non-",
 			    tuner->scenarios[scenario].description);
-		if (t->desc.type == BPFTUNABLE_SYSCTL) {
+		if (t->desc.flags & BPFTUNABLE_CPUMASK) {
+			bpftune_log(BPFTUNE_LOG_LEVEL, "sysctl '%s' changed from (%ld CPUs) -> (%ld CPUs)\n",
+				    t->desc.name, t->initial_values[0],
+				    t->current_values[0]);
+		} else if (t->desc.type == BPFTUNABLE_SYSCTL) {
 			char oldvals[PATH_MAX] = { };
 			char newvals[PATH_MAX] = { };
 			char s[PATH_MAX];
 			__u8 i;
 
-			for (i = 0; i < t->desc.num_values; i++) {
-				snprintf(s, sizeof(s), "%ld ",
-					 t->initial_values[i]);
-				strcat(oldvals, s);
-				snprintf(s, sizeof(s), "%ld ",
-					 t->current_values[i]);
-				strcat(newvals, s);
+			for (i = 0; i < t->desc.num_values; i++) {
+				snprintf(s, sizeof(s), "%ld ",
+					 t->initial_values[i]);
+				strcat(oldvals, s);
+				snprintf(s, sizeof(s), "%ld ",
+					 t->current_values[i]);
+				strcat(newvals, s);
+			}
+			bpftune_log(BPFTUNE_LOG_LEVEL, "sysctl '%s' changed from (%s) -> (%s)\n",
+				    t->desc.name, oldvals, newvals);
+		}
+	} else {
+		bpftune_log(BPFTUNE_LOG_LEVEL, "Scenario '%s' occurred for tunable '%s' in %sglobal ns. %s\n",
+			    tuner->scenarios[scenario].name,
+			    t->desc.name,
+			    global_ns ? "" : "non-",
+			    tuner->scenarios[scenario].description);
+		__bpftune_log(BPFTUNE_LOG_LEVEL, fmt, args);
+		bpftuner_tunable_stats_update(t, scenario, global_ns);
+	}
+}
+
+/* only need a netns fd if the sysctl fds for netns are not cached.
+ * Returns 1 if the netns could not be found, and nothing was written.
+ */
+static int __bpftuner_sysctls_write(struct bpftuner *tuner,
+				    unsigned long netns_cookie,
+				    unsigned int num_sysctls,
+				    struct bpftune_sysctl_value *sysctls)
+{
+	int ret, fd;
+
+	ret = bpftune_sysctls_write(0, netns_cookie, num_sysctls, sysctls);
+	if (ret == -EBADF) {
+		fd = bpftuner_netns_fd_from_cookie(tuner, netns_cookie);
+		if (fd <= 0) {
+			bpftune_log(LOG_DEBUG, "could not get netns fd for cookie %ld\n",
+				    netns_cookie);
+			return 1;
+		}
+		ret = bpftune_sysctls_write(fd, netns_cookie, num_sysctls,
+					    sysctls);
+		close(fd);
+	}
+	return ret;
+}
+
+static void bpftune_values_str(char *buf, size_t bufsz, __u8 num_values,
+			       long *values)
+{
+	size_t len = 0;
+	__u8 i;
+
+	buf[0] = '\0';
+	for (i = 0; i < num_values && len < bufsz; i++)
+		len += snprintf(buf + len, bufsz - len, "%s%ld",
+				i ? " " : "", values[i]);
+}
+
+/* Closed-loop verification of tunable changes.  When enabled via
+ * bpftune_set_verify(), an increase of a BPFTUNABLE_VERIFY tunable opens
+ * a verification window of bpftune_verify_sec seconds during which the
+ * tunable is not changed further in that netns.  At the end of the
+ * window, the rate of the tunable's cost metric (accumulated in BPF via
+ * bpftune_verify_cost_add()) since the change is compared with its rate
+ * before the change.  If the change made things worse, the previous
+ * values are restored and further changes to the tunable in that netns
+ * are backed off; the backoff doubles each time a change is rolled back
+ * and is reset once a change verifies.
+ */
+#define BPFTUNE_VERIFY_MIN_COST		4	/* ignore noise below this */
+#define BPFTUNE_VERIFY_TOLERANCE_PCT	25	/* allowed increase in rate */
+#define BPFTUNE_VERIFY_BACKOFF_MAX	3600	/* seconds */
+
+enum bpftune_verify_state {
+	BPFTUNE_VERIFY_IDLE,
+	BPFTUNE_VERIFY_PENDING,		/* change in progress/being verified */
+	BPFTUNE_VERIFY_BACKOFF,		/* change rolled back */
+};
+
+struct bpftune_verify {
+	struct bpftune_verify *next;
+	struct bpftuner *tuner;
+	unsigned int tunable;
+	unsigned long netns_cookie;	/* cookie of events/cost metric */
+	unsigned long write_cookie;	/* 0 for global netns */
+	enum bpftune_verify_state state;
+	bool armed;			/* change made; verify at window end */
+	__u64 cost;			/* cost at last checkpoint */
+	__u64 time;			/* time of last checkpoint */
+	double before_rate;		/* cost/sec before change */
+	__u64 backoff_ns;
+	__u64 backoff_until;
+	__u8 num_values;
+	long old_values[BPFTUNE_MAX_VALUES];
+	long new_values[BPFTUNE_MAX_VALUES];
+};
+
+static struct bpftune_verify *bpftune_verifies;
+static pthread_mutex_t bpftune_verify_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* must be called prior to tuner init to take effect */
+void bpftune_set_verify(unsigned int window_sec)
+{
+	bpftune_verify_sec = window_sec;
+}
+
+static bool bpftuner_verify_enabled(struct bpftuner *tuner,
+				    struct bpftunable *t)
+{
+	return bpftune_verify_sec && tuner->verify_map_fd > 0 &&
+	       (t->desc.flags & BPFTUNABLE_VERIFY);
+}
+
+/* only speculative increases - e.g. buffer growth to improve throughput -
+ * are verified; decreases, such as those made under memory pressure, are
+ * not held back or undone.
+ */
+static bool bpftune_values_increase(__u8 num_values, long *old_values,
+				    long *new_values)
+{
+	__u8 i;
+
+	for (i = 0; i < num_values; i++) {
+		if (new_values[i] > old_values[i])
+			return true;
+	}
+	return false;
+}
+
+static void bpftuner_verify_cost(struct bpftuner *tuner, unsigned int tunable,
+				 unsigned long netns_cookie,
+				 struct bpftune_verify_metric *m)
+{
+	struct bpftune_verify_key key = {};
+
+	key.netns_cookie = netns_cookie;
+	key.tunable = tunable;
+	if (bpf_map_lookup_elem(tuner->verify_map_fd, &key, m))
+		memset(m, 0, sizeof(*m));
+}
+
+static double bpftune_verify_rate(__u64 cost, __u64 ns)
+{
+	return ns ? (double)cost * SECOND / ns : 0;
+}
+
+static struct bpftune_verify *__bpftuner_verify_get(struct bpftuner *tuner,
+						    unsigned int tunable,
+						    unsigned long netns_cookie)
+{
+	struct bpftune_verify *v;
+
+	for (v = bpftune_verifies; v; v = v->next) {
+		if (v->tuner == tuner && v->tunable == tunable &&
+		    v->netns_cookie == netns_cookie)
+			return v;
+	}
+	return NULL;
+}
+
+/* Called prior to a change; returns -EAGAIN if the tunable should not be
+ * changed because a previous change is being verified or was rolled back.
+ * Otherwise the cost rate before the change is recorded.
+ */
+static int bpftuner_verify_begin(struct bpftuner *tuner, unsigned int tunable,
+				 unsigned long netns_cookie,
+				 unsigned long write_cookie)
+{
+	struct bpftune_verify_metric m;
+	__u64 now = bpftune_ktime_ns();
+	struct bpftune_verify *v;
+	int ret = 0;
+
+	bpftuner_verify_cost(tuner, tunable, netns_cookie, &m);
+	pthread_mutex_lock(&bpftune_verify_lock);
+	v = __bpftuner_verify_get(tuner, tunable, netns_cookie);
+	if (!v) {
+		v = calloc(1, sizeof(*v));
+		if (!v) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		v->tuner = tuner;
+		v->tunable = tunable;
+		v->netns_cookie = netns_cookie;
+		/* no checkpoint yet; use rate since cost was first seen. */
+		v->cost = 0;
+		v->time = m.start ? m.start : now;
+		v->next = bpftune_verifies;
+		bpftune_verifies = v;
+	}
+	if (v->state == BPFTUNE_VERIFY_BACKOFF && now >= v->backoff_until)
+		v->state = BPFTUNE_VERIFY_IDLE;
+	if (v->state != BPFTUNE_VERIFY_IDLE) {
+		ret = -EAGAIN;
+		goto out;
+	}
+	v->write_cookie = write_cookie;
+	v->before_rate = bpftune_verify_rate(m.cost - v->cost,
+					     now > v->time ? now - v->time : 0);
+	v->cost = m.cost;
+	v->time = now;
+	v->state = BPFTUNE_VERIFY_PENDING;
+	v->armed = false;
+out:
+	pthread_mutex_unlock(&bpftune_verify_lock);
+	return ret;
+}
+
+/* Called after a change; if it was made, verify it at window end. */
+static void bpftuner_verify_end(struct bpftuner *tuner, unsigned int tunable,
+				unsigned long netns_cookie, __u8 num_values,
+				long *old_values, long *new_values)
+{
+	struct bpftune_verify *v;
+
+	pthread_mutex_lock(&bpftune_verify_lock);
+	v = __bpftuner_verify_get(tuner, tunable, netns_cookie);
+	if (v && v->state == BPFTUNE_VERIFY_PENDING) {
+		if (old_values && num_values <= BPFTUNE_MAX_VALUES) {
+			v->num_values = num_values;
+			memcpy(v->old_values, old_values,
+			       num_values * sizeof(*old_values));
+			memcpy(v->new_values, new_values,
+			       num_values * sizeof(*new_values));
+			v->time = bpftune_ktime_ns();
+			v->armed = true;
+		} else {
+			v->state = BPFTUNE_VERIFY_IDLE;
+		}
+	}
+	pthread_mutex_unlock(&bpftune_verify_lock);
+}
+
+/* a change made without verification supersedes one being verified. */
+static void bpftuner_verify_cancel(struct bpftuner *tuner, unsigned int tunable,
+				   unsigned long netns_cookie)
+{
+	struct bpftune_verify *v;
+
+	pthread_mutex_lock(&bpftune_verify_lock);
+	v = __bpftuner_verify_get(tuner, tunable, netns_cookie);
+	if (v && v->state == BPFTUNE_VERIFY_PENDING)
+		v->state = BPFTUNE_VERIFY_IDLE;
+	pthread_mutex_unlock(&bpftune_verify_lock);
+}
+
+static void bpftuner_verify_rollback(struct bpftune_verify *v,
+				     double after_rate, __u64 now)
+{
+	struct bpftunable *t = bpftuner_tunable(v->tuner, v->tunable);
+	struct bpftune_sysctl_value sysctl = {};
+	char oldvals[BPFTUNE_MAX_NAME], newvals[BPFTUNE_MAX_NAME];
+	__u64 max = BPFTUNE_VERIFY_BACKOFF_MAX * SECOND;
+	int ret;
+	__u8 i;
+
+	sysctl.name = t->desc.name;
+	sysctl.num_values = v->num_values;
+	memcpy(sysctl.values, v->old_values,
+	       v->num_values * sizeof(*v->old_values));
+	ret = __bpftuner_sysctls_write(v->tuner, v->write_cookie, 1, &sysctl);
+	if (ret) {
+		bpftune_log(LOG_DEBUG, "could not roll back '%s': %s\n",
+			    t->desc.name, ret > 0 ? "no netns" : strerror(-ret));
+		v->state = BPFTUNE_VERIFY_IDLE;
+		return;
+	}
+	for (i = 0; v->write_cookie == 0 && i < v->num_values; i++)
+		t->current_values[i] = v->old_values[i];
+	__atomic_add_fetch(&t->stats.rollbacks, 1, __ATOMIC_RELAXED);
+
+	v->backoff_ns = v->backoff_ns ? v->backoff_ns * 2 :
+					2 * bpftune_verify_sec * SECOND;
+	if (v->backoff_ns > max)
+		v->backoff_ns = max;
+	v->backoff_until = now + v->backoff_ns;
+	v->state = BPFTUNE_VERIFY_BACKOFF;
+
+	bpftune_values_str(newvals, sizeof(newvals), v->num_values,
+			   v->new_values);
+	bpftune_values_str(oldvals, sizeof(oldvals), v->num_values,
+			   v->old_values);
+	bpftune_log(BPFTUNE_LOG_LEVEL,
+		    "Rolled back change of '%s' in %sglobal ns from (%s) -> (%s); cost rose from %.2f to %.2f/sec.  Backing off changes for %llu seconds\n",
+		    t->desc.name, v->write_cookie ? "non-" : "", newvals,
+		    oldvals, v->before_rate, after_rate,
+		    (unsigned long long)(v->backoff_ns / SECOND));
+}
+
+/* verify changes whose window has ended; called from the event loop. */
+static void bpftune_verify_update(__u64 now)
+{
+	__u64 window = bpftune_verify_sec * SECOND;
+	struct bpftune_verify_metric m;
+	struct bpftune_verify *v;
+	double after_rate;
+	__u64 cost;
+
+	pthread_mutex_lock(&bpftune_verify_lock);
+	for (v = bpftune_verifies; v; v = v->next) {
+		if (v->state != BPFTUNE_VERIFY_PENDING || !v->armed ||
+		    now - v->time < window ||
+		    v->tuner->state != BPFTUNE_ACTIVE)
+			continue;
+		bpftuner_verify_cost(v->tuner, v->tunable, v->netns_cookie,
+				     &m);
+		cost = m.cost - v->cost;
+		after_rate = bpftune_verify_rate(cost, now - v->time);
+		if (cost >= BPFTUNE_VERIFY_MIN_COST &&
+		    after_rate * 100 > v->before_rate *
+				       (100 + BPFTUNE_VERIFY_TOLERANCE_PCT)) {
+			bpftuner_verify_rollback(v, after_rate, now);
+		} else {
+			bpftune_log(LOG_DEBUG, "verified change of tunable %d for '%s' (netns cookie %lu); cost %.2f -> %.2f/sec\n",
+				    v->tunable, v->tuner->name,
+				    v->netns_cookie, v->before_rate,
+				    after_rate);
+			v->backoff_ns = 0;
+			v->state = BPFTUNE_VERIFY_IDLE;
+		}
+		v->cost = m.cost;
+		v->time = now;
+	}
+	pthread_mutex_unlock(&bpftune_verify_lock);
+}
+
+/* drop verification state for tuner, optionally only for one netns. */
+static void bpftuner_verify_del(struct bpftuner *tuner, bool all,
+				unsigned long netns_cookie)
+{
+	struct bpftune_verify **vp, *v;
+
+	pthread_mutex_lock(&bpftune_verify_lock);
+	for (vp = &bpftune_verifies; (v = *vp) != NULL; ) {
+		if (v->tuner == tuner &&
+		    (all || v->netns_cookie == netns_cookie)) {
+			struct bpftune_verify_key key = {};
+
+			if (!all) {
+				key.netns_cookie = v->netns_cookie;
+				key.tunable = v->tunable;
+				bpf_map_delete_elem(tuner->verify_map_fd,
+						    &key);
 			}
-			bpftune_log(BPFTUNE_LOG_LEVEL, "sysctl '%s' changed from (%s) -> (%s)\n",
-				    t->desc.name, oldvals, newvals);
+			*vp = v->next;
+			free(v);
+		} else {
+			vp = &v->next;
 		}
-	} else {
-		bpftune_log(BPFTUNE_LOG_LEVEL, "Scenario '%s' occurred for tunable '%s' in %sglobal ns. %s\n",
-			    tuner->scenarios[scenario].name,
-			    t->desc.name,
-			    global_ns ? "" : "non-",
-			    tuner->scenarios[scenario].description);
-		__bpftune_log(BPFTUNE_LOG_LEVEL, fmt, args);
-		bpftuner_tunable_stats_update(t, scenario, global_ns);
 	}
+	pthread_mutex_unlock(&bpftune_verify_lock);
+}
+
+/* read current values of sysctl tunable in netns (0 for global). */
+static int bpftuner_tunable_values_read(struct bpftuner *tuner,
+					struct bpftunable *t,
+					unsigned long netns_cookie,
+					long *values)
+{
+	int ret, fd = 0;
+
+	if (netns_cookie) {
+		fd = bpftuner_netns_fd_from_cookie(tuner, netns_cookie);
+		if (fd <= 0)
+			return -ENOENT;
+	}
+	ret = bpftune_sysctl_read(fd, t->desc.name, values);
+	if (fd > 0)
+		close(fd);
+	return ret;
 }
 
 int bpftuner_tunable_sysctl_write(struct bpftuner *tuner, unsigned int tunable,
@@ -1048,19 +4388,24 @@ int bpftuner_tunable_sysctl_write(struct bpftuner *tuner, unsigned int tunable,
 				  const char *fmt, ...)
 {
 	struct bpftunable *t = bpftuner_tunable(tuner, tunable);
-	struct bpftuner_netns *netns;
-	int ret = 0, fd = 0;
+	unsigned long verify_cookie = netns_cookie;
+	long old_values[BPFTUNE_MAX_VALUES];
+	struct bpftune_sysctl_value sysctl = {};
+	struct bpftuner_netns netns;
+	bool verify = false;
+	int ret = 0;
 
 	if (!t) {
 		bpftune_log(LOG_ERR, "no tunable %d for tuner '%s'\n",
 			    tunable, tuner->name);
 		return -EINVAL;
 	}
-	netns = bpftuner_netns_from_cookie(tuner->id, netns_cookie);
-	if (netns) {
+	if (num_values > BPFTUNE_MAX_VALUES)
+		return -EINVAL;
+	if (!bpftuner_netns_from_cookie(tuner->id, netns_cookie, &netns)) {
 		bpftune_log(LOG_DEBUG, "found netns (cookie %ld); state %d\n",
-			    netns_cookie, netns->state);
-		if (netns->state >= BPFTUNE_MANUAL) {
+			    netns_cookie, netns.state);
+		if (netns.state >= BPFTUNE_MANUAL) {
 			bpftune_log(BPFTUNE_LOG_LEVEL,
 				    "Skipping update of '%s' ; tuner '%s' is disabled in netns (cookie %ld)\n",
 				    t->desc.name, tuner->name, netns_cookie);
@@ -1068,35 +4413,199 @@ int bpftuner_tunable_sysctl_write(struct bpftuner *tuner, unsigned int tunable,
 		}
 	}
 
-	if (t->desc.flags & BPFTUNABLE_NAMESPACED) {
-		fd = bpftuner_netns_fd_from_cookie(tuner, netns_cookie);
-		if (fd < 0) {
-			bpftune_log(LOG_DEBUG, "could not get netns fd for cookie %ld\n",
-				    netns_cookie);
-			return 0;
+	if (!(t->desc.flags & BPFTUNABLE_NAMESPACED) ||
+	    netns_cookie == global_netns_cookie)
+		netns_cookie = 0;
+
+	if (bpftuner_verify_enabled(tuner, t)) {
+		if (bpftuner_tunable_values_read(tuner, t, netns_cookie,
+						 old_values) != num_values ||
+		    !bpftune_values_increase(num_values, old_values, values)) {
+			bpftuner_verify_cancel(tuner, tunable, verify_cookie);
+		} else {
+			ret = bpftuner_verify_begin(tuner, tunable,
+						    verify_cookie,
+						    netns_cookie);
+			if (ret == -EAGAIN) {
+				bpftune_log(LOG_DEBUG, "Skipping update of '%s'; previous change in netns (cookie %ld) is being verified or was rolled back\n",
+					    t->desc.name, verify_cookie);
+				return 0;
+			}
+			verify = ret == 0;
 		}
 	}
 
-	ret = bpftune_sysctl_write(fd, t->desc.name, num_values, values);
+	sysctl.name = t->desc.name;
+	sysctl.num_values = num_values;
+	memcpy(sysctl.values, values, num_values * sizeof(*values));
+
+	ret = __bpftuner_sysctls_write(tuner, netns_cookie, 1, &sysctl);
+	if (verify)
+		bpftuner_verify_end(tuner, tunable, verify_cookie, num_values,
+				    ret ? NULL : old_values, values);
+	if (ret > 0)
+		return 0;
 	if (!ret) {
 		va_list args;
 		__u8 i;
 
+		bpftune_trace_sysctl(tuner, tunable, scenario, netns_cookie,
+				     num_values,
+				     verify ? old_values :
+				     netns_cookie == 0 ? t->current_values : NULL,
+				     values);
 		va_start(args, fmt);
-		bpftuner_scenario_log(tuner, tunable, scenario, fd,
-				      false, fmt, args);
+		bpftuner_scenario_log(tuner, tunable, scenario,
+				      netns_cookie != 0, false, fmt, args);
 		va_end(args);
 
-		for (i = 0; i < t->desc.num_values; i++)
+		/* current values reflect global netns */
+		for (i = 0; netns_cookie == 0 && i < t->desc.num_values; i++)
 			t->current_values[i] = values[i];
 	}
 
-	if (fd > 0)
-		close(fd);
+	return ret;
+}
+
+static void bpftuner_scenario_logf(struct bpftuner *tuner,
+				   unsigned int tunable, unsigned int scenario,
+				   int netns_fd, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	bpftuner_scenario_log(tuner, tunable, scenario, netns_fd, false,
+			      fmt, args);
+	va_end(args);
+}
+
+/* Apply multiple sysctl updates for one netns together, for example the
+ * updates of a multi-update event; all are written under one capability
+ * raise and namespace switch.  Tunables must either all be namespaced or
+ * all global.  Each successful update is logged as "Due to <reason>
+ * change <tunable> from (old) -> (new)".  Returns the first error.
+ */
+int bpftuner_tunable_sysctls_write(struct bpftuner *tuner,
+				   unsigned int scenario,
+				   unsigned long netns_cookie,
+				   unsigned int num_updates,
+				   struct bpftunable_update *updates,
+				   const char *reason)
+{
+	struct bpftune_sysctl_value sysctls[BPFTUNE_MAX_UPDATES] = {};
+	struct bpftunable *t[BPFTUNE_MAX_UPDATES];
+	struct bpftuner_netns netns;
+	bool global = netns_cookie == global_netns_cookie;
+	unsigned long verify_cookie = netns_cookie;
+	unsigned int i, num_global = 0;
+	int ret;
+
+	if (!num_updates || num_updates > BPFTUNE_MAX_UPDATES)
+		return -EINVAL;
+	for (i = 0; i < num_updates; i++) {
+		t[i] = bpftuner_tunable(tuner, updates[i].id);
+		if (!t[i] || t[i]->desc.type != BPFTUNABLE_SYSCTL ||
+		    (t[i]->desc.flags & BPFTUNABLE_CPUMASK)) {
+			bpftune_log(LOG_ERR, "no sysctl tunable %d for tuner '%s'\n",
+				    updates[i].id, tuner->name);
+			return -EINVAL;
+		}
+		if (!(t[i]->desc.flags & BPFTUNABLE_NAMESPACED))
+			num_global++;
+		sysctls[i].name = t[i]->desc.name;
+		sysctls[i].num_values = t[i]->desc.num_values;
+		memcpy(sysctls[i].values, updates[i].new,
+		       sizeof(sysctls[i].values));
+	}
+	if (!bpftuner_netns_from_cookie(tuner->id, netns_cookie, &netns) &&
+	    netns.state >= BPFTUNE_MANUAL) {
+		bpftune_log(BPFTUNE_LOG_LEVEL,
+			    "Skipping update of %u tunables; tuner '%s' is disabled in netns (cookie %ld)\n",
+			    num_updates, tuner->name, netns_cookie);
+		return 0;
+	}
+	if (num_global && num_global < num_updates && !global) {
+		bpftune_log(LOG_ERR, "cannot update global and namespaced tunables together for tuner '%s'\n",
+			    tuner->name);
+		return -EINVAL;
+	}
+	if (global || num_global)
+		netns_cookie = 0;
+
+	ret = __bpftuner_sysctls_write(tuner, netns_cookie, num_updates,
+				       sysctls);
+	if (ret > 0)
+		return 0;
+	/* errors not specific to a sysctl mean nothing was written */
+	if (ret) {
+		bool failed = false;
 
+		for (i = 0; i < num_updates; i++)
+			failed |= sysctls[i].ret != 0;
+		for (i = 0; !failed && i < num_updates; i++)
+			sysctls[i].ret = ret;
+	}
+	for (i = 0; i < num_updates; i++) {
+		char oldvals[BPFTUNE_MAX_NAME], newvals[BPFTUNE_MAX_NAME];
+		__u8 v;
+
+		if (sysctls[i].ret) {
+			bpftune_log(LOG_DEBUG, "could not update '%s': %s\n",
+				    t[i]->desc.name, strerror(-sysctls[i].ret));
+			continue;
+		}
+		bpftune_values_str(oldvals, sizeof(oldvals),
+				   t[i]->desc.num_values, updates[i].old);
+		bpftune_values_str(newvals, sizeof(newvals),
+				   t[i]->desc.num_values, updates[i].new);
+		bpftuner_scenario_logf(tuner, updates[i].id, scenario,
+				       netns_cookie != 0,
+				       "Due to %s change %s from (%s) -> (%s)\n",
+				       reason, t[i]->desc.name, oldvals,
+				       newvals);
+		bpftune_trace_sysctl(tuner, updates[i].id, scenario,
+				     netns_cookie, t[i]->desc.num_values,
+				     updates[i].old, updates[i].new);
+		/* current values reflect global netns */
+		for (v = 0; netns_cookie == 0 && v < t[i]->desc.num_values; v++)
+			t[i]->current_values[v] = updates[i].new[v];
+		if (bpftuner_verify_enabled(tuner, t[i]))
+			bpftuner_verify_cancel(tuner, updates[i].id,
+					       verify_cookie);
+	}
 	return ret;
 }
 
+/* CPU mask tunables are global; the tunable value is the number of CPUs
+ * in the mask.
+ */
+int bpftuner_tunable_cpumask_write(struct bpftuner *tuner, unsigned int tunable,
+				   unsigned int scenario, const __u64 *mask,
+				   unsigned int nwords, const char *fmt, ...)
+{
+	struct bpftunable *t = bpftuner_tunable(tuner, tunable);
+	va_list args;
+	long weight;
+	int ret;
+
+	if (!t || !(t->desc.flags & BPFTUNABLE_CPUMASK)) {
+		bpftune_log(LOG_ERR, "no CPU mask tunable %d for tuner '%s'\n",
+			    tunable, tuner->name);
+		return -EINVAL;
+	}
+	ret = bpftune_sysctl_cpumask_write(t->desc.name, mask, nwords);
+	if (ret)
+		return ret;
+	va_start(args, fmt);
+	bpftuner_scenario_log(tuner, tunable, scenario, 0, false, fmt, args);
+	va_end(args);
+	weight = bpftune_cpumask_weight(mask, nwords);
+	bpftune_trace_sysctl(tuner, tunable, scenario, 0, 1,
+			     t->current_values, &weight);
+	t->current_values[0] = weight;
+	return 0;
+}
+
 int bpftuner_tunable_update(struct bpftuner *tuner, unsigned int tunable,
 			    unsigned int scenario, int netns_fd,
 			    const char *fmt, ...)
@@ -1126,6 +4635,7 @@ void bpftuner_tunables_fini(struct bpftuner *tuner)
 {
 	tuner->num_tunables = 0;
 	free(tuner->tunables);
+	tuner->tunables = NULL;
 }
 
 static int bpftune_netns_fd(int netns_pid)
@@ -1159,8 +4669,11 @@ int bpftune_netns_set(int new_fd, int *orig_fd)
 	if (err)
 		return err;
 
+	/* setns() applies to the calling thread only, so we need the
+	 * thread's netns rather than that of the thread group leader.
+	 */
 	if (orig_fd) {
-		fd = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+		fd = open("/proc/thread-self/ns/net", O_RDONLY | O_CLOEXEC);
 		if (fd < 0) {
 			err = -errno;
 			bpftune_log(LOG_ERR,
@@ -1232,37 +4745,452 @@ int bpftune_netns_info(int pid, int *fd, unsigned long *cookie)
 		}
 		bpftune_netns_set(orig_netns_fd, NULL);
 
-		if (ret == 0) {
-			if (fdnew && fd)
-				*fd = netns_fd;
-			if (cookie)
-				*cookie = netns_cookie;
+		if (ret == 0) {
+			if (fdnew && fd)
+				*fd = netns_fd;
+			if (cookie)
+				*cookie = netns_cookie;
+		}
+	} else {
+		bpftune_log(LOG_DEBUG, "setns failed for for fd %d\n",
+			    netns_fd);
+		ret = -errno;
+	}
+	if (fdnew && !fd)
+		close(netns_fd);
+	if (orig_netns_fd > 0)
+		close(orig_netns_fd);
+	return ret;
+}
+
+/* Per-tuner namespace state lives in a single open-addressing hash table
+ * keyed by netns cookie, recording which tuners track the namespace and
+ * in which of those tuners it has been manually disabled.  Both are
+ * bitmaps indexed by tuner id (BPFTUNE_MAX_TUNERS <= 64), so an entry is
+ * 24 bytes regardless of the number of tuners, and init/lookup/removal
+ * are O(1).  Cookie 0 marks an empty slot; the global netns is not
+ * stored.
+ */
+struct bpftune_netns_state {
+	unsigned long cookie;
+	__u64 tuners;
+	__u64 manual;
+};
+
+#define BPFTUNE_NETNS_STATE_MIN_SIZE	64
+
+static struct bpftune_netns_state *bpftune_netns_states;
+static unsigned int bpftune_netns_states_size;	/* power of 2 */
+static unsigned int bpftune_netns_states_count;
+static pthread_rwlock_t bpftune_netns_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static unsigned int bpftune_netns_state_hash(unsigned long cookie,
+					     unsigned int size)
+{
+	return (((__u64)cookie * 0x9E3779B97F4A7C15ULL) >> 32) & (size - 1);
+}
+
+static struct bpftune_netns_state *__bpftune_netns_state_get(unsigned long cookie)
+{
+	unsigned int i, mask = bpftune_netns_states_size - 1;
+
+	if (!bpftune_netns_states_size)
+		return NULL;
+	for (i = bpftune_netns_state_hash(cookie, bpftune_netns_states_size);
+	     bpftune_netns_states[i].cookie != 0; i = (i + 1) & mask) {
+		if (bpftune_netns_states[i].cookie == cookie)
+			return &bpftune_netns_states[i];
+	}
+	return NULL;
+}
+
+static int __bpftune_netns_states_resize(unsigned int size)
+{
+	struct bpftune_netns_state *old = bpftune_netns_states;
+	unsigned int i, j, old_size = bpftune_netns_states_size;
+
+	bpftune_netns_states = calloc(size, sizeof(*bpftune_netns_states));
+	if (!bpftune_netns_states) {
+		bpftune_netns_states = old;
+		return -ENOMEM;
+	}
+	bpftune_netns_states_size = size;
+	for (i = 0; i < old_size; i++) {
+		if (!old[i].cookie)
+			continue;
+		for (j = bpftune_netns_state_hash(old[i].cookie, size);
+		     bpftune_netns_states[j].cookie != 0; j = (j + 1) & (size - 1)) {}
+		bpftune_netns_states[j] = old[i];
+	}
+	free(old);
+	return 0;
+}
+
+static struct bpftune_netns_state *__bpftune_netns_state_add(unsigned long cookie)
+{
+	struct bpftune_netns_state *state = __bpftune_netns_state_get(cookie);
+	unsigned int i, mask;
+
+	if (state)
+		return state;
+	/* keep load factor <= 1/2 */
+	if ((bpftune_netns_states_count + 1) * 2 > bpftune_netns_states_size &&
+	    __bpftune_netns_states_resize(bpftune_netns_states_size ?
+					  bpftune_netns_states_size * 2 :
+					  BPFTUNE_NETNS_STATE_MIN_SIZE))
+		return NULL;
+	mask = bpftune_netns_states_size - 1;
+	for (i = bpftune_netns_state_hash(cookie, bpftune_netns_states_size);
+	     bpftune_netns_states[i].cookie != 0; i = (i + 1) & mask) {}
+	bpftune_netns_states_count++;
+	state = &bpftune_netns_states[i];
+	state->cookie = cookie;
+	return state;
+}
+
+/* remove by shifting back later entries in the probe sequence, so no
+ * tombstones are needed.
+ */
+static void __bpftune_netns_state_del(struct bpftune_netns_state *state)
+{
+	unsigned int mask = bpftune_netns_states_size - 1;
+	unsigned int i = state - bpftune_netns_states, j = i, home;
+
+	for (;;) {
+		bpftune_netns_states[i].cookie = 0;
+		for (;;) {
+			j = (j + 1) & mask;
+			if (!bpftune_netns_states[j].cookie)
+				goto out;
+			home = bpftune_netns_state_hash(bpftune_netns_states[j].cookie,
+							bpftune_netns_states_size);
+			/* can entry j move to i? only if home is not in (i, j] */
+			if (i <= j ? (home <= i || home > j) :
+				     (home <= i && home > j))
+				break;
+		}
+		bpftune_netns_states[i] = bpftune_netns_states[j];
+		i = j;
+	}
+out:
+	bpftune_netns_states_count--;
+}
+
+static bool bpftune_netns_global(unsigned long cookie)
+{
+	return cookie == 0 || cookie == global_netns_cookie;
+}
+
+/* init netns state for all tuners with id in tuners mask. */
+static void bpftune_netns_state_init(unsigned long cookie, __u64 tuners)
+{
+	struct bpftune_netns_state *state;
+
+	if (bpftune_netns_global(cookie))
+		return;
+	pthread_rwlock_wrlock(&bpftune_netns_lock);
+	state = __bpftune_netns_state_add(cookie);
+	if (!state)
+		bpftune_log(LOG_ERR, "unable to allocate netns state for cookie %ld: %s\n",
+			    cookie, strerror(ENOMEM));
+	else
+		state->tuners |= tuners;
+	pthread_rwlock_unlock(&bpftune_netns_lock);
+}
+
+/* init netns state for all registered tuners. */
+static void bpftune_netns_init_tuners(unsigned long cookie)
+{
+	unsigned int num_tuners = bpftune_tuner_num();
+
+	bpftune_netns_state_init(cookie, num_tuners >= 64 ? ~0ULL :
+					 (1ULL << num_tuners) - 1);
+}
+
+void bpftuner_netns_init(struct bpftuner *tuner, unsigned long cookie)
+{
+	bpftune_log(LOG_DEBUG, "Added netns (cookie %ld) for tuner '%s'\n",
+		    cookie, tuner->name);
+	bpftune_netns_state_init(cookie, 1ULL << tuner->id);
+}
+
+/* record namespaces in which tuner is manually disabled */
+static void bpftuner_netns_manual_save(struct bpftuner *tuner, FILE *fp)
+{
+	__u64 bit = 1ULL << tuner->id;
+	unsigned int i;
+
+	pthread_rwlock_rdlock(&bpftune_netns_lock);
+	for (i = 0; i < bpftune_netns_states_size; i++) {
+		if (bpftune_netns_states[i].cookie &&
+		    (bpftune_netns_states[i].manual & bit))
+			fprintf(fp, "manual %lu\n",
+				bpftune_netns_states[i].cookie);
+	}
+	pthread_rwlock_unlock(&bpftune_netns_lock);
+}
+
+/* netns cookies are not re-used, so a saved cookie either refers to the
+ * same namespace or to one that is gone.
+ */
+static void bpftuner_netns_manual_restore(struct bpftuner *tuner,
+					  unsigned long cookie)
+{
+	struct bpftune_netns_state *state;
+	__u64 bit = 1ULL << tuner->id;
+
+	if (bpftune_netns_global(cookie))
+		return;
+	pthread_rwlock_wrlock(&bpftune_netns_lock);
+	state = __bpftune_netns_state_add(cookie);
+	if (state) {
+		state->tuners |= bit;
+		state->manual |= bit;
+	}
+	pthread_rwlock_unlock(&bpftune_netns_lock);
+}
+
+void bpftuner_netns_fini(struct bpftuner *tuner, unsigned long cookie, enum bpftune_state state)
+{
+	struct bpftune_netns_state *netns;
+	__u64 bit = 1ULL << tuner->id;
+
+	if (bpftune_netns_global(cookie)) {
+		bpftuner_fini(tuner, state);
+		return;
+	}
+	if (!netns_cookie_supported) {
+		bpftune_log(LOG_DEBUG, "no netns support and not global netns; ignoring...\n");
+		return;
+	}
+
+	if (state == BPFTUNE_GONE) {
+		bpftune_sysctl_cache_flush(cookie);
+		bpftuner_verify_del(tuner, false, cookie);
+	}
+
+	pthread_rwlock_wrlock(&bpftune_netns_lock);
+	netns = __bpftune_netns_state_get(cookie);
+	if (!netns || !(netns->tuners & bit)) {
+		bpftune_log(LOG_DEBUG, "netns_fini: could not find netns for cookie %ld\n",
+			    cookie);
+		goto out;
+	}
+	if (state == BPFTUNE_MANUAL) {
+		bpftune_log(LOG_DEBUG, "setting state of netns (cookie %ld) to manual for '%s'\n",
+			    cookie, tuner->name);
+		netns->manual |= bit;
+		goto out;
+	}
+	netns->tuners &= ~bit;
+	netns->manual &= ~bit;
+	if (!netns->tuners)
+		__bpftune_netns_state_del(netns);
+out:
+	pthread_rwlock_unlock(&bpftune_netns_lock);
+}
+
+/* fill in netns state for tuner; returns -ENOENT if netns is not known. */
+int bpftuner_netns_from_cookie(unsigned long tuner_id, unsigned long cookie,
+			       struct bpftuner_netns *netns)
+{
+	struct bpftune_netns_state *state;
+	__u64 bit = 1ULL << tuner_id;
+	int ret = -ENOENT;
+
+	if (!netns_cookie_supported || tuner_id >= BPFTUNE_MAX_TUNERS)
+		return -ENOENT;
+
+	netns->netns_cookie = cookie;
+	if (bpftune_netns_global(cookie)) {
+		netns->state = BPFTUNE_ACTIVE;
+		return 0;
+	}
+	pthread_rwlock_rdlock(&bpftune_netns_lock);
+	state = __bpftune_netns_state_get(cookie);
+	if (state && (state->tuners & bit)) {
+		netns->state = (state->manual & bit) ? BPFTUNE_MANUAL :
+						       BPFTUNE_ACTIVE;
+		ret = 0;
+	}
+	pthread_rwlock_unlock(&bpftune_netns_lock);
+	if (ret)
+		bpftune_log(LOG_DEBUG, "no tuner netns found for tuner %d, cookie %ld\n",
+			    tuner_id, cookie);
+	return ret;
+}
+
+/* Index of known network namespaces, keyed by netns cookie.  Entries
+ * record a pid in the namespace or, for namespaces only reachable via
+ * an nsfs mount, the mount path.  No netns fds are held, since a held fd
+ * pins the namespace and would prevent it from being destroyed (and
+ * hence netns destroy events from firing); instead a new fd is opened
+ * via /proc/<pid>/ns/net or the mount path on lookup, and verified to
+ * still refer to the namespace.  A full scan of nsfs mounts and /proc is
+ * only needed when that fails.  The index is maintained from the initial
+ * scan and from netns creation/destruction events.
+ */
+#define BPFTUNE_NETNS_INDEX_SIZE	1024	/* must be power of 2 */
+
+struct bpftune_netns_entry {
+	struct bpftune_netns_entry *next;
+	unsigned long cookie;
+	int pid;
+	char *path;
+};
+
+static struct bpftune_netns_entry *bpftune_netns_index[BPFTUNE_NETNS_INDEX_SIZE];
+static pthread_mutex_t bpftune_netns_index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct bpftune_netns_entry **bpftune_netns_index_slot(unsigned long cookie)
+{
+	__u64 hash = (__u64)cookie * 0x9E3779B97F4A7C15ULL;
+
+	return &bpftune_netns_index[(hash >> 32) & (BPFTUNE_NETNS_INDEX_SIZE - 1)];
+}
+
+static struct bpftune_netns_entry *__bpftune_netns_index_get(unsigned long cookie)
+{
+	struct bpftune_netns_entry *e;
+
+	for (e = *bpftune_netns_index_slot(cookie); e != NULL; e = e->next) {
+		if (e->cookie == cookie)
+			return e;
+	}
+	return NULL;
+}
+
+/* add/update netns cookie with pid and/or nsfs mount path in index. */
+int bpftune_netns_index_add(unsigned long cookie, int pid, const char *path)
+{
+	struct bpftune_netns_entry *e;
+	int err = 0;
+
+	if (!cookie || cookie == global_netns_cookie)
+		return 0;
+
+	pthread_mutex_lock(&bpftune_netns_index_lock);
+	e = __bpftune_netns_index_get(cookie);
+	if (!e) {
+		struct bpftune_netns_entry **slot = bpftune_netns_index_slot(cookie);
+
+		e = calloc(1, sizeof(*e));
+		if (!e) {
+			err = -ENOMEM;
+			goto out;
+		}
+		e->cookie = cookie;
+		e->next = *slot;
+		*slot = e;
+	}
+	if (pid > 0)
+		e->pid = pid;
+	if (path && (!e->path || strcmp(e->path, path) != 0)) {
+		char *newpath = strdup(path);
+
+		if (!newpath) {
+			err = -ENOMEM;
+			goto out;
+		}
+		free(e->path);
+		e->path = newpath;
+	}
+out:
+	pthread_mutex_unlock(&bpftune_netns_index_lock);
+	return err;
+}
+
+void bpftune_netns_index_remove(unsigned long cookie)
+{
+	struct bpftune_netns_entry **ep, *e;
+
+	pthread_mutex_lock(&bpftune_netns_index_lock);
+	for (ep = bpftune_netns_index_slot(cookie); *ep != NULL; ep = &(*ep)->next) {
+		e = *ep;
+		if (e->cookie != cookie)
+			continue;
+		*ep = e->next;
+		free(e->path);
+		free(e);
+		break;
+	}
+	pthread_mutex_unlock(&bpftune_netns_index_lock);
+}
+
+void bpftune_netns_fini_all(void)
+{
+	struct bpftune_netns_entry *e, *next;
+	unsigned int i;
+
+	pthread_mutex_lock(&bpftune_netns_index_lock);
+	for (i = 0; i < BPFTUNE_NETNS_INDEX_SIZE; i++) {
+		for (e = bpftune_netns_index[i]; e != NULL; e = next) {
+			next = e->next;
+			free(e->path);
+			free(e);
+		}
+		bpftune_netns_index[i] = NULL;
+	}
+	pthread_mutex_unlock(&bpftune_netns_index_lock);
+}
+
+/* return a new fd for netns cookie from index, or -ENOENT. */
+static int bpftune_netns_index_lookup(unsigned long cookie)
+{
+	unsigned long netns_cookie = 0;
+	struct bpftune_netns_entry *e;
+	char path[PATH_MAX] = {};
+	int fd = 0, pid = 0;
+
+	pthread_mutex_lock(&bpftune_netns_index_lock);
+	e = __bpftune_netns_index_get(cookie);
+	if (e) {
+		pid = e->pid;
+		if (e->path)
+			strncpy(path, e->path, sizeof(path) - 1);
+	}
+	pthread_mutex_unlock(&bpftune_netns_index_lock);
+
+	/* the pid may have exited or moved namespace since it was recorded,
+	 * so verify the fd opened refers to the namespace.
+	 */
+	if (pid > 0 && bpftune_netns_info(pid, &fd, &netns_cookie) == 0) {
+		if (netns_cookie == cookie)
+			return fd;
+		close(fd);
+	}
+	if (path[0]) {
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd >= 0) {
+			if (bpftune_netns_info(0, &fd, &netns_cookie) == 0 &&
+			    netns_cookie == cookie)
+				return fd;
+			close(fd);
 		}
-	} else {
-		bpftune_log(LOG_DEBUG, "setns failed for for fd %d\n",
-			    netns_fd);
-		ret = -errno;
 	}
-	if (fdnew && !fd)
-		close(netns_fd);
-	if (orig_netns_fd > 0)
-		close(orig_netns_fd);
-	return ret;
+	return -ENOENT;
 }
 
 static int bpftune_netns_find(unsigned long cookie)
 {
 	unsigned long netns_cookie;
-	struct bpftuner *t;
 	struct mntent *ent;
         FILE *mounts;
 	struct dirent *dirent;
 	int ret = -ENOENT;
 	DIR *dir;
 
-	if (!netns_cookie_supported || cookie == 0 || (global_netns_cookie && cookie == global_netns_cookie))
+	if (!netns_cookie_supported || (global_netns_cookie && cookie == global_netns_cookie))
 		return 0;
 
+	if (cookie) {
+		ret = bpftune_netns_index_lookup(cookie);
+		if (ret >= 0)
+			return ret;
+		bpftune_log(LOG_DEBUG, "netns cookie %ld not in index, scanning\n",
+			    cookie);
+	}
+
 	ret = bpftune_cap_add();
 	if (ret)
 		return ret;
@@ -1290,13 +5218,18 @@ static int bpftune_netns_find(unsigned long cookie)
 		}
 		bpftune_log(LOG_DEBUG, "found netns fd %d for cookie %ld via mnt %s\n",
 			    mntfd, netns_cookie, ent->mnt_dir);
+		/* nsfs mounts have no pid to reopen via, so record the path. */
+		bpftune_netns_index_add(netns_cookie, 0, ent->mnt_dir);
 		if (cookie == 0) {
 			close(mntfd);
-			bpftune_for_each_tuner(t)
-				bpftuner_netns_init(t, netns_cookie);
+			bpftune_netns_init_tuners(netns_cookie);
 			ret = 0;
 			continue;
 		}
+		if (netns_cookie != cookie) {
+			close(mntfd);
+			continue;
+		}
 		ret = mntfd;
 		endmntent(mounts);
 		goto out;
@@ -1321,10 +5254,10 @@ static int bpftune_netns_find(unsigned long cookie)
 		if (bpftune_netns_info(pid, &netns_fd, &netns_cookie))
 			continue;
 
+		bpftune_netns_index_add(netns_cookie, pid, NULL);
 		if (cookie == 0) {
 			close(netns_fd);
-			bpftune_for_each_tuner(t)
-				bpftuner_netns_init(t, netns_cookie);
+			bpftune_netns_init_tuners(netns_cookie);
 			continue;
 		}
 		if (netns_cookie == cookie) {
@@ -1345,14 +5278,16 @@ out:
 
 int bpftuner_netns_fd_from_cookie(struct bpftuner *tuner, unsigned long cookie)
 {
-	struct bpftuner_netns *netns = bpftuner_netns_from_cookie(tuner->id,
-								  cookie);
+	struct bpftuner_netns netns;
 
-	if (netns && netns->state >= BPFTUNE_MANUAL) {
+	if (!bpftuner_netns_from_cookie(tuner->id, cookie, &netns) &&
+	    netns.state >= BPFTUNE_MANUAL) {
 		bpftune_log(LOG_DEBUG, "netns (cookie %ld} manually disabled\n",
 			    cookie);
 		return -ENOENT;
 	}
+	if (!cookie)
+		return 0;
 	return bpftune_netns_find(cookie);
 }
 
@@ -1372,86 +5307,6 @@ int bpftune_netns_init_all(void)
 	return bpftune_netns_find(0);
 }
 
-void bpftuner_netns_init(struct bpftuner *tuner, unsigned long cookie)
-{
-	struct bpftuner_netns *netns, *new = NULL;
-
-	if (bpftuner_netns_from_cookie(tuner->id, cookie))
-		return;
-
-	for (netns = &tuner->netns; netns->next != NULL; netns = netns->next) {}
-
-	new = calloc(1, sizeof(struct bpftuner_netns));
-	if (!new) {
-		bpftune_log(LOG_ERR, "unable to allocate netns for bpftuner: %s\n",
-			    strerror(errno));
-	} else {
-		bpftune_log(LOG_DEBUG, "Added netns (cookie %ld) for tuner '%s'\n",
-				       cookie, tuner->name);
-
-		new->netns_cookie = cookie;
-		netns->next = new;
-	}
-}
-
-void bpftuner_netns_fini(struct bpftuner *tuner, unsigned long cookie, enum bpftune_state state)
-{
-	struct bpftuner_netns *netns, *prev = NULL;
-
-	if (cookie == 0 || cookie == global_netns_cookie) {
-		bpftuner_fini(tuner, state);
-		return;
-	}
-	if (!netns_cookie_supported) {
-		bpftune_log(LOG_DEBUG, "no netns support and not global netns; ignoring...\n");
-		return;
-	}
-
-	for (netns = &tuner->netns; netns != NULL; netns = netns->next) {
-		if (netns->netns_cookie == cookie) {
-			if (state == BPFTUNE_MANUAL) {
-				bpftune_log(LOG_DEBUG, "setting state of netns (cookie %ld) to manual for '%s'\n",
-					    cookie, tuner->name);
-				netns->state = BPFTUNE_MANUAL;
-				return;
-			}
-			if (prev)
-				prev->next = netns->next;
-			else
-				tuner->netns.next = netns->next;
-			free(netns);
-			return;
-		}
-		prev = netns;
-	}
-	bpftune_log(LOG_DEBUG, "netns_fini: could not find netns for cookie %ld\n",
-		    cookie);
-}
-
-struct bpftuner_netns *bpftuner_netns_from_cookie(unsigned long tuner_id,
-						  unsigned long cookie)
-{
-	struct bpftuner *tuner;
-	struct bpftuner_netns *netns;
-	
-	if (!netns_cookie_supported)
-		return NULL;
-
-	bpftune_for_each_tuner(tuner) {
-		if (tuner->id != tuner_id)
-			continue;
-		if (cookie == 0)
-			return &tuner->netns;
-		bpftuner_for_each_netns(tuner, netns) {
-			if (cookie == netns->netns_cookie)
-				return netns;
-		}
-	}
-	bpftune_log(LOG_DEBUG, "no tuner netns found for tuner %d, cookie %ld\n",
-		    tuner_id, cookie);
-	return NULL;
-}
-
 static int bpftune_module_path(const char *name, char *modpath, size_t pathsz)
 {
 	struct utsname utsname;
@@ -1515,81 +5370,165 @@ int bpftune_module_unload(const char *name)
 	return ret;
 }
 
-static void bpftuner_strategy_update(struct bpftuner *tuner)
+static bool bpftune_prog_in_list(const char **progs, const char *prog)
 {
-	struct bpftuner_strategy *strategy, *max_strategy = NULL;
-	int curr, max = 0;
+	int i;
 
-	if (!tuner->strategies)
-		return;
+	for (i = 0; progs[i] != NULL; i++) {
+		if (strcmp(prog, progs[i]) == 0)
+			return true;
+	}
+	return false;
+}
 
-	bpftune_log(LOG_DEBUG, "%s: updating strategy...\n", tuner->name);
+/* cgroup programs are attached by the tuner, not via skeleton links */
+static bool bpftune_prog_cgroup(struct bpf_program *prog)
+{
+	switch (bpf_program__type(prog)) {
+	case BPF_PROG_TYPE_CGROUP_SKB:
+	case BPF_PROG_TYPE_CGROUP_SOCK:
+	case BPF_PROG_TYPE_SOCK_OPS:
+	case BPF_PROG_TYPE_CGROUP_DEVICE:
+	case BPF_PROG_TYPE_CGROUP_SOCK_ADDR:
+	case BPF_PROG_TYPE_CGROUP_SYSCTL:
+	case BPF_PROG_TYPE_CGROUP_SOCKOPT:
+		return true;
+	default:
+		return false;
+	}
+}
 
-	bpftuner_for_each_strategy(tuner, strategy) {
-		curr = strategy->evaluate(tuner, strategy);
-		if (curr < max)
+/* attach loaded programs in the current strategy, and detach others;
+ * on-demand programs which are idle are left detached.
+ */
+static void bpftuner_strategy_attach(struct bpftuner *tuner)
+{
+	struct bpftuner_ondemand *o = NULL;
+	struct bpf_object_skeleton *s = tuner->skeleton;
+	int i;
+
+	if (!s || bpftune_no_attach)
+		return;
+	if (tuner->id < BPFTUNE_MAX_TUNERS && bpftuner_ondemand[tuner->id].progs)
+		o = &bpftuner_ondemand[tuner->id];
+	for (i = 0; i < s->prog_cnt; i++) {
+		struct bpf_prog_skeleton *ps = (struct bpf_prog_skeleton *)
+			((char *)s->progs + i * s->prog_skel_sz);
+		struct bpf_program *prog = *ps->prog;
+
+		if (!prog || bpf_program__fd(prog) < 0 ||
+		    bpftune_prog_cgroup(prog))
 			continue;
-		max = curr;
-		max_strategy = strategy;
+		if (!bpftuner_bpf_prog_in_strategy(tuner, ps->name))
+			bpftuner_bpf_prog_detach(tuner, ps->name);
+		else if (!o || o->attached ||
+			 !bpftune_prog_in_list(o->progs, ps->name))
+			bpftuner_bpf_prog_attach(tuner, ps->name);
 	}
-	if (max_strategy && max_strategy != tuner->strategy)
-		bpftuner_strategy_set(tuner, max_strategy);
 }
 
-static void bpftuner_strategy_timeout(sigval_t sigval)
+static void bpftuner_strategy_schedule(struct bpftuner *tuner)
 {
-	struct bpftuner *tuner = sigval.sival_ptr;
+	__u64 now = bpftune_ktime_ns();
 
-	if (tuner)
-		bpftuner_strategy_update(tuner);
+	tuner->strategy_start = now;
+	tuner->strategy_next = tuner->strategy && tuner->strategy->timeout ?
+			       now + tuner->strategy->timeout * SECOND : 0;
 }
 
-int bpftuner_strategy_set(struct bpftuner *tuner,
-			  struct bpftuner_strategy *strategy)
+/* Strategies are re-evaluated from the event loop every timeout seconds.
+ * Strategies providing reward() are scored as a multi-armed bandit: the
+ * reward for the period just ended is folded into the active strategy's
+ * mean, each strategy is tried once, and the strategy with the best mean
+ * is then chosen, except that with probability "<tuner>.strategy_epsilon"
+ * percent (default 10) a random strategy is explored instead.  Strategies
+ * without reward() are scored by evaluate().
+ */
+#define BPFTUNE_STRATEGY_EPSILON_PCT	10
+
+static void bpftuner_strategy_update(struct bpftuner *tuner)
 {
-	bpftune_log(LOG_DEBUG, "setting stragegy for tuner '%s' to '%s': %s\n",
-		    tuner->name, strategy->name, strategy->description);
-	int err = 0;
+	struct bpftuner_strategy *strategy, *best = NULL, *untried = NULL;
+	struct bpftuner_strategy *curr = tuner->strategy;
+	unsigned int num_strategies = 0;
+	bool rewards = false;
+	double score, max = 0;
 
-	if (!strategy)
-		return 0;
+	if (!tuner->strategies)
+		return;
 
-	if (tuner->strategy) {
-		/* clean up for current strategy */
-		bpftune_log(LOG_DEBUG, "%s: cleaning up current strategy '%s'\n",
-			    tuner->name, strategy->name);
-		tuner->fini(tuner);
-	}
-	/* arm timer for timeout */
-	if (strategy->timeout) {
-		struct sigevent sev = {};
-		struct itimerspec its = {};
-		timer_t tid;
+	bpftune_log(LOG_DEBUG, "%s: updating strategy...\n", tuner->name);
 
-		sev.sigev_notify = SIGEV_THREAD;
-		sev.sigev_notify_function = &bpftuner_strategy_timeout;
-		sev.sigev_value.sival_ptr = tuner;
+	if (curr && curr->reward) {
+		double reward = curr->reward(tuner, curr);
 
-		if (timer_create(CLOCK_REALTIME, &sev, &tid)
-		    == -1) {
-			err = -errno;
-			bpftune_log(LOG_DEBUG, "%s: could not arm timer for strategy '%s'\n",
-				    strerror(-err));
-			return 0;
-		}
-		its.it_value.tv_sec = strategy->timeout;
-		if (timer_settime(tid, 0, &its, NULL)) {
-			err = -errno;
-			bpftune_log(LOG_DEBUG, "%s: could not arm timer for strategy '%s: %s'\n",
-				    tuner->name, strategy->name, strerror(-err));
-			return 0;
+		curr->pulls++;
+		curr->mean_reward += (reward - curr->mean_reward) / curr->pulls;
+		bpftune_log(LOG_DEBUG, "%s: strategy '%s' reward %.3f, mean %.3f over %lu periods\n",
+			    tuner->name, curr->name, reward, curr->mean_reward,
+			    curr->pulls);
+	}
+	bpftuner_for_each_strategy(tuner, strategy) {
+		num_strategies++;
+		if (strategy->reward) {
+			rewards = true;
+			if (!strategy->pulls && !untried)
+				untried = strategy;
+			score = strategy->mean_reward;
+		} else {
+			score = strategy->evaluate(tuner, strategy);
 		}
+		if (best && score < max)
+			continue;
+		max = score;
+		best = strategy;
 	}
-	if (!err) {
-		tuner->strategy = strategy;
-		err = tuner->init(tuner);
+	if (untried) {
+		best = untried;
+	} else if (rewards && num_strategies > 1) {
+		char name[BPFTUNE_MAX_NAME];
+		long epsilon;
+
+		snprintf(name, sizeof(name), "%s.strategy_epsilon",
+			 tuner->name);
+		epsilon = bpftune_option_long(name,
+					      BPFTUNE_STRATEGY_EPSILON_PCT);
+		if (rand() % 100 < epsilon) {
+			best = tuner->strategies[rand() % num_strategies];
+			bpftune_log(LOG_DEBUG, "%s: exploring strategy '%s'\n",
+				    tuner->name, best->name);
+		}
 	}
-	return err;
+	if (best && best != curr)
+		bpftuner_strategy_set(tuner, best);
+	else
+		bpftuner_strategy_schedule(tuner);
+}
+
+/* switching strategy attaches/detaches programs; since all programs used
+ * by any strategy are loaded, the tuner is not reloaded.  When called
+ * prior to the tuner loading its skeleton, the strategy determines which
+ * programs are attached.
+ */
+int bpftuner_strategy_set(struct bpftuner *tuner,
+			  struct bpftuner_strategy *strategy)
+{
+	if (!strategy)
+		return 0;
+
+	bpftune_log(LOG_DEBUG, "setting strategy for tuner '%s' to '%s': %s\n",
+		    tuner->name, strategy->name, strategy->description);
+	if (tuner->strategy && tuner->strategy != strategy)
+		bpftune_log(BPFTUNE_LOG_LEVEL, "%s: switching from strategy '%s' to '%s'\n",
+			    tuner->name, tuner->strategy->name,
+			    strategy->name);
+	tuner->strategy = strategy;
+	bpftuner_strategy_schedule(tuner);
+	if (bpftune_cap_add())
+		return 0;
+	bpftuner_strategy_attach(tuner);
+	bpftune_cap_drop();
+	return 0;
 }
 
 int bpftuner_strategies_add(struct bpftuner *tuner, struct bpftuner_strategy **strategies,
@@ -1606,43 +5545,320 @@ int bpftuner_strategies_add(struct bpftuner *tuner, struct bpftuner_strategy **s
 
 bool bpftuner_bpf_prog_in_strategy(struct bpftuner *tuner, const char *prog)
 {
-	const char **progs;
-	int i;
-
 	if (!tuner->strategy || !tuner->strategy->bpf_progs)
 		return true;
-	progs = tuner->strategy->bpf_progs;
-
-	for (i = 0; progs[i] != NULL; i++) {
-		if (strcmp(prog, progs[i]) == 0)
-			return true;
-	}
-	return false;
+	return bpftune_prog_in_list(tuner->strategy->bpf_progs, prog);
 }
 
+/* load only programs used by some strategy; all of these are loaded so
+ * that switching strategy does not require a reload.
+ */
 void bpftuner_bpf_set_autoload(struct bpftuner *tuner)
 {
-	const char **progs;
-	int err, i;
+	struct bpftuner_strategy *strategy;
+	struct bpf_program *prog;
+	int err;
 
-	if (!tuner->strategy || !tuner->strategy->bpf_progs)
+	if (!tuner->strategies)
 		return;
-
-	progs = tuner->strategy->bpf_progs;
-	for (i = 0; progs[i]; i++) {
-		struct bpf_program *prog = bpf_object__find_program_by_name(tuner->obj, progs[i]);
-		const char *name;
-	
-		if (!prog)
-			continue;
-		name = bpf_program__name(prog);
-		if (bpftuner_bpf_prog_in_strategy(tuner, name))
+	bpftuner_for_each_strategy(tuner, strategy) {
+		if (!strategy->bpf_progs)
+			return;
+	}
+	bpf_object__for_each_program(prog, tuner->obj) {
+		const char *name = bpf_program__name(prog);
+		bool used = false;
+		unsigned int i;
+
+		for (i = 0; tuner->strategies[i] && !used; i++)
+			used = bpftune_prog_in_list(tuner->strategies[i]->bpf_progs,
+						    name);
+		if (used)
 			continue;
 		err = bpf_program__set_autoload(prog, false);
 		if (err) {
-			bpftune_log(LOG_ERR, "%s: could not disable autoload for prog '%s' for strategy '%s': %s\n",
-				    tuner->name, name,
-				    tuner->strategy->name, strerror(err));
+			bpftune_log(LOG_ERR, "%s: could not disable autoload for prog '%s': %s\n",
+				    tuner->name, name, strerror(-err));
+		}
+	}
+}
+
+/* Metrics are served in OpenMetrics text format to clients connecting
+ * to a unix socket, e.g. "socat - UNIX-CONNECT:/var/run/bpftune/metrics".
+ */
+static int bpftune_metrics_fd = -1;
+static pthread_t bpftune_metrics_tid;
+static bool bpftune_metrics_done;
+static char bpftune_metrics_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+/* write run time (or if runs, run count) samples for tuner BPF programs */
+static void bpftune_metrics_prog_write(FILE *f, bool runs)
+{
+	struct bpftuner *tuner;
+
+	bpftune_for_each_tuner(tuner) {
+		struct bpf_program *prog;
+
+		if (tuner->state != BPFTUNE_ACTIVE || !tuner->obj)
+			continue;
+		bpf_object__for_each_program(prog, tuner->obj) {
+			struct bpf_prog_info info = {};
+			__u32 len = sizeof(info);
+			int fd = bpf_program__fd(prog);
+
+			if (fd < 0 || bpf_obj_get_info_by_fd(fd, &info, &len))
+				continue;
+			if (runs)
+				fprintf(f, "bpftune_prog_runs_total{tuner=\"%s\",prog=\"%s\"} %llu\n",
+					tuner->name, bpf_program__name(prog),
+					(unsigned long long)info.run_cnt);
+			else
+				fprintf(f, "bpftune_prog_run_seconds_total{tuner=\"%s\",prog=\"%s\"} %.9f\n",
+					tuner->name, bpf_program__name(prog),
+					(double)info.run_time_ns / 1e9);
+		}
+	}
+}
+
+/* write initial (or if current, current) sysctl tunable value samples */
+static void bpftune_metrics_tunable_write(FILE *f, bool current)
+{
+	struct bpftunable *t;
+	struct bpftuner *tuner;
+	unsigned int i;
+
+	bpftune_for_each_tuner(tuner) {
+		if (tuner->state != BPFTUNE_ACTIVE)
+			continue;
+		bpftuner_for_each_tunable(tuner, t) {
+			if (t->desc.type != BPFTUNABLE_SYSCTL)
+				continue;
+			for (i = 0; i < t->desc.num_values; i++)
+				fprintf(f, "bpftune_tunable_%s{tuner=\"%s\",tunable=\"%s\",index=\"%u\"} %ld\n",
+					current ? "current" : "initial",
+					tuner->name, t->desc.name, i,
+					current ? t->current_values[i] :
+						  t->initial_values[i]);
+		}
+	}
+}
+
+/* tuner state is read with bpftune_tuner_fini_lock held, so tuners
+ * cannot be torn down while their tunables and BPF objects are walked.
+ */
+static void bpftune_metrics_write(FILE *f)
+{
+	struct bpftunable *t;
+	struct bpftuner *tuner;
+	unsigned int i, j;
+
+	pthread_rwlock_rdlock(&bpftune_tuner_fini_lock);
+
+	fprintf(f, "# TYPE bpftune_events counter\n"
+		"# HELP bpftune_events Events handled by tuner.\n");
+	bpftune_for_each_tuner(tuner) {
+		fprintf(f, "bpftune_events_total{tuner=\"%s\"} %llu\n",
+			tuner->name, (unsigned long long)
+			__atomic_load_n(&bpftune_tuner_metrics[tuner->id].events,
+					__ATOMIC_RELAXED));
+	}
+
+	fprintf(f, "# TYPE bpftune_ringbuf_drops counter\n"
+		"# HELP bpftune_ringbuf_drops Events dropped because the ring buffer was full.\n");
+	bpftune_for_each_tuner(tuner) {
+		__s64 drops = 0;
+
+		if (tuner->state != BPFTUNE_ACTIVE || tuner->counters_map_fd <= 0 ||
+		    bpftune_percpu_counter_sum(tuner->counters_map_fd,
+					       BPFTUNE_COUNTER_RINGBUF_DROPS,
+					       &drops))
+			continue;
+		fprintf(f, "bpftune_ringbuf_drops_total{tuner=\"%s\"} %lld\n",
+			tuner->name, (long long)drops);
+	}
+
+	fprintf(f, "# TYPE bpftune_event_handler_seconds histogram\n"
+		"# HELP bpftune_event_handler_seconds Time spent in tuner event handlers.\n");
+	bpftune_for_each_tuner(tuner) {
+		struct bpftune_tuner_metrics *m = &bpftune_tuner_metrics[tuner->id];
+		unsigned long long count = 0;
+
+		for (i = 0; i < BPFTUNE_LATENCY_BUCKETS; i++) {
+			count += __atomic_load_n(&m->latency[i], __ATOMIC_RELAXED);
+			if (i == BPFTUNE_LATENCY_BUCKETS - 1)
+				fprintf(f, "bpftune_event_handler_seconds_bucket{tuner=\"%s\",le=\"+Inf\"} %llu\n",
+					tuner->name, count);
+			else
+				fprintf(f, "bpftune_event_handler_seconds_bucket{tuner=\"%s\",le=\"%g\"} %llu\n",
+					tuner->name, (double)(1ULL << i) / 1e6,
+					count);
+		}
+		fprintf(f, "bpftune_event_handler_seconds_sum{tuner=\"%s\"} %.9f\n",
+			tuner->name,
+			(double)__atomic_load_n(&m->handler_ns, __ATOMIC_RELAXED) / 1e9);
+		fprintf(f, "bpftune_event_handler_seconds_count{tuner=\"%s\"} %llu\n",
+			tuner->name, count);
+	}
+
+	fprintf(f, "# TYPE bpftune_tuner_load_seconds gauge\n"
+		"# HELP bpftune_tuner_load_seconds Time taken to initialize tuner.\n");
+	bpftune_for_each_tuner(tuner) {
+		if (tuner->state != BPFTUNE_ACTIVE)
+			continue;
+		fprintf(f, "bpftune_tuner_load_seconds{tuner=\"%s\"} %.6f\n",
+			tuner->name, (double)tuner->load_time_ns / SECOND);
+	}
+
+	if (bpftune_stats_fd >= 0) {
+		fprintf(f, "# TYPE bpftune_prog_cpu_percent gauge\n"
+			"# HELP bpftune_prog_cpu_percent Share of total cpu time used by tuner BPF programs.\n");
+		bpftune_for_each_tuner(tuner) {
+			if (tuner->state != BPFTUNE_ACTIVE)
+				continue;
+			fprintf(f, "bpftune_prog_cpu_percent{tuner=\"%s\"} %.6f\n",
+				tuner->name, bpftune_prog_stats[tuner->id].cpu_pct);
+		}
+		/* OpenMetrics requires each family's samples to be
+		 * contiguous, so walk programs once per family.
+		 */
+		fprintf(f, "# TYPE bpftune_prog_run_seconds counter\n"
+			"# HELP bpftune_prog_run_seconds Run time of tuner BPF programs.\n");
+		bpftune_metrics_prog_write(f, false);
+		fprintf(f, "# TYPE bpftune_prog_runs counter\n"
+			"# HELP bpftune_prog_runs Invocations of tuner BPF programs.\n");
+		bpftune_metrics_prog_write(f, true);
+	}
+
+	fprintf(f, "# TYPE bpftune_tunable_changes counter\n"
+		"# HELP bpftune_tunable_changes Tunable changes by scenario, in global and non-global network namespaces.\n");
+	bpftune_for_each_tuner(tuner) {
+		if (tuner->state != BPFTUNE_ACTIVE)
+			continue;
+		bpftuner_for_each_tunable(tuner, t) {
+			for (j = 0; j < tuner->num_scenarios; j++) {
+				fprintf(f, "bpftune_tunable_changes_total{tuner=\"%s\",tunable=\"%s\",scenario=\"%s\",netns=\"global\"} %lu\n",
+					tuner->name, t->desc.name,
+					tuner->scenarios[j].name,
+					t->stats.global_ns[j]);
+				fprintf(f, "bpftune_tunable_changes_total{tuner=\"%s\",tunable=\"%s\",scenario=\"%s\",netns=\"nonglobal\"} %lu\n",
+					tuner->name, t->desc.name,
+					tuner->scenarios[j].name,
+					t->stats.nonglobal_ns[j]);
+			}
+		}
+	}
+
+	fprintf(f, "# TYPE bpftune_tunable_initial gauge\n"
+		"# HELP bpftune_tunable_initial Sysctl tunable value in global network namespace at startup.\n");
+	bpftune_metrics_tunable_write(f, false);
+	fprintf(f, "# TYPE bpftune_tunable_current gauge\n"
+		"# HELP bpftune_tunable_current Sysctl tunable value in global network namespace.\n");
+	bpftune_metrics_tunable_write(f, true);
+
+	/* last values written/read for non-global namespaces */
+	fprintf(f, "# TYPE bpftune_netns_sysctl gauge\n"
+		"# HELP bpftune_netns_sysctl Last known sysctl value in non-global network namespace.\n");
+	pthread_mutex_lock(&bpftune_sysctl_lock);
+	for (i = 0; i < BPFTUNE_SYSCTL_CACHE_SIZE; i++) {
+		struct bpftune_sysctl_entry *e = &bpftune_sysctl_cache[i];
+
+		if (e->fd <= 0 || !e->netns_cookie)
+			continue;
+		for (j = 0; j < e->num_values; j++)
+			fprintf(f, "bpftune_netns_sysctl{netns_cookie=\"%lu\",tunable=\"%s\",index=\"%u\"} %ld\n",
+				e->netns_cookie, e->name, j, e->values[j]);
+	}
+	pthread_mutex_unlock(&bpftune_sysctl_lock);
+
+	fprintf(f, "# TYPE bpftune_sysctl_write_seconds counter\n"
+		"# HELP bpftune_sysctl_write_seconds Time spent writing sysctls.\n"
+		"bpftune_sysctl_write_seconds_total %.9f\n"
+		"# TYPE bpftune_sysctl_writes counter\n"
+		"# HELP bpftune_sysctl_writes Sysctl write batches.\n"
+		"bpftune_sysctl_writes_total %llu\n"
+		"# EOF\n",
+		(double)__atomic_load_n(&bpftune_sysctl_write_ns, __ATOMIC_RELAXED) / 1e9,
+		(unsigned long long)__atomic_load_n(&bpftune_sysctl_write_count,
+						    __ATOMIC_RELAXED));
+	pthread_rwlock_unlock(&bpftune_tuner_fini_lock);
+}
+
+static void *bpftune_metrics_thread(__attribute__((unused))void *arg)
+{
+	struct pollfd pfd = { .fd = bpftune_metrics_fd, .events = POLLIN };
+	struct timeval timeout = { .tv_sec = 1 };
+
+	while (!__atomic_load_n(&bpftune_metrics_done, __ATOMIC_ACQUIRE)) {
+		FILE *f;
+		int fd;
+
+		/* wake periodically to check if we are done */
+		if (poll(&pfd, 1, 500) <= 0)
+			continue;
+		fd = accept4(bpftune_metrics_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0)
+			continue;
+		/* do not let a stuck client block metrics */
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		f = fdopen(fd, "w");
+		if (!f) {
+			close(fd);
+			continue;
 		}
+		bpftune_metrics_write(f);
+		fclose(f);
+	}
+	return NULL;
+}
+
+int bpftune_metrics_init(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int err;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(addr.sun_path, path);
+	strcpy(bpftune_metrics_path, path);
+
+	bpftune_metrics_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (bpftune_metrics_fd < 0) {
+		err = -errno;
+		bpftune_log(LOG_ERR, "could not create metrics socket: %s\n",
+			    strerror(-err));
+		return err;
+	}
+	unlink(path);
+	if (bind(bpftune_metrics_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    chmod(path, 0600) || listen(bpftune_metrics_fd, 8)) {
+		err = -errno;
+		bpftune_log(LOG_ERR, "could not listen on metrics socket '%s': %s\n",
+			    path, strerror(-err));
+		goto err;
+	}
+	err = -pthread_create(&bpftune_metrics_tid, NULL,
+			      bpftune_metrics_thread, NULL);
+	if (err) {
+		bpftune_log(LOG_ERR, "could not create metrics thread: %s\n",
+			    strerror(-err));
+		goto err;
 	}
+	bpftune_log(LOG_DEBUG, "serving metrics on '%s'\n", path);
+	return 0;
+err:
+	close(bpftune_metrics_fd);
+	bpftune_metrics_fd = -1;
+	unlink(path);
+	return err;
+}
+
+void bpftune_metrics_fini(void)
+{
+	if (bpftune_metrics_fd < 0)
+		return;
+	__atomic_store_n(&bpftune_metrics_done, true, __ATOMIC_RELEASE);
+	pthread_join(bpftune_metrics_tid, NULL);
+	close(bpftune_metrics_fd);
+	bpftune_metrics_fd = -1;
+	unlink(bpftune_metrics_path);
 }
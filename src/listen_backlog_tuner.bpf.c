@@ -0,0 +1,85 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * Copyright (c) 2023, Oracle and/or its affiliates.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include <bpftune/bpftune.bpf.h>
+#include "listen_backlog_tuner.h"
+
+/* growth limit, set by userspace */
+int backlog_max = LISTEN_BACKLOG_MAX;
+
+/* tcp_conn_request() handles each SYN received by a listener; it drops
+ * the SYN if the accept queue is full, and if the SYN queue is full
+ * either falls back to syncookies or drops.  Both queues are limited
+ * by the listen() backlog, which is capped at net.core.somaxconn; with
+ * syncookies disabled the SYN queue is also limited to 3/4 of
+ * net.ipv4.tcp_max_syn_backlog.  (tcp_listendrop() itself is inline so
+ * cannot be traced.)
+ */
+BPF_FENTRY(tcp_conn_request, struct request_sock_ops *rsk_ops,
+	   const struct tcp_request_sock_ops *af_ops,
+	   struct sock *sk, struct sk_buff *skb)
+{
+	struct inet_connection_sock *icsk = (struct inet_connection_sock *)sk;
+	struct bpftune_event event = { 0 };
+	long old[3] = {}, new[3] = {};
+	__u32 ack_backlog, max_ack_backlog;
+	int qlen, somaxconn, max_syn_backlog;
+	struct net *net;
+
+	/* called for every SYN so bail early if we can... */
+	ack_backlog = BPF_CORE_READ(sk, sk_ack_backlog);
+	max_ack_backlog = BPF_CORE_READ(sk, sk_max_ack_backlog);
+	qlen = BPF_CORE_READ(icsk, icsk_accept_queue.qlen.counter);
+	if (!qlen && ack_backlog < max_ack_backlog)
+		return 0;
+
+	net = BPF_CORE_READ(sk, sk_net.net);
+	if (!net)
+		return 0;
+
+	if (ack_backlog >= max_ack_backlog || qlen >= (int)max_ack_backlog) {
+		somaxconn = BPF_CORE_READ(net, core.sysctl_somaxconn);
+		/* a listener asking for a shorter backlog than somaxconn
+		 * will not benefit from an increase.
+		 */
+		if (max_ack_backlog < (__u32)somaxconn || somaxconn >= backlog_max)
+			goto syn_backlog;
+		old[0] = somaxconn;
+		new[0] = BPFTUNE_GROW_BY_DELTA(somaxconn);
+		if (new[0] > backlog_max)
+			new[0] = backlog_max;
+		send_net_sysctl_event(net, SOMAXCONN_INCREASE,
+				      LISTEN_BACKLOG_SOMAXCONN, old, new,
+				      &event);
+	}
+syn_backlog:
+	if (BPF_CORE_READ(net, ipv4.sysctl_tcp_syncookies))
+		return 0;
+	max_syn_backlog = BPF_CORE_READ(net, ipv4.sysctl_max_syn_backlog);
+	if (qlen < max_syn_backlog - (max_syn_backlog >> 2) ||
+	    max_syn_backlog >= backlog_max)
+		return 0;
+	old[0] = max_syn_backlog;
+	new[0] = BPFTUNE_GROW_BY_DELTA(max_syn_backlog);
+	if (new[0] > backlog_max)
+		new[0] = backlog_max;
+	send_net_sysctl_event(net, MAX_SYN_BACKLOG_INCREASE,
+			      LISTEN_BACKLOG_MAX_SYN_BACKLOG, old, new, &event);
+	return 0;
+}
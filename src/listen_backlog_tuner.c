@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/* Copyright (c) 2023, Oracle and/or its affiliates. */
+
+#include <bpftune/libbpftune.h>
+#include "listen_backlog_tuner.h"
+#include "listen_backlog_tuner.skel.h"
+#include "listen_backlog_tuner.skel.legacy.h"
+
+#include <unistd.h>
+
+static struct bpftunable_desc descs[] = {
+{ LISTEN_BACKLOG_SOMAXCONN,
+			BPFTUNABLE_SYSCTL, "net.core.somaxconn",
+						BPFTUNABLE_NAMESPACED, 1 },
+{ LISTEN_BACKLOG_MAX_SYN_BACKLOG,
+			BPFTUNABLE_SYSCTL, "net.ipv4.tcp_max_syn_backlog",
+						BPFTUNABLE_NAMESPACED, 1 },
+};
+
+static struct bpftunable_scenario scenarios[] = {
+{ SOMAXCONN_INCREASE,		"need to increase listen backlog limit",
+	"Need to increase maximum listen backlog to avoid accept queue overflow" },
+{ MAX_SYN_BACKLOG_INCREASE,	"need to increase SYN backlog",
+	"Need to increase SYN backlog to avoid dropping connection requests" },
+};
+
+int init(struct bpftuner *tuner)
+{
+	int err;
+
+	err = bpftuner_bpf_open(listen_backlog, tuner);
+	if (err)
+		return err;
+	err = bpftuner_bpf_load(listen_backlog, tuner);
+	if (err)
+		return err;
+	bpftuner_bpf_var_set(listen_backlog, tuner, backlog_max,
+			     bpftune_option_long("listen_backlog.max",
+						 LISTEN_BACKLOG_MAX));
+	err = bpftuner_bpf_attach(listen_backlog, tuner, NULL);
+	if (err)
+		return err;
+	return bpftuner_tunables_init(tuner, LISTEN_BACKLOG_NUM_TUNABLES, descs,
+				      ARRAY_SIZE(scenarios), scenarios);
+}
+
+void fini(struct bpftuner *tuner)
+{
+	bpftune_log(LOG_DEBUG, "calling fini for %s\n", tuner->name);
+	bpftuner_bpf_fini(tuner);
+}
+
+void event_handler(struct bpftuner *tuner,
+		   struct bpftune_event *event,
+		   __attribute__((unused))void *ctx)
+{
+	int scenario = event->scenario_id;
+	const char *tunable;
+	int id;
+
+	/* netns cookie not supported; ignore */
+	if (event->netns_cookie == (unsigned long)-1)
+		return;
+
+	id = event->update[0].id;
+	tunable = bpftuner_tunable_name(tuner, id);
+	if (!tunable) {
+		bpftune_log(LOG_DEBUG, "unknown tunable [%d] for listen_backlog_tuner\n", id);
+		return;
+	}
+	switch (id) {
+	case LISTEN_BACKLOG_SOMAXCONN:
+		/* only affects listen() calls made after the change */
+		bpftuner_tunable_sysctl_write(tuner, id, scenario,
+					      event->netns_cookie, 1,
+					      (long int *)event->update[0].new,
+"Due to listen queue overflow, change %s from (%ld) -> (%ld)\n",
+					      tunable,
+					      event->update[0].old[0],
+					      event->update[0].new[0]);
+		break;
+	case LISTEN_BACKLOG_MAX_SYN_BACKLOG:
+		bpftuner_tunable_sysctl_write(tuner, id, scenario,
+					      event->netns_cookie, 1,
+					      (long int *)event->update[0].new,
+"Due to SYN queue approaching its limit, change %s from (%ld) -> (%ld)\n",
+					      tunable,
+					      event->update[0].old[0],
+					      event->update[0].new[0]);
+		break;
+	}
+}
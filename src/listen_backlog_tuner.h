@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * Copyright (c) 2023, Oracle and/or its affiliates.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include <bpftune/bpftune.h>
+
+enum listen_backlog_tunables {
+	LISTEN_BACKLOG_SOMAXCONN,
+	LISTEN_BACKLOG_MAX_SYN_BACKLOG,
+	LISTEN_BACKLOG_NUM_TUNABLES,
+};
+
+enum listen_backlog_scenarios {
+	SOMAXCONN_INCREASE,
+	MAX_SYN_BACKLOG_INCREASE,
+};
+
+/* default growth limit for both tunables; listen queue lengths are
+ * stored in 32-bit fields but very long queues only hide an application
+ * that cannot keep up with accepting connections.
+ */
+#define LISTEN_BACKLOG_MAX	65535
@@ -20,7 +20,7 @@
 #include <bpftune/bpftune.bpf.h>
 #include "neigh_table_tuner.h"
 
-BPF_MAP_DEF(tbl_map, BPF_MAP_TYPE_HASH, __u64, struct tbl_stats, 1024);
+BPF_MAP_DEF(tbl_map, BPF_MAP_TYPE_LRU_HASH, __u64, struct tbl_stats, 1024);
 
 #ifdef BPFTUNE_LEGACY
 SEC("raw_tracepoint/neigh_create")
@@ -33,7 +33,7 @@ int BPF_PROG(bpftune_neigh_create, struct neigh_table *tbl,
 {
 	
 	struct tbl_stats *tbl_stats;
-	struct bpftune_event event = {};
+	struct bpftune_event *event;
 	__u64 key = (__u64)tbl;
 
 	tbl_stats = bpf_map_lookup_elem(&tbl_map, &key);
@@ -56,6 +56,8 @@ int BPF_PROG(bpftune_neigh_create, struct neigh_table *tbl,
 	tbl_stats->entries = BPF_CORE_READ(tbl, entries.counter);
 	tbl_stats->gc_entries = BPF_CORE_READ(tbl, gc_entries.counter);
 	tbl_stats->max = BPF_CORE_READ(tbl, gc_thresh3);
+	tbl_stats->gc_thresh1 = BPF_CORE_READ(tbl, gc_thresh1);
+	tbl_stats->gc_thresh2 = BPF_CORE_READ(tbl, gc_thresh2);
 
 	/* exempt from gc entries are not subject to space constraints, but
  	 * do take up table entries.
@@ -64,17 +66,23 @@ int BPF_PROG(bpftune_neigh_create, struct neigh_table *tbl,
 		struct neigh_parms *parms = BPF_CORE_READ(n, parms);
 		struct net *net = BPF_CORE_READ(parms, net.net);
 
-		event.tuner_id = tuner_id;
-		event.scenario_id = NEIGH_TABLE_FULL;
+		long netns_cookie = 0;
+
 		if (net) {
-			event.netns_cookie = get_netns_cookie(net);
-			if (event.netns_cookie < 0)
+			netns_cookie = get_netns_cookie(net);
+			if (netns_cookie < 0)
 				return 0;
 		}
-		STATIC_ASSERT(sizeof(event.raw_data) >= sizeof(*tbl_stats),
-			      "event.raw_data too small");
-		__builtin_memcpy(&event.raw_data, tbl_stats, sizeof(*tbl_stats));
-		bpf_ringbuf_output(&ring_buffer_map, &event, sizeof(event), 0);
+		STATIC_ASSERT(sizeof(event->raw_data) >= sizeof(*tbl_stats),
+			      "event->raw_data too small");
+		event = bpftune_event_reserve(BPFTUNE_EVENT_RAW,
+					      sizeof(*tbl_stats));
+		if (!event)
+			return 0;
+		event->scenario_id = NEIGH_TABLE_FULL;
+		event->netns_cookie = netns_cookie;
+		__builtin_memcpy(&event->raw_data, tbl_stats, sizeof(*tbl_stats));
+		bpftune_event_submit(event);
 	}
 	return 0;
 }
@@ -19,6 +19,7 @@
 
 #include <bpftune/libbpftune.h>
 #include <time.h>
+#include <pthread.h>
 #include <linux/netlink.h>
 #include <libnl3/netlink/route/neightbl.h>
 #include "neigh_table_tuner.h"
@@ -70,37 +71,105 @@ int init(struct bpftuner *tuner)
 				      ARRAY_SIZE(scenarios), scenarios);
 }
 
+/* Neighbour table thresholds are per-table rather than per-netns, and can
+ * only be changed from the initial netns, so one long-lived netlink socket
+ * serves all updates; it is closed when idle.  Last updates per table are
+ * kept to coalesce repeated table-full events.
+ */
+struct neigh_table_update {
+	int gc_thresh3;
+	__u64 time;
+};
+
+static struct nl_sock *neigh_sk;
+static __u64 neigh_sk_last_use;
+static struct neigh_table_update neigh_updates[2];	/* ipv4, ipv6 */
+static pthread_mutex_t neigh_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void neigh_table_sock_close(void)
+{
+	if (!neigh_sk)
+		return;
+	nl_socket_free(neigh_sk);
+	neigh_sk = NULL;
+}
+
+static struct nl_sock *neigh_table_sock(void)
+{
+	int ret;
+
+	if (neigh_sk)
+		return neigh_sk;
+	neigh_sk = nl_socket_alloc();
+	if (!neigh_sk) {
+		bpftune_log(LOG_ERR, "failed to alloc netlink socket\n");
+		return NULL;
+	}
+	ret = nl_connect(neigh_sk, NETLINK_ROUTE);
+	if (ret) {
+		bpftune_log(LOG_ERR, "nl_connect() failed: %s\n",
+			    nl_geterror(ret));
+		neigh_table_sock_close();
+	}
+	return neigh_sk;
+}
+
 void fini(struct bpftuner *tuner)
 {
 	bpftune_log(LOG_DEBUG, "calling fini for %s\n", tuner->name);
+	pthread_mutex_lock(&neigh_lock);
+	neigh_table_sock_close();
+	pthread_mutex_unlock(&neigh_lock);
 	bpftuner_bpf_fini(tuner);
 }
 
-static int set_gc_thresh3(struct bpftuner *tuner, struct tbl_stats *stats)
+void periodic(__attribute__((unused))struct bpftuner *tuner)
+{
+	pthread_mutex_lock(&neigh_lock);
+	if (neigh_sk &&
+	    bpftune_ktime_ns() - neigh_sk_last_use > NEIGH_TABLE_SOCK_IDLE * SECOND)
+		neigh_table_sock_close();
+	pthread_mutex_unlock(&neigh_lock);
+}
+
+/* scale a lower threshold by the same ratio as gc_thresh3 so garbage
+ * collection does not thrash just below gc_thresh3.
+ */
+static int scale_gc_thresh(int thresh, int old_thresh3, int new_thresh3)
 {
-	char *tbl_name = stats->family == AF_INET ? "arp_cache" : "ndisc_cache";
-	/* Open raw socket for the NETLINK_ROUTE protocol */
-	unsigned int tunable = stats->family == AF_INET ?
-				NEIGH_TABLE_IPV4_GC_THRESH3 :
-				NEIGH_TABLE_IPV6_GC_THRESH3;
-	struct nl_sock *sk = nl_socket_alloc();
+	if (thresh <= 0 || old_thresh3 <= 0 || thresh >= old_thresh3)
+		return thresh;
+	return (int)(((long long)thresh * new_thresh3) / old_thresh3);
+}
+
+static int set_gc_thresh(struct bpftuner *tuner, struct tbl_stats *stats)
+{
+	bool ipv4 = stats->family == AF_INET;
+	char *tbl_name = ipv4 ? "arp_cache" : "ndisc_cache";
+	struct neigh_table_update *last = &neigh_updates[ipv4 ? 0 : 1];
 	struct ndtmsg ndt = {
                 .ndtm_family = stats->family,
         };
 	struct nl_msg *m = NULL, *parms = NULL;
-	int new_gc_thresh3 = 0;
+	int new_gc_thresh1, new_gc_thresh2, new_gc_thresh3;
+	__u64 now = bpftune_ktime_ns();
+	struct nl_sock *sk;
 	int ret;
 
-	if (!sk) {
-		bpftune_log(LOG_ERR, "failed to alloc netlink socket\n");
-		return -ENOMEM;
+	pthread_mutex_lock(&neigh_lock);
+	if (stats->max < last->gc_thresh3 &&
+	    now - last->time < NEIGH_TABLE_COALESCE_INTERVAL * SECOND) {
+		bpftune_log(LOG_DEBUG, "coalescing %s table-full event (gc_thresh3 %d, set to %d)\n",
+			    tbl_name, stats->max, last->gc_thresh3);
+		pthread_mutex_unlock(&neigh_lock);
+		return 0;
 	}
-	ret = nl_connect(sk, NETLINK_ROUTE);
-	if (ret) {
-		bpftune_log(LOG_ERR, "nl_connect() failed: %d\n",
-			    strerror(-ret));
+	sk = neigh_table_sock();
+	if (!sk) {
+		ret = -ENOMEM;
 		goto out;
 	}
+	neigh_sk_last_use = now;
 
 	/* it would be nice if we could simply call rtnl_neightbl_change()
 	 * here but it has a bug; it doesn't set gc_thresh3 (copy-and-paste
@@ -119,7 +188,15 @@ static int set_gc_thresh3(struct bpftuner *tuner, struct tbl_stats *stats)
 	NLA_PUT_STRING(m, NDTA_NAME, tbl_name);
 
 	new_gc_thresh3 = BPFTUNE_GROW_BY_DELTA(stats->max);
+	new_gc_thresh2 = scale_gc_thresh(stats->gc_thresh2, stats->max,
+					 new_gc_thresh3);
+	new_gc_thresh1 = scale_gc_thresh(stats->gc_thresh1, stats->max,
+					 new_gc_thresh3);
 	NLA_PUT_U32(m, NDTA_THRESH3, new_gc_thresh3);
+	if (new_gc_thresh2 != stats->gc_thresh2)
+		NLA_PUT_U32(m, NDTA_THRESH2, new_gc_thresh2);
+	if (new_gc_thresh1 != stats->gc_thresh1)
+		NLA_PUT_U32(m, NDTA_THRESH1, new_gc_thresh1);
 
 	parms = nlmsg_alloc();
 	if (!parms) {
@@ -133,30 +210,69 @@ static int set_gc_thresh3(struct bpftuner *tuner, struct tbl_stats *stats)
 	if (ret < 0)
 		goto out;
 
+	/* during trace replay, do not change tables of the replaying host */
+	if (bpftune_dry_run_enabled()) {
+		bpftune_log(LOG_DEBUG, "Dry run: not setting gc_thresh3 for %s table, dev '%s' to %d\n",
+			    tbl_name, stats->dev, new_gc_thresh3);
+		goto out;
+	}
+
 	ret = nl_send_auto_complete(sk, m);
-	if (ret < 0)
+	if (ret < 0) {
 		bpftune_log(LOG_ERR, "nl_send_auto_complete() failed: %s\n",
-			    strerror(-ret));
+			    nl_geterror(ret));
+	} else {
+		/* read the ack, else acks accumulate on the socket. */
+		ret = nl_wait_for_ack(sk);
+		if (ret < 0)
+			bpftune_log(LOG_ERR, "RTM_SETNEIGHTBL failed: %s\n",
+				    nl_geterror(ret));
+	}
+	/* socket state is unknown after errors; start afresh next time. */
+	if (ret < 0)
+		neigh_table_sock_close();
+	goto out;
 
 nla_put_failure:
+	ret = -EMSGSIZE;
 out:
 	if (parms)
 		nlmsg_free(parms);
 	if (m)
 		nlmsg_free(m);
-	nl_socket_free(sk);
 
 	if (ret < 0) {
 		bpftune_log(LOG_ERR, "could not change neightbl for %s : %s\n",
 			    stats->dev, strerror(-ret));
-	} else {
-		bpftuner_tunable_update(tuner, tunable, NEIGH_TABLE_FULL, 0,
-"updated gc_thresh3 for %s table, dev '%s' (ifindex %d) from %ld to %ld\n",
-			    tbl_name, stats->dev, stats->ifindex,
-			    stats->max, new_gc_thresh3);
+		pthread_mutex_unlock(&neigh_lock);
+		return ret;
 	}
-	return ret;
-}		
+	last->gc_thresh3 = new_gc_thresh3;
+	last->time = now;
+	pthread_mutex_unlock(&neigh_lock);
+
+	bpftuner_tunable_update(tuner, ipv4 ? NEIGH_TABLE_IPV4_GC_THRESH3 :
+					      NEIGH_TABLE_IPV6_GC_THRESH3,
+				NEIGH_TABLE_FULL, 0,
+"updated gc_thresh3 for %s table, dev '%s' (ifindex %d) from %d to %d\n",
+				tbl_name, stats->dev, stats->ifindex,
+				stats->max, new_gc_thresh3);
+	if (new_gc_thresh2 != stats->gc_thresh2)
+		bpftuner_tunable_update(tuner, ipv4 ? NEIGH_TABLE_IPV4_GC_THRESH2 :
+						      NEIGH_TABLE_IPV6_GC_THRESH2,
+					NEIGH_TABLE_FULL, 0,
+"updated gc_thresh2 for %s table from %d to %d in proportion to gc_thresh3\n",
+					tbl_name, stats->gc_thresh2,
+					new_gc_thresh2);
+	if (new_gc_thresh1 != stats->gc_thresh1)
+		bpftuner_tunable_update(tuner, ipv4 ? NEIGH_TABLE_IPV4_GC_THRESH1 :
+						      NEIGH_TABLE_IPV6_GC_THRESH1,
+					NEIGH_TABLE_FULL, 0,
+"updated gc_thresh1 for %s table from %d to %d in proportion to gc_thresh3\n",
+					tbl_name, stats->gc_thresh1,
+					new_gc_thresh1);
+	return 0;
+}
 
 void event_handler(struct bpftuner *tuner,
 		   struct bpftune_event *event,
@@ -168,7 +284,7 @@ void event_handler(struct bpftuner *tuner,
 	case NEIGH_TABLE_FULL:
 		if (bpftune_cap_add())
 			return;
-		set_gc_thresh3(tuner, stats);
+		set_gc_thresh(tuner, stats);
 		bpftune_cap_drop();
 		break;
 	default:
@@ -41,11 +41,21 @@ enum neigh_table_scenarios {
 	NEIGH_TABLE_FULL,
 };
 
+/* table-full events for a table reporting a gc_thresh3 below one we set
+ * within this interval are stale, and are coalesced into that update.
+ */
+#define NEIGH_TABLE_COALESCE_INTERVAL	1	/* seconds */
+
+/* close the netlink socket used for table updates when idle this long */
+#define NEIGH_TABLE_SOCK_IDLE		60	/* seconds */
+
 struct tbl_stats {
 	int family;
 	int entries;
 	int gc_entries;
 	int max;
+	int gc_thresh1;
+	int gc_thresh2;
 	int ifindex;
 	char dev[IFNAMSIZ];
 };
@@ -26,10 +26,12 @@ extern const void netdev_max_backlog __ksym;
 #define NET_RX_DROP	1
 #endif
 
-__u64 drop_count = 0;
-__u64 drop_interval_start = 0;
+/* sized to the number of possible CPUs at load time */
+BPF_MAP_DEF(net_buffer_cpu_drops, BPF_MAP_TYPE_ARRAY, __u32,
+	    struct net_buffer_cpu_drops, BPFTUNE_MAX_CPUS);
 
-__u64 flow_limit_cpu_bitmap = 0;
+/* CPUs with flow limits set; kept up-to-date by userspace. */
+__u64 flow_limit_cpus[BPFTUNE_CPUMASK_WORDS] = {};
 
 #ifdef BPFTUNE_LEGACY
 SEC("kretprobe/enqueue_to_backlog")
@@ -41,18 +43,32 @@ int BPF_PROG(bpftune_enqueue_to_backlog, struct sk_buff *skb, int cpu,
 #endif
 {
 	struct bpftune_event event =  { 0 };
-	long old[3], new[3];
+	long old[3] = {}, new[3] = {};
 	int max_backlog, *max_backlogp = (int *)&netdev_max_backlog;
+	struct net_buffer_cpu_drops *drops;
 	__u64 time, cpubit;
+	__u32 key;
 
 	/* a high-frequency event so bail early if we can... */
 	if (ret != NET_RX_DROP)
 		return 0;
 
-	drop_count++;
+#ifdef BPFTUNE_LEGACY
+	int cpu = bpf_get_smp_processor_id();
+#endif
+	if (cpu < 0 || cpu >= BPFTUNE_MAX_CPUS)
+		return 0;
+	key = cpu;
+	/* backlog queues are per-cpu, so count drops per-cpu also. */
+	drops = bpf_map_lookup_elem(&net_buffer_cpu_drops, &key);
+	if (!drops)
+		return 0;
+	__sync_fetch_and_add(&drops->drops, 1);
+	/* drops are the cost a max backlog increase should not increase */
+	bpftune_verify_cost_add(0, NETDEV_MAX_BACKLOG, 1);
 
 	/* only sample subset of drops to reduce overhead. */
-	if ((drop_count % 4) != 0)
+	if ((drops->drops % 4) != 0)
 		return 0;
 	if (bpf_probe_read_kernel(&max_backlog, sizeof(max_backlog),
 				  max_backlogp))
@@ -63,11 +79,12 @@ int BPF_PROG(bpftune_enqueue_to_backlog, struct sk_buff *skb, int cpu,
 	 * increases, the likliehood of hitting that limit decreases.
 	 */
 	time = bpf_ktime_get_ns();
-	if (!drop_interval_start || (time - drop_interval_start) > MINUTE) {
-		drop_count = 1;
-		drop_interval_start = time;
+	if (!drops->interval_start || (time - drops->interval_start) > MINUTE) {
+		drops->interval_drops = 0;
+		drops->interval_start = time;
 	}
-	if (drop_count < (max_backlog >> 4))
+	drops->interval_drops += 4;
+	if (drops->interval_drops < (max_backlog >> 4))
 		return 0;
 
 	old[0] = max_backlog;
@@ -75,20 +92,17 @@ int BPF_PROG(bpftune_enqueue_to_backlog, struct sk_buff *skb, int cpu,
 	send_net_sysctl_event(NULL, NETDEV_MAX_BACKLOG_INCREASE,
 			      NETDEV_MAX_BACKLOG, old, new, &event);
 
-#ifdef BPFTUNE_LEGACY
-	int cpu = bpf_get_smp_processor_id();
-#endif
-	/* ensure flow limits prioritize small flows on this cpu */
-	if (cpu < 64) {
-		cpubit = 1 << cpu;
-		if (!(flow_limit_cpu_bitmap & cpubit)) {
-			old[0] = flow_limit_cpu_bitmap;
-			new[0] = flow_limit_cpu_bitmap |= cpubit;
-			if (!send_net_sysctl_event(NULL, FLOW_LIMIT_CPU_SET,	
-						   FLOW_LIMIT_CPU_BITMAP,
-						   old, new, &event))
-				flow_limit_cpu_bitmap = new[0];
-		}
+	/* ensure flow limits prioritize small flows on this cpu; userspace
+	 * sets flow limits for all hot CPUs, so if this event is coalesced
+	 * with another the CPU is not missed.
+	 */
+	drops->hot = 1;
+	cpubit = 1ULL << (key % 64);
+	if (!(flow_limit_cpus[key / 64] & cpubit)) {
+		old[0] = key;
+		new[0] = key;
+		send_net_sysctl_event(NULL, FLOW_LIMIT_CPU_SET,
+				      FLOW_LIMIT_CPU_BITMAP, old, new, &event);
 	}
 	return 0;
 }
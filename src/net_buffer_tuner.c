@@ -7,15 +7,16 @@
 #include "net_buffer_tuner.skel.legacy.h"
 
 #include <unistd.h>
+#include <pthread.h>
 
 struct tcp_buffer_tuner_bpf *skel;
 
 static struct bpftunable_desc descs[] = {
 { NETDEV_MAX_BACKLOG,	BPFTUNABLE_SYSCTL, "net.core.netdev_max_backlog",
-								0, 1 },
+						BPFTUNABLE_VERIFY, 1 },
 { FLOW_LIMIT_CPU_BITMAP,
 			BPFTUNABLE_SYSCTL, "net.core.flow_limit_cpu_bitmap",
-								0, 1 },
+						BPFTUNABLE_CPUMASK, 1 },
 };
 
 static struct bpftunable_scenario scenarios[] = {
@@ -25,21 +26,33 @@ static struct bpftunable_scenario scenarios[] = {
 	"Need to set flow limit per-cpu to prioritize small flows" }
 };
 
+/* CPUs with flow limits set, and the lock serializing updates to them */
+static __u64 flow_limit_mask[BPFTUNE_CPUMASK_WORDS];
+static pthread_mutex_t flow_limit_lock = PTHREAD_MUTEX_INITIALIZER;
+
 int init(struct bpftuner *tuner)
 {
-	long cpu_bitmap = 0;
+	int ncpus = libbpf_num_possible_cpus();
 	int err;
 
-	bpftune_sysctl_read(0, "net.core.flow_limit_cpu_bitmap", &cpu_bitmap);
+	err = bpftune_sysctl_cpumask_read("net.core.flow_limit_cpu_bitmap",
+					  flow_limit_mask,
+					  BPFTUNE_CPUMASK_WORDS);
+	if (err)
+		return err;
 
 	err = bpftuner_bpf_open(net_buffer, tuner);
 	if (err)
 		return err;
+	if (ncpus > 0 && ncpus < BPFTUNE_MAX_CPUS)
+		bpf_map__set_max_entries(bpftuner_bpf_map_get(net_buffer, tuner,
+							      net_buffer_cpu_drops),
+					 ncpus);
 	err = bpftuner_bpf_load(net_buffer, tuner);
 	if (err)
 		return err;
-	bpftuner_bpf_var_set(net_buffer, tuner, flow_limit_cpu_bitmap,
-			     cpu_bitmap);
+	memcpy(bpftuner_bpf_var_get(net_buffer, tuner, flow_limit_cpus),
+	       flow_limit_mask, sizeof(flow_limit_mask));
 	err = bpftuner_bpf_attach(net_buffer, tuner, NULL);
 	if (err)
 		return err;
@@ -50,10 +63,61 @@ int init(struct bpftuner *tuner)
 
 void fini(struct bpftuner *tuner)
 {
+	struct bpf_map *map = bpftuner_bpf_map_get(net_buffer, tuner,
+						   net_buffer_cpu_drops);
+	struct net_buffer_cpu_drops drops;
+	__u32 cpu;
+
 	bpftune_log(LOG_DEBUG, "calling fini for %s\n", tuner->name);
+	for (cpu = 0; cpu < bpf_map__max_entries(map); cpu++) {
+		if (bpf_map_lookup_elem(bpf_map__fd(map), &cpu, &drops) ||
+		    !drops.drops)
+			continue;
+		bpftune_log(LOG_DEBUG, "backlog drops for cpu %u: %llu%s\n",
+			    cpu, (unsigned long long)drops.drops,
+			    drops.hot ? " (flow limit set)" : "");
+	}
 	bpftuner_bpf_fini(tuner);
 }
 
+/* add flow limits for all CPUs which have seen enough backlog drops;
+ * events for individual CPUs may be coalesced so do not rely on the
+ * CPU in the event.
+ */
+static void flow_limit_update(struct bpftuner *tuner, unsigned int scenario,
+			      const char *tunable)
+{
+	struct bpf_map *map = bpftuner_bpf_map_get(net_buffer, tuner,
+						   net_buffer_cpu_drops);
+	__u64 mask[BPFTUNE_CPUMASK_WORDS];
+	struct net_buffer_cpu_drops drops;
+	unsigned int old_cpus, new_cpus;
+	__u32 cpu;
+
+	pthread_mutex_lock(&flow_limit_lock);
+	memcpy(mask, flow_limit_mask, sizeof(mask));
+	for (cpu = 0; cpu < bpf_map__max_entries(map) &&
+		      cpu < BPFTUNE_MAX_CPUS; cpu++) {
+		if (bpf_map_lookup_elem(bpf_map__fd(map), &cpu, &drops) ||
+		    !drops.hot)
+			continue;
+		mask[cpu / 64] |= 1ULL << (cpu % 64);
+	}
+	old_cpus = bpftune_cpumask_weight(flow_limit_mask, BPFTUNE_CPUMASK_WORDS);
+	new_cpus = bpftune_cpumask_weight(mask, BPFTUNE_CPUMASK_WORDS);
+	if (new_cpus != old_cpus &&
+	    !bpftuner_tunable_cpumask_write(tuner, FLOW_LIMIT_CPU_BITMAP,
+					    scenario, mask,
+					    BPFTUNE_CPUMASK_WORDS,
+"To prioritize small flows on CPUs with backlog drops, change %s from (%u CPUs) -> (%u CPUs)\n",
+					    tunable, old_cpus, new_cpus)) {
+		memcpy(flow_limit_mask, mask, sizeof(mask));
+		memcpy(bpftuner_bpf_var_get(net_buffer, tuner, flow_limit_cpus),
+		       mask, sizeof(mask));
+	}
+	pthread_mutex_unlock(&flow_limit_lock);
+}
+
 void event_handler(struct bpftuner *tuner,
 		   struct bpftune_event *event,
 		   __attribute__((unused))void *ctx)
@@ -83,13 +147,8 @@ void event_handler(struct bpftuner *tuner,
 					     event->update[0].new[0]);
 		break;
 	case FLOW_LIMIT_CPU_BITMAP:
-		bpftuner_tunable_sysctl_write(tuner, id, scenario, 
-					      event->netns_cookie, 1,
-					      (long int *)event->update[0].new,
-"To prioritize small flows, change %s from (%ld) -> (%ld)\n",
-					      tunable,
-					      event->update[0].old[0],
-					      event->update[0].new[0]);
+		flow_limit_update(tuner, scenario, tunable);
+		break;
 
 	}
 }
@@ -29,3 +29,15 @@ enum net_buffer_scenarios {
 	NETDEV_MAX_BACKLOG_INCREASE,	
 	FLOW_LIMIT_CPU_SET,
 };
+
+/* Backlog drops per CPU; netdev_max_backlog limits per-CPU backlog queues.
+ * Drops are accounted to the CPU owning the backlog queue, which with RPS
+ * may differ from the CPU enqueueing the packet.  Entries are shared across
+ * CPUs, so interval accounting is approximate.
+ */
+struct net_buffer_cpu_drops {
+	__u64 drops;		/* total drops */
+	__u64 interval_drops;	/* drops since interval_start */
+	__u64 interval_start;
+	__u64 hot;		/* enough drops in an interval to set flow limit */
+};
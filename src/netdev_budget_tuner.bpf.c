@@ -0,0 +1,145 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * Copyright (c) 2023, Oracle and/or its affiliates.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+
+#include <bpftune/bpftune.bpf.h>
+#include "netdev_budget_tuner.h"
+
+extern const void netdev_budget __ksym;
+extern const void netdev_budget_usecs __ksym;
+#ifndef BPFTUNE_LEGACY
+extern struct softnet_data softnet_data __ksym;
+#endif
+
+BPF_PERCPU_COUNTERS(netdev_budget_counters, NETDEV_BUDGET_NUM_COUNTERS);
+
+BPF_MAP_DEF(netdev_budget_cpu_map, BPF_MAP_TYPE_PERCPU_ARRAY, __u32,
+	    struct netdev_budget_cpu, 1);
+
+/* growth limits, set by userspace */
+int budget_max = 0;
+unsigned int budget_usecs_max = 0;
+
+static __always_inline struct netdev_budget_cpu *netdev_budget_cpu(void)
+{
+	__u32 zero = 0;
+
+	return bpf_map_lookup_elem(&netdev_budget_cpu_map, &zero);
+}
+
+#ifdef BPFTUNE_LEGACY
+SEC("kprobe/net_rx_action")
+int BPF_KPROBE(bpftune_net_rx_action_entry)
+#else
+SEC("fentry/net_rx_action")
+int BPF_PROG(bpftune_net_rx_action_entry)
+#endif
+{
+	struct netdev_budget_cpu *c = netdev_budget_cpu();
+
+	if (!c)
+		return 0;
+	c->start = bpf_ktime_get_ns();
+#ifndef BPFTUNE_LEGACY
+	{
+		struct softnet_data *sd = bpf_this_cpu_ptr(&softnet_data);
+
+		c->time_squeeze = sd->time_squeeze;
+	}
+#endif
+	return 0;
+}
+
+#ifdef BPFTUNE_LEGACY
+SEC("kretprobe/net_rx_action")
+int BPF_KRETPROBE(bpftune_net_rx_action_exit)
+#else
+SEC("fexit/net_rx_action")
+int BPF_PROG(bpftune_net_rx_action_exit)
+#endif
+{
+	int budget, *budgetp = (int *)&netdev_budget;
+	unsigned int usecs, *usecsp = (unsigned int *)&netdev_budget_usecs;
+	struct netdev_budget_cpu *c = netdev_budget_cpu();
+	struct bpftune_event event = { 0 };
+	long old[3] = {}, new[3] = {};
+	bool squeezed, time_limited;
+	__u64 now, elapsed;
+
+	if (!c || !c->start)
+		return 0;
+	now = bpf_ktime_get_ns();
+	elapsed = (now - c->start) / 1000;
+	c->start = 0;
+
+	if (bpf_probe_read_kernel(&usecs, sizeof(usecs), usecsp) ||
+	    bpf_probe_read_kernel(&budget, sizeof(budget), budgetp))
+		return 0;
+#ifdef BPFTUNE_LEGACY
+	/* softnet time_squeeze is not available; only time limits are seen. */
+	squeezed = elapsed >= usecs;
+#else
+	{
+		struct softnet_data *sd = bpf_this_cpu_ptr(&softnet_data);
+
+		squeezed = sd->time_squeeze != c->time_squeeze;
+	}
+#endif
+	if (!squeezed)
+		return 0;
+
+	/* time limits are in jiffies, so a run squeezed after more than
+	 * half the usecs budget most likely ran out of time rather than
+	 * packet budget.
+	 */
+	time_limited = elapsed >= (usecs >> 1);
+	percpu_counter_add(&netdev_budget_counters,
+			   time_limited ? NETDEV_BUDGET_TIME_SQUEEZE_COUNT :
+					  NETDEV_BUDGET_SQUEEZE_COUNT, 1);
+
+	if (!c->interval_start || (now - c->interval_start) > SECOND) {
+		c->interval_start = now;
+		c->interval_squeezes = 0;
+	}
+	if (++c->interval_squeezes < NETDEV_BUDGET_SQUEEZE_THRESH)
+		return 0;
+	c->interval_squeezes = 0;
+
+	if (time_limited) {
+		/* guardrail; longer softirq runs delay other work on the CPU */
+		if (usecs >= budget_usecs_max)
+			return 0;
+		old[0] = usecs;
+		new[0] = BPFTUNE_GROW_BY_DELTA(usecs);
+		if (new[0] > budget_usecs_max)
+			new[0] = budget_usecs_max;
+		send_net_sysctl_event(NULL, NETDEV_BUDGET_USECS_INCREASE,
+				      NETDEV_BUDGET_USECS, old, new, &event);
+	} else {
+		if (budget >= budget_max)
+			return 0;
+		old[0] = budget;
+		new[0] = BPFTUNE_GROW_BY_DELTA(budget);
+		if (new[0] > budget_max)
+			new[0] = budget_max;
+		send_net_sysctl_event(NULL, NETDEV_BUDGET_INCREASE,
+				      NETDEV_BUDGET, old, new, &event);
+	}
+	return 0;
+}
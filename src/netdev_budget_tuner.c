@@ -0,0 +1,162 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/* Copyright (c) 2023, Oracle and/or its affiliates. */
+
+#include <bpftune/libbpftune.h>
+#include "netdev_budget_tuner.h"
+#include "netdev_budget_tuner.skel.h"
+#include "netdev_budget_tuner.skel.legacy.h"
+
+#include <unistd.h>
+
+static struct bpftunable_desc descs[] = {
+{ NETDEV_BUDGET,	BPFTUNABLE_SYSCTL, "net.core.netdev_budget",
+								0, 1 },
+{ NETDEV_BUDGET_USECS,	BPFTUNABLE_SYSCTL, "net.core.netdev_budget_usecs",
+								0, 1 },
+};
+
+static struct bpftunable_scenario scenarios[] = {
+{ NETDEV_BUDGET_INCREASE,	"need to increase softirq packet budget",
+	"Need to increase packet budget to avoid squeezing receive processing" },
+{ NETDEV_BUDGET_USECS_INCREASE,	"need to increase softirq time budget",
+	"Need to increase time budget to avoid squeezing receive processing" },
+{ NETDEV_BUDGET_DECREASE,	"reduce softirq packet budget",
+	"No receive processing squeezes seen; reduce packet budget" },
+{ NETDEV_BUDGET_USECS_DECREASE,	"reduce softirq time budget",
+	"No receive processing squeezes seen; reduce time budget" },
+};
+
+/* squeezes seen at last check, and when they last changed */
+static __s64 last_squeezes;
+static __u64 last_squeeze_time;
+
+int init(struct bpftuner *tuner)
+{
+	long budget = 0, usecs = 0;
+	int err;
+
+	if (bpftune_sysctl_read(0, "net.core.netdev_budget", &budget) < 0 ||
+	    bpftune_sysctl_read(0, "net.core.netdev_budget_usecs", &usecs) < 0)
+		return -ENOENT;
+
+	err = bpftuner_bpf_open(netdev_budget, tuner);
+	if (err)
+		return err;
+	err = bpftuner_bpf_load(netdev_budget, tuner);
+	if (err)
+		return err;
+	/* Softirq time is bounded by netdev_budget_usecs, so that limit
+	 * is the latency guardrail; by default it may only double, and
+	 * latency-sensitive systems can prevent growth entirely by
+	 * setting it to 0.
+	 */
+	bpftuner_bpf_var_set(netdev_budget, tuner, budget_max,
+			     bpftune_option_long("netdev_budget.budget_max",
+						 budget * 4));
+	bpftuner_bpf_var_set(netdev_budget, tuner, budget_usecs_max,
+			     bpftune_option_long("netdev_budget.usecs_max",
+						 usecs * 2));
+	err = bpftuner_bpf_attach(netdev_budget, tuner, NULL);
+	if (err)
+		return err;
+
+	last_squeeze_time = bpftune_ktime_ns();
+	return bpftuner_tunables_init(tuner, NETDEV_BUDGET_NUM_TUNABLES, descs,
+				      ARRAY_SIZE(scenarios), scenarios);
+}
+
+void fini(struct bpftuner *tuner)
+{
+	struct bpf_map *counters = bpftuner_bpf_map_get(netdev_budget, tuner,
+							netdev_budget_counters);
+	__s64 squeezes = 0, time_squeezes = 0;
+
+	bpftune_log(LOG_DEBUG, "calling fini for %s\n", tuner->name);
+	if (!bpftune_percpu_counter_sum(bpf_map__fd(counters),
+					NETDEV_BUDGET_SQUEEZE_COUNT,
+					&squeezes) &&
+	    !bpftune_percpu_counter_sum(bpf_map__fd(counters),
+					NETDEV_BUDGET_TIME_SQUEEZE_COUNT,
+					&time_squeezes))
+		bpftune_log(LOG_DEBUG, "net_rx_action squeezes: %lld budget, %lld time\n",
+			    (long long)squeezes, (long long)time_squeezes);
+	bpftuner_bpf_fini(tuner);
+}
+
+/* shrink a tunable raised by bpftune back towards its initial value. */
+static void netdev_budget_shrink(struct bpftuner *tuner, unsigned int id,
+				 unsigned int scenario)
+{
+	struct bpftunable *t = bpftuner_tunable(tuner, id);
+	long new;
+
+	if (!t || t->current_values[0] <= t->initial_values[0])
+		return;
+	new = BPFTUNE_SHRINK_BY_DELTA(t->current_values[0]);
+	if (new < t->initial_values[0])
+		new = t->initial_values[0];
+	bpftuner_tunable_sysctl_write(tuner, id, scenario, 0, 1, &new,
+"No receive processing squeezes in %d seconds, change %s from (%ld) -> (%ld)\n",
+				      NETDEV_BUDGET_SHRINK_INTERVAL,
+				      t->desc.name, t->current_values[0], new);
+}
+
+void periodic(struct bpftuner *tuner)
+{
+	struct bpf_map *counters = bpftuner_bpf_map_get(netdev_budget, tuner,
+							netdev_budget_counters);
+	__s64 squeezes = 0, time_squeezes = 0;
+	__u64 now = bpftune_ktime_ns();
+
+	if (bpftune_percpu_counter_sum(bpf_map__fd(counters),
+				       NETDEV_BUDGET_SQUEEZE_COUNT,
+				       &squeezes) ||
+	    bpftune_percpu_counter_sum(bpf_map__fd(counters),
+				       NETDEV_BUDGET_TIME_SQUEEZE_COUNT,
+				       &time_squeezes))
+		return;
+	if (squeezes + time_squeezes != last_squeezes) {
+		last_squeezes = squeezes + time_squeezes;
+		last_squeeze_time = now;
+		return;
+	}
+	if (now - last_squeeze_time < NETDEV_BUDGET_SHRINK_INTERVAL * SECOND)
+		return;
+	/* shrink gradually; one step per interval without squeezes. */
+	last_squeeze_time = now;
+	netdev_budget_shrink(tuner, NETDEV_BUDGET, NETDEV_BUDGET_DECREASE);
+	netdev_budget_shrink(tuner, NETDEV_BUDGET_USECS,
+			     NETDEV_BUDGET_USECS_DECREASE);
+}
+
+void event_handler(struct bpftuner *tuner,
+		   struct bpftune_event *event,
+		   __attribute__((unused))void *ctx)
+{
+	int scenario = event->scenario_id;
+	const char *tunable;
+	int id;
+
+	/* netns cookie not supported; ignore */
+	if (event->netns_cookie == (unsigned long)-1)
+		return;
+
+	id = event->update[0].id;
+	tunable = bpftuner_tunable_name(tuner, id);
+	if (!tunable) {
+		bpftune_log(LOG_DEBUG, "unknown tunable [%d] for netdev_budget_tuner\n", id);
+		return;
+	}
+	switch (id) {
+	case NETDEV_BUDGET:
+	case NETDEV_BUDGET_USECS:
+		bpftuner_tunable_sysctl_write(tuner, id, scenario,
+					      event->netns_cookie, 1,
+					      (long int *)event->update[0].new,
+"Due to receive processing being squeezed, change %s from (%ld) -> (%ld)\n",
+					      tunable,
+					      event->update[0].old[0],
+					      event->update[0].new[0]);
+		break;
+	}
+}
@@ -0,0 +1,57 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * Copyright (c) 2023, Oracle and/or its affiliates.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+
+#include <bpftune/bpftune.h>
+
+enum netdev_budget_tunables {
+	NETDEV_BUDGET,
+	NETDEV_BUDGET_USECS,
+	NETDEV_BUDGET_NUM_TUNABLES,
+};
+
+enum netdev_budget_scenarios {
+	NETDEV_BUDGET_INCREASE,
+	NETDEV_BUDGET_USECS_INCREASE,
+	NETDEV_BUDGET_DECREASE,
+	NETDEV_BUDGET_USECS_DECREASE,
+};
+
+/* per-CPU counters of net_rx_action runs squeezed by budget/time limits */
+enum netdev_budget_counters {
+	NETDEV_BUDGET_SQUEEZE_COUNT,
+	NETDEV_BUDGET_TIME_SQUEEZE_COUNT,
+	NETDEV_BUDGET_NUM_COUNTERS,
+};
+
+/* per-CPU net_rx_action state */
+struct netdev_budget_cpu {
+	__u64 start;		/* start time of current net_rx_action */
+	__u64 time_squeeze;	/* softnet time_squeeze at start */
+	__u64 interval_start;
+	__u64 interval_squeezes;
+};
+
+/* grow budget if a CPU is squeezed this many times within a second */
+#define NETDEV_BUDGET_SQUEEZE_THRESH	16
+
+/* shrink budget towards its initial value if no CPU is squeezed for
+ * this long.
+ */
+#define NETDEV_BUDGET_SHRINK_INTERVAL	(5 * 60)	/* seconds */
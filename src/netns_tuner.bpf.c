@@ -20,13 +20,31 @@
 #include <bpftune/bpftune.bpf.h>
 #include "netns_tuner.h"
 
+/* netns events carry no payload, so send just the event header. */
+static __always_inline void send_netns_event(struct net *net, int scenario_id)
+{
+	struct bpftune_event *event;
+	long netns_cookie;
+
+	netns_cookie = get_netns_cookie(net);
+	if (netns_cookie < 0)
+		return;
+	event = bpftune_event_reserve(BPFTUNE_EVENT_HDR, 0);
+	if (!event)
+		return;
+	event->pid = bpf_get_current_pid_tgid() >> 32;
+	event->scenario_id = scenario_id;
+	event->netns_cookie = netns_cookie;
+	bpftune_event_submit(event);
+}
+
 #ifdef BPFTUNE_LEGACY
 
 struct setup_net {
 	struct net *net;
 };
 
-BPF_MAP_DEF(setup_net_map, BPF_MAP_TYPE_HASH, __u64, __u64, 65536);
+BPF_MAP_DEF(setup_net_map, BPF_MAP_TYPE_LRU_HASH, __u64, __u64, 1024);
 
 SEC("kprobe/setup_net")
 int BPF_KPROBE(bpftune_setup_net, struct net *net, struct user_namespace *user_ns)
@@ -38,7 +56,6 @@ int BPF_KPROBE(bpftune_setup_net, struct net *net, struct user_namespace *user_n
 SEC("kretprobe/setup_net")
 int BPF_KRETPROBE(bpftune_setup_net_return, int ret)
 {
-	struct bpftune_event event = {};
 	struct net *netns;
 	
 	if (ret != 0)
@@ -48,12 +65,7 @@ int BPF_KRETPROBE(bpftune_setup_net_return, int ret)
 	if (!netns)
 		return 0;
 
-	event.tuner_id = tuner_id;
-	event.pid = bpf_get_current_pid_tgid() >> 32;
-	event.scenario_id = NETNS_SCENARIO_CREATE;
-	event.netns_cookie = get_netns_cookie(netns);
-	if (event.netns_cookie >= 0)
-		bpf_ringbuf_output(&ring_buffer_map, &event, sizeof(event), 0);
+	send_netns_event(netns, NETNS_SCENARIO_CREATE);
 
 	return 0;
 }
@@ -63,17 +75,10 @@ SEC("fexit/setup_net")
 int BPF_PROG(bpftune_setup_net, struct net *net, struct user_namespace *user_ns,
 	     int ret)
 {
-	struct bpftune_event event = {};
-
 	if (ret != 0 || net == NULL || net == &init_net)
 		return 0;
 
-	event.tuner_id = tuner_id;
-	event.pid = bpf_get_current_pid_tgid() >> 32;
-	event.scenario_id = NETNS_SCENARIO_CREATE;
-	event.netns_cookie = get_netns_cookie(net);
-	if (event.netns_cookie >= 0)
-		bpf_ringbuf_output(&ring_buffer_map, &event, sizeof(event), 0);
+	send_netns_event(net, NETNS_SCENARIO_CREATE);
 
 	return 0;
 }
@@ -90,7 +95,7 @@ int BPF_PROG(bpftune_setup_net, struct net *net, struct user_namespace *user_ns,
 	event.scenario_id = NETNS_SCENARIO_DESTROY;
 	event.netns_cookie = get_netns_cookie(net);
 	if (event.netns_cookie >= 0)
-		bpf_ringbuf_output(&ring_buffer_map, &event, sizeof(event), 0);
+		bpftune_ringbuf_output(&event, sizeof(event));
 
 	return 0;
 } */
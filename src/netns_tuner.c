@@ -69,14 +69,17 @@ void event_handler(__attribute__((unused))struct bpftuner *tuner,
 		   __attribute__((unused))void *ctx)
 {
 	unsigned long netns_cookie;
-	int netns_fd = 0, ret;
+	int netns_fd = 0, pid, ret;
 	struct bpftuner *t;
 
 	switch (event->scenario_id) {
 	case NETNS_SCENARIO_CREATE:
-		ret = bpftune_netns_info(event->pid, &netns_fd, &netns_cookie);
+		pid = event->pid;
+		ret = bpftune_netns_info(pid, &netns_fd, &netns_cookie);
 		if (ret || netns_cookie != event->netns_cookie) {
-			
+			pid = 0;
+			if (!ret)
+				close(netns_fd);
 			bpftune_log(LOG_DEBUG, "netns cookie from pid %d %ld != %ld (cookie from event)\n",
 				    event->pid, netns_cookie, event->netns_cookie);
 			netns_fd = bpftuner_netns_fd_from_cookie(tuner, event->netns_cookie);
@@ -88,6 +91,7 @@ void event_handler(__attribute__((unused))struct bpftuner *tuner,
 		}
 		bpftune_log(LOG_DEBUG, "got netns fd %d for cookie %ld\n",
 			    netns_fd, event->netns_cookie);
+		bpftune_netns_index_add(event->netns_cookie, pid, NULL);
 		bpftune_for_each_tuner(t)
 			bpftuner_netns_init(t, event->netns_cookie);
 		close(netns_fd);
@@ -95,6 +99,7 @@ void event_handler(__attribute__((unused))struct bpftuner *tuner,
 	case NETNS_SCENARIO_DESTROY:
 		bpftune_for_each_tuner(t)
 			bpftuner_netns_fini(t, event->netns_cookie, BPFTUNE_GONE);
+		bpftune_netns_index_remove(event->netns_cookie);
 		break;
 	default:
 		return;
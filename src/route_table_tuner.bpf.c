@@ -20,12 +20,41 @@
 #include <bpftune/bpftune.bpf.h>
 #include "route_table_tuner.h"
 
+/* The dst table is full when dst entries exceed net.ipv6.route.max_size.
+ * Rather than counting entries as fib6_age() visits them during gc, use
+ * the dst entry count the kernel itself checks against max_size; it is a
+ * per-cpu counter, and its approximate value is cheap to read.
+ */
+static __always_inline void route_table_check(struct net *net)
+{
+	struct bpftune_event event = {};
+	long old[3] = {};
+	long new[3] = {};
+	int max_size;
+	long entries;
+
+	if (!net)
+		return;
+	entries = BPF_CORE_READ(net, ipv6.ip6_dst_ops.pcpuc_entries.count);
+	max_size = BPF_CORE_READ(net, ipv6.sysctl.ip6_rt_max_size);
+	if (!NEARLY_FULL(entries, max_size))
+		return;
+
+	event.tuner_id = tuner_id;
+	event.scenario_id = ROUTE_TABLE_FULL;
+	old[0] = max_size;
+	new[0] = BPFTUNE_GROW_BY_DELTA(max_size);
+	(void) send_net_sysctl_event(net, ROUTE_TABLE_FULL,
+				     ROUTE_TABLE_IPV6_MAX_SIZE,
+				     old, new, &event);
+}
+
+#ifdef BPFTUNE_LEGACY
 struct dst_net {
 	struct net *net;
-	int entries;
 };
 
-BPF_MAP_DEF(dst_net_map, BPF_MAP_TYPE_HASH, __u64, struct dst_net, 65536);
+BPF_MAP_DEF(dst_net_map, BPF_MAP_TYPE_LRU_HASH, __u64, struct dst_net, 1024);
 
 SEC("kprobe/fib6_run_gc")
 int BPF_KPROBE(bpftune_fib6_run_gc_entry, unsigned long expires,
@@ -46,42 +75,21 @@ SEC("kretprobe/fib6_run_gc")
 int BPF_KRETPROBE(bpftune_fib6_run_gc)
 {
 	struct dst_net *dst_net;
-	struct net *net;
-	int max_size;
 
 	get_entry_struct(dst_net_map, dst_net);
-	if (!dst_net || !dst_net->net)
+	if (!dst_net)
 		return 0;
-
-	net = dst_net->net;
-
-	max_size = BPF_CORE_READ(net, ipv6.sysctl.ip6_rt_max_size);
-	if (NEARLY_FULL(dst_net->entries, max_size)) {
-		struct bpftune_event event = {};
-		long old[3] = {};
-		long new[3] = {};
-
-		event.tuner_id = tuner_id;
-		event.scenario_id = ROUTE_TABLE_FULL;
-
-		old[0] = max_size;
-		new[0] = BPFTUNE_GROW_BY_DELTA(max_size);
-		(void) send_net_sysctl_event(net, ROUTE_TABLE_FULL,
-					     ROUTE_TABLE_IPV6_MAX_SIZE,
-					     old, new, &event);
-	}
+	route_table_check(dst_net->net);
 	del_entry_struct(dst_net_map);
 	return 0;
 }
-
-/* count dst entries */
-BPF_FENTRY(fib6_age, struct fib6_info *rt, void *arg)
+#else
+/* catch dst alloc approaching limit and increase route table max size */
+SEC("fexit/fib6_run_gc")
+int BPF_PROG(bpftune_fib6_run_gc, unsigned long expires, struct net *net,
+	     bool force)
 {
-	struct dst_net *dst_net;
-
-	get_entry_struct(dst_net_map, dst_net);
-	if (dst_net)
-		dst_net->entries++;
-
+	route_table_check(net);
 	return 0;
 }
+#endif
@@ -19,6 +19,12 @@
 
 #include <bpftune/bpftune.bpf.h>
 
+/* hash of "parent/procname" -> mask of tuner ids using the sysctl; only
+ * writes to sysctls in this map are sent to userspace.
+ */
+BPF_MAP_DEF(sysctl_watch_map, BPF_MAP_TYPE_HASH, __u32, __u64,
+	    BPFTUNE_SYSCTL_WATCH_MAX);
+
 /* use kprobe here as it is not in fastpath and the function has a large
  * number of args not well handled by fentry.  We trace the sysctl set
  * because we cannot derive the net namespace easily from sysctl progs.
@@ -33,20 +39,21 @@ int BPF_KPROBE(bpftune_sysctl, struct ctl_table_header *head,
  	 */
 	struct ctl_table_set *dummy_ctl_table_set = NULL;
 	struct net *dummy_net = NULL;
-	struct bpftune_event event = {};
+	struct bpftune_event *event;
 	struct ctl_dir *root, *parent, *gparent, *ggparent;
 	struct ctl_dir *gggparent;
 	struct ctl_table *parent_table;
-	int len = sizeof(event.str);
+	int len = BPFTUNE_MAX_NAME;
+	unsigned long netns_cookie;
+	__u32 hash = BPFTUNE_SYSCTL_HASH_INIT;
 	const char *procname;
 	int current_pid = 0;	
 	char *str;
 	void *net;
+	int i;
 
 	if (!write)
 		return 0;
-	event.tuner_id = tuner_id;
-	event.scenario_id = 0;
 	current_pid = bpf_get_current_pid_tgid() >> 32;
 	if (current_pid == bpftune_pid)
 		return 0;
@@ -72,19 +79,25 @@ int BPF_KPROBE(bpftune_sysctl, struct ctl_table_header *head,
 	net = (void *)root -
 		(__u64)__builtin_preserve_access_index(&dummy_net->sysctls) -
 		(__u64)__builtin_preserve_access_index(&dummy_ctl_table_set->dir);
-	event.pid = current_pid;
-	event.netns_cookie = get_netns_cookie(net);
-	if (event.netns_cookie == (unsigned long)-1)
+	netns_cookie = get_netns_cookie(net);
+	if (netns_cookie == (unsigned long)-1)
+		return 0;
+	/* build the sysctl name in the ring buffer rather than on the stack */
+	event = bpftune_event_reserve(BPFTUNE_EVENT_STR, BPFTUNE_MAX_NAME);
+	if (!event)
 		return 0;
+	event->pid = current_pid;
+	event->netns_cookie = netns_cookie;
+	event->str[0] = '\0';
 	parent_table = BPF_CORE_READ(parent, header.ctl_table);
-	str = event.str;
+	str = event->str;
 	if (parent_table) {
 		procname = BPF_CORE_READ(parent_table, procname);
 		if (procname) {
-			if (!bpf_probe_read(event.str, sizeof(event.str), procname)) {
+			if (!bpf_probe_read(event->str, BPFTUNE_MAX_NAME, procname)) {
 				for (; len > 0 && *str; len--, str++) {}
 				if (len == 0)
-					return 0;
+					goto discard;
 				str[0] = '/';
 				str++;
 				len--;
@@ -94,10 +107,18 @@ int BPF_KPROBE(bpftune_sysctl, struct ctl_table_header *head,
 
 	procname = BPF_CORE_READ(table, procname);
 	if (!procname)
-		return 0;
+		goto discard;
 	if (bpf_probe_read(str, len, procname) < 0)
-		return 0;
-	bpf_ringbuf_output(&ring_buffer_map, &event, sizeof(event), 0);	
+		goto discard;
+	/* drop writes to sysctls no tuner is interested in. */
+	for (i = 0; i < BPFTUNE_MAX_NAME && event->str[i]; i++)
+		hash = bpftune_sysctl_hash_add(hash, event->str[i]);
+	if (!bpf_map_lookup_elem(&sysctl_watch_map, &hash))
+		goto discard;
+	bpftune_event_submit(event);
+	return 0;
+discard:
+	bpftune_event_discard(event);
 	return 0;
 }
 
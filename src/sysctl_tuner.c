@@ -37,6 +37,8 @@ int init(struct bpftuner *tuner)
 
 	if (err)
 		return err;
+	bpftune_sysctl_watch_init(bpf_map__fd(bpftuner_bpf_map_get(sysctl, tuner,
+								  sysctl_watch_map)));
 	/* attach to root cgroup */
 	if (bpftuner_cgroup_attach(tuner, "sysctl_write", BPF_CGROUP_SYSCTL))
 		return 1;
@@ -48,6 +50,7 @@ void fini(struct bpftuner *tuner)
 {
 	bpftune_log(LOG_DEBUG, "calling fini for %s\n", tuner->name);
 	bpftuner_cgroup_detach(tuner, "sysctl_write", BPF_CGROUP_SYSCTL);
+	bpftune_sysctl_watch_init(0);
 	bpftuner_bpf_fini(tuner);
 }
 
@@ -55,6 +58,7 @@ void event_handler(struct bpftuner *tuner, struct bpftune_event *event,
 		   __attribute__((unused))void *ctx)
 {
 	struct bpftuner *t = NULL;
+	__u64 tuners;
 
 	bpftune_log(LOG_DEBUG, "sysctl write for '%s' (scenario %d) for tuner %s\n",
 		    event->str, event->scenario_id, tuner->name);
@@ -62,30 +66,19 @@ void event_handler(struct bpftuner *tuner, struct bpftune_event *event,
 	if (event->netns_cookie == (unsigned long)-1)
 		return;
 
-	bpftune_for_each_tuner(t) {
-		struct bpftunable *tunable;
-
-		bpftune_log(LOG_DEBUG, "checking tuner %s\n", tuner->name);
-		bpftuner_for_each_tunable(t, tunable) {
-			char path[PATH_MAX];
+	/* match "parent/procname" exactly; want to avoid gc_thresh in
+	 * routing table tuner matching gc_thresh3 in neigh table tuner
+	 * for example.
+	 */
+	tuners = bpftune_sysctl_watch_lookup(event->str);
 
-			bpftune_sysctl_name_to_path(tunable->desc.name, path,
-						    sizeof(path));
-
-			bpftune_log(LOG_DEBUG, "checking path %s against %s\n",
-				    path, event->str);
-			/* does name match last characters in path? want to
-			 * avoid gc_thresh in routing table tuner matching
-			 * gc_thresh3 in neigh table tuner for example.
-			 */
-			if (strstr(path, event->str)) {
-				bpftune_log(BPFTUNE_LOG_LEVEL,
-					    "user (pid %ld) modified sysctl '%s' that tuner '%s' uses; disabling '%s' for namespace cookie %ld\n",
-					    event->pid, event->str, t->name, t->name,
-					    event->netns_cookie);
-				bpftuner_netns_fini(t, event->netns_cookie, BPFTUNE_MANUAL);
-				break;
-			}
-		}
+	bpftune_for_each_tuner(t) {
+		if (!(tuners & (1ULL << t->id)))
+			continue;
+		bpftune_log(BPFTUNE_LOG_LEVEL,
+			    "user (pid %ld) modified sysctl '%s' that tuner '%s' uses; disabling '%s' for namespace cookie %ld\n",
+			    event->pid, event->str, t->name, t->name,
+			    event->netns_cookie);
+		bpftuner_netns_fini(t, event->netns_cookie, BPFTUNE_MANUAL);
 	}
 }
@@ -21,78 +21,112 @@
 #include "tcp_buffer_tuner.h"
 #include <bpftune/corr.h>
 
-BPF_MAP_DEF(corr_map, BPF_MAP_TYPE_HASH, struct corr_key, struct corr, 1024);
+BPF_MAP_DEF(corr_map, BPF_MAP_TYPE_LRU_HASH, struct corr_key, struct corr, 1024);
 
 bool under_memory_pressure = false;
 bool near_memory_pressure = false;
 bool near_memory_exhaustion = false;
 /* use global tcp sock count since tcp memory pressure/exhaustion are
- * computed as fraction of total system memory.
+ * computed as fraction of total system memory.  Count is per-cpu since
+ * it is updated for every socket; a socket may be counted on one cpu
+ * and released on another, so only the sum is meaningful.
  */
-__s64 tcp_sock_count = 0;
-__s64 tcp_max_sock_count = 0;
+BPF_PERCPU_COUNTERS(tcp_buffer_counters, TCP_BUFFER_NUM_COUNTERS);
+
+/* only a fraction of sndbuf/rcvbuf events are examined when few of them
+ * find a socket near its buffer limit.
+ */
+BPF_SAMPLERS(tcp_buffer_samplers, TCP_BUFFER_NUM_SAMPLERS);
 
 /* set from userspace */
+bool per_socket_buffers;
+bool bdp_growth;
+long sockbuf_max;
+long net_core_wmem_max;
 int kernel_page_size;
 int kernel_page_shift;
 int sk_mem_quantum;
 int sk_mem_quantum_shift;
-unsigned long nr_free_buffer_pages;
-
-#define tcp_tunable_corr(__id, __cookie, __newval, __tp, __field_type, __field)\
-	{								\
-		__field_type __field;					\
-		if (!bpf_probe_read_kernel(&__field, sizeof(__field),	\
-			__builtin_preserve_access_index(&tp->__field)))	\
-			corr_update_bpf(&corr_map, __id, __cookie,	\
-					__newval, __field);		\
+struct bpftune_mem free_mem;
+
+#ifndef BPFTUNE_LEGACY
+/* retransmit and segment counts when a socket was last correlated */
+struct corr_sk {
+	__u32 total_retrans;
+	__u32 segs_out;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_SK_STORAGE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, int);
+	__type(value, struct corr_sk);
+} corr_sk_map SEC(".maps");
+#endif
+
+/* retransmits per 1000 segments sent since the socket was last
+ * correlated; cumulative counts would grow with connection lifetime
+ * rather than with loss.  Legacy programs cannot use socket storage, so
+ * use the lifetime rate there.
+ */
+static __always_inline __u64 tcp_retrans_rate(struct tcp_sock *tp)
+{
+	__u32 retrans = BPF_CORE_READ(tp, total_retrans);
+	__u32 segs = BPF_CORE_READ(tp, segs_out);
+#ifndef BPFTUNE_LEGACY
+	struct corr_sk *c = bpf_sk_storage_get(&corr_sk_map, tp, 0,
+					       BPF_SK_STORAGE_GET_F_CREATE);
+
+	if (c) {
+		__u32 delta_retrans = retrans - c->total_retrans;
+		__u32 delta_segs = segs - c->segs_out;
+
+		c->total_retrans = retrans;
+		c->segs_out = segs;
+		retrans = delta_retrans;
+		segs = delta_segs;
 	}
+#endif
+	if (!segs)
+		return 0;
+	return ((__u64)retrans * 1000) / segs;
+}
+
+/* correlate buffer size with srtt, retransmit rate and delivery rate (in
+ * bytes/msec); increases correlated with latency or retransmits are
+ * suspect unless delivery rate improves also.
+ */
+static __always_inline void tcp_tunable_corr(__u32 id, __u64 cookie,
+					     __u64 newval, struct tcp_sock *tp)
+{
+	__u32 interval_us = BPF_CORE_READ(tp, rate_interval_us);
+
+	corr_update_bpf(&corr_map, id, CORR_METRIC_SRTT, cookie, newval,
+			BPF_CORE_READ(tp, srtt_us) >> 3);
+	corr_update_bpf(&corr_map, id, CORR_METRIC_RETRANS, cookie, newval,
+			tcp_retrans_rate(tp));
+	if (interval_us)
+		corr_update_bpf(&corr_map, id, CORR_METRIC_DELIVERY_RATE,
+				cookie, newval,
+				((__u64)BPF_CORE_READ(tp, rate_delivered) *
+				 BPF_CORE_READ(tp, mss_cache) * 1000) /
+				interval_us);
+}
 
 static __always_inline bool tcp_nearly_out_of_memory(struct sock *sk,
 						     struct bpftune_event *event)
 {
-	long limit_sk_mem_quantum[3] = { };
-	long allocated;
+	unsigned long buffer_pages = free_mem.buffer_pages;
 	long mem[3] = { }, mem_new[3] = { };
 	struct net *net = BPF_CORE_READ(sk, sk_net.net);
-	struct proto *prot = BPF_CORE_READ(sk, sk_prot);
-	atomic_long_t *memory_allocated = BPF_CORE_READ(prot, memory_allocated);
-	long *sysctl_mem = BPF_CORE_READ(prot, sysctl_mem);
-	__u8 shift_left = 0, shift_right = 0;
-	int i;
-
-	if (!sk || !prot || !memory_allocated)
-		return false;
-	allocated = BPF_CORE_READ(memory_allocated, counter);
-	if (!allocated)
-		return false;
-	if (bpf_probe_read_kernel(mem, sizeof(mem), sysctl_mem))
-		return false;
+	int state;
 
-	if (!mem[0] || !mem[1] || !mem[2])
+	state = bpftune_sk_mem_state(sk, mem, kernel_page_shift,
+				     sk_mem_quantum_shift);
+	if (state < 0)
 		return false;
 
-	if (kernel_page_shift >= sk_mem_quantum_shift) {
-		shift_left = kernel_page_shift - sk_mem_quantum_shift;
-		if (shift_left >= 32)
-			return false;
-	} else {
-		shift_right = sk_mem_quantum_shift - kernel_page_shift;
-		if (shift_right >= 32)
-			return false;
-	}
-
-	for (i = 0; i < 3; i++) {
-		limit_sk_mem_quantum[i] = mem[i];
-		if (shift_left)
-			limit_sk_mem_quantum[i] <<= shift_left;
-		if (shift_right)
-			limit_sk_mem_quantum[i] >>= shift_right;
-		if (limit_sk_mem_quantum[i] <= 0)
-			return false;
-	}
-
-	if (NEARLY_FULL(allocated, limit_sk_mem_quantum[2])) {
+	if (state == BPFTUNE_SK_MEM_NEAR_EXHAUSTION) {
 		/* approaching memory exhaustion event; dial down wmem/rmem
  		 * buffer limits to limit per-socket costs.
 		 */
@@ -100,12 +134,12 @@ static __always_inline bool tcp_nearly_out_of_memory(struct sock *sk,
 		near_memory_pressure = true;
 		mem_new[0] = mem[0];
 		mem_new[1] = mem[1];
-		mem_new[2] = min(nr_free_buffer_pages >> 2,
+		mem_new[2] = min(buffer_pages >> 2,
 				 BPFTUNE_GROW_BY_DELTA(mem[2]));
 		/* if we still have room to grow mem exhaustion limit, do that,
 		 * otherwise shrink wmem/rmem.
 		 */
-		if (mem_new[2] <= (nr_free_buffer_pages >> 2)) {
+		if (mem_new[2] > mem[2] && !bpftune_node_low_on_memory(&free_mem)) {
 			send_sk_sysctl_event(sk, TCP_MEM_EXHAUSTION,
 					     TCP_BUFFER_TCP_MEM, mem, mem_new,
 					     event);
@@ -113,49 +147,47 @@ static __always_inline bool tcp_nearly_out_of_memory(struct sock *sk,
 		}
 		if (!net)
 			return true;
+		/* shrink wmem and rmem together in one event. */
 		mem[0] = (long)BPF_CORE_READ(net, ipv4.sysctl_tcp_wmem[0]);
 		mem[1] = (long)BPF_CORE_READ(net, ipv4.sysctl_tcp_wmem[1]);
 		mem[2] = (long)BPF_CORE_READ(net, ipv4.sysctl_tcp_wmem[2]);
 		mem_new[0] = mem[0];
 		mem_new[1] = mem[1];
 		mem_new[2] = BPFTUNE_SHRINK_BY_DELTA(mem[2]);
-		send_sk_sysctl_event(sk, TCP_BUFFER_DECREASE,
-				     TCP_BUFFER_TCP_WMEM,
-				     mem, mem_new, event);
-		if (!net)
-			return true;
+		bpftune_event_update_add(event, TCP_BUFFER_TCP_WMEM,
+					 mem, mem_new);
 		mem[0] = (long)BPF_CORE_READ(net, ipv4.sysctl_tcp_rmem[0]);
 		mem[1] = (long)BPF_CORE_READ(net, ipv4.sysctl_tcp_rmem[1]);
 		mem[2] = (long)BPF_CORE_READ(net, ipv4.sysctl_tcp_rmem[2]);
 		mem_new[0] = mem[0];
 		mem_new[1] = mem[1];
 		mem_new[2] = BPFTUNE_SHRINK_BY_DELTA(mem[2]);
-		send_sk_sysctl_event(sk, TCP_BUFFER_DECREASE,
-				     TCP_BUFFER_TCP_RMEM,
-				     mem, mem_new, event);
+		bpftune_event_update_add(event, TCP_BUFFER_TCP_RMEM,
+					 mem, mem_new);
+		send_net_sysctl_events(net, TCP_BUFFER_DECREASE, event);
 		return true;
-	} else if (NEARLY_FULL(allocated, limit_sk_mem_quantum[1])) {
+	} else if (state == BPFTUNE_SK_MEM_NEAR_PRESSURE) {
 		/* send approaching memory pressure event; we also increase
 		 * memory exhaustion limit as it tends to lead to
 		 * pathological tcp behaviour.  If min/memory pressure are
 		 * less than ~8%,~12% of memory), bump them up too.
 		 * Mem exhaustion maxes out at 25% of memory.
 		 */
-		if (!mem[0] || !mem[1] || !mem[2])
-			return false;
+		near_memory_pressure = true;
+		if (bpftune_node_low_on_memory(&free_mem))
+			return true;
 
 		mem_new[0] = mem[0];
 		mem_new[1] = mem[1];
-		if (mem[0] < nr_free_buffer_pages >> 4)
+		if (mem[0] < buffer_pages >> 4)
 			mem_new[0] = BPFTUNE_GROW_BY_DELTA(mem[0]);
-		if (mem[1] < nr_free_buffer_pages >> 3)
+		if (mem[1] < buffer_pages >> 3)
 			mem_new[1] = BPFTUNE_GROW_BY_DELTA(mem[1]);
-		mem_new[2] = min(nr_free_buffer_pages >> 2,
+		mem_new[2] = min(buffer_pages >> 2,
 				 BPFTUNE_GROW_BY_DELTA(mem[2]));
 		send_sk_sysctl_event(sk, TCP_MEM_PRESSURE,
 				     TCP_BUFFER_TCP_MEM, mem, mem_new,
 				     event);
-		near_memory_pressure = true;
 		return true;
 	}
 	near_memory_exhaustion = false;
@@ -164,10 +196,73 @@ static __always_inline bool tcp_nearly_out_of_memory(struct sock *sk,
 	return false;
 }
 
+/* In BDP mode, rather than growing a buffer limit by a fixed step, jump
+ * to a target estimated from the bandwidth-delay product of the socket
+ * that hit the limit, so that long fat pipes converge in one or two
+ * steps.  On the send side, delivery rate over the last sample interval
+ * times smoothed RTT gives BDP; on the receive side the sender's rate
+ * tells us nothing, so use the data copied to the application over the
+ * last receiver RTT estimate (rcvq_space.space), as receive autotuning
+ * does.  Double it to allow for skb overhead.  Target is capped to
+ * 1/16 of the tcp_mem pressure threshold, so a single buffer limit
+ * cannot bring us close to memory pressure.
+ */
+static __always_inline long tcp_buffer_grow(struct sock *sk,
+					    struct tcp_sock *tp, long cur,
+					    bool rcv)
+{
+	long grow = BPFTUNE_GROW_BY_DELTA(cur);
+	struct proto *prot = BPF_CORE_READ(sk, sk_prot);
+	__u32 srtt_us, delivered, interval_us, mss;
+	long *sysctl_mem, mem[3] = { }, limit;
+	__u64 target;
+
+	if (!bdp_growth || !prot || kernel_page_shift <= 0)
+		return grow;
+	if (rcv) {
+		/* no receiver RTT sample yet means space is not a BDP */
+		if (!BPF_CORE_READ(tp, rcv_rtt_est.rtt_us))
+			return grow;
+		target = (__u64)BPF_CORE_READ(tp, rcvq_space.space) << 1;
+		if (!target)
+			return grow;
+	} else {
+		srtt_us = BPF_CORE_READ(tp, srtt_us) >> 3;
+		delivered = BPF_CORE_READ(tp, rate_delivered);
+		interval_us = BPF_CORE_READ(tp, rate_interval_us);
+		mss = BPF_CORE_READ(tp, mss_cache);
+		if (!srtt_us || !delivered || !interval_us || !mss)
+			return grow;
+		target = (((__u64)delivered * mss * srtt_us) / interval_us) << 1;
+	}
+
+	sysctl_mem = BPF_CORE_READ(prot, sysctl_mem);
+	if (!sysctl_mem || bpf_probe_read_kernel(mem, sizeof(mem), sysctl_mem) ||
+	    !mem[1])
+		return grow;
+	limit = (mem[1] << kernel_page_shift) >> 4;
+	if (target > limit)
+		target = limit;
+	if (target <= grow)
+		return grow;
+	bpftune_debug("tcp_buffer: bdp target %ld (limit %ld, current %ld)\n",
+		      (long)target, limit, cur);
+	return target;
+}
+
 BPF_FENTRY(tcp_enter_memory_pressure, struct sock *sk)
 {
 	struct bpftune_event event = { 0 };
 
+	/* sndbuf/rcvbuf programs also watch for memory exhaustion */
+	bpftune_ondemand_trigger();
+	/* memory pressure is the cost buffer increases should not raise */
+	if (bpftune_verify_sec) {
+		long nscookie = get_netns_cookie(BPF_CORE_READ(sk, sk_net.net));
+
+		bpftune_verify_cost_add(nscookie, TCP_BUFFER_TCP_WMEM, 1);
+		bpftune_verify_cost_add(nscookie, TCP_BUFFER_TCP_RMEM, 1);
+	}
 	(void) tcp_nearly_out_of_memory(sk, &event);
 	return 0;
 }
@@ -192,35 +287,55 @@ BPF_FENTRY(tcp_leave_memory_pressure, struct sock *sk)
 BPF_FENTRY(tcp_sndbuf_expand, struct sock *sk)
 {
 	struct bpftune_event event = { 0 };
-	struct net *net = BPF_CORE_READ(sk, sk_net.net);
 	struct tcp_sock *tp = (struct tcp_sock *)sk;
 	long wmem[3], wmem_new[3];
+	struct net *net;
+	bool full, sample;
 	long sndbuf;
 
-	if (!sk || !net || tcp_nearly_out_of_memory(sk, &event))
+	if (!sk)
+		return 0;
+	/* memory checks are not sampled, so that approaching pressure or
+	 * exhaustion is acted on promptly.
+	 */
+	sample = bpftune_sample(&tcp_buffer_samplers, TCP_BUFFER_SAMPLE_SNDBUF);
+	if (tcp_nearly_out_of_memory(sk, &event)) {
+		if (sample)
+			bpftune_sample_yield(&tcp_buffer_samplers,
+					     TCP_BUFFER_SAMPLE_SNDBUF, true);
+		return 0;
+	}
+	if (!sample)
+		return 0;
+	net = BPF_CORE_READ(sk, sk_net.net);
+	if (!net)
 		return 0;
 
 	sndbuf = BPF_CORE_READ(sk, sk_sndbuf);
 	wmem[2] = BPF_CORE_READ(net, ipv4.sysctl_tcp_wmem[2]);
+	full = NEARLY_FULL(sndbuf, wmem[2]);
+	bpftune_sample_yield(&tcp_buffer_samplers, TCP_BUFFER_SAMPLE_SNDBUF,
+			     full);
 
-	if (NEARLY_FULL(sndbuf, wmem[2])) {
+	if (full) {
 
-		if (!net)
+		/* per-socket sizing is done by tcp_buffer_sockops */
+		if (!net || per_socket_buffers)
 			return 0;
 		wmem[0] = wmem_new[0] = BPF_CORE_READ(net, ipv4.sysctl_tcp_wmem[0]);
 		wmem[1] = wmem_new[1] = BPF_CORE_READ(net, ipv4.sysctl_tcp_wmem[1]);
-		wmem_new[2] = BPFTUNE_GROW_BY_DELTA(wmem[2]);
+		wmem_new[2] = tcp_buffer_grow(sk, tp, wmem[2], false);
 
 		if (send_sk_sysctl_event(sk, TCP_BUFFER_INCREASE,
 					 TCP_BUFFER_TCP_WMEM,
 					 wmem, wmem_new, &event) < 0)
 			return 0;
-		/* correlate changes to wmem with round-trip time to spot
-		 * cases where buffer increase is correlated with longer
+		/* correlate changes to wmem with round-trip time etc to
+		 * spot cases where buffer increase is correlated with longer
 		 * latencies.
 		 */
 		tcp_tunable_corr(TCP_BUFFER_TCP_WMEM, event.netns_cookie,
-				 wmem[2], tp, __u32, srtt_us);
+				 wmem[2], tp);
 	}
 	return 0;
 }
@@ -232,42 +347,49 @@ BPF_FENTRY(tcp_sndbuf_expand, struct sock *sk)
 BPF_FENTRY(tcp_rcv_space_adjust, struct sock *sk)
 {
 	struct bpftune_event event = { 0 };
-	struct net *net = BPF_CORE_READ(sk, sk_net.net);
 	struct tcp_sock *tp = (struct tcp_sock *)sk;
 	long rmem[3], rmem_new[3];
 	__u8 sk_userlocks = 0;
+	struct net *net;
+	bool full;
 	long rcvbuf;
 
-	if (!sk || !net)
+	if (!sk || near_memory_pressure || near_memory_exhaustion ||
+	    !bpftune_sample(&tcp_buffer_samplers, TCP_BUFFER_SAMPLE_RCVBUF))
+		return 0;
+	net = BPF_CORE_READ(sk, sk_net.net);
+	if (!net)
 		return 0;
 
 #ifndef BPFTUNE_LEGACY
 	/* CO-RE does not support bitfields... */
 	sk_userlocks = sk->sk_userlocks;
 #endif
-	if ((sk_userlocks & SOCK_RCVBUF_LOCK) || near_memory_pressure ||
-	    near_memory_exhaustion)
+	if (sk_userlocks & SOCK_RCVBUF_LOCK)
 		return 0;
 
 	rcvbuf = BPF_CORE_READ(sk, sk_rcvbuf);
 	rmem[2] = BPF_CORE_READ(net, ipv4.sysctl_tcp_rmem[2]);
+	full = NEARLY_FULL(rcvbuf, rmem[2]);
+	bpftune_sample_yield(&tcp_buffer_samplers, TCP_BUFFER_SAMPLE_RCVBUF,
+			     full);
 
-	if (NEARLY_FULL(rcvbuf, rmem[2])) {
+	if (full) {
 		if (tcp_nearly_out_of_memory(sk, &event))
 			return 0;
 
 		rmem[0] = rmem_new[0] = BPF_CORE_READ(net, ipv4.sysctl_tcp_rmem[0]);
 		rmem[1] = rmem_new[1] = BPF_CORE_READ(net, ipv4.sysctl_tcp_rmem[1]);
-		rmem_new[2] = BPFTUNE_GROW_BY_DELTA(rmem[2]);
+		rmem_new[2] = tcp_buffer_grow(sk, tp, rmem[2], true);
 		if (send_sk_sysctl_event(sk, TCP_BUFFER_INCREASE, TCP_BUFFER_TCP_RMEM,
 					 rmem, rmem_new, &event) < 0)
 			return 0;
-		/* correlate changes to rmem with round-trip time to spot
-		 * cases where buffer increase is correlated with longer
+		/* correlate changes to rmem with round-trip time etc to
+		 * spot cases where buffer increase is correlated with longer
 		 * latencies.
 		 */
 		tcp_tunable_corr(TCP_BUFFER_TCP_RMEM, event.netns_cookie,
-				 rmem[2], tp, __u32, srtt_us);
+				 rmem[2], tp);
 
 	}
 	return 0;
@@ -278,8 +400,7 @@ BPF_FENTRY(tcp_init_sock, struct sock *sk)
 	struct bpftune_event event = { 0 };
 
 	if (sk) {
-		if (++tcp_sock_count > tcp_max_sock_count)
-			tcp_max_sock_count = tcp_sock_count;
+		percpu_counter_add(&tcp_buffer_counters, TCP_BUFFER_SOCK_COUNT, 1);
 		(void) tcp_nearly_out_of_memory(sk, &event);
 	}
 	return 0;
@@ -287,7 +408,199 @@ BPF_FENTRY(tcp_init_sock, struct sock *sk)
 
 BPF_FENTRY(tcp_release_cb, struct sock *sk)
 {
-	if (tcp_sock_count > 0)
-		tcp_sock_count--;
+	percpu_counter_add(&tcp_buffer_counters, TCP_BUFFER_SOCK_COUNT, -1);
 	return 0;
 }
+
+#ifndef BPFTUNE_LEGACY
+/* Per-socket send buffer sizing.  Rather than raising tcp_wmem max for
+ * all sockets in a namespace, estimate each connection's bandwidth-delay
+ * product from its delivery rate and smoothed RTT, and for connections
+ * whose BDP exceeds what tcp_wmem max allows, set SO_SNDBUF for that
+ * connection only.  Sizes are remembered per remote host (and per cgroup,
+ * with cgroup-scoped tuning) so new connections to the same host start
+ * with larger buffers.
+ *
+ * Setting SO_SNDBUF locks the send buffer size, so kernel autotuning no
+ * longer applies to the socket; from then on its buffer follows the BDP
+ * estimate on every RTT sample, shrinking as well as growing.  Sockets
+ * whose send buffer size the application set are left alone.
+ *
+ * SO_SNDBUF is clamped to net.core.wmem_max, so increases of that limit
+ * are requested as needed; it only applies to sockets which set buffer
+ * sizes explicitly.  Receive buffers are not sized per socket: pure
+ * receivers see few RTT samples, and setting SO_RCVBUF would stop receive
+ * autotuning, so tcp_rmem max is tuned as usual from receive-side state.
+ */
+struct sockbuf_host {
+	long sndbuf;
+};
+
+BPF_MAP_DEF(sockbuf_host_map, BPF_MAP_TYPE_LRU_HASH, struct bpftune_host_key,
+	    struct sockbuf_host, 4096);
+
+/* sockets whose send buffer size is managed here */
+struct {
+	__uint(type, BPF_MAP_TYPE_SK_STORAGE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, int);
+	__type(value, __u8);
+} sockbuf_sk_map SEC(".maps");
+
+/* when a net.core.wmem_max increase was last requested; userspace updates
+ * net_core_wmem_max only once the increase has been made, so requests
+ * are repeated until then.
+ */
+__u64 wmem_max_requested;
+
+/* for sockets still autotuned, returns buffer size to set, or 0 if none
+ * is needed.
+ */
+static __always_inline long sockbuf_target(long bdp, long cur, long sysctl_max)
+{
+	/* allow for skb overhead, which is accounted in buffer sizes */
+	long want = bdp << 1;
+
+	if (want <= sysctl_max || want <= cur + (cur >> 3))
+		return 0;
+	return min(want, sockbuf_max);
+}
+
+/* for sockets sized here, returns new buffer size, or 0 to keep the
+ * current one; never shrink below the tcp_wmem default.
+ */
+static __always_inline long sockbuf_resize(long bdp, long cur, long floor)
+{
+	long want = bdp << 1;
+
+	if (want < floor)
+		want = floor;
+	want = min(want, sockbuf_max);
+
+	if (want <= cur + (cur >> 3) && want >= cur - (cur >> 2))
+		return 0;
+	return want;
+}
+
+static __always_inline void sockbuf_set(struct bpf_sock_ops *ops,
+					struct tcp_sock *tp, long size)
+{
+	/* kernel doubles SO_SNDBUF values */
+	int val = size >> 1;
+	__u64 now;
+	int ret;
+
+	if (val > net_core_wmem_max) {
+		now = bpf_ktime_get_ns();
+		if (now - wmem_max_requested >= TCP_BUFFER_SOCKBUF_RETRY) {
+			struct bpftune_event event = {};
+			long old[3] = { net_core_wmem_max }, new[3] = { val };
+
+			wmem_max_requested = now;
+			/* net.core.wmem_max is not namespaced */
+			send_net_sysctl_event(NULL, TCP_BUFFER_SOCKBUF_INCREASE,
+					      TCP_BUFFER_NET_CORE_WMEM_MAX,
+					      old, new, &event);
+		}
+	}
+	if (!bpf_sk_storage_get(&sockbuf_sk_map, tp, 0,
+				BPF_SK_STORAGE_GET_F_CREATE))
+		return;
+	ret = bpf_setsockopt(ops, SOL_SOCKET, SO_SNDBUF, &val, sizeof(val));
+	bpftune_debug("tcp_buffer: set sndbuf to %d: %d\n", val, ret);
+}
+
+static __always_inline bool sndbuf_user_locked(struct tcp_sock *tp)
+{
+	struct sock *sk = (struct sock *)tp;
+
+	/* CO-RE does not support bitfields... */
+	return (sk->sk_userlocks & SOCK_SNDBUF_LOCK) &&
+	       !bpf_sk_storage_get(&sockbuf_sk_map, tp, 0, 0);
+}
+
+SEC("sockops")
+int tcp_buffer_sockops(struct bpf_sock_ops *ops)
+{
+	struct sockbuf_host *host, new_host = {};
+	struct bpftune_host_key key = {};
+	long sndbuf, want;
+	struct tcp_sock *tp;
+	__u64 srtt, bdp;
+	struct net *net;
+	struct sock *sk;
+
+	if (!per_socket_buffers || !ops->sk)
+		return 1;
+	tp = bpf_skc_to_tcp_sock(ops->sk);
+	if (!tp)
+		return 1;
+	sk = (struct sock *)tp;
+
+	switch (ops->family) {
+	case AF_INET:
+		key.addr[0] = ops->remote_ip4;
+		break;
+	case AF_INET6:
+		key.addr[0] = ops->remote_ip6[0];
+		key.addr[1] = ops->remote_ip6[1];
+		key.addr[2] = ops->remote_ip6[2];
+		key.addr[3] = ops->remote_ip6[3];
+		break;
+	default:
+		return 1;
+	}
+	key.cgroup_id = get_sk_cgroup_id(sk);
+
+	switch (ops->op) {
+	case BPF_SOCK_OPS_ACTIVE_ESTABLISHED_CB:
+	case BPF_SOCK_OPS_PASSIVE_ESTABLISHED_CB:
+		/* enable RTT events to track BDP */
+		bpf_sock_ops_cb_flags_set(ops, ops->bpf_sock_ops_cb_flags |
+					       BPF_SOCK_OPS_RTT_CB_FLAG);
+		/* start with size previously needed for this host */
+		host = bpf_map_lookup_elem(&sockbuf_host_map, &key);
+		if (host && host->sndbuf && !sndbuf_user_locked(tp))
+			sockbuf_set(ops, tp, host->sndbuf);
+		return 1;
+	case BPF_SOCK_OPS_RTT_CB:
+		break;
+	default:
+		return 1;
+	}
+
+	if (!ops->rate_interval_us || sndbuf_user_locked(tp))
+		return 1;
+	net = BPF_CORE_READ(sk, sk_net.net);
+	if (!net)
+		return 1;
+	srtt = ops->srtt_us >> 3;
+	bdp = ((__u64)ops->rate_delivered * ops->mss_cache * srtt) /
+	      ops->rate_interval_us;
+	if (!bdp)
+		return 1;
+
+	sndbuf = BPF_CORE_READ(sk, sk_sndbuf);
+	if (bpf_sk_storage_get(&sockbuf_sk_map, tp, 0, 0))
+		want = sockbuf_resize(bdp, sndbuf,
+				      BPF_CORE_READ(net, ipv4.sysctl_tcp_wmem[1]));
+	else
+		want = sockbuf_target(bdp, sndbuf,
+				      BPF_CORE_READ(net, ipv4.sysctl_tcp_wmem[2]));
+	if (!want)
+		return 1;
+	sockbuf_set(ops, tp, want);
+
+	host = bpf_map_lookup_elem(&sockbuf_host_map, &key);
+	if (!host) {
+		bpf_map_update_elem(&sockbuf_host_map, &key, &new_host,
+				    BPF_NOEXIST);
+		host = bpf_map_lookup_elem(&sockbuf_host_map, &key);
+		if (!host)
+			return 1;
+	}
+	if (want > host->sndbuf)
+		host->sndbuf = want;
+	return 1;
+}
+#endif /* BPFTUNE_LEGACY */
@@ -14,12 +14,16 @@
 struct tcp_buffer_tuner_bpf *skel;
 
 static struct bpftunable_desc descs[] = {
-{ TCP_BUFFER_TCP_WMEM,	BPFTUNABLE_SYSCTL, "net.ipv4.tcp_wmem",	true, 3 },
-{ TCP_BUFFER_TCP_RMEM,	BPFTUNABLE_SYSCTL, "net.ipv4.tcp_rmem",	true, 3 },
+{ TCP_BUFFER_TCP_WMEM,	BPFTUNABLE_SYSCTL, "net.ipv4.tcp_wmem",
+				BPFTUNABLE_NAMESPACED | BPFTUNABLE_VERIFY, 3 },
+{ TCP_BUFFER_TCP_RMEM,	BPFTUNABLE_SYSCTL, "net.ipv4.tcp_rmem",
+				BPFTUNABLE_NAMESPACED | BPFTUNABLE_VERIFY, 3 },
 { TCP_BUFFER_TCP_MEM,	BPFTUNABLE_SYSCTL, "net.ipv4.tcp_mem",	false, 3 },
 { TCP_BUFFER_TCP_MAX_ORPHANS,
 			BPFTUNABLE_SYSCTL, "net.ipv4.tcp_max_orphans",
 								false, 1 },
+{ TCP_BUFFER_NET_CORE_WMEM_MAX,
+			BPFTUNABLE_SYSCTL, "net.core.wmem_max",	false, 1 },
 };
 
 static struct bpftunable_scenario scenarios[] = {
@@ -37,23 +41,16 @@ static struct bpftunable_scenario scenarios[] = {
 { TCP_MAX_ORPHANS_INCREASE,
 			"increase max number of orphaned sockets",
 			"" },
+{ TCP_BUFFER_SOCKBUF_INCREASE,
+			"need to increase per-socket buffer size limit",
+	"A connection's bandwidth-delay product needs a larger buffer than tcp_wmem/tcp_rmem max allow, so raise the limit on per-socket buffer sizes; only connections which need it will use the larger limit" },
 };
 
 /* When TCP starts up, it calls nr_free_buffer_pages() and uses it to estimate
  * the values for tcp_mem[0-2].  The equivalent of this estimate can be
- * retrieved via /proc/zoneinfo; in the Normal zone the number of managed
- * pages less the high watermark:
- *
- * Node 0, zone   Normal
- *   pages free     145661
- *         min      13560
- *         low      16950
- *         high     20340
- *         spanned  3282944
- *         present  3282944
- *         managed  3199514
- * 
- * In this case, we have 3199514 (managed) - 20340 (high watermark) = 3179174
+ * retrieved via /proc/zoneinfo (see bpftune_mem_read()); for a node with
+ * a single Normal zone of 3199514 managed pages and a high watermark
+ * of 20340 pages, we have 3199514 - 20340 = 3179174.
  *
  * On startup tcp_mem[0-2] are ~4.6%,  6.25%  and  9.37% of nr_free_buffer_pages.
  * Calculating these values for the above we get
@@ -64,86 +61,52 @@ static struct bpftunable_scenario scenarios[] = {
  *
  * 185565 247423 371130
  *
- * Note that on < 4GB systems, zone Normals report 0 and zone DMA32 contains
- * the managed pages.
+ * Managed pages change with memory hotplug, and free pages with workload
+ * (and hugepage pool) changes, so the estimate is refreshed periodically
+ * rather than computed once.  tcp_mem is global, but socket memory comes
+ * from the local node, so per-node free pages are passed to BPF too;
+ * tcp_mem is not raised on behalf of a node with no free pages above its
+ * high watermark.
  */
 
-int get_from_file(FILE *fp, const char *fmt, ...)
-{
-	char line[PATH_MAX];
-	int ret = 0;
-	va_list ap;
-
-	va_start(ap, fmt);
-	while (fgets(line, sizeof(line), fp)) {
-		ret = vsscanf(line, fmt, ap);
-		if (ret >= 1)
-			break;
-		else
-			ret = -ENOENT;
-	}
-	va_end(ap);
-	return ret;
-}
+static __u64 mem_refresh_last;
 
-long nr_free_buffer_pages(bool initial)
+/* push current memory limits to BPF, unless done in the last
+ * min_interval nanoseconds.
+ */
+static void tcp_buffer_mem_refresh(struct bpftuner *tuner, __u64 min_interval)
 {
-	unsigned long nr_pages = 0;
-	char *mzone = "Normal";
-	FILE *fp;
-	int err;
-
-	err = bpftune_cap_add();
-	if (err)
-		return err;
-
-retry:
-	fp = fopen("/proc/zoneinfo", "r");
-
-	if (!fp) {
-		bpftune_log(LOG_DEBUG, "could not open /proc/zoneinfo: %s\n", strerror(errno));
-	}
-	while (fp && !feof(fp)) {
-		long managed = 0, high = 0, free = 0, node;
-		char zone[PATH_MAX] = "";
+	bpftune_mem_refresh(bpftuner_bpf_var_ptr(tcp_buffer, tuner, free_mem),
+			    &mem_refresh_last, min_interval);
+}
 
-		if (get_from_file(fp, "Node %d, zone %s", &node, zone) < 0)
-			break;
-		if (strcmp(zone, mzone) != 0)
-			continue;
-		if (get_from_file(fp, " high\t%ld", &high) < 0)
-			continue;	
-		if (initial) {
-			if (get_from_file(fp, " managed\t%ld", &managed) < 0)
-				continue;
-			if (managed > high)
-				nr_pages += managed - high;
-		} else {
-			if (get_from_file(fp, " nr_free_pages\t%ld", &free))
-				nr_pages += free;
-		}
-	}
-	if (fp)
-		fclose(fp);
+/* per-socket buffer sizing is enabled via "-o tcp_buffer.per_socket=1" */
+static bool per_socket;
 
-	/* for < 4GB, managed pages are in DMA32 zone. */
-	if (nr_pages == 0 && strcmp(mzone, "Normal") == 0) {
-		mzone = "DMA32";
-		goto retry;
-	}
+static const char *ondemand_progs[] = {
+	"entry__tcp_sndbuf_expand",
+	"entry__tcp_rcv_space_adjust",
+	NULL
+};
 
-	bpftune_cap_drop();
-	return nr_pages;
-}
+/* learned correlations and per-remote-host send buffer sizes */
+static const char *persist_maps[] = {
+	"corr_map",
+	"sockbuf_host_map",
+	NULL
+};
 
 int init(struct bpftuner *tuner)
 {
+	unsigned int num_tunables = TCP_BUFFER_NUM_TUNABLES;
+	long wmem_max = 0;
 	int pagesize;
 	int err;
 
 	err = bpftuner_bpf_open(tcp_buffer, tuner);
 	if (err)
 		return err;
+	tuner->persist_maps = persist_maps;
 	err = bpftuner_bpf_load(tcp_buffer, tuner);
 	if (err)
 		return err;
@@ -157,21 +120,105 @@ int init(struct bpftuner *tuner)
 	bpftuner_bpf_var_set(tcp_buffer, tuner, sk_mem_quantum, SK_MEM_QUANTUM);
 	bpftuner_bpf_var_set(tcp_buffer, tuner, sk_mem_quantum_shift,
 			     ilog2(SK_MEM_QUANTUM));
-	bpftuner_bpf_var_set(tcp_buffer, tuner, nr_free_buffer_pages,
-			     nr_free_buffer_pages(true));
+	tcp_buffer_mem_refresh(tuner, 0);
+
+	if (bpftune_option_long("tcp_buffer.bdp", 0))
+		bpftuner_bpf_var_set(tcp_buffer, tuner, bdp_growth, true);
+
+	per_socket = bpftune_option_long("tcp_buffer.per_socket", 0) != 0;
+	if (per_socket && tuner->bpf_legacy) {
+		bpftune_log(LOG_ERR, "tcp_buffer: per-socket buffer sizing is not supported in legacy mode\n");
+		per_socket = false;
+	}
+	if (per_socket) {
+		bpftune_sysctl_read(0, "net.core.wmem_max", &wmem_max);
+		bpftuner_bpf_var_set(tcp_buffer, tuner, per_socket_buffers, true);
+		bpftuner_bpf_var_set(tcp_buffer, tuner, sockbuf_max,
+				     bpftune_option_long("tcp_buffer.sockbuf_max",
+							 TCP_BUFFER_SOCKBUF_MAX));
+		bpftuner_bpf_var_set(tcp_buffer, tuner, net_core_wmem_max,
+				     wmem_max);
+	} else {
+		/* net.core.wmem_max is only tuned in per-socket mode; do not
+		 * claim it otherwise, since an admin writing it would then
+		 * disable the tuner.
+		 */
+		num_tunables = TCP_BUFFER_NET_CORE_WMEM_MAX;
+	}
 	err = bpftuner_bpf_attach(tcp_buffer, tuner, NULL);
 	if (err)
 		return err;
-	return bpftuner_tunables_init(tuner, TCP_BUFFER_NUM_TUNABLES, descs,
+	if (per_socket &&
+	    bpftuner_cgroup_attach(tuner, "tcp_buffer_sockops", BPF_CGROUP_SOCK_OPS))
+		return 1;
+	/* optionally keep sndbuf/rcvbuf programs detached while idle */
+	if (bpftune_option_long("tcp_buffer.on_demand", 0))
+		bpftuner_bpf_progs_ondemand(tuner, ondemand_progs,
+					    bpftune_option_long("tcp_buffer.on_demand_idle",
+								TCP_BUFFER_ONDEMAND_IDLE),
+					    bpftune_option_long("tcp_buffer.on_demand_probe",
+								TCP_BUFFER_ONDEMAND_PROBE));
+	return bpftuner_tunables_init(tuner, num_tunables, descs,
 				      ARRAY_SIZE(scenarios), scenarios);
 }
 
 void fini(struct bpftuner *tuner)
 {
+	struct bpf_map *counters = bpftuner_bpf_map_get(tcp_buffer, tuner,
+							tcp_buffer_counters);
+	__s64 sock_count;
+
 	bpftune_log(LOG_DEBUG, "calling fini for %s\n", tuner->name);
+	if (per_socket)
+		bpftuner_cgroup_detach(tuner, "tcp_buffer_sockops",
+				       BPF_CGROUP_SOCK_OPS);
+	if (!bpftune_percpu_counter_sum(bpf_map__fd(counters),
+					TCP_BUFFER_SOCK_COUNT, &sock_count))
+		bpftune_log(LOG_DEBUG, "tcp socket count: %lld\n",
+			    sock_count > 0 ? (long long)sock_count : 0LL);
 	bpftuner_bpf_fini(tuner);
 }
 
+void periodic(struct bpftuner *tuner)
+{
+	tcp_buffer_mem_refresh(tuner, TCP_BUFFER_MEM_REFRESH * SECOND);
+}
+
+static const char *corr_metric_names[CORR_NUM_METRICS] = {
+	"srtt", "retransmits", "delivery rate"
+};
+
+/* returns true if increases in tunable are correlated with increased
+ * latency or retransmits, without a corresponding increase in delivery
+ * rate.
+ */
+static bool tcp_buffer_corr_latency(struct bpftuner *tuner, int id,
+				    unsigned long netns_cookie,
+				    const char *tunable)
+{
+	long double corrs[CORR_NUM_METRICS] = {};
+	struct corr_key key = {};
+	unsigned int metric;
+
+	key.id = id;
+	key.netns_cookie = netns_cookie;
+	for (metric = 0; metric < CORR_NUM_METRICS; metric++) {
+		struct corr c = {};
+
+		key.metric = metric;
+		if (bpf_map_lookup_elem(tuner->corr_map_fd, &key, &c))
+			continue;
+		corrs[metric] = corr_compute(&c);
+		bpftune_log(LOG_DEBUG, "covar for '%s'/%s netns %ld: %LF ; corr %LF\n",
+			    tunable, corr_metric_names[metric], netns_cookie,
+			    covar_compute(&c), corrs[metric]);
+	}
+	if (corrs[CORR_METRIC_DELIVERY_RATE] > CORR_THRESHOLD)
+		return false;
+	return corrs[CORR_METRIC_SRTT] > CORR_THRESHOLD ||
+	       corrs[CORR_METRIC_RETRANS] > CORR_THRESHOLD;
+}
+
 void event_handler(struct bpftuner *tuner,
 		   struct bpftune_event *event,
 		   __attribute__((unused))void *ctx)
@@ -180,11 +227,8 @@ void event_handler(struct bpftuner *tuner,
 	const char *reason = "unknown reason";
 	bool near_memory_exhaustion, under_memory_pressure, near_memory_pressure;
 	int scenario = event->scenario_id;
-	struct corr c = { 0 };
-	long double corr = 0;
 	const char *tunable;
 	long new[3], old[3];
-	struct corr_key key;
 	int id;
 
 	/* netns cookie not supported; ignore */
@@ -207,6 +251,9 @@ void event_handler(struct bpftuner *tuner,
 					            under_memory_pressure);
 	near_memory_pressure = bpftuner_bpf_var_get(tcp_buffer, tuner,
 						   near_memory_pressure);
+	/* memory available may have changed; refresh limits for next time */
+	if (near_memory_exhaustion || near_memory_pressure)
+		tcp_buffer_mem_refresh(tuner, SECOND);
 	if (near_memory_exhaustion)
 		lowmem = "near memory exhaustion";
 	else if (under_memory_pressure)
@@ -214,17 +261,18 @@ void event_handler(struct bpftuner *tuner,
 	else if (near_memory_pressure)
 		lowmem = "near memory pressure";
 
-	key.id = (__u64)id;
-	key.netns_cookie = event->netns_cookie;
-
-	if (!bpf_map_lookup_elem(tuner->corr_map_fd, &key, &c)) {
-		corr = corr_compute(&c);
-		bpftune_log(LOG_DEBUG, "covar for '%s' netns %ld (new %ld %ld %ld): %LF ; corr %LF\n",
-			    tunable, key.netns_cookie, new[0], new[1], new[2],
-			    covar_compute(&c), corr);
-		if (corr > CORR_THRESHOLD && scenario == TCP_BUFFER_INCREASE)
-			scenario = TCP_BUFFER_NOCHANGE_LATENCY;
+	/* related updates, e.g. wmem/rmem decrease near memory exhaustion */
+	if (event->num_updates > 1) {
+		bpftuner_tunable_sysctls_write(tuner, scenario,
+					       event->netns_cookie,
+					       event->num_updates,
+					       event->update, lowmem);
+		return;
 	}
+
+	if (scenario == TCP_BUFFER_INCREASE &&
+	    tcp_buffer_corr_latency(tuner, id, event->netns_cookie, tunable))
+		scenario = TCP_BUFFER_NOCHANGE_LATENCY;
 	switch (id) {
 	case TCP_BUFFER_TCP_MEM:
 		bpftuner_tunable_sysctl_write(tuner, id, scenario,
@@ -257,6 +305,19 @@ void event_handler(struct bpftuner *tuner,
 		break;
 	case TCP_BUFFER_TCP_MAX_ORPHANS:
 		break;
+	case TCP_BUFFER_NET_CORE_WMEM_MAX:
+		bpftuner_tunable_sysctl_write(tuner, id, scenario,
+					      event->netns_cookie, 1, new,
+"Due to connection(s) needing larger per-socket send buffers, change %s from (%ld) -> (%ld)\n",
+					      tunable, old[0], new[0]);
+		/* BPF requests the increase again (rate-limited) until the
+		 * value it sees has been raised, so only pass on the value
+		 * actually in place.
+		 */
+		if (bpftune_sysctl_read(0, tunable, new) == 1)
+			bpftuner_bpf_var_set(tcp_buffer, tuner,
+					     net_core_wmem_max, new[0]);
+		break;
 	}
 
 }
@@ -28,6 +28,8 @@ enum tcp_buffer_tunables {
 	TCP_BUFFER_TCP_RMEM,
 	TCP_BUFFER_TCP_MEM,
 	TCP_BUFFER_TCP_MAX_ORPHANS,
+	/* only registered in per-socket mode; must be last */
+	TCP_BUFFER_NET_CORE_WMEM_MAX,
 	TCP_BUFFER_NUM_TUNABLES,
 };
 
@@ -38,4 +40,35 @@ enum tcp_buffer_scenarios {
 	TCP_MEM_PRESSURE,
 	TCP_MEM_EXHAUSTION,
 	TCP_MAX_ORPHANS_INCREASE,
+	TCP_BUFFER_SOCKBUF_INCREASE,
+};
+
+/* default cap on per-socket buffer size in per-socket mode */
+#define TCP_BUFFER_SOCKBUF_MAX	(64 << 20)
+
+/* a net.core.wmem_max increase not yet made is requested again after */
+#define TCP_BUFFER_SOCKBUF_RETRY	(10 * SECOND)
+
+/* samplers gating the hot-path sndbuf/rcvbuf programs */
+enum tcp_buffer_samplers {
+	TCP_BUFFER_SAMPLE_SNDBUF,
+	TCP_BUFFER_SAMPLE_RCVBUF,
+	TCP_BUFFER_NUM_SAMPLERS,
+};
+
+/* in on-demand mode, detach sndbuf/rcvbuf programs after this long
+ * without useful samples, and re-attach them to probe this often.
+ */
+#define TCP_BUFFER_ONDEMAND_IDLE	30	/* seconds */
+#define TCP_BUFFER_ONDEMAND_PROBE	60	/* seconds */
+
+/* tcp_mem limits are computed from /proc/zoneinfo per NUMA node, and
+ * refreshed periodically and (at most once a second) on TCP memory
+ * pressure events.
+ */
+#define TCP_BUFFER_MEM_REFRESH		10	/* seconds */
+
+enum tcp_buffer_counters {
+	TCP_BUFFER_SOCK_COUNT,
+	TCP_BUFFER_NUM_COUNTERS,
 };
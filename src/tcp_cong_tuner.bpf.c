@@ -17,26 +17,145 @@
  * Boston, MA 021110-1307, USA.
  */
 
+
 #include <bpftune/bpftune.bpf.h>
 
 #include "tcp_cong_tuner.h"
 
-const char bbr[4] = { 'b', 'b', 'r', '\0' };
+/* indexed by enum tcp_cong_alg; "" means use system default */
+const char cong_algs[TCP_CONG_NUM_ALGS][CONG_MAXNAME] = {
+	[TCP_CONG_ALG_DEFAULT]	= "",
+	[TCP_CONG_ALG_BBR]	= "bbr",
+	[TCP_CONG_ALG_DCTCP]	= "dctcp",
+};
+
+/* bitmask of available algorithms (1 << enum tcp_cong_alg); set from
+ * userspace.
+ */
+unsigned int cong_available;
+
+/* system default algorithm, which sockets we moved to another algorithm
+ * are returned to when the default is selected again; set from userspace.
+ */
+char cong_default[CONG_MAXNAME];
 
 struct remote_host {
 	__u64 last_retransmit;
 	__u64 retransmits;
 	bool retransmit_threshold;
 	char cong_alg[CONG_MAXNAME];
+	__u64 last_change;
+	__u32 srtt_us;			/* EWMA of observed srtt */
+	__u16 ecn;			/* EWMA of connections negotiating ECN */
+	__u16 ce;			/* ...and of those seeing CE marks */
+	__u8 alg;			/* current enum tcp_cong_alg */
+	__u8 candidate;			/* candidate alg ... */
+	__u8 candidate_count;		/* ...and how many periods in a row chosen */
+	__u64 last_eval;		/* time of last selection evaluation */
+	__u64 last_sample;		/* time of last delivery rate sample */
+	/* EWMA of delivery rate (bytes/msec) observed using each alg */
+	__u32 goodput[TCP_CONG_NUM_ALGS];
 };
 
+/* LRU so that with many remote hosts we keep tracking the most recently
+ * active ones rather than silently failing to add new ones.
+ */
 struct {
-	__uint(type, BPF_MAP_TYPE_HASH);
-	__uint(max_entries, 1024);
-	__type(key, struct in6_addr);
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, REMOTE_HOST_MAX);
+	__type(key, struct bpftune_host_key);
 	__type(value, struct remote_host);
 } remote_host_map SEC(".maps");
 
+/* remote hosts (or prefixes) whose selection changed since the last
+ * iterator sweep; the iterator skips all sockets to other destinations.
+ * Values are the sweep generation (dirty_gen) current when marked;
+ * userspace advances dirty_gen before each sweep, and afterwards only
+ * removes entries marked in earlier generations, so hosts re-marked
+ * while the sweep runs are kept for the next one.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, DIRTY_HOST_MAX);
+	__type(key, struct bpftune_host_key);
+	__type(value, __u32);
+} dirty_host_map SEC(".maps");
+
+__u32 dirty_gen;
+
+/* set to the generation if dirty_host_map filled up; next sweep then
+ * covers all sockets.
+ */
+__u32 dirty_overflow;
+
+static __always_inline void mark_dirty(struct bpftune_host_key *key)
+{
+	__u32 gen = dirty_gen;
+
+	if (bpf_map_update_elem(&dirty_host_map, key, &gen, BPF_ANY))
+		dirty_overflow = gen;
+}
+
+#ifndef BPFTUNE_LEGACY
+/* with cgroup-scoped tuning, cgroups in which the sockops program (which
+ * is only attached to the chosen subtrees) has seen connections.  The
+ * retransmit and iterator programs see all TCP sockets, and skip those
+ * in other cgroups.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, CONG_CGROUP_MAX);
+	__type(key, __u64);
+	__type(value, __u8);
+} cong_cgroup_map SEC(".maps");
+
+static __always_inline bool cong_cgroup_in_scope(__u64 cgroup_id)
+{
+	return !bpftune_cgroup_scoped ||
+	       bpf_map_lookup_elem(&cong_cgroup_map, &cgroup_id) != NULL;
+}
+#endif
+
+/* if non-zero, aggregate remote hosts by prefix; set from userspace */
+unsigned int remote_prefix_v4;
+unsigned int remote_prefix_v6;
+
+/* mask remote address to configured prefix length, so that congestion
+ * decisions apply to (and are learned from) the whole remote network.
+ * IPv4 addresses are stored in the first 32 bits of the key.
+ */
+static __always_inline void remote_host_key_mask(struct bpftune_host_key *key,
+						 int family)
+{
+	unsigned int bits, max, i;
+
+	switch (family) {
+	case AF_INET:
+		bits = remote_prefix_v4;
+		max = 32;
+		break;
+	case AF_INET6:
+		bits = remote_prefix_v6;
+		max = 128;
+		break;
+	default:
+		return;
+	}
+	if (!bits || bits >= max)
+		return;
+#pragma clang loop unroll(full)
+	for (i = 0; i < 4; i++) {
+		if (bits >= 32) {
+			bits -= 32;
+			continue;
+		}
+		if (bits)
+			key->addr[i] &= bpf_htonl(~0U << (32 - bits));
+		else
+			key->addr[i] = 0;
+		bits = 0;
+	}
+}
 
 static __always_inline bool
 retransmit_threshold(struct remote_host *remote_host,
@@ -61,15 +180,132 @@ retransmit_threshold(struct remote_host *remote_host,
 	} else if (total_retrans > (segs_out >> 5)) {
 		/* with retransmission rate of > 1%, BBR performs better. */
 		remote_host->retransmit_threshold = true;
-		__builtin_memcpy(remote_host->cong_alg, bbr,
-				 sizeof(remote_host->cong_alg));
 	}
 	remote_host->last_retransmit = now;
 
 	return remote_host->retransmit_threshold;
 }
 
-static __always_inline struct remote_host *get_remote_host(struct in6_addr *key)
+/* update EWMA of the fraction (scaled to CONG_ECN_ONE) of observations
+ * for which seen is true.
+ */
+static __always_inline void cong_ecn_ewma(__u16 *ewma, bool seen)
+{
+	*ewma += ((seen ? CONG_ECN_ONE : 0) >> 3) - (*ewma >> 3);
+}
+
+/* record srtt, ECN use and delivery rate (bytes/msec) for a connection
+ * to the remote host; delivery rate is scored against the algorithm in
+ * use.  ECN and CE use are aggregated over connections to the host, so
+ * one connection does not flip the host between ECN and non-ECN.  Whether
+ * CE marks are seen is only known once an ECN connection has delivered
+ * data, so CE evidence is left unchanged otherwise.
+ */
+static __always_inline void cong_observe(struct remote_host *remote_host,
+					 __u32 srtt_us, bool ecn,
+					 __u32 delivered, __u32 delivered_ce,
+					 __u64 rate)
+{
+	__u8 alg = remote_host->alg;
+
+	if (srtt_us) {
+		if (remote_host->srtt_us)
+			remote_host->srtt_us += (srtt_us >> 3) -
+						(remote_host->srtt_us >> 3);
+		else
+			remote_host->srtt_us = srtt_us;
+	}
+	cong_ecn_ewma(&remote_host->ecn, ecn);
+	if (ecn && delivered)
+		cong_ecn_ewma(&remote_host->ce, delivered_ce > 0);
+	if (!rate || alg >= TCP_CONG_NUM_ALGS)
+		return;
+	if (rate > 0xffffffff)
+		rate = 0xffffffff;
+	if (remote_host->goodput[alg])
+		remote_host->goodput[alg] += ((__u32)rate >> 3) -
+					     (remote_host->goodput[alg] >> 3);
+	else
+		remote_host->goodput[alg] = rate;
+}
+
+static __always_inline __u8 cong_candidate(struct remote_host *remote_host)
+{
+	/* low-latency peers on a path with ECN marking are likely in the
+	 * same datacenter; ECN negotiation alone says nothing about the path.
+	 */
+	if (remote_host->ecn >= CONG_ECN_THRESHOLD &&
+	    remote_host->ce >= CONG_CE_THRESHOLD && remote_host->srtt_us &&
+	    remote_host->srtt_us < CONG_DC_RTT_US &&
+	    (cong_available & (1 << TCP_CONG_ALG_DCTCP)))
+		return TCP_CONG_ALG_DCTCP;
+	if (remote_host->retransmit_threshold &&
+	    (cong_available & (1 << TCP_CONG_ALG_BBR)))
+		return TCP_CONG_ALG_BBR;
+	return TCP_CONG_ALG_DEFAULT;
+}
+
+/* choose algorithm for remote host; to avoid flapping, a new algorithm
+ * must be the candidate for CONG_HYSTERESIS consecutive evaluations and
+ * the previous choice must have been in place for CONG_HOLD.  Selection
+ * is evaluated at most once per CONG_EVAL_INTERVAL, so a burst of
+ * retransmits or new connections counts once.  A switch is also skipped
+ * if the candidate has been observed to deliver significantly lower
+ * goodput to this host than the current algorithm.  Returns true if the
+ * algorithm changed.
+ */
+static __always_inline bool cong_select(struct remote_host *remote_host)
+{
+	__u8 candidate, alg = remote_host->alg;
+	__u64 now = bpf_ktime_get_ns();
+	__u32 cur_goodput, new_goodput;
+
+	if (remote_host->last_eval &&
+	    (now - remote_host->last_eval) < CONG_EVAL_INTERVAL)
+		return false;
+	remote_host->last_eval = now;
+	candidate = cong_candidate(remote_host);
+
+	if (candidate == alg || alg >= TCP_CONG_NUM_ALGS) {
+		remote_host->candidate_count = 0;
+		return false;
+	}
+	if (candidate != remote_host->candidate) {
+		remote_host->candidate = candidate;
+		remote_host->candidate_count = 0;
+	}
+	if (++remote_host->candidate_count < CONG_HYSTERESIS)
+		return false;
+	if (remote_host->last_change &&
+	    (now - remote_host->last_change) < CONG_HOLD)
+		return false;
+	cur_goodput = remote_host->goodput[alg];
+	new_goodput = remote_host->goodput[candidate];
+	if (cur_goodput && new_goodput &&
+	    new_goodput < cur_goodput - (cur_goodput >> 2))
+		return false;
+
+	remote_host->alg = candidate;
+	remote_host->candidate_count = 0;
+	remote_host->last_change = now;
+	switch (candidate) {
+	case TCP_CONG_ALG_BBR:
+		__builtin_memcpy(remote_host->cong_alg, cong_algs[TCP_CONG_ALG_BBR],
+				 sizeof(remote_host->cong_alg));
+		break;
+	case TCP_CONG_ALG_DCTCP:
+		__builtin_memcpy(remote_host->cong_alg, cong_algs[TCP_CONG_ALG_DCTCP],
+				 sizeof(remote_host->cong_alg));
+		break;
+	default:
+		__builtin_memset(remote_host->cong_alg, 0,
+				 sizeof(remote_host->cong_alg));
+		break;
+	}
+	return true;
+}
+
+static __always_inline struct remote_host *get_remote_host(struct bpftune_host_key *key)
 {
 	struct remote_host *remote_host = NULL;
 
@@ -84,110 +320,211 @@ static __always_inline struct remote_host *get_remote_host(struct in6_addr *key)
 	return remote_host;
 }
 
-static __always_inline void set_cong(void *ctx, struct remote_host *remote_host)
+/* set the algorithm selected for the remote host on the socket; dctcp
+ * needs ECN feedback, so sockets which did not negotiate ECN get the
+ * default instead.
+ */
+static __always_inline void set_cong(void *ctx, struct remote_host *remote_host,
+				     bool ecn)
 {
-	char buf[CONG_MAXNAME] = {};
+	char buf[CONG_MAXNAME] = {}, alg[CONG_MAXNAME] = {};
+	bool use_default;
 	int ret;
 
+	if (bpf_getsockopt(ctx, SOL_TCP, TCP_CONGESTION, &buf, sizeof(buf)))
+		return;
+	use_default = remote_host->cong_alg[0] == '\0' ||
+		      (!ecn && remote_host->alg == TCP_CONG_ALG_DCTCP);
+	if (use_default) {
+		/* default selected; only sockets on an algorithm we select
+		 * (i.e. before the host switched back) are moved to it.
+		 */
+		if (cong_default[0] == '\0' ||
+		    (__strncmp(buf, cong_algs[TCP_CONG_ALG_BBR], sizeof(buf)) &&
+		     __strncmp(buf, cong_algs[TCP_CONG_ALG_DCTCP], sizeof(buf))))
+			return;
+		__builtin_memcpy(alg, cong_default, sizeof(alg));
+	} else {
+		__builtin_memcpy(alg, remote_host->cong_alg, sizeof(alg));
+	}
 	/* check if cong alg already set */
-	if (bpf_getsockopt(ctx, SOL_TCP, TCP_CONGESTION, &buf, sizeof(buf)) ||
-	    __strncmp(remote_host->cong_alg, buf, sizeof(buf)) == 0)
+	if (__strncmp(alg, buf, sizeof(buf)) == 0)
 		return;
-	ret = bpf_setsockopt(ctx, SOL_TCP, TCP_CONGESTION,
-			     &remote_host->cong_alg,
-			     sizeof(remote_host->cong_alg));
-	bpftune_debug("cong_tuner: set cong '%s': %d\n",
-		      remote_host->cong_alg, ret);
+	ret = bpf_setsockopt(ctx, SOL_TCP, TCP_CONGESTION, alg, sizeof(alg));
+	bpftune_debug("cong_tuner: set cong '%s': %d\n", alg, ret);
 }
 
-#ifdef BPFTUNE_LEGACY
-/* in legacy mode, use sockops prog to set cong algoritm when retransmit
- * threshold is passed.  Because we need to enable retransmit sock ops
- * events on socket accept/connect, this does not work for existing
- * connections which were initiated prior to bpftune starting.
+static __always_inline void send_cong_event(struct remote_host *remote_host,
+					    struct tcp_cong_event *e,
+					    long netns_cookie)
+{
+	struct bpftune_event *event;
+
+	STATIC_ASSERT(sizeof(event->raw_data) >= sizeof(*e),
+		      "event->raw_data too small");
+	/* only the remote host key and family in raw_data are needed. */
+	event = bpftune_event_reserve(BPFTUNE_EVENT_RAW, sizeof(*e));
+	if (!event)
+		return;
+	event->scenario_id = remote_host->alg;
+	event->netns_cookie = netns_cookie;
+	__builtin_memcpy(&event->raw_data, e, sizeof(*e));
+	bpftune_event_submit(event);
+}
+
+/* On connection establishment, record RTT and ECN use for the remote
+ * host, and set the algorithm selected for it.  Per-RTT events are then
+ * enabled so that delivery rate (goodput) under the algorithm in use is
+ * sampled - at most once per CONG_SAMPLE_INTERVAL for a remote host -
+ * throughout the connection rather than only when it retransmits.  In
+ * legacy mode, we use retransmit sock ops events instead, which also
+ * track loss since tracepoint and iterator programs are not available;
+ * because we need to enable retransmit sock ops events on socket
+ * accept/connect, this does not work for existing connections which
+ * were initiated prior to bpftune starting.
  */
 SEC("sockops")
 int cong_tuner_sockops(struct bpf_sock_ops *ops)
 {
 	struct remote_host *remote_host;
-	struct bpftune_event event = {};
-	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&event.raw_data;
-	struct in6_addr *key = &sin6->sin6_addr;
-	bool prior_retransmit_threshold;
+	struct tcp_cong_event cong_event = {};
+	struct tcp_cong_event *e = &cong_event;
+	struct bpftune_host_key *key = &e->key;
+	bool established = false, ecn = false;
+	__u32 delivered = 0, delivered_ce = 0;
+	__u64 rate = 0, now;
 
 	switch (ops->op) {
 	case BPF_SOCK_OPS_ACTIVE_ESTABLISHED_CB:
 	case BPF_SOCK_OPS_PASSIVE_ESTABLISHED_CB:
+#ifdef BPFTUNE_LEGACY
 		/* enable retransmission events */
 		bpf_sock_ops_cb_flags_set(ops, BPF_SOCK_OPS_RETRANS_CB_FLAG);
-		return 1;
+#else
+		/* enable per-RTT events to sample goodput */
+		bpf_sock_ops_cb_flags_set(ops, ops->bpf_sock_ops_cb_flags |
+					       BPF_SOCK_OPS_RTT_CB_FLAG);
+#endif
+		established = true;
+		break;
+#ifdef BPFTUNE_LEGACY
 	case BPF_SOCK_OPS_RETRANS_CB:
+#else
+	case BPF_SOCK_OPS_RTT_CB:
+#endif
 		break;
 	default:
 		return 1;
 	}
-	sin6->sin6_family = ops->family;
+	e->family = ops->family;
 	switch (ops->family) {
 	case AF_INET:
-		sin6->sin6_addr.s6_addr32[0] = ops->remote_ip4;
+		key->addr[0] = ops->remote_ip4;
 		break;
 	case AF_INET6:
-		sin6->sin6_addr.s6_addr32[0] = ops->remote_ip6[0];
-		sin6->sin6_addr.s6_addr32[1] = ops->remote_ip6[1];
-		sin6->sin6_addr.s6_addr32[2] = ops->remote_ip6[2];
-		sin6->sin6_addr.s6_addr32[3] = ops->remote_ip6[3];
+		key->addr[0] = ops->remote_ip6[0];
+		key->addr[1] = ops->remote_ip6[1];
+		key->addr[2] = ops->remote_ip6[2];
+		key->addr[3] = ops->remote_ip6[3];
 		break;
 	default:
 		return 1;
 	}
-
+	remote_host_key_mask(key, ops->family);
+
+#ifndef BPFTUNE_LEGACY
+	if (ops->sk) {
+		struct tcp_sock *tp = bpf_skc_to_tcp_sock(ops->sk);
+		__u8 seen = 1;
+
+		if (tp) {
+			ecn = BPF_CORE_READ(tp, ecn_flags) & TCP_ECN_OK;
+			delivered = BPF_CORE_READ(tp, delivered);
+			delivered_ce = BPF_CORE_READ(tp, delivered_ce);
+			key->cgroup_id = get_sk_cgroup_id((struct sock *)tp);
+		}
+		/* record that this cgroup is in scope for other programs;
+		 * only done at establishment, and only if not already
+		 * recorded, to keep map updates off the per-RTT path.
+		 */
+		if (established && bpftune_cgroup_scoped && key->cgroup_id &&
+		    !bpf_map_lookup_elem(&cong_cgroup_map, &key->cgroup_id))
+			bpf_map_update_elem(&cong_cgroup_map, &key->cgroup_id,
+					    &seen, BPF_ANY);
+	}
+#endif
 	remote_host = get_remote_host(key);
 	if (!remote_host)
 		return 1;
-	prior_retransmit_threshold = remote_host->retransmit_threshold;
-
-	if (!retransmit_threshold(remote_host, ops->segs_out,
-				  ops->total_retrans))
-		return 1;
 
-	set_cong(ops, remote_host);
+	if (!established) {
+		now = bpf_ktime_get_ns();
+		if (remote_host->last_sample &&
+		    (now - remote_host->last_sample) < CONG_SAMPLE_INTERVAL)
+			return 1;
+		remote_host->last_sample = now;
+		if (ops->rate_interval_us)
+			rate = ((__u64)ops->rate_delivered * ops->mss_cache *
+				1000) / ops->rate_interval_us;
+#ifdef BPFTUNE_LEGACY
+		retransmit_threshold(remote_host, ops->segs_out,
+				     ops->total_retrans);
+#endif
+	}
+	cong_observe(remote_host, ops->srtt_us >> 3, ecn, delivered,
+		     delivered_ce, rate);
 
-	/* if first sock to cross threshold for remote host, send event. */
-	if (!prior_retransmit_threshold) {
-		event.tuner_id = tuner_id;
-		event.scenario_id = TCP_CONG_BBR;
-		bpf_ringbuf_output(&ring_buffer_map, &event, sizeof(event), 0);
+	if (cong_select(remote_host)) {
+#ifndef BPFTUNE_LEGACY
+		/* other existing connections to this host need updating */
+		mark_dirty(key);
+#endif
+		send_cong_event(remote_host, e, 0);
 	}
+	set_cong(ops, remote_host, ecn);
 
 	return 1;
 }
-#else
-static __always_inline int get_sk_key(struct sock *sk, struct in6_addr *key)
+
+#ifndef BPFTUNE_LEGACY
+/* fails for sockets in cgroups outside the subtrees tuning is scoped to */
+static __always_inline int get_sk_key(struct sock *sk,
+				      struct bpftune_host_key *key)
 {
 	int family = BPF_CORE_READ(sk, sk_family);
+	int ret;
+
+	key->cgroup_id = get_sk_cgroup_id(sk);
+	if (!cong_cgroup_in_scope(key->cgroup_id))
+		return -ENOENT;
 
 	switch (family) {
 	case AF_INET:
-		return bpf_probe_read_kernel(key, sizeof(sk->sk_daddr),
-					     __builtin_preserve_access_index(&sk->sk_daddr));
+		ret = bpf_probe_read_kernel(key->addr, sizeof(sk->sk_daddr),
+					    __builtin_preserve_access_index(&sk->sk_daddr));
+		break;
 	case AF_INET6:
-		return bpf_probe_read_kernel(key, sizeof(*key),
-					     __builtin_preserve_access_index(&sk->sk_v6_daddr));
+		ret = bpf_probe_read_kernel(key->addr, sizeof(key->addr),
+					    __builtin_preserve_access_index(&sk->sk_v6_daddr));
+		break;
 	default:
 		return -EINVAL;
 	}
+	if (!ret)
+		remote_host_key_mask(key, family);
+	return ret;
 }
 
 SEC("tp_btf/tcp_retransmit_skb")
 int BPF_PROG(cong_retransmit, struct sock *sk, struct sk_buff *skb)
 {
 	struct remote_host *remote_host;
-	struct bpftune_event event = {};
-	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&event.raw_data;
+	struct tcp_cong_event cong_event = {};
+	struct tcp_cong_event *e = &cong_event;
 	struct tcp_sock *tp = (struct tcp_sock *)sk;
-	struct in6_addr *key = &sin6->sin6_addr;
+	struct bpftune_host_key *key = &e->key;
 	__u32 segs_out = 0, total_retrans = 0;
-	int id = TCP_CONG_BBR;
+	long netns_cookie;
 	struct net *net;
 
 	if (get_sk_key(sk, key))
@@ -197,40 +534,46 @@ int BPF_PROG(cong_retransmit, struct sock *sk, struct sk_buff *skb)
 	if (!remote_host)
 		return 0;
 
-	/* already sent ringbuf message */
-	if (remote_host->retransmit_threshold)
-		return 0;
-
 	segs_out = BPF_CORE_READ(tp, segs_out);
 	total_retrans = BPF_CORE_READ(tp, total_retrans);
 
-	if (!retransmit_threshold(remote_host, segs_out, total_retrans))
+	retransmit_threshold(remote_host, segs_out, total_retrans);
+	/* goodput is sampled by the sockops program; a sample taken while
+	 * retransmitting would understate it.
+	 */
+	cong_observe(remote_host, BPF_CORE_READ(tp, srtt_us) >> 3,
+		     BPF_CORE_READ(tp, ecn_flags) & TCP_ECN_OK,
+		     BPF_CORE_READ(tp, delivered),
+		     BPF_CORE_READ(tp, delivered_ce), 0);
+
+	/* only send event when selection changes */
+	if (!cong_select(remote_host))
                 return 0;
 
-	sin6->sin6_family = BPF_CORE_READ(sk, sk_family);
-	event.tuner_id = tuner_id;
-	event.scenario_id = id;
+	e->family = BPF_CORE_READ(sk, sk_family);
 	net = BPF_CORE_READ(sk, sk_net.net);
-	event.netns_cookie = get_netns_cookie(net);
-	if (event.netns_cookie < 0)
+	netns_cookie = get_netns_cookie(net);
+	if (netns_cookie < 0)
 		return 0;
-	bpf_ringbuf_output(&ring_buffer_map, &event, sizeof(event), 0);
+	mark_dirty(key);
+	send_cong_event(remote_host, e, netns_cookie);
 
 	return 0;
 }
 
 
 /* specify congestion control algorithm here via iterator (to catch
- * existing + new TCP connections) for connections to remote hosts which
- * have seen retransmits in the past.  The event sent from the retransmit
- * threshold being surpassed will trigger the iterator.
+ * existing + new TCP connections) for connections to remote hosts for
+ * which selection has changed.  The event sent when selection changes
+ * schedules a sweep; only sockets to dirty hosts are updated, so the
+ * per-socket cost for the rest is a key read and a hash lookup.
  */
 SEC("iter/tcp")
 int bpftune_cong_iter(struct bpf_iter__tcp *ctx)
 {
 	struct sock_common *skc = ctx->sk_common;
 	struct remote_host *remote_host;
-	struct in6_addr key = {};
+	struct bpftune_host_key key = {};
         struct sock *sk = NULL;
 
 	if (skc)
@@ -241,15 +584,14 @@ int bpftune_cong_iter(struct bpf_iter__tcp *ctx)
 	if (get_sk_key(sk, &key))
 		return 0;
 
-	remote_host = get_remote_host(&key);
-	if (!remote_host)
+	if (!dirty_overflow && !bpf_map_lookup_elem(&dirty_host_map, &key))
 		return 0;
-
-	if (!remote_host->retransmit_threshold ||
-	    remote_host->cong_alg[0] == '\0')
+	remote_host = bpf_map_lookup_elem(&remote_host_map, &key);
+	if (!remote_host)
 		return 0;
 
-	set_cong(sk, remote_host);
+	set_cong(sk, remote_host,
+		 BPF_CORE_READ((struct tcp_sock *)sk, ecn_flags) & TCP_ECN_OK);
 
 	return 0;
 }
@@ -35,13 +35,71 @@ static struct bpftunable_desc descs[] = {
 };
 
 static struct bpftunable_scenario scenarios[] = {
+{ TCP_CONG_DEFAULT,	"specify default congestion control",
+  "Because conditions which favoured another congestion control algorithm no longer apply for a remote host, use the default algorithm" },
 { TCP_CONG_BBR,		"specify bbr congestion control",
   "Because loss rate has exceeded 1 percent for a connection, use bbr congestion control algorithm instead of default" },
+{ TCP_CONG_DCTCP,	"specify dctcp congestion control",
+  "Because a remote host has low latency and the path to it marks ECN it is likely in the same datacenter, so use dctcp congestion control algorithm" },
 };
 
+static const char *cong_alg_names[TCP_CONG_NUM_ALGS] = {
+	[TCP_CONG_ALG_DEFAULT]	= "default",
+	[TCP_CONG_ALG_BBR]	= "bbr",
+	[TCP_CONG_ALG_DCTCP]	= "dctcp",
+};
+
+/* return bitmask of available algorithms (1 << enum tcp_cong_alg) */
+static unsigned int cong_available(void)
+{
+	unsigned int available = 1 << TCP_CONG_ALG_DEFAULT;
+	char algs[256] = "", *alg;
+	FILE *fp;
+	int i;
+
+	fp = fopen("/proc/sys/net/ipv4/tcp_available_congestion_control", "r");
+	if (!fp)
+		return available;
+	if (!fgets(algs, sizeof(algs), fp))
+		algs[0] = '\0';
+	fclose(fp);
+	for (alg = strtok(algs, " \n"); alg; alg = strtok(NULL, " \n")) {
+		for (i = TCP_CONG_ALG_DEFAULT + 1; i < TCP_CONG_NUM_ALGS; i++) {
+			if (strcmp(alg, cong_alg_names[i]) == 0)
+				available |= 1 << i;
+		}
+	}
+	return available;
+}
+
+/* read system default algorithm into name; left empty on failure */
+static void cong_default(char *name, size_t len)
+{
+	FILE *fp;
+
+	name[0] = '\0';
+	fp = fopen("/proc/sys/net/ipv4/tcp_congestion_control", "r");
+	if (!fp)
+		return;
+	if (!fgets(name, len, fp))
+		name[0] = '\0';
+	fclose(fp);
+	name[strcspn(name, " \n")] = '\0';
+}
+
 struct tcp_cong_tuner_bpf *skel;
 
-int tcp_iter_fd;
+static struct bpf_link *tcp_iter_link;
+static bool sweep_pending;
+static __u64 last_sweep;
+
+static long prefix_v4, prefix_v6;
+
+/* learned per-remote-host congestion control choices */
+static const char *persist_maps[] = {
+	"remote_host_map",
+	NULL
+};
 
 int init(struct bpftuner *tuner)
 {
@@ -54,8 +112,35 @@ int init(struct bpftuner *tuner)
 	if (err != -EEXIST)
 		bpftune_log(LOG_DEBUG, "could not load tcp_bbr module: %s\n",
 			    strerror(-err));
+	err = bpftune_module_load("net/ipv4/tcp_dctcp.ko");
+	if (err != -EEXIST)
+		bpftune_log(LOG_DEBUG, "could not load tcp_dctcp module: %s\n",
+			    strerror(-err));
 
-	err = bpftuner_bpf_init(tcp_cong, tuner, NULL);
+	err = bpftuner_bpf_open(tcp_cong, tuner);
+	if (err)
+		return err;
+	tuner->persist_maps = persist_maps;
+	err = bpftuner_bpf_load(tcp_cong, tuner);
+	if (err)
+		return err;
+	/* optionally aggregate remote hosts by prefix, e.g. /24, /48 */
+	prefix_v4 = bpftune_option_long("tcp_cong.prefix_v4", 0);
+	prefix_v6 = bpftune_option_long("tcp_cong.prefix_v6", 0);
+	if (prefix_v4 < 0 || prefix_v4 > 32)
+		prefix_v4 = 0;
+	if (prefix_v6 < 0 || prefix_v6 > 128)
+		prefix_v6 = 0;
+	bpftuner_bpf_var_set(tcp_cong, tuner, remote_prefix_v4, prefix_v4);
+	bpftuner_bpf_var_set(tcp_cong, tuner, remote_prefix_v6, prefix_v6);
+	bpftuner_bpf_var_set(tcp_cong, tuner, cong_available, cong_available());
+	/* generation 0 is reserved to mean no dirty_overflow */
+	bpftuner_bpf_var_set(tcp_cong, tuner, dirty_gen, 1);
+	cong_default(*bpftuner_bpf_var_ptr(tcp_cong, tuner, cong_default),
+		     CONG_MAXNAME);
+	bpftune_log(LOG_DEBUG, "tcp_cong: default algorithm is '%s'\n",
+		    *bpftuner_bpf_var_ptr(tcp_cong, tuner, cong_default));
+	err = bpftuner_bpf_attach(tcp_cong, tuner, NULL);
 	if (err)
 		return err;
 
@@ -65,12 +150,10 @@ int init(struct bpftuner *tuner)
 		return 1;
 	}
 
-	if (tuner->bpf_legacy) {
-
-		/* attach to root cgroup */
-		if (bpftuner_cgroup_attach(tuner, "cong_tuner_sockops", BPF_CGROUP_SOCK_OPS))
-			goto error;
-	} else {
+	/* attach to root cgroup */
+	if (bpftuner_cgroup_attach(tuner, "cong_tuner_sockops", BPF_CGROUP_SOCK_OPS))
+		goto error;
+	if (!tuner->bpf_legacy) {
 		struct bpf_link *link;
 
 		skel = tuner->skel;
@@ -80,12 +163,7 @@ int init(struct bpftuner *tuner)
 				    strerror(libbpf_get_error(link)));
 			goto error;
 		}
-		tcp_iter_fd = bpf_iter_create(bpf_link__fd(link));
-		if (tcp_iter_fd < 0) {
-			bpftune_log(LOG_ERR, "cannot create iter fd: %s\n",
-				    strerror(errno));
-			goto error;
-		}
+		tcp_iter_link = link;
 	}
 
 	return bpftuner_tunables_init(tuner, ARRAY_SIZE(descs), descs,
@@ -98,32 +176,131 @@ error:
 void fini(struct bpftuner *tuner)
 {
 	bpftune_log(LOG_DEBUG, "calling fini for %s\n", tuner->name);
-	if (tuner->bpf_legacy)
-		bpftuner_cgroup_detach(tuner, "cong_tuner_sockops", BPF_CGROUP_SOCK_OPS);
-	if (tcp_iter_fd)
-		close(tcp_iter_fd);
+	bpftuner_cgroup_detach(tuner, "cong_tuner_sockops", BPF_CGROUP_SOCK_OPS);
+	if (tcp_iter_link) {
+		bpf_link__destroy(tcp_iter_link);
+		tcp_iter_link = NULL;
+	}
 	bpftuner_bpf_fini(tuner);
 }
 
+/* run the iterator over existing TCP connections, updating those to
+ * hosts marked dirty.  Each sweep needs its own iterator fd, since once
+ * read to completion an iterator fd just returns 0.  The generation is
+ * advanced first, so hosts (or overflow) marked while the sweep runs
+ * carry a later one; afterwards only marks from this or earlier
+ * generations are cleared.  Entries are removed with lookup-and-delete
+ * and re-added if re-marked, so a mark racing with removal is not lost.
+ */
+static void cong_sweep(struct bpftuner *tuner)
+{
+	static struct bpftune_host_key keys[DIRTY_HOST_MAX];
+	__u32 *dirty_gen = bpftuner_bpf_var_ptr(tcp_cong, tuner, dirty_gen);
+	__u32 *dirty_overflow = bpftuner_bpf_var_ptr(tcp_cong, tuner,
+						     dirty_overflow);
+	struct bpftune_host_key *prev = NULL;
+	unsigned int i, nkeys = 0;
+	__u32 gen, overflow, val;
+	char iterbuf;
+	int map_fd, iter_fd;
+
+	map_fd = bpf_map__fd(bpftuner_bpf_map_get(tcp_cong, tuner,
+						  dirty_host_map));
+	gen = __atomic_load_n(dirty_gen, __ATOMIC_ACQUIRE);
+	__atomic_store_n(dirty_gen, gen + 1, __ATOMIC_RELEASE);
+	while (nkeys < DIRTY_HOST_MAX &&
+	       !bpf_map_get_next_key(map_fd, prev, &keys[nkeys])) {
+		prev = &keys[nkeys];
+		nkeys++;
+	}
+	overflow = __atomic_load_n(dirty_overflow, __ATOMIC_ACQUIRE);
+	if (!nkeys && !overflow)
+		return;
+
+	iter_fd = bpf_iter_create(bpf_link__fd(tcp_iter_link));
+	if (iter_fd < 0) {
+		bpftune_log(LOG_ERR, "cannot create iter fd: %s\n",
+			    strerror(errno));
+		return;
+	}
+	for (;;) {
+		ssize_t ret = read(iter_fd, &iterbuf, sizeof(iterbuf));
+
+		if (ret > 0 || (ret < 0 && errno == EAGAIN))
+			continue;
+		if (ret < 0)
+			bpftune_log(LOG_DEBUG, "iter read failed: %s\n",
+				    strerror(errno));
+		break;
+	}
+	close(iter_fd);
+
+	for (i = 0; i < nkeys; i++) {
+		if (bpf_map_lookup_and_delete_elem(map_fd, &keys[i], &val)) {
+			if (errno == ENOENT)
+				continue;
+			/* no lookup-and-delete for hash maps (< 5.14) */
+			if (!bpf_map_lookup_elem(map_fd, &keys[i], &val) &&
+			    val <= gen)
+				bpf_map_delete_elem(map_fd, &keys[i]);
+			continue;
+		}
+		if (val > gen)
+			bpf_map_update_elem(map_fd, &keys[i], &val, BPF_NOEXIST);
+	}
+	if (overflow && overflow <= gen)
+		__atomic_compare_exchange_n(dirty_overflow, &overflow, 0, false,
+					    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	bpftune_log(LOG_DEBUG, "tcp_cong: swept connections for %u hosts%s\n",
+		    nkeys, overflow ? " (full sweep)" : "");
+}
+
+/* sweeps are deferred to here so that many selection changes in a
+ * short interval result in a single walk over all TCP sockets.
+ */
+void periodic(struct bpftuner *tuner)
+{
+	__u64 now;
+
+	if (!sweep_pending || !tcp_iter_link)
+		return;
+	now = bpftune_ktime_ns();
+	if (now - last_sweep < TCP_CONG_SWEEP_INTERVAL)
+		return;
+	if (bpftune_cap_add())
+		return;
+	cong_sweep(tuner);
+	bpftune_cap_drop();
+	sweep_pending = false;
+	last_sweep = now;
+}
+
 void event_handler(struct bpftuner *tuner, struct bpftune_event *event,
 		   __attribute__((unused))void *ctx)
 {
-	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&event->raw_data;
+	struct tcp_cong_event *e = (struct tcp_cong_event *)&event->raw_data;
 	unsigned int id = event->scenario_id;
 	char buf[INET6_ADDRSTRLEN];
-	char iterbuf;
+	long prefix = e->family == AF_INET ? prefix_v4 : prefix_v6;
+	char prefixbuf[8] = "";
+	char cgroupbuf[32] = "";
 
-	inet_ntop(sin6->sin6_family, &sin6->sin6_addr, buf, sizeof(buf));
+	inet_ntop(e->family, e->key.addr, buf, sizeof(buf));
+	if (prefix)
+		snprintf(prefixbuf, sizeof(prefixbuf), "/%ld", prefix);
+	if (e->key.cgroup_id)
+		snprintf(cgroupbuf, sizeof(cgroupbuf), " in cgroup %llu",
+			 (unsigned long long)e->key.cgroup_id);
+	if (id >= TCP_CONG_NUM_ALGS)
+		return;
 	bpftuner_tunable_update(tuner, TCP_CONG, id, 0,
-"due to loss events for %s, specify '%s' congestion control algorithm\n",
-				buf, "bbr");
+"due to %s for %s%s%s, specify '%s' congestion control algorithm\n",
+				id == TCP_CONG_DCTCP ? "low-latency ECN peer" :
+				id == TCP_CONG_BBR ? "loss events" :
+				"recovered conditions",
+				buf, prefixbuf, cgroupbuf, cong_alg_names[id]);
 
-	if (!tuner->bpf_legacy) {
-		if (!bpftune_cap_add()) {
-			/* kick existing connections by running iter over them... */
-			while (read(tcp_iter_fd, &iterbuf, sizeof(iterbuf)) > 0 || errno == EAGAIN) {}
-			
-			bpftune_cap_drop();
-		}
-	}
+	/* kick existing connections by scheduling an iter sweep */
+	if (!tuner->bpf_legacy)
+		sweep_pending = true;
 }
@@ -23,13 +23,64 @@ enum tcp_cong_tunables {
 	TCP_CONG,
 };
 
+/* scenarios correspond to the algorithm selected for a remote host */
+enum tcp_cong_alg {
+	TCP_CONG_ALG_DEFAULT,
+	TCP_CONG_ALG_BBR,
+	TCP_CONG_ALG_DCTCP,
+	TCP_CONG_NUM_ALGS,
+};
+
 enum tcp_cong_scenarios {
-	TCP_CONG_BBR,
-	TCP_CONG_HTCP,
+	TCP_CONG_DEFAULT = TCP_CONG_ALG_DEFAULT,
+	TCP_CONG_BBR = TCP_CONG_ALG_BBR,
+	TCP_CONG_DCTCP = TCP_CONG_ALG_DCTCP,
 };
 
 #define CONG_MAXNAME	16
 
+/* max remote hosts (or prefixes, if aggregating) tracked */
+#define REMOTE_HOST_MAX	65536
+
+/* max remote hosts awaiting an iterator sweep of existing connections */
+#define DIRTY_HOST_MAX		1024
+
+/* max cgroups tracked when tuning is scoped to cgroup subtrees */
+#define CONG_CGROUP_MAX		1024
+
+/* raw event data sent when selection for a remote host changes */
+struct tcp_cong_event {
+	struct bpftune_host_key key;
+	__u16 family;
+};
+
+/* minimum interval between iterator sweeps */
+#define TCP_CONG_SWEEP_INTERVAL	(5 * SECOND)
+
+/* peers with ECN and srtt below this (usec) are assumed to be in-datacenter */
+#define CONG_DC_RTT_US	1000
+
+/* ECN evidence per remote host is an EWMA (weight 1/8) of the fraction,
+ * scaled to CONG_ECN_ONE, of observations from connections which
+ * negotiated ECN, and of those which saw CE marks on delivery.  dctcp is
+ * only a candidate once most connections negotiate ECN and a significant
+ * fraction see CE marks.
+ */
+#define CONG_ECN_ONE		1024
+#define CONG_ECN_THRESHOLD	(CONG_ECN_ONE - (CONG_ECN_ONE >> 2))
+#define CONG_CE_THRESHOLD	(CONG_ECN_ONE >> 3)
+
+/* a new algorithm must be selected in this many evaluation periods in a
+ * row, and the previous selection must be at least CONG_HOLD old, to
+ * switch.
+ */
+#define CONG_HYSTERESIS		3
+#define CONG_EVAL_INTERVAL	(5 * SECOND)
+#define CONG_HOLD		MINUTE
+
+/* minimum interval between goodput samples for a remote host */
+#define CONG_SAMPLE_INTERVAL	SECOND
+
 /* a long fat pipe is defined as having a BDP of > 10^5; it implies latency
  * plus high bandwith.  In such cases use htcp.
  */
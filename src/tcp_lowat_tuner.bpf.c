@@ -0,0 +1,205 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * Copyright (c) 2023, Oracle and/or its affiliates.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include <bpftune/bpftune.bpf.h>
+
+#include "tcp_lowat_tuner.h"
+
+/* set from userspace */
+__u64 bulk_bytes = TCP_LOWAT_BULK_BYTES;
+__u32 lowat_min = TCP_LOWAT_MIN;
+
+struct lowat_host {
+	__u64 last_event;
+	__u64 last_sample;
+	__u32 bdp;			/* EWMA of bandwidth-delay product */
+	__u32 bulk;			/* EWMA of fraction of bulk samples */
+	__u32 lowat;			/* limit for connections; 0 if bulk */
+};
+
+/* LRU so that with many remote hosts we keep tracking the most recently
+ * active ones rather than silently failing to add new ones.
+ */
+BPF_MAP_DEF(lowat_host_map, BPF_MAP_TYPE_LRU_HASH, struct bpftune_host_key,
+	    struct lowat_host, LOWAT_HOST_MAX);
+
+static __always_inline struct lowat_host *
+get_lowat_host(struct bpftune_host_key *key)
+{
+	struct lowat_host *host = bpf_map_lookup_elem(&lowat_host_map, key);
+
+	if (!host) {
+		struct lowat_host new_host = {};
+
+		bpf_map_update_elem(&lowat_host_map, key, &new_host,
+				    BPF_NOEXIST);
+		host = bpf_map_lookup_elem(&lowat_host_map, key);
+	}
+	return host;
+}
+
+static __always_inline void lowat_set(struct bpf_sock_ops *ops, __u32 lowat)
+{
+	int val = lowat;
+	int ret;
+
+	ret = bpf_setsockopt(ops, SOL_TCP, TCP_NOTSENT_LOWAT, &val,
+			     sizeof(val));
+	bpftune_debug("tcp_lowat: set notsent_lowat %d: %d\n", val, ret);
+}
+
+static __always_inline void send_lowat_event(struct bpf_sock_ops *ops,
+					     struct bpftune_host_key *key,
+					     struct lowat_host *host)
+{
+	struct tcp_lowat_event e = {};
+	struct bpftune_event *event;
+
+	STATIC_ASSERT(sizeof(event->raw_data) >= sizeof(e),
+		      "event->raw_data too small");
+	e.family = ops->family;
+	e.lowat = host->lowat;
+	e.key = *key;
+	event = bpftune_event_reserve(BPFTUNE_EVENT_RAW, sizeof(e));
+	if (!event)
+		return;
+	event->scenario_id = host->lowat ? TCP_LOWAT_LIMIT : TCP_LOWAT_DEFAULT;
+	__builtin_memcpy(&event->raw_data, &e, sizeof(e));
+	bpftune_event_submit(event);
+}
+
+/* Unsent data queued beyond what is needed to keep the pipe full only
+ * adds latency; for request/response flows, limit it to twice the
+ * bandwidth-delay product of the remote host.  Connections which have
+ * had bulk_bytes acked are bulk transfers which keep the system default
+ * (usually unlimited), so they keep large send buffers.  Remote host
+ * (and cgroup, if tuning is scoped to cgroups) state is only sampled
+ * once per TCP_LOWAT_SAMPLE_INTERVAL, from whichever connection sees an
+ * RTT event first; whether the host is limited is decided from the
+ * fraction of samples from bulk connections, and connections start
+ * with that limit.
+ */
+SEC("sockops")
+int tcp_lowat_sockops(struct bpf_sock_ops *ops)
+{
+	struct bpftune_host_key key = {};
+	struct lowat_host *host;
+	__u32 srtt, unsent, lowat, cur;
+	struct tcp_sock *tp;
+	__u64 bdp, now;
+	bool changed, bulk, first;
+
+	if (!ops->sk)
+		return 1;
+	tp = bpf_skc_to_tcp_sock(ops->sk);
+	if (!tp)
+		return 1;
+
+	switch (ops->family) {
+	case AF_INET:
+		key.addr[0] = ops->remote_ip4;
+		break;
+	case AF_INET6:
+		key.addr[0] = ops->remote_ip6[0];
+		key.addr[1] = ops->remote_ip6[1];
+		key.addr[2] = ops->remote_ip6[2];
+		key.addr[3] = ops->remote_ip6[3];
+		break;
+	default:
+		return 1;
+	}
+	key.cgroup_id = get_sk_cgroup_id((struct sock *)tp);
+
+	switch (ops->op) {
+	case BPF_SOCK_OPS_ACTIVE_ESTABLISHED_CB:
+	case BPF_SOCK_OPS_PASSIVE_ESTABLISHED_CB:
+		/* enable RTT events to track BDP and unsent data */
+		bpf_sock_ops_cb_flags_set(ops, ops->bpf_sock_ops_cb_flags |
+					       BPF_SOCK_OPS_RTT_CB_FLAG);
+		host = bpf_map_lookup_elem(&lowat_host_map, &key);
+		if (host && host->lowat)
+			lowat_set(ops, host->lowat);
+		return 1;
+	case BPF_SOCK_OPS_RTT_CB:
+		break;
+	default:
+		return 1;
+	}
+
+	if (!ops->rate_interval_us)
+		return 1;
+	host = get_lowat_host(&key);
+	if (!host)
+		return 1;
+	now = bpf_ktime_get_ns();
+	first = !host->last_sample;
+	if (!first && (now - host->last_sample) < TCP_LOWAT_SAMPLE_INTERVAL)
+		return 1;
+	host->last_sample = now;
+
+	srtt = ops->srtt_us >> 3;
+	bdp = ((__u64)ops->rate_delivered * ops->mss_cache * srtt) /
+	      ops->rate_interval_us;
+	if (host->bdp)
+		host->bdp += ((__u32)bdp >> 3) - (host->bdp >> 3);
+	else
+		host->bdp = bdp;
+	bulk = ops->bytes_acked >= bulk_bytes;
+	if (first)
+		host->bulk = bulk ? TCP_LOWAT_BULK_ONE : 0;
+	else
+		host->bulk += ((bulk ? TCP_LOWAT_BULK_ONE : 0) >> 3) -
+			      (host->bulk >> 3);
+
+	if (host->bulk > TCP_LOWAT_BULK_DEFAULT) {
+		lowat = 0;
+	} else if (host->bulk < TCP_LOWAT_BULK_LIMIT || host->lowat) {
+		lowat = host->bdp << 1;
+		if (lowat < lowat_min)
+			lowat = lowat_min;
+	} else {
+		lowat = 0;
+	}
+
+	cur = BPF_CORE_READ(tp, notsent_lowat);
+	if (bulk || !lowat) {
+		/* restore the default if we limited this connection */
+		if (cur)
+			lowat_set(ops, 0);
+	} else {
+		/* only limit connections queuing more than the limit, and
+		 * tolerate small changes in the limit.
+		 */
+		unsent = BPF_CORE_READ(tp, write_seq) - ops->snd_nxt;
+		if (unsent > lowat &&
+		    (!cur || cur > lowat + (lowat >> 2) ||
+		     lowat > cur + (cur >> 2)))
+			lowat_set(ops, lowat);
+	}
+	/* report when a host switches between limited and default */
+	changed = !host->lowat != !lowat;
+	host->lowat = lowat;
+	if (changed) {
+		if (now - host->last_event < TCP_LOWAT_EVENT_INTERVAL)
+			return 1;
+		host->last_event = now;
+		send_lowat_event(ops, &key, host);
+	}
+	return 1;
+}
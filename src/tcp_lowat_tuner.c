@@ -0,0 +1,94 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/* Copyright (c) 2023, Oracle and/or its affiliates. */
+
+#include <bpftune/libbpftune.h>
+#include "tcp_lowat_tuner.h"
+#include "tcp_lowat_tuner.skel.h"
+#include "tcp_lowat_tuner.skel.legacy.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+
+static struct bpftunable_desc descs[] = {
+{ TCP_LOWAT,	BPFTUNABLE_OTHER, "TCP unsent data limit",	0, 0 },
+};
+
+static struct bpftunable_scenario scenarios[] = {
+{ TCP_LOWAT_LIMIT,	"limit unsent data for request/response flows",
+  "Because connections to a remote host send small amounts of data, limit unsent data queued for them to avoid adding send queue latency" },
+{ TCP_LOWAT_DEFAULT,	"use default unsent data limit for bulk flows",
+  "Because connections to a remote host are bulk transfers, use the system default limit on unsent data so they keep large send buffers" },
+};
+
+/* learned per-remote-host unsent data limits */
+static const char *persist_maps[] = {
+	"lowat_host_map",
+	NULL
+};
+
+int init(struct bpftuner *tuner)
+{
+	int err;
+
+	/* tcp_sock fields are needed to find unsent data */
+	if (tuner->bpf_legacy) {
+		bpftune_log(LOG_ERR, "tcp_lowat: not supported in legacy mode\n");
+		return -ENOTSUP;
+	}
+	err = bpftuner_bpf_open(tcp_lowat, tuner);
+	if (err)
+		return err;
+	tuner->persist_maps = persist_maps;
+	err = bpftuner_bpf_load(tcp_lowat, tuner);
+	if (err)
+		return err;
+	bpftuner_bpf_var_set(tcp_lowat, tuner, bulk_bytes,
+			     bpftune_option_long("tcp_lowat.bulk_bytes",
+						 TCP_LOWAT_BULK_BYTES));
+	bpftuner_bpf_var_set(tcp_lowat, tuner, lowat_min,
+			     bpftune_option_long("tcp_lowat.min",
+						 TCP_LOWAT_MIN));
+	err = bpftuner_bpf_attach(tcp_lowat, tuner, NULL);
+	if (err)
+		return err;
+
+	/* attach to root cgroup */
+	err = bpftuner_cgroup_attach(tuner, "tcp_lowat_sockops",
+				     BPF_CGROUP_SOCK_OPS);
+	if (err)
+		return err;
+
+	return bpftuner_tunables_init(tuner, ARRAY_SIZE(descs), descs,
+				      ARRAY_SIZE(scenarios), scenarios);
+}
+
+void fini(struct bpftuner *tuner)
+{
+	bpftune_log(LOG_DEBUG, "calling fini for %s\n", tuner->name);
+	bpftuner_cgroup_detach(tuner, "tcp_lowat_sockops", BPF_CGROUP_SOCK_OPS);
+	bpftuner_bpf_fini(tuner);
+}
+
+void event_handler(struct bpftuner *tuner, struct bpftune_event *event,
+		   __attribute__((unused))void *ctx)
+{
+	struct tcp_lowat_event *e = (struct tcp_lowat_event *)&event->raw_data;
+	unsigned int id = event->scenario_id;
+	char buf[INET6_ADDRSTRLEN];
+	char cgroupbuf[32] = "";
+
+	if (id > TCP_LOWAT_DEFAULT ||
+	    !inet_ntop(e->family, e->key.addr, buf, sizeof(buf)))
+		return;
+	if (e->key.cgroup_id)
+		snprintf(cgroupbuf, sizeof(cgroupbuf), " in cgroup %llu",
+			 (unsigned long long)e->key.cgroup_id);
+	if (id == TCP_LOWAT_LIMIT)
+		bpftuner_tunable_update(tuner, TCP_LOWAT, id, 0,
+"due to request/response traffic for %s%s, limit unsent data to %u bytes\n",
+					buf, cgroupbuf, e->lowat);
+	else
+		bpftuner_tunable_update(tuner, TCP_LOWAT, id, 0,
+"due to bulk traffic for %s%s, use default unsent data limit\n",
+					buf, cgroupbuf);
+}
@@ -0,0 +1,62 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * Copyright (c) 2023, Oracle and/or its affiliates.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include <bpftune/bpftune.h>
+
+enum tcp_lowat_tunables {
+	TCP_LOWAT,
+};
+
+enum tcp_lowat_scenarios {
+	TCP_LOWAT_LIMIT,	/* limit unsent data for a remote host */
+	TCP_LOWAT_DEFAULT,	/* use system default for a remote host */
+};
+
+/* max remote hosts tracked */
+#define LOWAT_HOST_MAX		65536
+
+/* connections which have had this many bytes acked are bulk transfers */
+#define TCP_LOWAT_BULK_BYTES	(4 << 20)
+
+/* never limit unsent data below this */
+#define TCP_LOWAT_MIN		(16 << 10)
+
+/* changes for a remote host are reported at most this often */
+#define TCP_LOWAT_EVENT_INTERVAL	(10 * SECOND)
+
+/* remote host state is sampled at most this often */
+#define TCP_LOWAT_SAMPLE_INTERVAL	SECOND
+
+/* The fraction of samples for a remote host from bulk connections is
+ * tracked as an EWMA (weight 1/8) scaled to TCP_LOWAT_BULK_ONE.  A host
+ * (and new connections to it) is limited once the fraction falls below
+ * TCP_LOWAT_BULK_LIMIT, and reverts to the default once it rises above
+ * TCP_LOWAT_BULK_DEFAULT, so hosts with a mix of bulk and
+ * request/response connections do not flap.
+ */
+#define TCP_LOWAT_BULK_ONE	1024
+#define TCP_LOWAT_BULK_LIMIT	(TCP_LOWAT_BULK_ONE >> 2)
+#define TCP_LOWAT_BULK_DEFAULT	(TCP_LOWAT_BULK_ONE - (TCP_LOWAT_BULK_ONE >> 2))
+
+/* raw event data sent when the limit for a remote host changes */
+struct tcp_lowat_event {
+	struct bpftune_host_key key;
+	__u32 lowat;		/* 0 means system default */
+	__u16 family;
+};
@@ -0,0 +1,168 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * Copyright (c) 2023, Oracle and/or its affiliates.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include <bpftune/bpftune.bpf.h>
+#include "udp_buffer_tuner.h"
+
+extern const void sysctl_rmem_max __ksym;
+extern const void sysctl_rmem_default __ksym;
+
+BPF_PERCPU_COUNTERS(udp_buffer_counters, UDP_BUFFER_NUM_COUNTERS);
+
+bool near_memory_pressure = false;
+bool near_memory_exhaustion = false;
+
+/* set from userspace */
+long rmem_limit = UDP_BUFFER_RMEM_LIMIT;
+int kernel_page_shift;
+int sk_mem_quantum_shift;
+struct bpftune_mem free_mem;
+
+/* As for TCP, but UDP has no memory pressure state; allocations fail
+ * only once udp_mem[2] is reached.  udp_mem[2] defaults to 1/4 of
+ * buffer pages; grow it to at most 3/8 while approaching pressure
+ * (udp_mem[1]) or exhaustion, and once it cannot grow, shrink
+ * rmem_default to limit per-socket costs.
+ */
+static __always_inline bool udp_nearly_out_of_memory(struct sock *sk,
+						     struct bpftune_event *event)
+{
+	long mem[3] = { }, mem_new[3] = { };
+	long old[3] = {}, new[3] = {};
+	int rmem_default, state;
+	long mem_max;
+
+	state = bpftune_sk_mem_state(sk, mem, kernel_page_shift,
+				     sk_mem_quantum_shift);
+	if (state < 0)
+		return false;
+
+	mem_max = (free_mem.buffer_pages >> 2) + (free_mem.buffer_pages >> 3);
+	mem_new[0] = mem[0];
+	mem_new[1] = mem[1];
+	mem_new[2] = min(mem_max, BPFTUNE_GROW_BY_DELTA(mem[2]));
+
+	if (state == BPFTUNE_SK_MEM_NEAR_EXHAUSTION) {
+		near_memory_exhaustion = true;
+		near_memory_pressure = true;
+		if (mem_new[2] > mem[2] && !bpftune_node_low_on_memory(&free_mem)) {
+			send_sk_sysctl_event(sk, UDP_MEM_EXHAUSTION,
+					     UDP_BUFFER_UDP_MEM, mem, mem_new,
+					     event);
+			return true;
+		}
+		if (bpf_probe_read_kernel(&rmem_default, sizeof(rmem_default),
+					  (int *)&sysctl_rmem_default))
+			return true;
+		old[0] = rmem_default;
+		new[0] = BPFTUNE_SHRINK_BY_DELTA(rmem_default);
+		send_net_sysctl_event(NULL, UDP_BUFFER_DECREASE,
+				      UDP_BUFFER_RMEM_DEFAULT, old, new, event);
+		return true;
+	} else if (state == BPFTUNE_SK_MEM_NEAR_PRESSURE) {
+		near_memory_pressure = true;
+		if (mem_new[2] > mem[2] && !bpftune_node_low_on_memory(&free_mem))
+			send_sk_sysctl_event(sk, UDP_MEM_PRESSURE,
+					     UDP_BUFFER_UDP_MEM, mem, mem_new,
+					     event);
+		return true;
+	}
+	near_memory_exhaustion = false;
+	near_memory_pressure = false;
+
+	return false;
+}
+
+/* __udp_enqueue_schedule_skb() fails with -ENOMEM if the socket receive
+ * buffer is full, and -ENOBUFS if udp_mem[2] is reached.  A socket's
+ * receive buffer is net.core.rmem_default unless set via SO_RCVBUF, which
+ * is limited to (twice) net.core.rmem_max; grow whichever limited the
+ * socket.
+ */
+#ifdef BPFTUNE_LEGACY
+SEC("kprobe/__udp_enqueue_schedule_skb")
+int BPF_KPROBE(bpftune_udp_enqueue, struct sock *sk, struct sk_buff *skb)
+#else
+SEC("fexit/__udp_enqueue_schedule_skb")
+int BPF_PROG(bpftune_udp_enqueue, struct sock *sk, struct sk_buff *skb,
+	     int ret)
+#endif
+{
+	struct bpftune_event event = { 0 };
+	long old[3] = {}, new[3] = {};
+	int rmem_max, rmem_default;
+	__u8 sk_userlocks = 0;
+	int rcvbuf;
+	__s64 drops;
+
+	if (!sk)
+		return 0;
+	rcvbuf = BPF_CORE_READ(sk, sk_rcvbuf);
+#ifdef BPFTUNE_LEGACY
+	/* return value is not available on entry; predict receive buffer
+	 * overflow.  udp_mem drops are not seen.
+	 */
+	int ret = 0;
+
+	if (BPF_CORE_READ(sk, sk_backlog.rmem_alloc.counter) > rcvbuf)
+		ret = -ENOMEM;
+#endif
+	/* a high-frequency event so bail early if we can... */
+	if (ret != -ENOMEM && ret != -ENOBUFS)
+		return 0;
+	drops = percpu_counter_add(&udp_buffer_counters,
+				   ret == -ENOMEM ? UDP_BUFFER_RCVBUF_DROPS :
+						    UDP_BUFFER_MEM_DROPS, 1);
+	/* only sample subset of drops to reduce overhead. */
+	if ((drops % 4) != 0)
+		return 0;
+
+	/* do not grow per-socket limits when approaching memory limits */
+	if (udp_nearly_out_of_memory(sk, &event) || ret != -ENOMEM)
+		return 0;
+
+	if (bpf_probe_read_kernel(&rmem_max, sizeof(rmem_max),
+				  (int *)&sysctl_rmem_max) ||
+	    bpf_probe_read_kernel(&rmem_default, sizeof(rmem_default),
+				  (int *)&sysctl_rmem_default))
+		return 0;
+#ifndef BPFTUNE_LEGACY
+	/* CO-RE does not support bitfields... */
+	sk_userlocks = sk->sk_userlocks;
+#endif
+	if (sk_userlocks & SOCK_RCVBUF_LOCK) {
+		/* SO_RCVBUF doubles the requested size to allow for
+		 * overhead; only grow rmem_max if it capped the request.
+		 */
+		if (rcvbuf < rmem_max * 2 || rmem_max >= rmem_limit)
+			return 0;
+		old[0] = rmem_max;
+		new[0] = min(rmem_limit, BPFTUNE_GROW_BY_DELTA(rmem_max));
+		send_net_sysctl_event(NULL, UDP_BUFFER_INCREASE,
+				      UDP_BUFFER_RMEM_MAX, old, new, &event);
+		return 0;
+	}
+	if (rcvbuf < rmem_default || rmem_default >= rmem_limit)
+		return 0;
+	old[0] = rmem_default;
+	new[0] = min(rmem_limit, BPFTUNE_GROW_BY_DELTA(rmem_default));
+	send_net_sysctl_event(NULL, UDP_BUFFER_INCREASE,
+			      UDP_BUFFER_RMEM_DEFAULT, old, new, &event);
+	return 0;
+}
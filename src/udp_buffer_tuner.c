@@ -0,0 +1,157 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/* Copyright (c) 2023, Oracle and/or its affiliates. */
+
+#include <bpftune/libbpftune.h>
+#include "udp_buffer_tuner.h"
+#include "udp_buffer_tuner.skel.h"
+#include "udp_buffer_tuner.skel.legacy.h"
+
+#include <unistd.h>
+
+static struct bpftunable_desc descs[] = {
+{ UDP_BUFFER_RMEM_DEFAULT,
+			BPFTUNABLE_SYSCTL, "net.core.rmem_default",	0, 1 },
+{ UDP_BUFFER_RMEM_MAX,	BPFTUNABLE_SYSCTL, "net.core.rmem_max",		0, 1 },
+{ UDP_BUFFER_UDP_MEM,	BPFTUNABLE_SYSCTL, "net.ipv4.udp_mem",		0, 3 },
+};
+
+static struct bpftunable_scenario scenarios[] = {
+{ UDP_BUFFER_INCREASE,	"need to increase UDP receive buffer size",
+	"Need to increase receive buffer size to avoid dropping datagrams" },
+{ UDP_BUFFER_DECREASE,	"need to decrease UDP receive buffer size",
+	"Need to decrease default receive buffer size to reduce memory utilization" },
+{ UDP_MEM_PRESSURE,	"approaching UDP memory pressure",
+	"Since UDP memory use is approaching its pressure threshold, adjust UDP memory limits" },
+{ UDP_MEM_EXHAUSTION,	"approaching UDP memory exhaustion",
+	"Since UDP datagrams are dropped when memory is exhausted, adjust UDP memory limits to avoid exhaustion" },
+};
+
+static __u64 mem_refresh_last;
+
+/* push current memory limits to BPF, unless done in the last
+ * min_interval nanoseconds.
+ */
+static void udp_buffer_mem_refresh(struct bpftuner *tuner, __u64 min_interval)
+{
+	bpftune_mem_refresh(bpftuner_bpf_var_ptr(udp_buffer, tuner, free_mem),
+			    &mem_refresh_last, min_interval);
+}
+
+int init(struct bpftuner *tuner)
+{
+	int pagesize;
+	int err;
+
+	err = bpftuner_bpf_open(udp_buffer, tuner);
+	if (err)
+		return err;
+	err = bpftuner_bpf_load(udp_buffer, tuner);
+	if (err)
+		return err;
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	if (pagesize < 0)
+		pagesize = 4096;
+	bpftuner_bpf_var_set(udp_buffer, tuner, kernel_page_shift,
+			     ilog2(pagesize));
+	bpftuner_bpf_var_set(udp_buffer, tuner, sk_mem_quantum_shift,
+			     ilog2(SK_MEM_QUANTUM));
+	bpftuner_bpf_var_set(udp_buffer, tuner, rmem_limit,
+			     bpftune_option_long("udp_buffer.rmem_max",
+						 UDP_BUFFER_RMEM_LIMIT));
+	udp_buffer_mem_refresh(tuner, 0);
+
+	err = bpftuner_bpf_attach(udp_buffer, tuner, NULL);
+	if (err)
+		return err;
+	return bpftuner_tunables_init(tuner, UDP_BUFFER_NUM_TUNABLES, descs,
+				      ARRAY_SIZE(scenarios), scenarios);
+}
+
+void fini(struct bpftuner *tuner)
+{
+	struct bpf_map *counters = bpftuner_bpf_map_get(udp_buffer, tuner,
+							udp_buffer_counters);
+	__s64 rcvbuf_drops = 0, mem_drops = 0;
+
+	bpftune_log(LOG_DEBUG, "calling fini for %s\n", tuner->name);
+	if (!bpftune_percpu_counter_sum(bpf_map__fd(counters),
+					UDP_BUFFER_RCVBUF_DROPS,
+					&rcvbuf_drops) &&
+	    !bpftune_percpu_counter_sum(bpf_map__fd(counters),
+					UDP_BUFFER_MEM_DROPS, &mem_drops))
+		bpftune_log(LOG_DEBUG, "udp drops: %lld receive buffer full, %lld udp_mem\n",
+			    (long long)rcvbuf_drops, (long long)mem_drops);
+	bpftuner_bpf_fini(tuner);
+}
+
+void periodic(struct bpftuner *tuner)
+{
+	udp_buffer_mem_refresh(tuner, UDP_BUFFER_MEM_REFRESH * SECOND);
+}
+
+void event_handler(struct bpftuner *tuner,
+		   struct bpftune_event *event,
+		   __attribute__((unused))void *ctx)
+{
+	const char *lowmem = "normal memory conditions";
+	int scenario = event->scenario_id;
+	struct bpftunable *t;
+	const char *tunable;
+	long new[3], old[3];
+	int id;
+
+	/* netns cookie not supported; ignore */
+	if (event->netns_cookie == (unsigned long)-1)
+		return;
+
+	id = event->update[0].id;
+	memcpy(new, event->update[0].new, sizeof(new));
+	memcpy(old, event->update[0].old, sizeof(old));
+
+	tunable = bpftuner_tunable_name(tuner, id);
+	if (!tunable) {
+		bpftune_log(LOG_DEBUG, "unknown tunable [%d] for udp_buffer_tuner\n", id);
+		return;
+	}
+	if (bpftuner_bpf_var_get(udp_buffer, tuner, near_memory_exhaustion))
+		lowmem = "near memory exhaustion";
+	else if (bpftuner_bpf_var_get(udp_buffer, tuner, near_memory_pressure))
+		lowmem = "near memory pressure";
+	/* memory available may have changed; refresh limits for next time */
+	if (scenario != UDP_BUFFER_INCREASE)
+		udp_buffer_mem_refresh(tuner, SECOND);
+
+	switch (id) {
+	case UDP_BUFFER_UDP_MEM:
+		bpftuner_tunable_sysctl_write(tuner, id, scenario,
+					      event->netns_cookie, 3, new,
+"Due to %s change %s(min pressure max) from (%ld %ld %ld) -> (%ld %ld %ld)\n",
+					      lowmem, tunable, old[0], old[1], old[2],
+					      new[0], new[1], new[2]);
+		break;
+	case UDP_BUFFER_RMEM_DEFAULT:
+		if (scenario == UDP_BUFFER_DECREASE) {
+			/* do not shrink below the value we started with */
+			t = bpftuner_tunable(tuner, id);
+			if (t && new[0] < t->initial_values[0])
+				new[0] = t->initial_values[0];
+			if (new[0] >= old[0])
+				break;
+			bpftuner_tunable_sysctl_write(tuner, id, scenario,
+						      event->netns_cookie, 1,
+						      new,
+"Due to %s change %s from (%ld) -> (%ld)\n",
+						      lowmem, tunable, old[0],
+						      new[0]);
+			break;
+		}
+		/* fall through */
+	case UDP_BUFFER_RMEM_MAX:
+		bpftuner_tunable_sysctl_write(tuner, id, scenario,
+					      event->netns_cookie, 1, new,
+"Due to UDP receive buffer drops, change %s from (%ld) -> (%ld)\n",
+					      tunable, old[0], new[0]);
+		break;
+	}
+}
@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * Copyright (c) 2023, Oracle and/or its affiliates.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include <bpftune/bpftune.h>
+
+#ifndef SK_MEM_QUANTUM
+#define SK_MEM_QUANTUM          4096
+#endif
+
+enum udp_buffer_tunables {
+	UDP_BUFFER_RMEM_DEFAULT,
+	UDP_BUFFER_RMEM_MAX,
+	UDP_BUFFER_UDP_MEM,
+	UDP_BUFFER_NUM_TUNABLES,
+};
+
+enum udp_buffer_scenarios {
+	UDP_BUFFER_INCREASE,
+	UDP_BUFFER_DECREASE,
+	UDP_MEM_PRESSURE,
+	UDP_MEM_EXHAUSTION,
+};
+
+/* per-CPU counts of datagrams dropped on enqueue to a socket */
+enum udp_buffer_counters {
+	UDP_BUFFER_RCVBUF_DROPS,	/* socket receive buffer full */
+	UDP_BUFFER_MEM_DROPS,		/* udp_mem limit reached */
+	UDP_BUFFER_NUM_COUNTERS,
+};
+
+/* default cap on rmem_default/rmem_max growth */
+#define UDP_BUFFER_RMEM_LIMIT	(16 << 20)
+
+/* udp_mem limits are computed from /proc/zoneinfo as for tcp_mem, and
+ * refreshed periodically and (at most once a second) on UDP memory
+ * pressure events.
+ */
+#define UDP_BUFFER_MEM_REFRESH		10	/* seconds */
@@ -0,0 +1,61 @@
+#!/usr/bin/bash
+#
+# SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note
+#
+# Copyright (c) 2023, Oracle and/or its affiliates.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public
+# License v2 as published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public
+# License along with this program; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 021110-1307, USA.
+#
+
+# run iperf3 test with low wmem max and added latency in BDP mode; ensure
+# tuner raises wmem max to the target in a few steps.
+
+PORT=5201
+
+LATENCY=${LATENCY:-"latency 50ms"}
+
+. ./test_lib.sh
+
+SLEEPTIME=1
+TIMEOUT=30
+MAX_STEPS=3
+
+test_start "$0|bdp test to $VETH1_IPV4:$PORT $LATENCY"
+
+wmem_orig=($(sysctl -n net.ipv4.tcp_wmem))
+
+test_setup true
+
+sysctl -w net.ipv4.tcp_wmem="${wmem_orig[0]} ${wmem_orig[1]} ${wmem_orig[1]}"
+
+test_run_cmd_local "ip netns exec $NETNS $IPERF3 -s -p $PORT -1 &"
+test_run_cmd_local "$BPFTUNE -s -o tcp_buffer.bdp=1 &" true
+sleep $SETUPTIME
+$IPERF3 -fm -p $PORT -c $VETH1_IPV4 -t 10
+sleep $SLEEPTIME
+
+wmem_post=($(sysctl -n net.ipv4.tcp_wmem))
+sysctl -w net.ipv4.tcp_wmem="${wmem_orig[0]} ${wmem_orig[1]} ${wmem_orig[2]}"
+steps=$(grep -c "change net.ipv4.tcp_wmem" $TESTLOG_LAST || true)
+echo "wmem before ${wmem_orig[1]} ; after ${wmem_post[2]} in $steps steps"
+if [[ ${wmem_post[2]} -le ${wmem_orig[1]} ]] || [[ $steps -gt $MAX_STEPS ]]; then
+	test_cleanup
+fi
+
+test_pass
+
+test_cleanup
+
+test_exit
@@ -0,0 +1,86 @@
+#!/usr/bin/bash
+#
+# SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note
+#
+# Copyright (c) 2023, Oracle and/or its affiliates.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public
+# License v2 as published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public
+# License along with this program; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 021110-1307, USA.
+#
+
+# run budget test; verify BPF program run-time accounting is enabled
+# and reported in metrics, and that with a tiny budget a tuner whose
+# programs run under load is disabled.
+
+. ./test_lib.sh
+
+SOCAT=$(which socat 2>/dev/null)
+check_prog "$SOCAT" socat socat
+
+SLEEPTIME=12
+METRICS_SOCK=/var/run/bpftune/budget_test
+
+test_start "$0|budget test: are BPF program run-time stats reported?"
+
+test_setup "true"
+
+test_run_cmd_local "$BPFTUNE -s -b 0 -M $METRICS_SOCK &" true
+
+sleep $SETUPTIME
+
+SYSCTL=net.ipv4.neigh.default.gc_thresh1
+val="$(sysctl -qn $SYSCTL)"
+sysctl -qw ${SYSCTL}="${val}"
+sleep $SLEEPTIME
+
+$SOCAT - UNIX-CONNECT:$METRICS_SOCK > ${CMDLOG}
+cat ${CMDLOG}
+grep -E '^bpftune_prog_cpu_percent\{tuner="sysctl"\}' ${CMDLOG}
+grep -E '^bpftune_prog_runs_total\{tuner="sysctl",prog="[a-z_]+"\} [1-9]' ${CMDLOG}
+grep -E '^bpftune_prog_run_seconds_total' ${CMDLOG}
+test_pass
+
+test_cleanup
+
+PORT=5201
+# budget is enforced after 3 consecutive 10 second intervals over it
+LOADTIME=45
+
+test_start "$0|budget test: is a tuner over a tiny budget disabled under load?"
+
+test_setup "true"
+
+test_run_cmd_local "ip netns exec $NETNS $IPERF3 -s -p $PORT &"
+test_run_cmd_local "$BPFTUNE -s -a tcp_buffer_tuner.so -b 0.000001 -M $METRICS_SOCK &" true
+
+sleep $SETUPTIME
+
+$IPERF3 -fm -t $LOADTIME -p $PORT -c $VETH1_IPV4
+sleep $SLEEPTIME
+
+grep -E "tuner 'tcp_buffer' BPF programs use .* over budget of .*; disabling 'tcp_buffer'" $TESTLOG_LAST
+$SOCAT - UNIX-CONNECT:$METRICS_SOCK > ${CMDLOG}.metrics
+# only active tuners report load time
+set +e
+grep -E '^bpftune_tuner_load_seconds\{tuner="tcp_buffer"\}' ${CMDLOG}.metrics
+ACTIVE=$?
+set -e
+rm -f ${CMDLOG}.metrics
+if [[ $ACTIVE -ne 0 ]]; then
+	test_pass
+fi
+
+test_cleanup
+
+test_exit
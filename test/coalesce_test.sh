@@ -0,0 +1,79 @@
+#!/usr/bin/bash
+#
+# SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note
+#
+# Copyright (c) 2023, Oracle and/or its affiliates.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public
+# License v2 as published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public
+# License along with this program; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 021110-1307, USA.
+#
+
+# run iperf3 test with low netdev_max_backlog with and without event
+# coalescing; ensure tuner still increases it, and that fewer events
+# are handled when coalescing.
+
+PORT=5201
+
+. ./test_lib.sh
+
+SOCAT=$(which socat 2>/dev/null)
+check_prog "$SOCAT" socat socat
+
+SLEEPTIME=1
+WINDOW=200
+METRICS_SOCK=/var/run/bpftune/coalesce_test
+
+declare -A EVENTS
+
+for FAMILY in ipv4 ; do
+
+ ADDR=127.0.0.1
+
+ for COALESCE in 0 $WINDOW ; do
+
+   test_start "$0|coalesce test to $ADDR:$PORT $FAMILY, window ${COALESCE}msec"
+
+   backlog_orig=($(sysctl -n net.core.netdev_max_backlog))
+   mask_orig=($(sysctl -n net.core.flow_limit_cpu_bitmap))
+   test_setup true
+
+   sysctl -w net.core.netdev_max_backlog=8
+   sysctl -w net.core.flow_limit_cpu_bitmap=0
+   backlog_pre=($(sysctl -n net.core.netdev_max_backlog))
+
+   test_run_cmd_local "$IPERF3 -s -p $PORT &"
+   test_run_cmd_local "$BPFTUNE -ds -a net_buffer_tuner.so -C $COALESCE -M $METRICS_SOCK &" true
+   sleep $SETUPTIME
+   test_run_cmd_local "$IPERF3 -fm -t 20 -c $PORT -c $ADDR" true
+   sleep $SLEEPTIME
+
+   backlog_post=($(sysctl -n net.core.netdev_max_backlog))
+   EVENTS[$COALESCE]=$($SOCAT - UNIX-CONNECT:$METRICS_SOCK | \
+	awk '/^bpftune_events_total\{tuner="net_buffer"\}/ { print $2 }')
+   sysctl -w net.core.netdev_max_backlog="$backlog_orig"
+   sysctl -w net.core.flow_limit_cpu_bitmap="$mask_orig"
+   echo "backlog	${backlog_pre}	->	${backlog_post}"
+   echo "events	${EVENTS[$COALESCE]}"
+   if [[ $backlog_post -gt $backlog_pre ]]; then
+	if [[ $COALESCE -eq 0 ]]; then
+		test_pass
+	elif [[ ${EVENTS[$COALESCE]:-0} -lt ${EVENTS[0]:-0} ]]; then
+		test_pass
+	fi
+   fi
+   test_cleanup
+ done
+done
+
+test_exit
@@ -0,0 +1,70 @@
+#!/usr/bin/bash
+#
+# SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note
+#
+# Copyright (c) 2023, Oracle and/or its affiliates.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public
+# License v2 as published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public
+# License along with this program; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 021110-1307, USA.
+#
+
+# verify that with tcp_cong.prefix_v4/prefix_v6 set, loss to a remote
+# host selects 'bbr' for its whole network rather than just that host.
+
+PORT=5201
+
+. ./test_lib.sh
+
+LOGFILE=$TESTLOG_LAST
+
+SLEEPTIME=1
+LOADTIME=20
+
+for FAMILY in ipv4 ipv6 ; do
+
+   case $FAMILY in
+   ipv4)
+	ADDR=$VETH1_IPV4
+	PREFIX="${VETH1_IPV4%.*}.0/24"
+	;;
+   ipv6)
+	ADDR=$VETH1_IPV6
+	PREFIX="${VETH1_IPV6%::*}::/64"
+	;;
+   esac
+
+   test_start "$0|cong prefix legacy test to $ADDR:$PORT $FAMILY prefix $PREFIX"
+
+   DROP=10
+   test_setup "true"
+
+   test_run_cmd_local "ip netns exec $NETNS $IPERF3 -p $PORT -s -1 &"
+   test_run_cmd_local "$BPFTUNE -dsL -o tcp_cong.prefix_v4=24 -o tcp_cong.prefix_v6=64 &" true
+   sleep $SETUPTIME
+   set +e
+   test_run_cmd_local "$IPERF3 -fm -t $LOADTIME -p $PORT -c $ADDR" true
+   set -e
+   sleep $SLEEPTIME
+   grep -E "due to loss events for ${PREFIX}, specify 'bbr'" $LOGFILE
+   set +e
+   grep -E "due to loss events for ${ADDR}, specify" $LOGFILE
+   UNMASKED=$?
+   set -e
+   if [[ $UNMASKED -ne 0 ]]; then
+	test_pass
+   fi
+   test_cleanup
+done
+
+test_exit
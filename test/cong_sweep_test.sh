@@ -0,0 +1,81 @@
+#!/usr/bin/bash
+#
+# SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note
+#
+# Copyright (c) 2023, Oracle and/or its affiliates.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public
+# License v2 as published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public
+# License along with this program; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 021110-1307, USA.
+#
+
+# verify existing connections are moved to the congestion control
+# algorithm selected for their remote host by the iterator sweep.  A
+# low-rate connection is established before bpftune starts, so only the
+# sweep can change its algorithm; a lossy connection to the same host
+# then has 'bbr' selected, and the existing one must follow.
+
+PORT=5201
+SWEEP_PORT=5202
+
+. ./test_lib.sh
+
+LOGFILE=$TESTLOG_LAST
+
+SLEEPTIME=1
+# sweeps run at most every 5 seconds
+SWEEPTIME=10
+LOADTIME=20
+
+for FAMILY in ipv4 ipv6 ; do
+
+   case $FAMILY in
+   ipv4)
+	ADDR=$VETH1_IPV4
+	;;
+   ipv6)
+	ADDR=$VETH1_IPV6
+	;;
+   esac
+
+   test_start "$0|cong sweep test to $ADDR:$SWEEP_PORT $FAMILY"
+
+   DROP=10
+   test_setup "true"
+
+   test_run_cmd_local "ip netns exec $NETNS $IPERF3 -p $SWEEP_PORT -s -1 &"
+   test_run_cmd_local "ip netns exec $NETNS $IPERF3 -p $PORT -s -1 &"
+   sleep $SLEEPTIME
+   test_run_cmd_local "$IPERF3 -fm -b 100K -t $(expr $LOADTIME + $SWEEPTIME + $SETUPTIME) -p $SWEEP_PORT -c $ADDR &"
+   sleep $SLEEPTIME
+   test_run_cmd_local "$BPFTUNE -ds &" true
+   sleep $SETUPTIME
+   set +e
+   test_run_cmd_local "$IPERF3 -fm -t $LOADTIME -p $PORT -c $ADDR" true
+   set -e
+   grep -E "due to loss events for ${ADDR}, specify 'bbr'" $LOGFILE
+   sleep $SWEEPTIME
+   grep -E "tcp_cong: swept connections for [1-9][0-9]* hosts" $LOGFILE
+   ss -tin "dport = :$SWEEP_PORT" | tee ${CMDLOG}.ss
+   set +e
+   grep -w bbr ${CMDLOG}.ss
+   SWEPT=$?
+   set -e
+   rm -f ${CMDLOG}.ss
+   if [[ $SWEPT -eq 0 ]]; then
+	test_pass
+   fi
+   test_cleanup
+done
+
+test_exit
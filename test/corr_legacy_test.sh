@@ -0,0 +1,60 @@
+#!/usr/bin/bash
+#
+# SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note
+#
+# Copyright (c) 2023, Oracle and/or its affiliates.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public
+# License v2 as published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public
+# License along with this program; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 021110-1307, USA.
+#
+
+# run iperf3 over a rate-limited link with a deep queue, so that larger
+# send buffers only add queueing delay; with a low wmem max, verify that
+# increases become correlated with srtt (so per-netns correlation state
+# is found) and that further increases are then vetoed.
+
+PORT=5201
+
+. ./test_lib.sh
+
+SLEEPTIME=1
+LOADTIME=60
+LATENCY="latency 5ms rate 20mbit limit 10000"
+
+for FAMILY in ipv4 ; do
+
+   ADDR=$VETH1_IPV4
+
+   test_start "$0|corr legacy test to $ADDR:$PORT $FAMILY $LATENCY"
+
+   wmem_orig=($(sysctl -n net.ipv4.tcp_wmem))
+
+   test_setup true
+
+   sysctl -w net.ipv4.tcp_wmem="${wmem_orig[0]} ${wmem_orig[1]} ${wmem_orig[1]}"
+
+   test_run_cmd_local "ip netns exec $NETNS $IPERF3 -s -p $PORT -1 &"
+   test_run_cmd_local "$BPFTUNE -dsL -a tcp_buffer_tuner.so &" true
+   sleep $SETUPTIME
+   test_run_cmd_local "$IPERF3 -fm -t $LOADTIME -p $PORT -c $ADDR" true
+   sleep $SLEEPTIME
+
+   sysctl -w net.ipv4.tcp_wmem="${wmem_orig[0]} ${wmem_orig[1]} ${wmem_orig[2]}"
+   grep -E "covar for 'net.ipv4.tcp_wmem'/srtt netns [0-9]+" $TESTLOG_LAST
+   grep "correlation between buffer size increase and latency" $TESTLOG_LAST
+   test_pass
+   test_cleanup
+done
+
+test_exit
@@ -0,0 +1,365 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * Copyright (c) 2023, Oracle and/or its affiliates.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+
+/* Benchmark the userspace event path: load tuners without attaching their
+ * BPF programs, then feed synthetic events through the ring buffer
+ * callback and report throughput, handler latency and syscalls per event.
+ * Syscalls are counted via the raw_syscalls:sys_enter tracepoint, so
+ * setns(), openat() etc. are included; if perf events are unavailable,
+ * only read/write syscalls are reported.
+ *
+ * Events request no-op updates (new values match current values), so the
+ * benchmark does not alter sysctl settings.
+ */
+
+#define _GNU_SOURCE
+
+#include <bpftune/libbpftune.h>
+#include <bpftune/bpftune.h>
+#include "../src/tcp_buffer_tuner.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BENCH_MAX_TUNERS	2
+
+struct bench_netns {
+	pid_t pid;
+	unsigned long cookie;
+	long values[BPFTUNE_MAX_VALUES];
+};
+
+static int usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-d tuner_dir] [-n num_events] [-N num_netns] [-v]\n"
+		"	   [-w tcp_buffer|sysctl]\n",
+		prog);
+	return 1;
+}
+
+static __u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	__u64 x = *(const __u64 *)a, y = *(const __u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* read/write syscall counts for this process */
+static void syscalls_read(unsigned long long *syscr, unsigned long long *syscw)
+{
+	char line[128];
+	FILE *fp;
+
+	*syscr = *syscw = 0;
+	fp = fopen("/proc/self/io", "r");
+	if (!fp)
+		return;
+	while (fgets(line, sizeof(line), fp)) {
+		sscanf(line, "syscr: %llu", syscr);
+		sscanf(line, "syscw: %llu", syscw);
+	}
+	fclose(fp);
+}
+
+/* open a counter of all syscalls made by this process (and threads it
+ * creates from now on); returns fd or negative errno.
+ */
+static int syscall_counter_open(void)
+{
+	const char *paths[] = {
+		"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+		"/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+		NULL
+	};
+	struct perf_event_attr attr = {};
+	unsigned long long id = 0;
+	FILE *fp = NULL;
+	int fd, i;
+
+	for (i = 0; paths[i] && !fp; i++)
+		fp = fopen(paths[i], "r");
+	if (!fp)
+		return -ENOENT;
+	if (fscanf(fp, "%llu", &id) != 1)
+		id = 0;
+	fclose(fp);
+	if (!id)
+		return -ENOENT;
+	attr.type = PERF_TYPE_TRACEPOINT;
+	attr.size = sizeof(attr);
+	attr.config = id;
+	attr.disabled = 1;
+	attr.inherit = 1;
+	fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	return fd < 0 ? -errno : fd;
+}
+
+static unsigned long long syscall_counter_read(int fd)
+{
+	unsigned long long count = 0;
+
+	if (read(fd, &count, sizeof(count)) != sizeof(count))
+		return 0;
+	return count;
+}
+
+/* create a network namespace held open by a child process; the child
+ * is reaped on failure.
+ */
+static int netns_create(struct bench_netns *ns)
+{
+	int pipefd[2], fd = 0, err;
+	char c = 0;
+
+	if (pipe(pipefd))
+		return -errno;
+	ns->pid = fork();
+	if (ns->pid < 0) {
+		err = -errno;
+		close(pipefd[0]);
+		close(pipefd[1]);
+		return err;
+	}
+	if (ns->pid == 0) {
+		close(pipefd[0]);
+		if (unshare(CLONE_NEWNET))
+			exit(1);
+		if (write(pipefd[1], &c, 1) != 1)
+			exit(1);
+		close(pipefd[1]);
+		pause();
+		exit(0);
+	}
+	close(pipefd[1]);
+	err = read(pipefd[0], &c, 1) == 1 ? 0 : -ECHILD;
+	close(pipefd[0]);
+	if (!err)
+		err = bpftune_netns_info(ns->pid, &fd, &ns->cookie);
+	if (!err)
+		err = bpftune_netns_index_add(ns->cookie, ns->pid, NULL);
+	if (!err && bpftune_sysctl_read(fd, "net.ipv4.tcp_wmem", ns->values) < 0)
+		err = -EINVAL;
+	if (fd > 0)
+		close(fd);
+	if (err) {
+		kill(ns->pid, SIGKILL);
+		waitpid(ns->pid, NULL, 0);
+		ns->pid = 0;
+	}
+	return err;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long syscr_start, syscw_start, syscr_end, syscw_end;
+	unsigned long long syscalls = 0;
+	int syscall_fd = -1;
+	struct bpftuner *tuners[BENCH_MAX_TUNERS] = {};
+	struct rlimit r = { RLIM_INFINITY, RLIM_INFINITY };
+	unsigned int num_events = 100000, num_netns = 16;
+	struct bpftuner *tcp_buffer = NULL;
+	const char *dir = BPFTUNER_LIB_DIR;
+	struct bench_netns *netns = NULL;
+	struct bpftune_event event;
+	const char *workload = "tcp_buffer";
+	int log_level = LOG_ERR;
+	__u64 *latency = NULL, start, elapsed;
+	unsigned int i, num_tuners = 0;
+	char path[PATH_MAX];
+	bool sysctl_storm;
+	int c, ret = 0;
+
+	while ((c = getopt(argc, argv, "d:n:N:vw:")) != -1) {
+		switch (c) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 'n':
+			num_events = strtoul(optarg, NULL, 0);
+			break;
+		case 'N':
+			num_netns = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			log_level = LOG_DEBUG;
+			break;
+		case 'w':
+			workload = optarg;
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+	if (strcmp(workload, "tcp_buffer") == 0) {
+		sysctl_storm = false;
+	} else if (strcmp(workload, "sysctl") == 0) {
+		sysctl_storm = true;
+	} else {
+		return usage(argv[0]);
+	}
+	/* sysctl events in the global namespace would disable tuners */
+	if (!num_events || (sysctl_storm && !num_netns))
+		return usage(argv[0]);
+
+	bpftune_set_log(log_level, bpftune_log_stderr);
+	if (setrlimit(RLIMIT_MEMLOCK, &r)) {
+		perror("setrlimit");
+		return 1;
+	}
+	bpftune_set_no_attach(true);
+	bpftune_netns_init_all();
+
+	/* sysctl storms target sysctls that tcp_buffer watches */
+	snprintf(path, sizeof(path), "%s/tcp_buffer_tuner.so", dir);
+	tcp_buffer = tuners[num_tuners++] = bpftuner_init(path);
+	if (sysctl_storm) {
+		snprintf(path, sizeof(path), "%s/sysctl_tuner.so", dir);
+		tuners[num_tuners++] = bpftuner_init(path);
+	}
+	for (i = 0; i < num_tuners; i++) {
+		if (!tuners[i]) {
+			fprintf(stderr, "could not load tuners from '%s'\n", dir);
+			ret = 1;
+			goto out;
+		}
+	}
+
+	netns = calloc(num_netns + 1, sizeof(*netns));
+	latency = calloc(num_events, sizeof(*latency));
+	if (!netns || !latency) {
+		ret = 1;
+		goto out;
+	}
+	/* slot 0 is the global namespace */
+	bpftune_netns_info(getpid(), NULL, &netns[0].cookie);
+	if (bpftune_sysctl_read(0, "net.ipv4.tcp_wmem", netns[0].values) < 0) {
+		ret = 1;
+		goto out;
+	}
+	for (i = 1; i <= num_netns; i++) {
+		ret = netns_create(&netns[i]);
+		if (ret) {
+			fprintf(stderr, "could not create netns %d: %s\n",
+				i, strerror(-ret));
+			num_netns = i - 1;
+			ret = 1;
+			goto out;
+		}
+	}
+
+	syscall_fd = syscall_counter_open();
+	if (syscall_fd < 0)
+		fprintf(stderr, "cannot count syscalls (%s); counting read/write only\n",
+			strerror(-syscall_fd));
+	else
+		ioctl(syscall_fd, PERF_EVENT_IOC_ENABLE, 0);
+	syscalls_read(&syscr_start, &syscw_start);
+	start = now_ns();
+	for (i = 0; i < num_events; i++) {
+		struct bench_netns *ns;
+		__u64 t;
+
+		memset(&event, 0, sizeof(event));
+		if (sysctl_storm) {
+			ns = &netns[1 + (i % num_netns)];
+			event.tuner_id = tuners[1]->id;
+			snprintf(event.str, sizeof(event.str), "ipv4/tcp_wmem");
+		} else {
+			ns = &netns[i % (num_netns + 1)];
+			event.tuner_id = tcp_buffer->id;
+			event.scenario_id = TCP_BUFFER_INCREASE;
+			event.update[0].id = TCP_BUFFER_TCP_WMEM;
+			memcpy(event.update[0].old, ns->values, sizeof(ns->values));
+			memcpy(event.update[0].new, ns->values, sizeof(ns->values));
+		}
+		event.netns_cookie = ns->cookie;
+		event.pid = getpid();
+		event.count = 1;
+
+		t = now_ns();
+		bpftune_ringbuf_event_read(NULL, &event, sizeof(event));
+		latency[i] = now_ns() - t;
+	}
+	elapsed = now_ns() - start;
+	if (syscall_fd >= 0) {
+		ioctl(syscall_fd, PERF_EVENT_IOC_DISABLE, 0);
+		syscalls = syscall_counter_read(syscall_fd);
+	}
+	syscalls_read(&syscr_end, &syscw_end);
+
+	qsort(latency, num_events, sizeof(*latency), cmp_u64);
+	printf("workload: %s, %u events over %u namespaces\n",
+	       workload, num_events, sysctl_storm ? num_netns : num_netns + 1);
+	printf("throughput: %.0f events/sec (%.3f sec)\n",
+	       num_events / ((double)elapsed / 1e9), (double)elapsed / 1e9);
+	printf("handler latency: p50 %llu ns, p99 %llu ns, max %llu ns\n",
+	       (unsigned long long)latency[num_events / 2],
+	       (unsigned long long)latency[(num_events * 99ULL) / 100],
+	       (unsigned long long)latency[num_events - 1]);
+	if (syscall_fd >= 0)
+		printf("syscalls/event: %.2f (read %.2f write %.2f)\n",
+		       (double)syscalls / num_events,
+		       (double)(syscr_end - syscr_start) / num_events,
+		       (double)(syscw_end - syscw_start) / num_events);
+	else
+		printf("syscalls/event: read %.2f write %.2f\n",
+		       (double)(syscr_end - syscr_start) / num_events,
+		       (double)(syscw_end - syscw_start) / num_events);
+out:
+	if (syscall_fd >= 0)
+		close(syscall_fd);
+	for (i = 1; netns && i <= num_netns; i++) {
+		if (netns[i].pid <= 0)
+			continue;
+		kill(netns[i].pid, SIGKILL);
+		waitpid(netns[i].pid, NULL, 0);
+	}
+	while (num_tuners > 0) {
+		if (tuners[--num_tuners])
+			bpftuner_fini(tuners[num_tuners], BPFTUNE_INACTIVE);
+	}
+	bpftune_netns_fini_all();
+	free(latency);
+	free(netns);
+	return ret;
+}
@@ -0,0 +1,77 @@
+#!/usr/bin/bash
+#
+# SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note
+#
+# Copyright (c) 2023, Oracle and/or its affiliates.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public
+# License v2 as published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public
+# License along with this program; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 021110-1307, USA.
+#
+
+# fill the accept queue of a listener with low net.core.somaxconn,
+# ensure tuner increases somaxconn.
+
+PORT=5202
+
+. ./test_lib.sh
+
+SLEEPTIME=1
+TIMEOUT=30
+CONNS=256
+
+test_start "$0|listen_backlog test"
+
+somaxconn_orig=$(sysctl -n net.core.somaxconn)
+
+test_setup true
+
+sysctl -w net.core.somaxconn=16
+
+test_run_cmd_local "$BPFTUNE &" true
+sleep $SETUPTIME
+# listener requests a long backlog, so is capped by somaxconn, and
+# does not accept; connection requests beyond the backlog are dropped.
+$PYTHONCMD -c "
+import socket, time
+s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+s.bind(('127.0.0.1', $PORT))
+s.listen(4096)
+time.sleep(10)
+" &
+sleep $SLEEPTIME
+$PYTHONCMD -c "
+import socket, time
+conns = []
+for i in range($CONNS):
+	c = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+	c.setblocking(False)
+	c.connect_ex(('127.0.0.1', $PORT))
+	conns.append(c)
+time.sleep(5)
+"
+sleep $SLEEPTIME
+
+somaxconn_post=$(sysctl -n net.core.somaxconn)
+sysctl -w net.core.somaxconn="$somaxconn_orig"
+echo "somaxconn 16 -> ${somaxconn_post}"
+if [[ $somaxconn_post -le 16 ]]; then
+	test_cleanup
+fi
+
+test_pass
+
+test_cleanup
+
+test_exit
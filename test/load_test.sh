@@ -0,0 +1,48 @@
+#!/usr/bin/bash
+#
+# SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note
+#
+# Copyright (c) 2023, Oracle and/or its affiliates.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public
+# License v2 as published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public
+# License along with this program; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 021110-1307, USA.
+#
+
+# run load test; verify tuners initialized concurrently all load, get
+# distinct ids and report their load times.
+
+. ./test_lib.sh
+
+test_start "$0|load test: do tuners load in parallel with unique ids?"
+
+test_setup "true"
+
+test_run_cmd_local "$BPFTUNE -s &" true
+
+sleep $SETUPTIME
+
+grep -E "initialized tuner [a-z_]+\[[0-9]+\] in [0-9.]+ seconds" $TESTLOG_LAST
+loaded=$(grep -E "initialized [0-9]+ of [0-9]+ tuners" $TESTLOG_LAST | \
+	 sed -E 's/.*initialized ([0-9]+) of ([0-9]+) tuners.*/\1 \2/')
+echo "loaded/found: $loaded"
+set -- $loaded
+test "$1" -eq "$2"
+ids=$(grep -oE "initialized tuner [a-z_]+\[[0-9]+\]" $TESTLOG_LAST | \
+      grep -oE "\[[0-9]+\]")
+test "$(echo "$ids" | wc -l)" -eq "$(echo "$ids" | sort -u | wc -l)"
+test_pass
+
+test_cleanup
+
+test_exit
@@ -0,0 +1,54 @@
+#!/usr/bin/bash
+#
+# SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note
+#
+# Copyright (c) 2023, Oracle and/or its affiliates.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public
+# License v2 as published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public
+# License along with this program; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 021110-1307, USA.
+#
+
+# verify free memory state is read per NUMA node at startup and then
+# refreshed periodically (every 10 seconds) while the tcp_buffer tuner
+# runs, without any events being needed to trigger refresh.
+
+. ./test_lib.sh
+
+LOGFILE=$TESTLOG_LAST
+
+# long enough for at least two periodic refreshes after startup
+REFRESHTIME=25
+
+test_start "$0|mem refresh test: is per-node free memory refreshed periodically?"
+
+NODES=$(ls -d /sys/devices/system/node/node[0-9]* 2>/dev/null | wc -l)
+if [[ $NODES -eq 0 ]]; then
+	NODES=1
+fi
+
+test_setup true
+
+test_run_cmd_local "$BPFTUNE -ds -a tcp_buffer_tuner.so &" true
+sleep $SETUPTIME
+sleep $REFRESHTIME
+
+grep -E "node $(expr $NODES - 1) has [0-9-]+ free pages above high watermark" $LOGFILE
+REFRESHES=$(grep -cE "node 0 has [0-9-]+ free pages above high watermark" $LOGFILE)
+echo "found $REFRESHES refreshes of $NODES node(s)"
+if [[ $REFRESHES -ge 3 ]]; then
+	test_pass
+fi
+test_cleanup
+
+test_exit
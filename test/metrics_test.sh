@@ -0,0 +1,75 @@
+#!/usr/bin/bash
+#
+# SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note
+#
+# Copyright (c) 2023, Oracle and/or its affiliates.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public
+# License v2 as published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public
+# License along with this program; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 021110-1307, USA.
+#
+
+# run metrics test; verify metrics are served on the metrics socket,
+# that events are counted, and that the output parses as exposition
+# format (e.g. metric families are not interleaved).
+
+. ./test_lib.sh
+
+SOCAT=$(which socat 2>/dev/null)
+check_prog "$SOCAT" socat socat
+PROMTOOL=$(which promtool 2>/dev/null)
+check_prog "$PROMTOOL" promtool prometheus
+
+SLEEPTIME=5
+METRICS_SOCK=/var/run/bpftune/metrics_test
+
+test_start "$0|metrics test: are metrics served on $METRICS_SOCK?"
+
+test_setup "true"
+
+# -b 0 enables BPF program stats, so their metric families are served
+test_run_cmd_local "$BPFTUNE -s -b 0 -M $METRICS_SOCK &" true
+
+sleep $SETUPTIME
+
+SYSCTL=net.ipv4.neigh.default.gc_thresh1
+val="$(sysctl -qn $SYSCTL)"
+sysctl -qw ${SYSCTL}="${val}"
+sleep $SLEEPTIME
+
+$SOCAT - UNIX-CONNECT:$METRICS_SOCK > ${CMDLOG}
+cat ${CMDLOG}
+grep -E '^bpftune_events_total\{tuner="sysctl"\} [1-9]' ${CMDLOG}
+grep -E '^bpftune_event_handler_seconds_count' ${CMDLOG}
+grep -E '^bpftune_tunable_current' ${CMDLOG}
+grep -E '^bpftune_tuner_load_seconds' ${CMDLOG}
+grep -E '^# EOF' ${CMDLOG}
+grep -E '^bpftune_prog_runs_total' ${CMDLOG}
+# lint findings are reported too; only fail on parse errors.
+set +e
+$PROMTOOL check metrics < ${CMDLOG} > ${CMDLOG}.promtool 2>&1
+set -e
+cat ${CMDLOG}.promtool
+set +e
+grep -qi "parsing error" ${CMDLOG}.promtool
+PARSE_ERROR=$?
+set -e
+rm -f ${CMDLOG}.promtool
+if [[ $PARSE_ERROR -eq 0 ]]; then
+	test_cleanup
+fi
+test_pass
+
+test_cleanup
+
+test_exit
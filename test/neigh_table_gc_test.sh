@@ -0,0 +1,93 @@
+#!/usr/bin/bash
+#
+# SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note
+#
+# Copyright (c) 2023, Oracle and/or its affiliates.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public
+# License v2 as published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public
+# License along with this program; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 021110-1307, USA.
+#
+
+# fill the neighbour table in one batch, so that table-full events arrive
+# faster than gc_thresh3 updates take effect; verify stale events are
+# coalesced, and gc_thresh1/gc_thresh2 grow in proportion to gc_thresh3.
+
+. ./test_lib.sh
+
+LOGFILE=$TESTLOG_LAST
+
+SLEEPTIME=1
+
+for TBL in arp_cache ndisc_cache ; do
+
+   test_start "$0|neigh table gc test: does filling $TBL grow gc_thresh1/2 and coalesce events?"
+
+   if [[ $TBL == "arp_cache" ]]; then
+	SYSCTL_PREFIX="net.ipv4.neigh.default"
+   else
+	SYSCTL_PREFIX="net.ipv6.neigh.default"
+   fi
+   thresh_orig=()
+   for T in 1 2 3 ; do
+	thresh_orig[$T]=$(sysctl -n ${SYSCTL_PREFIX}.gc_thresh${T})
+   done
+
+   test_setup "true"
+
+   test_run_cmd_local "$BPFTUNE -ds &" true
+
+   sleep $SETUPTIME
+
+   ip ntable change name $TBL dev $VETH2 thresh1 32 thresh2 64 thresh3 128
+
+   BATCH=${CMDLOG}.batch
+   rm -f $BATCH
+   for ((i=3; i < 255; i++ ))
+   do
+      ih=$(printf '%x' $i)
+      macaddr="de:ad:be:ef:de:${ih}"
+      if [[ $TBL == "arp_cache" ]]; then
+	echo "neigh replace 192.168.168.${i} lladdr $macaddr dev $VETH2" >> $BATCH
+      else
+	echo "neigh replace fd::${ih} lladdr $macaddr dev $VETH2" >> $BATCH
+      fi
+   done
+   set +e
+   ip -batch $BATCH
+   set -e
+   rm -f $BATCH
+   sleep $SLEEPTIME
+
+   grep "updated gc_thresh3 for $TBL table" $LOGFILE
+   grep "updated gc_thresh2 for $TBL table from 64 to" $LOGFILE
+   grep "updated gc_thresh1 for $TBL table from 32 to" $LOGFILE
+   grep "coalescing $TBL table-full event" $LOGFILE
+
+   thresh=()
+   for T in 1 2 3 ; do
+	thresh[$T]=$(ip ntable show name $TBL | grep -oE "thresh${T} [0-9]+" | \
+		     head -1 | awk '{ print $2 }')
+   done
+   echo "$TBL thresh1 ${thresh[1]} thresh2 ${thresh[2]} thresh3 ${thresh[3]}"
+   for T in 1 2 3 ; do
+	sysctl -qw ${SYSCTL_PREFIX}.gc_thresh${T}=${thresh_orig[$T]}
+   done
+   if [[ ${thresh[1]} -gt 32 && ${thresh[2]} -gt 64 && \
+	 ${thresh[1]} -lt ${thresh[2]} && ${thresh[2]} -lt ${thresh[3]} ]]; then
+	test_pass
+   fi
+   test_cleanup
+done
+
+test_exit
@@ -0,0 +1,59 @@
+#!/usr/bin/bash
+#
+# SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note
+#
+# Copyright (c) 2023, Oracle and/or its affiliates.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public
+# License v2 as published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public
+# License along with this program; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 021110-1307, USA.
+#
+
+# run iperf3 test over loopback with low netdev_budget_usecs in legacy
+# mode, ensure tuner increases it.
+
+PORT=5201
+
+. ./test_lib.sh
+
+SLEEPTIME=1
+TIMEOUT=30
+
+test_start "$0|netdev_budget legacy test"
+
+budget_orig=$(sysctl -n net.core.netdev_budget)
+usecs_orig=$(sysctl -n net.core.netdev_budget_usecs)
+
+test_setup true
+
+sysctl -w net.core.netdev_budget_usecs=100
+
+test_run_cmd_local "$IPERF3 -s -p $PORT -1 &"
+test_run_cmd_local "$BPFTUNE -L &" true
+sleep $SETUPTIME
+$IPERF3 -fm -p $PORT -c 127.0.0.1 -P 8 -t 20
+sleep $SLEEPTIME
+
+usecs_post=$(sysctl -n net.core.netdev_budget_usecs)
+sysctl -w net.core.netdev_budget="$budget_orig"
+sysctl -w net.core.netdev_budget_usecs="$usecs_orig"
+echo "netdev_budget_usecs 100 -> ${usecs_post}"
+if [[ $usecs_post -le 100 ]] || [[ $usecs_post -gt 200 ]]; then
+	test_cleanup
+fi
+
+test_pass
+
+test_cleanup
+
+test_exit
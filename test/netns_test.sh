@@ -19,7 +19,8 @@
 # Boston, MA 021110-1307, USA.
 #
 
-# verify netns/container add/remove is caught by bpftune
+# verify netns/container add/remove is caught by bpftune; bpftune must
+# not pin namespaces, otherwise removal never fires.
 
 # enable proxyt if available...
 service proxyt start 2>/dev/null
@@ -30,13 +31,13 @@ PROXYT_SERVICE=""
 . ./test_lib.sh
 
 
-SLEEPTIME=2
+SLEEPTIME=5
 
 
 test_setup "true"
 
 for CONTAINER_CMD in "ip netns add testns.$$" "$PODMAN_CMD sleep 5" ; do
- test_start "$0|netns test: does running '${CONTAINER_CMD}' generate event?"
+ test_start "$0|netns test: does running '${CONTAINER_CMD}' generate create/destroy events?"
 
  if [[ ${BPFTUNE_NETNS} -eq 0 ]]; then
 	echo "bpftune does not support per-netns policy, skipping..."
@@ -58,6 +59,7 @@ for CONTAINER_CMD in "ip netns add testns.$$" "$PODMAN_CMD sleep 5" ; do
  fi
  sleep $SLEEPTIME
  grep "netns created" $TESTLOG_LAST
+ grep "netns destroyed" $TESTLOG_LAST
  test_pass
 done
 test_cleanup
@@ -0,0 +1,139 @@
+#!/usr/bin/bash
+#
+# SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note
+#
+# Copyright (c) 2023, Oracle and/or its affiliates.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public
+# License v2 as published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public
+# License along with this program; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 021110-1307, USA.
+#
+
+# run datapath overhead test; measure iperf3 throughput, netperf TCP_RR
+# p99 latency and softirq cpu across a veth/netns topology with bpftune
+# off, with each tuner individually on, and with all tuners on, and
+# report deltas relative to bpftune being off.
+#
+# Set OVERHEAD_TUNERS to limit the tuners measured, DURATION to change
+# the per-run duration, and MAX_OVERHEAD_PCT to fail if throughput drops
+# (or p99 latency grows) by more than that percentage for any config.
+
+PORT=5201
+NETPERF_PORT=12865
+
+. ./test_lib.sh
+
+NETPERF=$(which netperf 2>/dev/null)
+NETSERVER=$(which netserver 2>/dev/null)
+
+DURATION=${DURATION:-10}
+MAX_OVERHEAD_PCT=${MAX_OVERHEAD_PCT:-}
+OVERHEAD_TUNERS=${OVERHEAD_TUNERS:-"tcp_buffer net_buffer netdev_budget listen_backlog udp_buffer tcp_lowat tcp_cong neigh_table route_table netns sysctl"}
+TIMEOUT=$(expr $DURATION \* 3)
+
+declare -A tput p99 softirq
+
+# sum of softirq and total jiffies across all cpus
+cpu_jiffies()
+{
+	awk '/^cpu / { t = 0; for (i = 2; i <= NF; i++) t += $i; print $8, t }' /proc/stat
+}
+
+delta_pct()
+{
+	awk -v base=$1 -v val=$2 'BEGIN { if (base > 0) printf "%.2f", 100 * (val - base) / base; else print "0" }'
+}
+
+measure()
+{
+	CONFIG=$1
+
+	read -r soft_start total_start <<< "$(cpu_jiffies)"
+	test_run_cmd_local "$IPERF3 -fm -t $DURATION -p $PORT -c $VETH1_IPV4" true
+	read -r soft_end total_end <<< "$(cpu_jiffies)"
+	tput[$CONFIG]=$(grep -E "sender" ${CMDLOG} | tail -1 | awk '{print $7}')
+	softirq[$CONFIG]=$(awk -v s=$((soft_end - soft_start)) -v t=$((total_end - total_start)) 'BEGIN { if (t > 0) printf "%.2f", 100 * s / t; else print "0" }')
+	echo "" > ${CMDLOG}
+
+	p99[$CONFIG]=0
+	if [[ -n "$NETPERF" ]]; then
+		test_run_cmd_local "$NETPERF -H $VETH1_IPV4 -p $NETPERF_PORT -t TCP_RR -l $DURATION -- -o P99_LATENCY" true
+		p99[$CONFIG]=$(tail -1 ${CMDLOG})
+		echo "" > ${CMDLOG}
+	fi
+}
+
+test_start "$0|overhead test: datapath cost of tuners over veth/netns"
+
+test_setup "true"
+
+test_run_cmd_local "ip netns exec $NETNS $IPERF3 -s -p $PORT &"
+if [[ -n "$NETPERF" && -n "$NETSERVER" ]]; then
+	test_run_cmd_local "ip netns exec $NETNS $NETSERVER -D -p $NETPERF_PORT &"
+else
+	echo "no netperf; install netperf for TCP_RR latency results"
+	NETPERF=""
+fi
+sleep $SLEEPTIME
+
+CONFIGS="off"
+for TUNER in $OVERHEAD_TUNERS ; do
+	CONFIGS="$CONFIGS $TUNER"
+done
+CONFIGS="$CONFIGS all"
+
+for CONFIG in $CONFIGS ; do
+	echo "Running with bpftune ${CONFIG}..."
+	case $CONFIG in
+	off)
+		;;
+	all)
+		test_run_cmd_local "$BPFTUNE -s &" true
+		sleep $SETUPTIME
+		;;
+	*)
+		test_run_cmd_local "$BPFTUNE -s -a ${CONFIG}_tuner.so &" true
+		sleep $SETUPTIME
+		;;
+	esac
+	measure $CONFIG
+	if [[ $CONFIG != "off" ]]; then
+		pkill -TERM -x bpftune || true
+		sleep $SLEEPTIME
+	fi
+done
+
+FAILED=0
+printf "%-15s %14s %8s %10s %8s %9s\n" "config" "tput(Mbit/s)" "delta%" \
+       "p99(us)" "delta%" "softirq%"
+for CONFIG in $CONFIGS ; do
+	tdelta=$(delta_pct ${tput[off]} ${tput[$CONFIG]})
+	ldelta=$(delta_pct ${p99[off]} ${p99[$CONFIG]})
+	printf "%-15s %14s %8s %10s %8s %9s\n" $CONFIG ${tput[$CONFIG]} \
+	       $tdelta ${p99[$CONFIG]} $ldelta ${softirq[$CONFIG]}
+	if [[ -n "$MAX_OVERHEAD_PCT" ]]; then
+		if awk -v t=$tdelta -v l=$ldelta -v m=$MAX_OVERHEAD_PCT \
+		   'BEGIN { exit !(-t > m || l > m) }' ; then
+			bold "Warning: ${CONFIG} overhead exceeds ${MAX_OVERHEAD_PCT}%"
+			FAILED=1
+		fi
+	fi
+done
+
+if [[ $FAILED -eq 0 ]]; then
+	test_pass
+fi
+
+test_cleanup
+
+test_exit
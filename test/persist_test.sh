@@ -0,0 +1,78 @@
+#!/usr/bin/bash
+#
+# SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note
+#
+# Copyright (c) 2023, Oracle and/or its affiliates.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public
+# License v2 as published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public
+# License along with this program; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 021110-1307, USA.
+#
+
+# run persist test; verify that with -p tuner maps holding learned state
+# are pinned and state saved on exit, that both are reused on restart,
+# and that pins are removed when bpftune runs without -p.
+
+. ./test_lib.sh
+
+SLEEPTIME=5
+PINDIR=/sys/fs/bpf/bpftune/tcp_cong
+STATEDIR=/var/run/bpftune/state
+
+test_start "$0|persist test: is learned state kept across restart?"
+
+test_setup "true"
+
+rm -rf /sys/fs/bpf/bpftune $STATEDIR
+
+test_run_cmd_local "$BPFTUNE -dsp &" true
+
+sleep $SETUPTIME
+
+ls -l $PINDIR
+test -e $PINDIR/remote_host_map
+# transient state is not pinned
+test ! -e $PINDIR/dirty_host_map
+
+pkill -TERM -x bpftune
+sleep $SLEEPTIME
+
+cat $STATEDIR/tcp_cong
+grep -E "^version 1" $STATEDIR/tcp_cong
+# pinned maps outlive bpftune
+test -e $PINDIR/remote_host_map
+
+test_run_cmd_local "$BPFTUNE -dsp &" true
+
+sleep $SETUPTIME
+
+grep "reusing pinned map '$PINDIR/remote_host_map'" $TESTLOG_LAST
+grep "restored .* state entries for 'tcp_cong'" $TESTLOG_LAST
+
+pkill -TERM -x bpftune
+sleep $SLEEPTIME
+
+# without -p, stale pins are removed
+test_run_cmd_local "$BPFTUNE -ds &" true
+
+sleep $SETUPTIME
+
+test ! -e $PINDIR/remote_host_map
+
+test_pass
+
+test_cleanup
+
+rm -rf /sys/fs/bpf/bpftune $STATEDIR
+
+test_exit
@@ -0,0 +1,75 @@
+#!/usr/bin/bash
+#
+# SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note
+#
+# Copyright (c) 2023, Oracle and/or its affiliates.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public
+# License v2 as published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public
+# License along with this program; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 021110-1307, USA.
+#
+#
+
+# record a trace while iperf3 runs with a low netdev_max_backlog, then
+# replay it; the replay should make the same change in dry-run mode,
+# leaving the sysctl as it was.
+
+PORT=5201
+
+. ./test_lib.sh
+
+SLEEPTIME=1
+TRACE=/tmp/bpftune_replay_test.trace
+
+for FAMILY in ipv4 ; do
+
+   ADDR=127.0.0.1
+
+   test_start "$0|replay test to $ADDR:$PORT $FAMILY"
+
+   backlog_orig=($(sysctl -n net.core.netdev_max_backlog))
+   mask_orig=($(sysctl -n net.core.flow_limit_cpu_bitmap))
+   test_setup true
+
+   rm -f $TRACE
+   sysctl -w net.core.netdev_max_backlog=8
+   sysctl -w net.core.flow_limit_cpu_bitmap=0
+
+   test_run_cmd_local "$IPERF3 -s -p $PORT &"
+   test_run_cmd_local "$BPFTUNE -ds -R $TRACE &" true
+   sleep $SETUPTIME
+   test_run_cmd_local "$IPERF3 -fm -t 10 -c $PORT -c $ADDR" true
+   sleep $SLEEPTIME
+   pkill -TERM -x bpftune
+   sleep $SLEEPTIME
+
+   grep "change net.core.netdev_max_backlog" $TESTLOG_LAST
+   ls -l $TRACE
+
+   sysctl -w net.core.netdev_max_backlog=8
+   test_run_cmd_local "$BPFTUNE -ds -P $TRACE" true
+   backlog_post=($(sysctl -n net.core.netdev_max_backlog))
+   sysctl -w net.core.netdev_max_backlog="$backlog_orig"
+   sysctl -w net.core.flow_limit_cpu_bitmap="$mask_orig"
+
+   grep -E "replayed [1-9][0-9]* events" $TESTLOG_LAST
+   grep "change net.core.netdev_max_backlog" $TESTLOG_LAST
+   echo "backlog after replay: $backlog_post"
+   if [[ $backlog_post -eq 8 ]]; then
+	test_pass
+   fi
+   rm -f $TRACE
+   test_cleanup
+done
+
+test_exit
@@ -0,0 +1,50 @@
+#!/usr/bin/bash
+#
+# SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note
+#
+# Copyright (c) 2023, Oracle and/or its affiliates.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public
+# License v2 as published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public
+# License along with this program; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 021110-1307, USA.
+#
+
+# run ring buffer test; verify events are delivered when tuners use
+# their own ring buffers or ring buffer groups.
+
+. ./test_lib.sh
+
+
+SLEEPTIME=10
+
+for RINGBUF_OPTS in "-m" "-g sysctl:256:1" "-m -g sysctl,neigh_table:512:1" ; do
+
+   test_start "$0|ringbuf test: are events delivered with '$RINGBUF_OPTS'?"
+
+   test_setup "true"
+
+   test_run_cmd_local "$BPFTUNE -ds $RINGBUF_OPTS &" true
+
+   sleep $SETUPTIME
+   grep "polling ring buffer for" $TESTLOG_LAST
+   SYSCTL=net.ipv4.neigh.default.gc_thresh1
+   val="$(sysctl -qn $SYSCTL)"
+   sysctl -qw ${SYSCTL}="${val}"
+   sleep $SLEEPTIME
+   grep "modified sysctl" $TESTLOG_LAST
+   test_pass
+
+   test_cleanup
+done
+
+test_exit
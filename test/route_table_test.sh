@@ -19,10 +19,14 @@
 # Boston, MA 021110-1307, USA.
 #
 
-# run neigh table test
+# run route table test; verify gc of a nearly-full IPv6 dst table is
+# caught via fexit and grows net.ipv6.route.max_size.
 
 . ./test_lib.sh
 
+BPFTOOL=$(which bpftool 2>/dev/null)
+check_prog "$BPFTOOL" bpftool bpftool
+
 LOGFILE=$TESTLOG_LAST
 
 SLEEPTIME=10
@@ -55,6 +59,8 @@ for TUNER in route_table ; do
 
    sleep $SETUPTIME
 
+   $BPFTOOL prog show | grep -E "tracing +name bpftune_fib6_r"
+
    for ((i=1; i < 1024; i++ ))
    do
       $PREFIX_CMD ip link add bpftunelink${i} type dummy
@@ -0,0 +1,97 @@
+#!/usr/bin/bash
+#
+# SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note
+#
+# Copyright (c) 2023, Oracle and/or its affiliates.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public
+# License v2 as published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public
+# License along with this program; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 021110-1307, USA.
+#
+
+# run iperf3 test with low wmem max and added latency in per-socket mode;
+# ensure tcp_wmem max is left alone and that the connection's own send
+# buffer grows beyond it instead.
+
+PORT=5201
+
+LATENCY=${LATENCY:-"latency 20ms"}
+
+. ./test_lib.sh
+
+SLEEPTIME=1
+TIMEOUT=30
+
+for FAMILY in ipv4 ipv6 ; do
+
+   case $FAMILY in
+   ipv4)
+   	ADDR=$VETH1_IPV4
+	SSADDR=$ADDR
+	;;
+   ipv6)
+	ADDR=$VETH1_IPV6
+	SSADDR="[$ADDR]"
+	;;
+   esac
+
+   test_start "$0|sockbuf test to $ADDR:$PORT $FAMILY $LATENCY"
+
+   wmem_orig=($(sysctl -n net.ipv4.tcp_wmem))
+   wmem_max_orig=$(sysctl -n net.core.wmem_max)
+
+   test_setup true
+
+   sysctl -w net.ipv4.tcp_wmem="${wmem_orig[0]} ${wmem_orig[1]} ${wmem_orig[1]}"
+
+   test_run_cmd_local "ip netns exec $NETNS $IPERF3 -s -p $PORT &"
+   test_run_cmd_local "$BPFTUNE -s -o tcp_buffer.per_socket=1 &" true
+   sleep $SETUPTIME
+   $IPERF3 -fm -p $PORT -c $ADDR -t 10 &
+   # record the largest send buffer (skmem "tb") of connections to the
+   # server while the transfer runs.
+   sndbuf_max=0
+   for i in $(seq 1 8) ; do
+	sleep 1
+	for tb in $(ss -tmn dst $SSADDR | grep -o 'tb[0-9]*' | tr -d 'tb') ; do
+		if [[ $tb -gt $sndbuf_max ]]; then
+			sndbuf_max=$tb
+		fi
+	done
+   done
+   wait
+   sleep $SLEEPTIME
+
+   wmem_post=($(sysctl -n net.ipv4.tcp_wmem))
+   wmem_max_post=$(sysctl -n net.core.wmem_max)
+   sysctl -w net.ipv4.tcp_wmem="${wmem_orig[0]} ${wmem_orig[1]} ${wmem_orig[2]}"
+   sysctl -w net.core.wmem_max=$wmem_max_orig
+
+   echo "tcp_wmem max before ${wmem_orig[1]} ; after ${wmem_post[2]}"
+   echo "wmem_max before ${wmem_max_orig} ; after ${wmem_max_post}"
+   echo "largest connection send buffer ${sndbuf_max}"
+   if [[ ${wmem_post[2]} -ne ${wmem_orig[1]} ]]; then
+	test_cleanup
+   fi
+   # the connection itself must have been given a larger send buffer
+   if [[ $sndbuf_max -le ${wmem_orig[1]} ]]; then
+	test_cleanup
+   fi
+   grep "per-socket send buffers" $TESTLOG_LAST
+
+   test_pass
+
+   test_cleanup
+done
+
+test_exit
@@ -22,6 +22,19 @@
 #include "strategy_tuner.skel.h"
 #include "strategy_tuner.skel.legacy.h"
 
+static unsigned long num_events;
+
+/* reward strategies by the rate of events seen while they were active */
+static double reward(struct bpftuner *tuner,
+		     __attribute__((unused))struct bpftuner_strategy *strategy)
+{
+	__u64 elapsed = bpftune_ktime_ns() - tuner->strategy_start;
+	double rate = elapsed ? (double)num_events * SECOND / elapsed : 0;
+
+	num_events = 0;
+	return rate;
+}
+
 static int evaluate_A(struct bpftuner *tuner, struct bpftuner_strategy *strategy)
 {
 	if (tuner->strategy == strategy)
@@ -38,6 +51,7 @@ struct bpftuner_strategy strategy_A = {
 	.evaluate	= evaluate_A,
 	.timeout	= 30,
 	.bpf_progs	= progs_A,
+	.reward		= reward,
 };
 
 static int evaluate_B(struct bpftuner *tuner, struct bpftuner_strategy *strategy)
@@ -56,6 +70,7 @@ struct bpftuner_strategy strategy_B = {
         .evaluate       = evaluate_B,
         .timeout        = 30,
         .bpf_progs      = progs_B,
+        .reward         = reward,
 };
 
 struct bpftuner_strategy *strategies[] = { &strategy_A, &strategy_B, NULL };
@@ -77,6 +92,7 @@ void fini(struct bpftuner *tuner)
 void event_handler(struct bpftuner *tuner, struct bpftune_event *event,
 		   __attribute__((unused))void *ctx)
 {
+	num_events++;
 	bpftune_log(LOG_DEBUG, "event  (scenario %d) for tuner %s, strategy %s\n",
 		    event->scenario_id, tuner->name, tuner->strategy->name);
 }
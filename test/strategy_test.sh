@@ -43,6 +43,7 @@ sleep 30
 sysctl kernel.core_pattern
 sleep $SLEEPTIME
 grep -E "event .* for tuner strategy, strategy strategy_B" $TESTLOG_LAST
+grep -E "strategy 'strategy_A' reward" $TESTLOG_LAST
 test_pass
 test_cleanup
 test_exit
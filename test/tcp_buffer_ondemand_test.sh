@@ -0,0 +1,76 @@
+#!/usr/bin/bash
+#
+# SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note
+#
+# Copyright (c) 2023, Oracle and/or its affiliates.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public
+# License v2 as published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public
+# License along with this program; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 021110-1307, USA.
+#
+
+# verify tcp_buffer sampling and on-demand modes still increase wmem max.
+# A rate-limited run first leaves the sndbuf sampler backed off; then,
+# with a low wmem max, a full-rate run must still get it increased.  In
+# on-demand mode the sndbuf/rcvbuf programs must be detached while idle,
+# and re-attached by probing once the load starts.
+
+PORT=5201
+
+. ./test_lib.sh
+
+SLEEPTIME=1
+IDLE=5
+PROBE=5
+LOADTIME=20
+
+for ONDEMAND in 0 1 ; do
+
+   ADDR=$VETH1_IPV4
+
+   test_start "$0|tcp_buffer test to $ADDR:$PORT on_demand=$ONDEMAND"
+
+   wmem_orig=($(sysctl -n net.ipv4.tcp_wmem))
+
+   test_setup true
+
+   test_run_cmd_local "$BPFTUNE -ds -a tcp_buffer_tuner.so -o tcp_buffer.on_demand=$ONDEMAND -o tcp_buffer.on_demand_idle=$IDLE -o tcp_buffer.on_demand_probe=$PROBE &" true
+   sleep $SETUPTIME
+
+   # light load; sockets do not near wmem max, so sampling backs off.
+   test_run_cmd_local "ip netns exec $NETNS $IPERF3 -s -p $PORT -1 &"
+   test_run_cmd_local "$IPERF3 -fm -b 1M -t 10 -p $PORT -c $ADDR" true
+   sleep $(expr $IDLE + $SLEEPTIME)
+
+   if [[ $ONDEMAND -eq 1 ]]; then
+	grep "tcp_buffer: detached on-demand programs" $TESTLOG_LAST
+   fi
+
+   sysctl -w net.ipv4.tcp_wmem="${wmem_orig[0]} ${wmem_orig[1]} ${wmem_orig[1]}"
+   test_run_cmd_local "ip netns exec $NETNS $IPERF3 -s -p $PORT -1 &"
+   test_run_cmd_local "$IPERF3 -fm -t $LOADTIME -p $PORT -c $ADDR" true
+   sleep $SLEEPTIME
+
+   wmem_post=($(sysctl -n net.ipv4.tcp_wmem))
+   sysctl -w net.ipv4.tcp_wmem="${wmem_orig[0]} ${wmem_orig[1]} ${wmem_orig[2]}"
+   echo "wmem before ${wmem_orig[1]} ; after ${wmem_post[2]}"
+   if [[ $ONDEMAND -eq 1 ]]; then
+	grep "tcp_buffer: attached on-demand programs" $TESTLOG_LAST
+   fi
+   if [[ "${wmem_post[2]}" -gt ${wmem_orig[1]} ]]; then
+	test_pass
+   fi
+   test_cleanup
+done
+
+test_exit
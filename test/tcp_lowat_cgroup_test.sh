@@ -0,0 +1,83 @@
+#!/usr/bin/bash
+#
+# SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note
+#
+# Copyright (c) 2023, Oracle and/or its affiliates.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public
+# License v2 as published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public
+# License along with this program; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 021110-1307, USA.
+#
+
+# scope per-connection tuning to a cgroup subtree; ensure connections
+# outside the subtree are not tuned, and that decisions for connections
+# within it are made for that cgroup.
+
+PORT=5201
+
+LATENCY=${LATENCY:-"latency 20ms"}
+
+. ./test_lib.sh
+
+LOGFILE=$TESTLOG_LAST
+
+SLEEPTIME=1
+TIMEOUT=30
+
+SUBTREE=bpftune_test
+CGROUP=$CGROUPDIR/$SUBTREE
+
+for FAMILY in ipv4 ipv6 ; do
+
+   case $FAMILY in
+   ipv4)
+   	ADDR=$VETH1_IPV4
+	;;
+   ipv6)
+	ADDR=$VETH1_IPV6
+	;;
+   esac
+
+   test_start "$0|tcp_lowat cgroup test to $ADDR:$PORT $FAMILY $LATENCY"
+
+   test_setup true
+
+   mount | grep -q " $CGROUPDIR type cgroup2" || \
+	mount -t cgroup2 none $CGROUPDIR
+   mkdir -p $CGROUP
+
+   test_run_cmd_local "ip netns exec $NETNS $IPERF3 -s -p $PORT &"
+   test_run_cmd_local "$BPFTUNE -s -d -o tcp_lowat.bulk_bytes=8388608 -o bpftune.cgroups=$SUBTREE &" true
+   sleep $SETUPTIME
+   grep -E "scoping per-connection tuning to cgroup '$CGROUP'" $LOGFILE
+   # outside the subtree, connections are not tuned
+   $IPERF3 -fm -p $PORT -c $ADDR -n 4M
+   sleep $SLEEPTIME
+   set +e
+   grep -E "limit unsent data" $LOGFILE
+   UNSCOPED=$?
+   set -e
+   if [[ $UNSCOPED -eq 0 ]]; then
+	test_cleanup
+   fi
+   bash -c "echo \$\$ > $CGROUP/cgroup.procs ; exec $IPERF3 -fm -p $PORT -c $ADDR -n 4M"
+   sleep $SLEEPTIME
+   grep -E "due to request/response traffic for ${ADDR} in cgroup [0-9]+, limit unsent data" $LOGFILE
+
+   test_pass
+
+   test_cleanup
+   rmdir $CGROUP
+done
+
+test_exit
@@ -0,0 +1,69 @@
+#!/usr/bin/bash
+#
+# SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note
+#
+# Copyright (c) 2023, Oracle and/or its affiliates.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public
+# License v2 as published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public
+# License along with this program; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 021110-1307, USA.
+#
+
+# run short iperf3 transfers (below the bulk threshold) over a link with
+# added latency; ensure unsent data is limited for the remote host, and
+# that a long transfer switches it back to the default.
+
+PORT=5201
+
+LATENCY=${LATENCY:-"latency 20ms"}
+
+. ./test_lib.sh
+
+LOGFILE=$TESTLOG_LAST
+
+SLEEPTIME=1
+TIMEOUT=30
+
+for FAMILY in ipv4 ipv6 ; do
+
+   case $FAMILY in
+   ipv4)
+   	ADDR=$VETH1_IPV4
+	;;
+   ipv6)
+	ADDR=$VETH1_IPV6
+	;;
+   esac
+
+   test_start "$0|tcp_lowat test to $ADDR:$PORT $FAMILY $LATENCY"
+
+   test_setup true
+
+   test_run_cmd_local "ip netns exec $NETNS $IPERF3 -s -p $PORT &"
+   test_run_cmd_local "$BPFTUNE -s -o tcp_lowat.bulk_bytes=8388608 &" true
+   sleep $SETUPTIME
+   $IPERF3 -fm -p $PORT -c $ADDR -n 4M
+   sleep $SLEEPTIME
+   grep -E "due to request/response traffic for ${ADDR}, limit unsent data" $LOGFILE
+   # host changes are reported at most every 10 seconds
+   sleep 10
+   $IPERF3 -fm -p $PORT -c $ADDR -t 10
+   sleep $SLEEPTIME
+   grep -E "due to bulk traffic for ${ADDR}, use default unsent data limit" $LOGFILE
+
+   test_pass
+
+   test_cleanup
+done
+
+test_exit
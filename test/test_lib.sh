@@ -223,11 +223,11 @@ test_setup_local()
 		ip netns exec $NETNS ip link set $VETH1 up
 		ip netns exec $NETNS sysctl -qw net.ipv4.conf.lo.rp_filter=0
 		if [[ -n "$DROP" ]] || [[ -n "$LATENCY" ]]; then
-		 D=$DROP
+		 D=""
 		 if [[ -n "$DROP" ]]; then
-		  D="${DROP}%"
+		  D="loss ${DROP}%"
 		 fi
-       	         tc qdisc add dev $VETH2 root netem loss ${D} ${LATENCY}
+       	         tc qdisc add dev $VETH2 root netem ${D} ${LATENCY}
 		 ethtool -K $VETH2 gso off
         	fi
 		ip addr add ${VETH2_IPV4}/24 dev $VETH2
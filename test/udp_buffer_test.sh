@@ -0,0 +1,69 @@
+#!/usr/bin/bash
+#
+# SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note
+#
+# Copyright (c) 2023, Oracle and/or its affiliates.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public
+# License v2 as published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public
+# License along with this program; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 021110-1307, USA.
+#
+
+# send a burst of UDP datagrams to a receiver with a small default receive
+# buffer which does not read them, ensure tuner increases rmem_default.
+
+PORT=5203
+
+. ./test_lib.sh
+
+SLEEPTIME=1
+TIMEOUT=30
+DGRAMS=2000
+
+test_start "$0|udp_buffer test"
+
+rmem_default_orig=$(sysctl -n net.core.rmem_default)
+
+test_setup true
+
+sysctl -w net.core.rmem_default=8192
+
+test_run_cmd_local "$BPFTUNE &" true
+sleep $SETUPTIME
+$PYTHONCMD -c "
+import socket, time
+s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+s.bind(('127.0.0.1', $PORT))
+time.sleep(10)
+" &
+sleep $SLEEPTIME
+$PYTHONCMD -c "
+import socket
+c = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+for i in range($DGRAMS):
+	c.sendto(b'x' * 1024, ('127.0.0.1', $PORT))
+"
+sleep $SLEEPTIME
+
+rmem_default_post=$(sysctl -n net.core.rmem_default)
+sysctl -w net.core.rmem_default="$rmem_default_orig"
+echo "rmem_default 8192 -> ${rmem_default_post}"
+if [[ $rmem_default_post -le 8192 ]]; then
+	test_cleanup
+fi
+
+test_pass
+
+test_cleanup
+
+test_exit
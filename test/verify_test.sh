@@ -0,0 +1,109 @@
+#!/usr/bin/bash
+#
+# SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note
+#
+# Copyright (c) 2023, Oracle and/or its affiliates.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public
+# License v2 as published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public
+# License along with this program; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 021110-1307, USA.
+#
+
+
+# run iperf3 test with low netdev_max_backlog and verification of
+# changes enabled; ensure tuner increases it, but only once during
+# the verification window.  Then ensure that an increase is rolled
+# back if backlog drops - the cost metric - rise after it is made.
+
+PORT=5201
+
+. ./test_lib.sh
+
+SLEEPTIME=1
+WINDOW=60
+
+for FAMILY in ipv4 ; do
+
+   ADDR=127.0.0.1
+
+   test_start "$0|verify test to $ADDR:$PORT $FAMILY, window ${WINDOW}sec"
+
+   backlog_orig=($(sysctl -n net.core.netdev_max_backlog))
+   mask_orig=($(sysctl -n net.core.flow_limit_cpu_bitmap))
+   test_setup true
+
+   sysctl -w net.core.netdev_max_backlog=8
+   sysctl -w net.core.flow_limit_cpu_bitmap=0
+   backlog_pre=($(sysctl -n net.core.netdev_max_backlog))
+
+   test_run_cmd_local "$IPERF3 -s -p $PORT &"
+   test_run_cmd_local "$BPFTUNE -ds -v $WINDOW &" true
+   sleep $SETUPTIME
+   test_run_cmd_local "$IPERF3 -fm -t 20 -c $PORT -c $ADDR" true
+   sleep $SLEEPTIME
+
+   backlog_post=($(sysctl -n net.core.netdev_max_backlog))
+   sysctl -w net.core.netdev_max_backlog="$backlog_orig"
+   sysctl -w net.core.flow_limit_cpu_bitmap="$mask_orig"
+   echo "backlog	${backlog_pre}	->	${backlog_post}"
+   changes=$(grep -c "change net.core.netdev_max_backlog" $TESTLOG_LAST)
+   echo "netdev_max_backlog changes during window: $changes"
+   if [[ $backlog_post -gt $backlog_pre ]] && [[ $changes -eq 1 ]]; then
+	test_pass
+   fi
+   test_cleanup
+done
+
+# light traffic triggers an increase; heavier traffic during the window
+# then raises the drop rate well above its rate before the change, so
+# the increase should be rolled back at window end.
+WINDOW=10
+
+for FAMILY in ipv4 ; do
+
+   ADDR=127.0.0.1
+
+   test_start "$0|verify rollback test to $ADDR:$PORT $FAMILY, window ${WINDOW}sec"
+
+   backlog_orig=($(sysctl -n net.core.netdev_max_backlog))
+   mask_orig=($(sysctl -n net.core.flow_limit_cpu_bitmap))
+   test_setup true
+
+   sysctl -w net.core.netdev_max_backlog=8
+   sysctl -w net.core.flow_limit_cpu_bitmap=0
+   backlog_pre=($(sysctl -n net.core.netdev_max_backlog))
+
+   test_run_cmd_local "$IPERF3 -s -p $PORT &"
+   test_run_cmd_local "$BPFTUNE -ds -v $WINDOW &" true
+   sleep $SETUPTIME
+   test_run_cmd_local "$IPERF3 -fm -u -b 20M -t 2 -p $PORT -c $ADDR"
+   for i in $(seq 1 10) ; do
+	grep -q "change net.core.netdev_max_backlog" $TESTLOG_LAST && break
+	sleep $SLEEPTIME
+   done
+   grep "change net.core.netdev_max_backlog" $TESTLOG_LAST
+   test_run_cmd_local "$IPERF3 -fm -P 8 -t $(expr $WINDOW + 5) -p $PORT -c $ADDR" true
+   sleep $SLEEPTIME
+
+   backlog_post=($(sysctl -n net.core.netdev_max_backlog))
+   sysctl -w net.core.netdev_max_backlog="$backlog_orig"
+   sysctl -w net.core.flow_limit_cpu_bitmap="$mask_orig"
+   echo "backlog	${backlog_pre}	->	${backlog_post}"
+   grep "Rolled back change of 'net.core.netdev_max_backlog'" $TESTLOG_LAST
+   if [[ $backlog_post -eq $backlog_pre ]]; then
+	test_pass
+   fi
+   test_cleanup
+done
+
+test_exit
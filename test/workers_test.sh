@@ -0,0 +1,60 @@
+#!/usr/bin/bash
+#
+# SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note
+#
+# Copyright (c) 2023, Oracle and/or its affiliates.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public
+# License v2 as published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public
+# License along with this program; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 021110-1307, USA.
+#
+
+# run workers test; verify events are handled by worker threads and
+# per-netns state is updated.
+
+. ./test_lib.sh
+
+SLEEPTIME=5
+
+for NUM_WORKERS in 1 4 ; do
+
+   test_start "$0|workers test: are events handled with $NUM_WORKERS workers?"
+
+   test_run_cmd_local "$BPFTUNE -ds -w $NUM_WORKERS &" true
+
+   sleep $SETUPTIME
+
+   # need to setup netns after bpftune starts...
+   test_setup "true"
+
+   grep "started $NUM_WORKERS event workers" $TESTLOG_LAST
+
+   for SYSCTL in kernel.core_pattern net.ipv4.tcp_rmem ; do
+	val=$(sysctl -qn $SYSCTL)
+	sysctl -qw ${SYSCTL}="${val}"
+	if [[ ${BPFTUNE_NETNS} -ne 0 ]]; then
+		val=$(ip netns exec $NETNS sysctl -qn $SYSCTL)
+		ip netns exec $NETNS sysctl -qw ${SYSCTL}="${val}"
+	fi
+   done
+   sleep $SLEEPTIME
+   grep "modified sysctl" $TESTLOG_LAST
+   if [[ ${BPFTUNE_NETNS} -ne 0 ]]; then
+	grep "setting state of netns" $TESTLOG_LAST
+   fi
+   test_pass
+
+   test_cleanup
+done
+
+test_exit